@@ -39,12 +39,19 @@
  * build/support flags
  */
 
-/* address tboot will load and execute at */
-#define TBOOT_START              0x0804000
-
 /* start address of tboot MLE page table, also the beginning of tboot memory */
 #define TBOOT_BASE_ADDR          0x0800000
 
+/* largest MLE (.text + .rodata) the MLE page table is sized for; SINIT only */
+/* takes 4KB pages, so that is 1 pg dir ptr + 1 pg dir + 1 ptab per 2MB */
+#define TBOOT_MLE_MAX_SIZE       0x0400000
+#define TBOOT_MLE_PT_PAGES       (2 + TBOOT_MLE_MAX_SIZE / 0x200000)
+
+/* address tboot will load and execute at (after the multiboot header page */
+/* and the MLE page table) */
+#define TBOOT_START              (TBOOT_BASE_ADDR + \
+                                  (1 + TBOOT_MLE_PT_PAGES) * 0x1000)
+
 /* address that tboot will do s3 resume at */
 /* (must be in lower 1MB (real mode) and less than Xen trampoline @ 0x8c000) */
 #define TBOOT_S3_WAKEUP_ADDR         0x8a000
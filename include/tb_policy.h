@@ -89,6 +89,9 @@ typedef struct __packed {
 } tb_policy_entry_t;
 
 #define TB_POLCTL_EXTEND_PCR17       0x1  /* extend policy into PCR 17 */
+#define TB_POLCTL_SORTED_HASHES      0x2  /* hashes of each entry are in */
+                                          /* ascending order, so they can */
+                                          /* be binary searched */
 
 typedef struct __packed {
     uint8_t             version;          /* currently 2 */
@@ -143,12 +146,31 @@ static inline const char *policy_type_to_string(uint8_t policy_type)
 
 static inline const char *policy_control_to_string(uint32_t policy_control)
 {
-    if ( policy_control & TB_POLCTL_EXTEND_PCR17 )
+    if ( (policy_control & TB_POLCTL_EXTEND_PCR17) &&
+         (policy_control & TB_POLCTL_SORTED_HASHES) )
+        return "EXTEND_PCR17 | SORTED_HASHES";
+    else if ( policy_control & TB_POLCTL_EXTEND_PCR17 )
         return "EXTEND_PCR17";
+    else if ( policy_control & TB_POLCTL_SORTED_HASHES )
+        return "SORTED_HASHES";
     else
         return "";
 }
 
+/* byte-wise order of hashes, as used by TB_POLCTL_SORTED_HASHES */
+static inline int compare_policy_hashes(const tb_hash_t *hash1,
+                                        const tb_hash_t *hash2,
+                                        uint16_t hash_alg)
+{
+    const uint8_t *h1 = (const uint8_t *)hash1, *h2 = (const uint8_t *)hash2;
+
+    for ( unsigned int i = 0; i < get_hash_size(hash_alg); i++ ) {
+        if ( h1[i] != h2[i] )
+            return h1[i] < h2[i] ? -1 : 1;
+    }
+    return 0;
+}
+
 static inline size_t calc_policy_entry_size(const tb_policy_entry_t *pol_entry,
                                             uint16_t hash_alg)
 {
@@ -233,14 +255,15 @@ static inline tb_policy_entry_t* find_policy_entry(const tb_policy_t *policy,
         return NULL;
     }
 
+    /* walk entries in one pass rather than get_policy_entry() for each */
+    tb_policy_entry_t *pol_entry = (tb_policy_entry_t *)policy->entries;
     for ( int i = 0; i < policy->num_entries; i++ ) {
-        tb_policy_entry_t *pol_entry = get_policy_entry(policy, i);
-        if ( pol_entry == NULL )
-            return NULL;
-
         if ( pol_entry->mod_num == mod_num ||
              pol_entry->mod_num == TB_POL_MOD_NUM_ANY )
             return pol_entry;
+
+        pol_entry = (void *)pol_entry +
+            calc_policy_entry_size(pol_entry, policy->hash_alg);
     }
 
     return NULL;
@@ -357,6 +380,16 @@ static inline bool verify_policy(const tb_policy_t *policy, size_t size, bool pr
                                                  policy->hash_alg, j),
                            policy->hash_alg);
             }
+            if ( (policy->policy_control & TB_POLCTL_SORTED_HASHES) &&
+                 j > 0 &&
+                 compare_policy_hashes(get_policy_entry_hash(pol_entry,
+                                                  policy->hash_alg, j - 1),
+                                       get_policy_entry_hash(pol_entry,
+                                                  policy->hash_alg, j),
+                                       policy->hash_alg) > 0 ) {
+                if ( print ) PRINT(TBOOT_ERR"hashes are not sorted\n");
+                return false;
+            }
         }
 
         pol_entry = (void *)pol_entry +
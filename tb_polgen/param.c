@@ -227,7 +227,8 @@ static bool validate_params(param_data_t *params)
                 msg = "Invalid --alg option\n";
                 goto error;
             }
-            if ( (params->policy_control & ~TB_POLCTL_EXTEND_PCR17) != 0 ) {
+            if ( (params->policy_control & ~(TB_POLCTL_EXTEND_PCR17 |
+                                             TB_POLCTL_SORTED_HASHES)) != 0 ) {
                 msg = "Invalid --ctrl value\n";
                 goto error;
             }
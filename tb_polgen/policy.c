@@ -164,12 +164,42 @@ void new_policy(int policy_type, int policy_control, int hash_alg)
     modify_policy(policy_type, policy_control);
 }
 
+/* insertion sort, since hashes are added one at a time anyway */
+static void sort_pol_entry_hashes(tb_policy_entry_t *pol_entry)
+{
+    tb_hash_t tmp;
+
+    for ( int i = 1; i < pol_entry->num_hashes; i++ ) {
+        copy_hash(&tmp, get_policy_entry_hash(pol_entry, g_policy->hash_alg, i),
+                  g_policy->hash_alg);
+        int j = i;
+        while ( j > 0 &&
+                compare_policy_hashes(get_policy_entry_hash(pol_entry,
+                                          g_policy->hash_alg, j - 1),
+                                      &tmp, g_policy->hash_alg) > 0 ) {
+            copy_hash(get_policy_entry_hash(pol_entry, g_policy->hash_alg, j),
+                      get_policy_entry_hash(pol_entry, g_policy->hash_alg,
+                                            j - 1),
+                      g_policy->hash_alg);
+            j--;
+        }
+        copy_hash(get_policy_entry_hash(pol_entry, g_policy->hash_alg, j),
+                  &tmp, g_policy->hash_alg);
+    }
+}
+
 void modify_policy(int policy_type, int policy_control)
 {
     if ( policy_type != -1 )
         g_policy->policy_type = policy_type;
 
     g_policy->policy_control = (uint32_t)policy_control;
+
+    /* an existing policy may have been written unsorted */
+    if ( g_policy->policy_control & TB_POLCTL_SORTED_HASHES ) {
+        for ( int i = 0; i < g_policy->num_entries; i++ )
+            sort_pol_entry_hashes(get_policy_entry(g_policy, i));
+    }
 }
 
 tb_policy_entry_t *add_pol_entry(uint8_t mod_num, uint8_t pcr,
@@ -225,10 +255,25 @@ bool add_hash(tb_policy_entry_t *pol_entry, const tb_hash_t *hash)
     unsigned char *entry_end = (unsigned char *)pol_entry + sizeof(*pol_entry)
                                + (pol_entry->num_hashes * hash_size);
     unsigned char *pol_end = _policy_buf + pol_size;
-    memmove_s(entry_end + hash_size, pol_end - entry_end,
-            entry_end, pol_end - entry_end);
 
-    copy_hash((tb_hash_t *)entry_end, hash, g_policy->hash_alg);
+    /* keep hashes in order if the policy says they are sorted */
+    unsigned char *pos = entry_end;
+    if ( g_policy->policy_control & TB_POLCTL_SORTED_HASHES ) {
+        int i = 0;
+        while ( i < pol_entry->num_hashes &&
+                compare_policy_hashes(get_policy_entry_hash(pol_entry,
+                                          g_policy->hash_alg, i),
+                                      hash, g_policy->hash_alg) <= 0 )
+            i++;
+        pos = (unsigned char *)get_policy_entry_hash(pol_entry,
+                                                     g_policy->hash_alg, i);
+        if ( pos == NULL )
+            pos = entry_end;
+    }
+
+    memmove_s(pos + hash_size, pol_end - pos, pos, pol_end - pos);
+
+    copy_hash((tb_hash_t *)pos, hash, g_policy->hash_alg);
     pol_entry->num_hashes++;
 
     return true;
@@ -170,90 +170,176 @@ struct acpi_rsdp
     return NULL;
 }
 
-/* this function can find dmar table whether or not it was hidden */
-static struct acpi_table_header *find_table(const char *table_name)
+/*
+ * directory of the RSDT/XSDT, built once per pass: the tables do not move
+ * while tboot runs, so lookups (including the MADT read by every waking AP)
+ * scan this array instead of walking firmware memory again
+ */
+#define MAX_ACPI_TABLES    64
+#define MAX_ACPI_TABLE_LEN (16 * 1024 * 1024)   /* sanity bound for checksum */
+
+static struct {
+    bool     built;
+    uint32_t count;
+    struct {
+        uint8_t                   signature[4];  /* as found when indexed */
+        struct acpi_table_header *table;
+    } entries[MAX_ACPI_TABLES];
+
+    /* MADT summary */
+    struct acpi_madt         *madt;
+    struct acpi_table_ioapic *ioapic;
+} g_acpi;
+
+static bool verify_table_checksum(const struct acpi_table_header *table)
+{
+    const uint8_t *p = (const uint8_t *)table;
+    uint8_t sum = 0;
+
+    for ( uint32_t i = 0; i < table->length; i++ )
+        sum += p[i];
+    return (sum == 0);
+}
+
+static void index_table(struct acpi_table_header *table)
+{
+    if ( table == NULL )
+        return;
+
+    if ( g_acpi.count >= MAX_ACPI_TABLES ) {
+        printk(TBOOT_WARN"too many ACPI tables, %.4s @ %p not indexed\n",
+               table->signature, table);
+        return;
+    }
+
+    /* firmware gets this wrong often enough that it only rates a warning */
+    if ( table->length < sizeof(*table) || table->length > MAX_ACPI_TABLE_LEN ||
+         !verify_table_checksum(table) )
+        printk(TBOOT_WARN"ACPI %.4s @ %p has a bad length or checksum\n",
+               table->signature, table);
+
+    tb_memcpy(g_acpi.entries[g_acpi.count].signature, table->signature,
+              sizeof(table->signature));
+    g_acpi.entries[g_acpi.count].table = table;
+    g_acpi.count++;
+}
+
+static void parse_madt(struct acpi_madt *madt)
+{
+    /* APIC tables begin after MADT */
+    union acpi_madt_entry *entry = (union acpi_madt_entry *)(madt + 1);
+
+    g_acpi.madt = madt;
+    while ( (void *)entry < ((void *)madt + madt->hdr.length) ) {
+        uint8_t length = entry->madt_lapic.length;
+
+        if ( entry->madt_lapic.apic_type == ACPI_MADT_IOAPIC ) {
+            if ( length != sizeof(entry->madt_ioapic) ) {
+                printk(TBOOT_ERR"APIC length error.\n");
+                return;
+            }
+            g_acpi.ioapic = (struct acpi_table_ioapic *)entry;
+            return;
+        }
+        if ( length == 0 )
+            break;
+        entry = (void *)entry + length;
+    }
+}
+
+static struct acpi_table_header *lookup_table(const char *table_name)
+{
+    for ( uint32_t i = 0; i < g_acpi.count; i++ ) {
+        if ( tb_memcmp(g_acpi.entries[i].signature, table_name,
+                       sizeof(g_acpi.entries[i].signature)) == 0 )
+            return g_acpi.entries[i].table;
+    }
+    return NULL;
+}
+
+static bool build_acpi_index(void)
 {
+    struct acpi_table_header *madt;
+
+    if ( g_acpi.built )
+        return true;
+
     if ( !find_rsdp() ) {
         printk(TBOOT_ERR"no rsdp to use\n");
-        return NULL;
+        return false;
     }
 
-    struct acpi_table_header *table = NULL;
     struct acpi_xsdt *xsdt = get_xsdt(); /* it is ok even on 1.0 tables */
                                          /* because value will be ignored */
 
     if ( rsdp->rsdp1.revision >= 2 && xsdt != NULL ) { /*  ACPI 2.0+ */
         for ( uint64_t *curr_table = xsdt->table_offsets;
               curr_table < (uint64_t *)((void *)xsdt + xsdt->hdr.length);
-              curr_table++ ) {
-            table = (struct acpi_table_header *)(uintptr_t)*curr_table;
-            if ( tb_memcmp(table->signature, table_name,
-                        sizeof(table->signature)) == 0 )
-                return table;
-        }
+              curr_table++ )
+            index_table((struct acpi_table_header *)(uintptr_t)*curr_table);
     }
     else {                             /* ACPI 1.0 */
         struct acpi_rsdt *rsdt = get_rsdt();
 
         if ( rsdt == NULL ) {
             printk(TBOOT_ERR"rsdt is invalid.\n");
-            return NULL;
+            return false;
         }
 
         for ( uint32_t *curr_table = rsdt->table_offsets;
               curr_table < (uint32_t *)((void *)rsdt + rsdt->hdr.length);
-              curr_table++ ) {
-            table = (struct acpi_table_header *)(uintptr_t)*curr_table;
-            if ( tb_memcmp(table->signature, table_name,
-                        sizeof(table->signature)) == 0 )
-                return table;
-        }
+              curr_table++ )
+            index_table((struct acpi_table_header *)(uintptr_t)*curr_table);
     }
 
-    printk(TBOOT_ERR"can't find %s table.\n", table_name);
-    return NULL;
+    madt = lookup_table(MADT_SIG);
+    if ( madt != NULL )
+        parse_madt((struct acpi_madt *)madt);
+
+    g_acpi.built = true;
+    printk(TBOOT_DETA"ACPI: %u tables indexed\n", g_acpi.count);
+    return true;
 }
 
-static struct acpi_madt *get_apic_table(void)
+/*
+ * this function can find dmar table whether or not it was hidden: the index
+ * keeps the signature it was built with, and the live header is re-checked
+ * so that hiding DMAR after indexing still hides it
+ */
+static struct acpi_table_header *find_table(const char *table_name)
 {
-    return (struct acpi_madt *)find_table(MADT_SIG);
+    struct acpi_table_header *table;
+
+    if ( !build_acpi_index() )
+        return NULL;
+
+    table = lookup_table(table_name);
+    if ( table != NULL && tb_memcmp(table->signature, table_name,
+                                    sizeof(table->signature)) == 0 )
+        return table;
+
+    printk(TBOOT_ERR"can't find %s table.\n", table_name);
+    return NULL;
 }
 
 uint32_t get_madt_apic_base(void)
 {
-    struct acpi_madt *madt = get_apic_table();
-    if ( madt == NULL ) {
+    if ( !build_acpi_index() || g_acpi.madt == NULL ) {
         printk(TBOOT_ERR"no MADT table found\n");
         return 0;
     }
-    return (uint32_t)madt->local_apic_address;
+    return (uint32_t)g_acpi.madt->local_apic_address;
 }
 
 struct acpi_table_ioapic *get_acpi_ioapic_table(void)
 {
-    struct acpi_madt *madt = get_apic_table();
-    if ( madt == NULL ) {
+    if ( !build_acpi_index() || g_acpi.madt == NULL ) {
         printk(TBOOT_ERR"no MADT table found\n");
         return NULL;
     }
-
-    /* APIC tables begin after MADT */
-    union acpi_madt_entry *entry = (union acpi_madt_entry *)(madt + 1);
-
-	while ( (void *)entry < ((void *)madt + madt->hdr.length) ) {
-		uint8_t length = entry->madt_lapic.length;
-
-		if ( entry->madt_lapic.apic_type == ACPI_MADT_IOAPIC ) {
-			if ( length != sizeof(entry->madt_ioapic) ) {
-                printk(TBOOT_ERR"APIC length error.\n");
-                return NULL;
-            }
-            return (struct acpi_table_ioapic *)entry;
-        }
-		entry = (void *)entry + length;
-	}
-    printk(TBOOT_ERR"no IOAPIC type.\n");
-    return NULL;
+    if ( g_acpi.ioapic == NULL )
+        printk(TBOOT_ERR"no IOAPIC type.\n");
+    return g_acpi.ioapic;
 }
 
 struct acpi_mcfg *get_acpi_mcfg_table(void)
@@ -33,6 +33,7 @@
  *
  */
 
+#ifndef IS_INCLUDED     /* host tools include this file directly */
 #include <config.h>
 #include <types.h>
 #include <stdbool.h>
@@ -47,6 +48,7 @@
 #include <efi_memmap.h>
 #include <e820.h>
 #include <txt/config_regs.h>
+#endif
 
 /* minimum size of RAM (type 1) region that cannot be marked as reserved even
    if it comes after a reserved region; 0 for no minimum (i.e. current
@@ -56,10 +58,17 @@ uint32_t g_min_ram = 0;
 /*
  * copy of bootloader/BIOS e820 table with adjusted entries
  * this version will replace original in mbi
+ *
+ * the table is edited as a sorted range map and only written out in
+ * multiboot memory_map_t layout (at TBOOT_E820_COPY_ADDR) when handed off
  */
 #define MAX_E820_ENTRIES      (TBOOT_E820_COPY_SIZE / sizeof(memory_map_t))
-static unsigned int g_nr_map;
+static range_t g_e820_ranges[MAX_E820_ENTRIES];
+static range_map_t g_e820_map = { g_e820_ranges, 0, MAX_E820_ENTRIES, NULL };
 static memory_map_t *g_copy_e820_map = (memory_map_t *)TBOOT_E820_COPY_ADDR;
+/* entries last written to the copy; like the copy, and unlike the range map
+   (bss), this survives to the S3 resume pass */
+static __data unsigned int g_nr_copy_e820_map = 0;
 
 static inline void split64b(uint64_t val, uint32_t *val_lo, uint32_t *val_hi)  {
      *val_lo = (uint32_t)(val & 0xffffffff); 
@@ -81,6 +90,11 @@ static inline uint64_t e820_length_64(memory_map_t *entry)
     return combine64b(entry->length_low, entry->length_high);
 }
 
+static bool is_e820_ram(uint32_t type)
+{
+    return type == E820_RAM;
+}
+
 
 /*
  * print_e820_map
@@ -104,182 +118,56 @@ static void print_map(memory_map_t *e820, int nr_map)
     }
 }
 
-static bool insert_after_region(memory_map_t *e820map, unsigned int *nr_map,
-                                unsigned int pos, uint64_t addr, uint64_t size,
-                                uint32_t type)
-{
-    /* no more room */
-    if ( *nr_map + 1 > MAX_E820_ENTRIES )
-        return false;
-
-    /* shift (copy) everything up one entry */
-    for ( unsigned int i = *nr_map - 1; i > pos; i--)
-        e820map[i+1] = e820map[i];
-
-    /* now add our entry */
-    split64b(addr, &(e820map[pos+1].base_addr_low),
-             &(e820map[pos+1].base_addr_high));
-    split64b(size, &(e820map[pos+1].length_low),
-             &(e820map[pos+1].length_high));
-    e820map[pos+1].type = type;
-    e820map[pos+1].size = sizeof(memory_map_t) - sizeof(uint32_t);
-
-    (*nr_map)++;
-
-    return true;
-}
-
-static void remove_region(memory_map_t *e820map, unsigned int *nr_map,
-                          unsigned int pos)
-{
-    /* shift (copy) everything down one entry */
-    for ( unsigned int i = pos; i < *nr_map - 1; i++)
-        e820map[i] = e820map[i+1];
-
-    (*nr_map)--;
-}
-
-static bool protect_region(memory_map_t *e820map, unsigned int *nr_map,
-                           uint64_t new_addr, uint64_t new_size,
-                           uint32_t new_type)
+static bool protect_region(range_map_t *map, uint64_t new_addr,
+                           uint64_t new_size, uint32_t new_type)
 {
-    uint64_t addr, tmp_addr, size, tmp_size;
-    uint32_t type;
-    unsigned int i;
-
     if ( new_size == 0 )
         return true;
     /* check for wrap */
     if ( new_addr + new_size < new_addr )
         return false;
 
-    /* find where our region belongs in the table and insert it */
-    for ( i = 0; i < *nr_map; i++ ) {
-        addr = e820_base_64(&e820map[i]);
-        size = e820_length_64(&e820map[i]);
-        type = e820map[i].type;
-        /* is our region at the beginning of the current map region? */
-        if ( new_addr == addr ) {
-            if ( !insert_after_region(e820map, nr_map, i-1, new_addr, new_size,
-                                      new_type) )
-                return false;
-            break;
-        }
-        /* are we w/in the current map region? */
-        else if ( new_addr > addr && new_addr < (addr + size) ) {
-            if ( !insert_after_region(e820map, nr_map, i, new_addr, new_size,
-                                      new_type) )
-                return false;
-            /* fixup current region */
-            tmp_addr = e820_base_64(&e820map[i]);
-            split64b(new_addr - tmp_addr, &(e820map[i].length_low),
-                     &(e820map[i].length_high));
-            i++;   /* adjust to always be that of our region */
-            /* insert a copy of current region (before adj) after us so */
-            /* that rest of code can be common with previous case */
-            if ( !insert_after_region(e820map, nr_map, i, addr, size, type) )
-                return false;
-            break;
-        }
-        /* is our region in a gap in the map? */
-        else if ( addr > new_addr ) {
-            if ( !insert_after_region(e820map, nr_map, i-1, new_addr, new_size,
-                                      new_type) )
-                return false;
-            break;
-        }
-    }
-    /* if we reached the end of the map without finding an overlapping */
-    /* region, insert us at the end (note that this test won't trigger */
-    /* for the second case above because the insert() will have incremented */
-    /* nr_map and so i++ will still be less) */
-    if ( i == *nr_map ) {
-        if ( !insert_after_region(e820map, nr_map, i-1, new_addr, new_size,
-                                  new_type) )
-            return false;
-        return true;
-    }
-
-    i++;     /* move to entry after our inserted one (we're not at end yet) */
-
-    tmp_addr = e820_base_64(&e820map[i]);
-    tmp_size = e820_length_64(&e820map[i]);
-
-    /* did we split the (formerly) previous region? */
-    if ( (new_addr >= tmp_addr) &&
-         ((new_addr + new_size) < (tmp_addr + tmp_size)) ) {
-        /* then adjust the current region (adj size first) */
-        split64b((tmp_addr + tmp_size) - (new_addr + new_size),
-                 &(e820map[i].length_low), &(e820map[i].length_high));
-        split64b(new_addr + new_size,
-                 &(e820map[i].base_addr_low), &(e820map[i].base_addr_high));
-        return true;
-    }
-
-    /* if our region completely covers any existing regions, delete them */
-    while ( (i < *nr_map) && ((new_addr + new_size) >=
-                              (tmp_addr + tmp_size)) ) {
-        remove_region(e820map, nr_map, i);
-        tmp_addr = e820_base_64(&e820map[i]);
-        tmp_size = e820_length_64(&e820map[i]);
-    }
-
-    /* finally, if our region partially overlaps an existing region, */
-    /* then truncate the existing region */
-    if ( i < *nr_map ) {
-        tmp_addr = e820_base_64(&e820map[i]);
-        tmp_size = e820_length_64(&e820map[i]);
-        if ( (new_addr + new_size) > tmp_addr ) {
-            split64b((tmp_addr + tmp_size) - (new_addr + new_size),
-                        &(e820map[i].length_low), &(e820map[i].length_high));
-            split64b(new_addr + new_size, &(e820map[i].base_addr_low),
-                        &(e820map[i].base_addr_high));
-        }
-    }
-
-    return true;
+    return range_map_set(map, new_addr, new_addr + new_size, new_type, 0);
 }
 
-/*
- * is_overlapped
- *
- * Detect whether two ranges are overlapped.
- *
- * return: true = overlapped
- */
-static bool is_overlapped(uint64_t base, uint64_t end, uint64_t e820_base,
-                          uint64_t e820_end)
+/* write the range map out in multiboot memory_map_t layout */
+static void sync_e820_copy(void)
 {
-    uint64_t length = end - base, e820_length = e820_end - e820_base;
-    uint64_t min, max;
-
-    min = (base < e820_base)?base:e820_base;
-    max = (end > e820_end)?end:e820_end;
-
-    /* overlapping */
-    if ( (max - min) < (length + e820_length) )
-        return true;
-
-    if ( (max - min) == (length + e820_length)
-         && ( ((length == 0) && (base > e820_base) && (base < e820_end))
-              || ((e820_length == 0) && (e820_base > base) &&
-                  (e820_base < end)) ) )
-        return true;
+    for ( unsigned int i = 0; i < g_e820_map.nr; i++ ) {
+        range_t *r = &g_e820_ranges[i];
+        memory_map_t *entry = &g_copy_e820_map[i];
 
-    return false;
+        entry->size = sizeof(memory_map_t) - sizeof(uint32_t);
+        split64b(r->base, &entry->base_addr_low, &entry->base_addr_high);
+        split64b(r->end - r->base, &entry->length_low, &entry->length_high);
+        entry->type = r->type;
+    }
+    g_nr_copy_e820_map = g_e820_map.nr;
 }
 
 /* helper funcs for loader.c */
 memory_map_t *get_e820_copy()
 {
+    sync_e820_copy();
     return g_copy_e820_map;
 }
 
 unsigned int get_nr_map()
 {
-    return g_nr_map;
+    return g_e820_map.nr;
 }
 
+/*
+ * the copy as last written by get_e820_copy(), without syncing it: on S3
+ * resume this is still the map the kernel was given
+ */
+const memory_map_t *get_e820_copy_written(unsigned int *nr_map)
+{
+    *nr_map = g_nr_copy_e820_map;
+    return g_copy_e820_map;
+}
+
+#ifndef IS_INCLUDED
 /*
  * copy_e820_map
  *
@@ -291,7 +179,7 @@ bool copy_e820_map(loader_ctx *lctx)
 {
     get_tboot_min_ram();
 
-    g_nr_map = 0;
+    g_e820_map.nr = 0;
 
     if (have_loader_memmap(lctx)){
         uint32_t memmap_length = get_loader_memmap_length(lctx);
@@ -302,16 +190,15 @@ bool copy_e820_map(loader_ctx *lctx)
         uint32_t entry_offset = 0;
 
         while ( entry_offset < memmap_length &&
-                g_nr_map < MAX_E820_ENTRIES ) {
+                g_e820_map.nr < MAX_E820_ENTRIES ) {
             memory_map_t *entry = (memory_map_t *)
                 (((uint32_t) memmap) + entry_offset);
 
             /* we want to support unordered and/or overlapping entries */
             /* so use protect_region() to insert into existing map, since */
             /* it handles these cases */
-            if ( !protect_region(g_copy_e820_map, &g_nr_map,
-                                 e820_base_64(entry), e820_length_64(entry),
-                                 entry->type) )
+            if ( !protect_region(&g_e820_map, e820_base_64(entry),
+                                 e820_length_64(entry), entry->type) )
                 return false;
             if (lctx->type == 1)
                 entry_offset += entry->size + sizeof(entry->size);
@@ -324,7 +211,7 @@ bool copy_e820_map(loader_ctx *lctx)
                 entry_offset += sizeof(memory_map_t);
 
         }
-        if ( g_nr_map == MAX_E820_ENTRIES ) {
+        if ( g_e820_map.nr == MAX_E820_ENTRIES ) {
             printk(TBOOT_ERR"Too many e820 entries\n");
             return false;
         }
@@ -334,35 +221,57 @@ bool copy_e820_map(loader_ctx *lctx)
                get_loader_mem_lower(lctx), get_loader_mem_upper(lctx));
 
         /* lower limit is 0x00000000 - <mem_lower>*0x400 (i.e. in kb) */
-        g_copy_e820_map[0].base_addr_low = 0;
-        g_copy_e820_map[0].base_addr_high = 0;
-        g_copy_e820_map[0].length_low = (get_loader_mem_lower(lctx)) << 10;
-        g_copy_e820_map[0].length_high = 0;
-        g_copy_e820_map[0].type = E820_RAM;
-        g_copy_e820_map[0].size = sizeof(memory_map_t) - sizeof(uint32_t);
-
         /* upper limit is 0x00100000 - <mem_upper>*0x400 */
-        g_copy_e820_map[1].base_addr_low = 0x100000;
-        g_copy_e820_map[1].base_addr_high = 0;
-        split64b((uint64_t)(get_loader_mem_upper(lctx)) << 10,
-                 &(g_copy_e820_map[1].length_low),
-                 &(g_copy_e820_map[1].length_high));
-        g_copy_e820_map[1].type = E820_RAM;
-        g_copy_e820_map[1].size = sizeof(memory_map_t) - sizeof(uint32_t);
-
-        g_nr_map = 2;
+        g_e820_ranges[0].base = 0;
+        g_e820_ranges[0].end = (uint64_t)get_loader_mem_lower(lctx) << 10;
+        g_e820_ranges[0].type = E820_RAM;
+        g_e820_ranges[0].attr = 0;
+        g_e820_ranges[1].base = 0x100000;
+        g_e820_ranges[1].end = 0x100000 +
+                               ((uint64_t)get_loader_mem_upper(lctx) << 10);
+        g_e820_ranges[1].type = E820_RAM;
+        g_e820_ranges[1].attr = 0;
+
+        g_e820_map.nr = 2;
     }
     else {
         printk(TBOOT_ERR"no e820 map nor memory limits provided\n");
         return false;
     }
 
+    if ( !range_map_is_valid(&g_e820_map) ) {
+        printk(TBOOT_ERR"e820 copy is inconsistent\n");
+        return false;
+    }
+
     return true;
 }
+#endif    /* IS_INCLUDED */
 
 bool e820_protect_region(uint64_t addr, uint64_t size, uint32_t type)
 {
-    return protect_region(g_copy_e820_map, &g_nr_map, addr, size, type);
+    return protect_region(&g_e820_map, addr, size, type);
+}
+
+/*
+ * e820_protect_regions
+ *
+ * Protect each of regions[] ([base, end) with its .type) in the e820 copy,
+ * and reserve them all in the EFI memory map copy in one pass.  regions[]
+ * is page-rounded and sorted in place.
+ *
+ * return:  false = error
+ */
+bool e820_protect_regions(range_t *regions, unsigned int count)
+{
+    for ( unsigned int i = 0; i < count; i++ ) {
+        if ( !protect_region(&g_e820_map, regions[i].base,
+                             regions[i].end - regions[i].base,
+                             regions[i].type) )
+            return false;
+    }
+
+    return efi_memmap_reserve_batch(regions, count);
 }
 
 /*
@@ -377,73 +286,7 @@ bool e820_protect_region(uint64_t addr, uint64_t size, uint32_t type)
  */
 uint32_t e820_check_region(uint64_t base, uint64_t length)
 {
-    memory_map_t* e820_entry;
-    uint64_t end = base + length, e820_base, e820_end, e820_length;
-    uint32_t type;
-    uint32_t ret = 0;
-    bool gap = true; /* suppose there is always a virtual gap at first */
-
-    e820_base = 0;
-    e820_length = 0;
-
-    for ( unsigned int i = 0; i < g_nr_map; i = gap ? i : i+1, gap = !gap ) {
-        e820_entry = &g_copy_e820_map[i];
-        if ( gap ) {
-            /* deal with the gap in e820 map */
-            e820_base = e820_base + e820_length;
-            e820_length = e820_base_64(e820_entry) - e820_base;
-            type = E820_GAP;
-        }
-        else {
-            /* deal with the normal item in e820 map */
-            e820_base = e820_base_64(e820_entry);
-            e820_length = e820_length_64(e820_entry);
-            type = e820_entry->type;
-        }
-
-        if ( e820_length == 0 )
-            continue; /* if the range is zero, then skip */
-
-        e820_end = e820_base + e820_length;
-
-        if ( !is_overlapped(base, end, e820_base, e820_end) )
-            continue; /* if no overlapping, then skip */
-
-        /* if the value of ret is not assigned before,
-           then set ret to type directly */
-        if ( ret == 0 ) {
-            ret = type;
-            continue;
-        }
-
-        /* if the value of ret is assigned before but ret is equal to type,
-           then no need to do anything */
-        if ( ret == type )
-            continue;
-
-        /* if the value of ret is assigned before but it is GAP,
-           then no need to do anything since any type merged with GAP is GAP */
-        if ( ret == E820_GAP )
-            continue;
-
-        /* if the value of ret is assigned before but it is not GAP and type
-           is GAP now this time, then set ret to GAP since any type merged
-           with GAP is GAP. */
-        if ( type == E820_GAP ) {
-            ret = E820_GAP;
-            continue;
-        }
-
-        /* if the value of ret is assigned before but both ret and type are
-           not GAP and their values are not equal, then set ret to MIXED
-           since any two non-GAP values are merged into MIXED if they are
-           not equal. */
-        ret = E820_MIXED;
-    }
-
-    /* deal with the last gap */
-    if ( is_overlapped(base, end, e820_base + e820_length, (uint64_t)-1) )
-        ret = E820_GAP;
+    uint32_t ret = range_map_check(&g_e820_map, base, base + length);
 
     /* print the result */
     printk(TBOOT_DETA" (range from %016Lx to %016Lx is in ", base, base + length);
@@ -478,99 +321,51 @@ uint32_t e820_check_region(uint64_t base, uint64_t length)
  */
 bool e820_reserve_ram(uint64_t base, uint64_t length)
 {
-    memory_map_t* e820_entry;
-    uint64_t e820_base, e820_length, e820_end;
-    uint64_t end;
-
     if ( length == 0 )
         return true;
 
-    end = base + length;
+    return range_map_retype(&g_e820_map, base, base + length, is_e820_ram,
+                            E820_RESERVED);
+}
 
-    /* find where our region should cover the ram in e820 */
-    for ( unsigned int i = 0; i < g_nr_map; i++ ) {
-        e820_entry = &g_copy_e820_map[i];
-        e820_base = e820_base_64(e820_entry);
-        e820_length = e820_length_64(e820_entry);
-        e820_end = e820_base + e820_length;
+/*
+ * e820_reserve_ram_batch
+ *
+ * Same as e820_reserve_ram() for a set of [base, end) ranges (which will be
+ * sorted in place).
+ *
+ * return:  false = error
+ */
+bool e820_reserve_ram_batch(range_t *ranges, unsigned int count)
+{
+    return range_map_retype_batch(&g_e820_map, ranges, count, is_e820_ram,
+                                  E820_RESERVED);
+}
 
-        /* if not ram, no need to deal with */
-        if ( e820_entry->type != E820_RAM )
-            continue;
+/*
+ * e820_get_ram_size
+ *
+ * return: number of bytes of RAM in [base, end)
+ */
+uint64_t e820_get_ram_size(uint64_t base, uint64_t end)
+{
+    uint64_t size = 0;
 
-        /* if the range is before the current ram range, skip the ram range */
-        if ( end <= e820_base )
-            continue;
-        /* if the range is after the current ram range, skip the ram range */
-        if ( base >= e820_end )
-            continue;
+    for ( unsigned int i = range_map_find(&g_e820_map, base);
+          i < g_e820_map.nr && g_e820_ranges[i].base < end; i++ ) {
+        const range_t *r = &g_e820_ranges[i];
 
-        /* case 1: the current ram range is within the range:
-           base, e820_base, e820_end, end */
-        if ( (base <= e820_base) && (e820_end <= end) )
-            e820_entry->type = E820_RESERVED;
-        /* case 2: overlapping:
-           base, e820_base, end, e820_end */
-        else if ( (e820_base >= base) && (end > e820_base) &&
-                  (e820_end > end) ) {
-            /* split the current ram map */
-            if ( !insert_after_region(g_copy_e820_map, &g_nr_map, i-1,
-                                      e820_base, (end - e820_base),
-                                      E820_RESERVED) )
-                return false;
-            /* fixup the current ram map */
-            i++;
-            split64b(end, &(g_copy_e820_map[i].base_addr_low),
-                     &(g_copy_e820_map[i].base_addr_high));
-            split64b(e820_end - end, &(g_copy_e820_map[i].length_low),
-                     &(g_copy_e820_map[i].length_high));
-            /* no need to check more */
-            break;
-        }
-        /* case 3: overlapping:
-           e820_base, base, e820_end, end */
-        else if ( (base > e820_base) && (e820_end > base) &&
-                  (end >= e820_end) ) {
-            /* fixup the current ram map */
-            split64b((base - e820_base), &(g_copy_e820_map[i].length_low),
-                     &(g_copy_e820_map[i].length_high));
-            /* split the current ram map */
-            if ( !insert_after_region(g_copy_e820_map, &g_nr_map, i, base,
-                                      (e820_end - base), E820_RESERVED) )
-                return false;
-            i++;
-        }
-        /* case 4: the range is within the current ram range:
-           e820_base, base, end, e820_end */
-        else if ( (base > e820_base) && (e820_end > end) ) {
-            /* fixup the current ram map */
-            split64b((base - e820_base), &(g_copy_e820_map[i].length_low),
-                     &(g_copy_e820_map[i].length_high));
-            /* split the current ram map */
-            if ( !insert_after_region(g_copy_e820_map, &g_nr_map, i, base,
-                                      length, E820_RESERVED) )
-                return false;
-            i++;
-            /* fixup the rest of the current ram map */
-            if ( !insert_after_region(g_copy_e820_map, &g_nr_map, i, end,
-                                      (e820_end - end), e820_entry->type) )
-                return false;
-            i++;
-            /* no need to check more */
-            break;
-        }
-        else {
-            printk(TBOOT_ERR"we should never get here\n");
-            return false;
-        }
+        if ( !is_e820_ram(r->type) )
+            continue;
+        size += ((r->end < end) ? r->end : end) -
+                ((r->base > base) ? r->base : base);
     }
-
-    return true;
+    return size;
 }
 
 void print_e820_map(void)
 {
-    print_map(g_copy_e820_map, g_nr_map);
+    print_map(get_e820_copy(), g_e820_map.nr);
 }
 
 bool get_ram_ranges(uint64_t *min_lo_ram, uint64_t *max_lo_ram,
@@ -600,10 +395,10 @@ bool get_ram_ranges(uint64_t *min_lo_ram, uint64_t *max_lo_ram,
                g_min_ram, last_min_ram_base, last_min_ram_size);
     }
 
-    for ( unsigned int i = 0; i < g_nr_map; i++ ) {
-        memory_map_t *entry = &g_copy_e820_map[i];
-        uint64_t base = e820_base_64(entry);
-        uint64_t limit = base + e820_length_64(entry);
+    for ( unsigned int i = 0; i < g_e820_map.nr; i++ ) {
+        range_t *entry = &g_e820_ranges[i];
+        uint64_t base = entry->base;
+        uint64_t limit = entry->end;
 
         if ( entry->type == E820_RAM ) {
             /* if range straddles 4GB boundary, that is an error */
@@ -632,6 +427,8 @@ bool get_ram_ranges(uint64_t *min_lo_ram, uint64_t *max_lo_ram,
                     if (!efi_memmap_reserve(base, limit - base)) {
                         return false;
                     }
+                    /* may have merged with its neighbours */
+                    i = range_map_find(&g_e820_map, base);
                 }
             }
 
@@ -665,35 +462,8 @@ bool get_ram_ranges(uint64_t *min_lo_ram, uint64_t *max_lo_ram,
 bool e820_get_highest_sized_ram(uint64_t size, uint64_t limit,
                                 uint64_t *ram_base, uint64_t *ram_size)
 {
-    uint64_t last_fit_base = 0, last_fit_size = 0;
-
-    if ( ram_base == NULL || ram_size == NULL )
-        return false;
-
-    for ( unsigned int i = 0; i < g_nr_map; i++ ) {
-        memory_map_t *entry = &g_copy_e820_map[i];
-
-        if ( entry->type == E820_RAM ) {
-            uint64_t base = e820_base_64(entry);
-            uint64_t length = e820_length_64(entry);
-
-            /* over 4GB so use the last region that fit */
-            if ( base + length > limit )
-                break;
-            if ( size <= length ) {
-                last_fit_base = base;
-                last_fit_size = length;
-            }
-        }
-    }
-
-    if (last_fit_size == 0) {
-        return false;
-    } else {
-        *ram_base = last_fit_base;
-        *ram_size = last_fit_size;
-        return true;
-    }
+    return range_map_get_highest(&g_e820_map, size, limit, is_e820_ram,
+                                 ram_base, ram_size);
 }
 
 
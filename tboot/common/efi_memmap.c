@@ -33,21 +33,89 @@
  *
  */
 
+#ifndef IS_INCLUDED     /* host tools include this file directly */
 #include <string.h>
 #include <stdbool.h>
 #include <printk.h>
 #include <uuid.h>
 #include <loader.h>
 #include <misc.h>
+#include <rangemap.h>
 #include <efi_memmap.h>
+#endif
 
 static bool efi_mmap_available = false;
 static efi_memmap_t* efi_mmap = (efi_memmap_t*)TBOOT_EFI_MEMMAP_COPY_ADDR;
 
-static bool insert_after_region(uint32_t pos, uint64_t addr, uint64_t size,
-                                uint32_t type, uint64_t attr);
+/*
+ * the firmware descriptors are copied verbatim to efi_mmap, and edited as a
+ * sorted range map (see rangemap.c) whose ranges are tagged with the index
+ * of the descriptor they came from; when the map is handed off only the
+ * descriptors a reservation split or retyped are rewritten
+ */
+static range_t efi_ranges[EFI_MEMMAP_MAX_ENTRIES];
+static range_map_t efi_range_map = { efi_ranges, 0, EFI_MEMMAP_MAX_ENTRIES,
+                                     NULL };
+static bool efi_mmap_dirty = false;
+/* descriptor bytes at the last hand off; not in bss, so that the S3 resume
+   pass, which has no range map, still knows what the kernel was given */
+static __data uint32_t efi_mmap_handed_off = 0;
+
+/* efi_memmap_sync() scratch: map ranges grouped by source descriptor */
+static uint16_t efi_pieces[EFI_MEMMAP_MAX_ENTRIES];
+static uint16_t efi_first_piece[EFI_MEMMAP_MAX_ENTRIES + 1];
+
 static bool region_is_free(uint32_t region_type);
+static bool region_is_reservable(uint32_t region_type);
+
+/*
+ * copy descr_size-sized descriptors at descr_addr to efi_mmap and load them
+ * into the range map
+ */
+static bool efi_memmap_load(uint32_t descr_addr, uint32_t descr_size,
+                            uint32_t mmap_size)
+{
+    efi_range_map.nr = 0;
+    efi_range_map.max = (TBOOT_EFI_MEMMAP_COPY_SIZE -
+                         offsetof(efi_memmap_t, descr)) / descr_size;
+    if (efi_range_map.max > EFI_MEMMAP_MAX_ENTRIES) {
+        efi_range_map.max = EFI_MEMMAP_MAX_ENTRIES;
+    }
+    if (mmap_size / descr_size > efi_range_map.max) {
+        printk(TBOOT_WARN"Too many entries in EFI memory map\n");
+        return false;
+    }
 
+    efi_mmap->size = mmap_size - mmap_size % descr_size;
+    efi_mmap->descr_size = descr_size;
+    tb_memcpy(efi_mmap->descr, (void*)descr_addr, efi_mmap->size);
+
+    for (uint32_t off = 0; off < efi_mmap->size; off += descr_size) {
+        efi_mem_descr_t* desc = (efi_mem_descr_t*)(efi_mmap->descr + off);
+        range_t range = { desc->physical_start,
+                          desc->physical_start +
+                              (desc->num_pages << EFI_PAGE_SHIFT),
+                          desc->type, desc->attribute, off / descr_size };
+
+        /* handles unordered and overlapping descriptors */
+        if (!range_map_set_range(&efi_range_map, &range)) {
+            printk(TBOOT_WARN"Too many entries in EFI memory map\n");
+            return false;
+        }
+    }
+
+    if (!range_map_is_valid(&efi_range_map)) {
+        printk(TBOOT_WARN"EFI memory map copy is inconsistent\n");
+        return false;
+    }
+
+    /* overlapping descriptors were clipped, so write the map back once */
+    efi_mmap_available = true;
+    efi_mmap_dirty = true;
+    return true;
+}
+
+#ifndef IS_INCLUDED
 /**
  * @brief Copy memory map from mbi to defined memory space to allow insertion
  *        of new entries
@@ -60,22 +128,115 @@ bool efi_memmap_copy(loader_ctx *lctx)
     descr_addr = find_efi_memmap(lctx, &descr_size,
                                  &descr_ver, &mmap_size);
 
-    if (descr_addr == 0 || descr_ver != EFI_MEMORY_DESCRIPTOR_VERSION) {
+    if (descr_addr == 0 || descr_ver != EFI_MEMORY_DESCRIPTOR_VERSION ||
+            descr_size < sizeof(efi_mem_descr_t)) {
         printk(TBOOT_WARN"Failed to get EFI memory map\n");
         return false;
     }
 
-    if (mmap_size < TBOOT_EFI_MEMMAP_COPY_SIZE - offsetof(efi_memmap_t, descr)) {
-        efi_mmap->size = mmap_size;
-        efi_mmap->descr_size = descr_size;
-        tb_memcpy(efi_mmap->descr, (void*)descr_addr, mmap_size);
-        efi_mmap_available = true;
-        return true;
-    } else {
+    if (mmap_size >= TBOOT_EFI_MEMMAP_COPY_SIZE - offsetof(efi_memmap_t, descr)) {
         printk(TBOOT_WARN"Too many entries in EFI memory map\n");
         return false;
     }
 
+    return efi_memmap_load(descr_addr, descr_size, mmap_size);
+}
+#endif    /* IS_INCLUDED */
+
+/* is the descriptor exactly what the map holds as its only piece? */
+static bool descr_unchanged(const efi_mem_descr_t* desc, uint32_t nr_pieces,
+                            const range_t* piece)
+{
+    return nr_pieces == 1 && desc->type == piece->type &&
+           desc->physical_start == piece->base &&
+           desc->num_pages == (piece->end - piece->base) >> EFI_PAGE_SHIFT &&
+           desc->attribute == piece->attr;
+}
+
+/*
+ * write the range map back as EFI memory descriptors
+ *
+ * Descriptors keep their firmware order.  One that a reservation touched is
+ * replaced, in place, by its pieces; each piece is a copy of the original
+ * (so bytes past efi_mem_descr_t are kept) with its type, physical start
+ * and size and, if set, its virtual start adjusted.  A descriptor left with
+ * no piece (fully overridden by a later overlapping one) is dropped.
+ * Afterwards every range is tagged with the descriptor it was written to.
+ */
+static void efi_memmap_sync(void)
+{
+    uint32_t descr_size = efi_mmap->descr_size;
+    uint32_t nr_descr = efi_mmap->size / descr_size;
+    uint16_t* start = efi_first_piece;
+    uint32_t d, n, p;
+
+    if (!efi_mmap_dirty) {
+        return;
+    }
+
+    /* group map indices by descriptor: d's are efi_pieces[start[d]..] */
+    tb_memset(start, 0, sizeof(efi_first_piece));
+    for (uint32_t i = 0; i < efi_range_map.nr; i++) {
+        start[efi_ranges[i].tag]++;
+    }
+    for (d = 0, n = 0; d < nr_descr; d++) {
+        n += start[d];
+        start[d] = n;
+    }
+    start[nr_descr] = efi_range_map.nr;
+    for (uint32_t i = efi_range_map.nr; i-- > 0; ) {
+        efi_pieces[--start[efi_ranges[i].tag]] = i;
+    }
+
+    /* drop descriptors without pieces; forward, so slot n <= d is free */
+    for (d = 0, n = 0; d < nr_descr; d++) {
+        if (start[d] == start[d + 1]) {
+            continue;
+        }
+        if (n != d) {
+            tb_memcpy(efi_mmap->descr + n * descr_size,
+                      efi_mmap->descr + d * descr_size, descr_size);
+        }
+        start[n++] = start[d];
+    }
+    start[n] = efi_range_map.nr;
+
+    /*
+     * expand backwards: piece p goes to slot p, and since every remaining
+     * descriptor has a piece, start[d] >= d, so no unread descriptor is
+     * overwritten and d's own slot is the last of its pieces written
+     */
+    while (n-- > 0) {
+        efi_mem_descr_t* orig = (efi_mem_descr_t*)(efi_mmap->descr +
+                                                   n * descr_size);
+        uint64_t orig_phys = orig->physical_start;
+        uint64_t orig_virt = orig->virtual_start;
+        bool unchanged = descr_unchanged(orig, start[n + 1] - start[n],
+                                         &efi_ranges[efi_pieces[start[n]]]);
+
+        for (p = start[n + 1]; p-- > start[n]; ) {
+            range_t* piece = &efi_ranges[efi_pieces[p]];
+            efi_mem_descr_t* desc = (efi_mem_descr_t*)(efi_mmap->descr +
+                                                       p * descr_size);
+            if (desc != orig) {
+                tb_memcpy(desc, orig, descr_size);
+            }
+            piece->tag = p;
+            if (unchanged) {
+                continue;
+            }
+            desc->type = piece->type;
+            desc->physical_start = piece->base;
+            desc->num_pages = (piece->end - piece->base) >> EFI_PAGE_SHIFT;
+            desc->attribute = piece->attr;
+            if (orig_virt != 0) {
+                desc->virtual_start = orig_virt + (piece->base - orig_phys);
+            }
+        }
+    }
+
+    efi_mmap->size = efi_range_map.nr * descr_size;
+    efi_mmap_dirty = false;
 }
 
 /**
@@ -91,6 +252,7 @@ uint32_t efi_memmap_get_addr(uint32_t *descr_size, uint32_t *descr_vers,
     if (!efi_mmap_available) {
         return 0;
     }
+    efi_memmap_sync();
     if (descr_size != NULL) {
         *descr_size = efi_mmap->descr_size;
     }
@@ -100,9 +262,24 @@ uint32_t efi_memmap_get_addr(uint32_t *descr_size, uint32_t *descr_vers,
     if (mmap_size != NULL) {
         *mmap_size = efi_mmap->size;
     }
+    efi_mmap_handed_off = efi_mmap->size;
     return (uint32_t)efi_mmap->descr;
 }
 
+/**
+ * @brief Get the descriptors as last returned by efi_memmap_get_addr()
+ *
+ * Unlike efi_memmap_get_addr() this does not sync, so on S3 resume it is
+ * still the map the kernel was given.
+ *
+ * @param mmap_size return sum of all descriptors size, 0 if never handed off
+ */
+const uint8_t* efi_memmap_get_handed_off(uint32_t *mmap_size)
+{
+    *mmap_size = efi_mmap_handed_off;
+    return efi_mmap->descr;
+}
+
 /**
  * @brief Walk through memory map descriptors
  * 
@@ -117,6 +294,10 @@ efi_mem_descr_t* efi_memmap_walk(efi_mem_descr_t* prev)
     }
 
     if (prev == NULL) {
+        efi_memmap_sync();
+        if (efi_mmap->size == 0) {
+            return NULL;
+        }
         return (efi_mem_descr_t*)efi_mmap->descr;
     } else if ((uint32_t)prev < (uint32_t)efi_mmap->descr) {
         /* 
@@ -149,107 +330,44 @@ efi_mem_descr_t* efi_memmap_walk(efi_mem_descr_t* prev)
  */
 bool efi_memmap_reserve(uint64_t base, uint64_t length)
 {
-    if (length == 0 || !efi_mmap_available) {
+    range_t range = { base, base + length, EFI_RESERVED_TYPE, 0 };
+
+    return efi_memmap_reserve_batch(&range, 1);
+}
+
+/**
+ * @brief Mark a set of memory regions as reserved
+ *
+ * Same as efi_memmap_reserve() for each of @p count [base, end) ranges; the
+ * ranges are rounded to pages and sorted in place.
+ *
+ * @param ranges ranges to reserve
+ * @param count  number of ranges
+ */
+bool efi_memmap_reserve_batch(range_t *ranges, uint32_t count)
+{
+    if (!efi_mmap_available) {
         return true;
     }
 
     /* Round to page size */
     uint64_t mask = ~((1ULL << EFI_PAGE_SHIFT) - 1ULL);
-    base &= mask;
-    if (length & ~mask) {
-        length &= mask;
-        length += (1ULL << EFI_PAGE_SHIFT);
-    }
-
-    uint64_t end = base + length;
-    efi_mem_descr_t* desc = NULL;
-    uint32_t i = 0;
-
-    while ((desc = efi_memmap_walk(desc)) != NULL) {
-        uint64_t desc_base = desc->physical_start;
-        uint64_t desc_length = desc->num_pages << EFI_PAGE_SHIFT;
-        uint64_t desc_end = desc_base + desc_length;
-
-        /* if already unusable, no need to deal with */
-        if (desc->type < EFI_LOADER_CODE ||
-                desc->type > EFI_CONVENTIONAL_MEMORY) {
-            goto cont;
-        }
-
-        /* if the range is before the current ram range, skip the ram range */
-        if (end <= desc_base) {
-            goto cont;
-        }
-        /* if the range is after the current ram range, skip the ram range */
-        if (base >= desc_end) {
-            goto cont;
-        }
-
-        /* case 1: the current ram range is within the range:
-           base, desc_base, desc_end, end */
-        if ((base <= desc_base) && (desc_end <= end)) {
-            desc->type = EFI_RESERVED_TYPE;
-        }
-        /* case 2: overlapping:
-           base, e820_base, end, e820_end */
-        else if ((desc_base >= base) && (end > desc_base) && (desc_end > end)) {
-            /* split the current ram map */
-            if (!insert_after_region(i-1, desc_base, (end - desc_base),
-                                     EFI_RESERVED_TYPE, desc->attribute)) {
-                return false;
-            }
-            /* fixup the current ram map */
-            desc = efi_memmap_walk(desc); 
-            ++i;
-            desc->physical_start = end;
-            desc->num_pages = (desc_end - end) >> EFI_PAGE_SHIFT;
-            /* no need to check more */
-            break;
+    for (uint32_t i = 0; i < count; i++) {
+        if (ranges[i].end == ranges[i].base) {
+            continue;
         }
-        /* case 3: overlapping:
-           desc_base, base, desc_end, end */
-        else if ((base > desc_base) && (desc_end > base) && (end >= desc_end)) {
-            /* fixup the current ram map */
-            desc->num_pages = (base - desc_base) >> EFI_PAGE_SHIFT;
-            /* split the current ram map */
-            if (!insert_after_region(i, base, (desc_end - base),
-                                     EFI_RESERVED_TYPE, desc->attribute)) {
-                return false;
-            }
-            desc = efi_memmap_walk(desc); 
-            ++i;
-        }
-        /* case 4: the range is within the current ram range:
-           desc_base, base, end, desc_end */
-        else if ((base > desc_base) && (desc_end > end)) {
-            /* fixup the current ram map */
-            desc->num_pages = (base - desc_base) >> EFI_PAGE_SHIFT;
-            /* split the current ram map */
-            if (!insert_after_region(i, base, length, EFI_RESERVED_TYPE,
-                                     desc->attribute)) {
-                return false;
-            }
-            ++i;
-            /* fixup the rest of the current ram map */
-            if (!insert_after_region(i, end, (desc_end - end), desc->type,
-                                     desc->attribute)) {
-                return false;
-            }
-            desc = efi_memmap_walk(desc);
-            desc = efi_memmap_walk(desc); 
-            ++i;
-            /* no need to check more */
-            break;
+        ranges[i].base &= mask;
+        if (ranges[i].end & ~mask) {
+            ranges[i].end = (ranges[i].end & mask) + (1ULL << EFI_PAGE_SHIFT);
         }
-        else {
-            printk(TBOOT_ERR"we should never get here\n");
-            return false;
-        }
-
-        cont:
-        ++i;
     }
 
+    efi_mmap_dirty = true;
+    if (!range_map_retype_batch(&efi_range_map, ranges, count,
+                                region_is_reservable, EFI_RESERVED_TYPE)) {
+        printk(TBOOT_ERR"Too many entries in EFI memory map\n");
+        return false;
+    }
     return true;
 }
 
@@ -258,12 +376,10 @@ bool efi_memmap_reserve(uint64_t base, uint64_t length)
  */
 void efi_memmap_dump(void)
 {
-    efi_mem_descr_t* desc = NULL;
-    while ((desc = efi_memmap_walk(desc)) != NULL) {
+    for (uint32_t i = 0; i < efi_range_map.nr; i++) {
         printk(TBOOT_INFO" %016llx - %016llx (%-2d | 0x%llx)\n",
-               desc->physical_start,
-               desc->physical_start + (desc->num_pages << EFI_PAGE_SHIFT),
-               desc->type, desc->attribute);
+               efi_ranges[i].base, efi_ranges[i].end,
+               efi_ranges[i].type, efi_ranges[i].attr);
     }
 }
 
@@ -292,21 +408,8 @@ bool efi_memmap_get_highest_sized_ram(uint64_t size, uint64_t limit,
         return false;
     }
 
-    efi_mem_descr_t* desc = NULL;
-    while ((desc = efi_memmap_walk(desc)) != NULL) {
-        if (region_is_free(desc->type)) {
-            uint64_t base = desc->physical_start;
-            uint64_t length = desc->num_pages * (1 << EFI_PAGE_SHIFT);
-
-            /* over 4GB so use the last region that fit */
-            if ( base + length > limit )
-                break;
-            if ( size <= length ) {
-                last_fit_base = base;
-                last_fit_size = length;
-            }
-        }
-    }
+    range_map_get_highest(&efi_range_map, size, limit, region_is_free,
+                          &last_fit_base, &last_fit_size);
 
     printk("get_highest_sized_ram: size %llx -> base %llx, size %llx\n",
            size, last_fit_base, last_fit_size);
@@ -320,35 +423,6 @@ bool efi_memmap_get_highest_sized_ram(uint64_t size, uint64_t limit,
     }
 }
 
-static bool insert_after_region(uint32_t pos, uint64_t addr, uint64_t size,
-                                uint32_t type, uint64_t attr)
-{
-    /* no more room */
-    if (efi_mmap->size / efi_mmap->descr_size + 1 > EFI_MEMMAP_MAX_ENTRIES)
-        return false;
-
-    pos *= efi_mmap->descr_size;
-
-    /* shift (copy) everything up one entry */
-    for (uint32_t i = efi_mmap->size; i > pos; i -= efi_mmap->descr_size) {
-        uint32_t bytes = efi_mmap->descr_size;
-        void* to = efi_mmap->descr + i;
-        void* from = efi_mmap->descr + i - bytes;
-        tb_memcpy(to, from, bytes);
-    }
-
-    efi_mem_descr_t* desc = (efi_mem_descr_t*)(efi_mmap->descr + pos +
-                            efi_mmap->descr_size);
-    tb_memset(desc, 0, efi_mmap->descr_size);
-    desc->type = type;
-    desc->physical_start = addr;
-    desc->num_pages = size >> EFI_PAGE_SHIFT;
-    desc->attribute = attr;
-    efi_mmap->size += efi_mmap->descr_size;
-
-    return true;
-}
-
 static bool region_is_free(uint32_t region_type)
 {
     if (region_type == EFI_LOADER_CODE || region_type == EFI_LOADER_DATA ||
@@ -357,4 +431,11 @@ static bool region_is_free(uint32_t region_type)
     } else {
         return false;
     }
-}
\ No newline at end of file
+}
+
+/* types that efi_memmap_reserve() may turn into EFI_RESERVED_TYPE */
+static bool region_is_reservable(uint32_t region_type)
+{
+    return region_type >= EFI_LOADER_CODE &&
+           region_type <= EFI_CONVENTIONAL_MEMORY;
+}
@@ -75,10 +75,17 @@ __data tpm_pcr_value_t post_launch_pcr17, post_launch_pcr18;
 extern tboot_shared_t _tboot_shared;
 
 extern bool hash_policy(tb_hash_t *hash, uint16_t hash_alg);
+extern bool hash_platform_state(tb_hash_t *hash);
 extern void apply_policy(tb_error_t error);
 
 #define EVTTYPE_TB_MEASUREMENT (0x400 + 0x101)
 extern bool evtlog_append(uint8_t pcr, hash_list_t *hl, uint32_t type);
+extern void evtlog_print_appended(void);
+extern bool evtlog_has_room(const hash_list_t *hl, unsigned int count);
+
+/* S3 resume: set once the pre-kernel state has been unsealed this pass */
+static bool g_pre_k_checked, g_pre_k_verified;
+static bool g_platform_verified;
 
 typedef struct {
     uint8_t mac_key[POLY1305_KEY_SIZE];
@@ -90,17 +97,27 @@ static bool extend_pcrs(void)
 {
     struct tpm_if *tpm = get_tpm();
     const struct tpm_if_fp *tpm_fp = get_tpm_fp();
-    for ( int i = 0; i < g_pre_k_s3_state.num_vl_entries; i++ ) {
-        if ( !tpm_fp->pcr_extend(tpm, 2, g_pre_k_s3_state.vl_entries[i].pcr,
-                    &g_pre_k_s3_state.vl_entries[i].hl) )
-            return false;
-        if ( !evtlog_append(g_pre_k_s3_state.vl_entries[i].pcr,
-                            &g_pre_k_s3_state.vl_entries[i].hl,
-                            EVTTYPE_TB_MEASUREMENT) )
-            return false;
+    bool ok = true;
+
+    /* all entries have the same banks, so the first one sizes them all */
+    if ( g_pre_k_s3_state.num_vl_entries > 0 &&
+         !evtlog_has_room(&g_pre_k_s3_state.vl_entries[0].hl,
+                          g_pre_k_s3_state.num_vl_entries) ) {
+        printk(TBOOT_ERR"event log has no room for %u measurements\n",
+               g_pre_k_s3_state.num_vl_entries);
+        return false;
     }
 
-    return true;
+    for ( int i = 0; ok && i < g_pre_k_s3_state.num_vl_entries; i++ ) {
+        ok = tpm_fp->pcr_extend(tpm, 2, g_pre_k_s3_state.vl_entries[i].pcr,
+                                &g_pre_k_s3_state.vl_entries[i].hl) &&
+             evtlog_append(g_pre_k_s3_state.vl_entries[i].pcr,
+                           &g_pre_k_s3_state.vl_entries[i].hl,
+                           EVTTYPE_TB_MEASUREMENT);
+    }
+    evtlog_print_appended();
+
+    return ok;
 }
 
 static void print_pre_k_s3_state(void)
@@ -114,6 +131,8 @@ static void print_pre_k_s3_state(void)
     printk(TBOOT_DETA"\t vtd_pmr_hi_size: 0x%Lx\n", g_pre_k_s3_state.vtd_pmr_hi_size);
     printk(TBOOT_DETA"\t pol_hash: ");
     print_hash(&g_pre_k_s3_state.pol_hash, tpm->cur_alg);
+    printk(TBOOT_DETA"\t plat_hash: ");
+    print_hash(&g_pre_k_s3_state.plat_hash, TB_HALG_SHA256);
     printk(TBOOT_DETA"\t VL measurements:\n");
     for ( unsigned int i = 0; i < g_pre_k_s3_state.num_vl_entries; i++ ) {
         printk(TBOOT_DETA"\t   PCR %d (alg count %d):\n",
@@ -227,6 +246,12 @@ bool seal_pre_k_state(void)
         goto error;
     }
 
+    /* and a digest of what was validated on the way here, for S3 */
+    if ( !hash_platform_state(&g_pre_k_s3_state.plat_hash) ) {
+        printk(TBOOT_ERR"failed to hash platform state\n");
+        goto error;
+    }
+
     print_pre_k_s3_state();
 
     /* read PCR 17/18, only for tpm1.2 */
@@ -373,22 +398,26 @@ static bool measure_memory_integrity(uint8_t* mac, uint8_t* key)
 }
 
 /*
- * verify memory integrity and sealed VL hashes, then re-extend hashes
- *
- * this must be called post-launch but before extending any modules or other
- * measurements into PCRs
+ * unseal and check the pre-kernel state; on S3 resume this is done as soon
+ * as the TPM is up so that the rest of the post-launch pass can skip what
+ * the first launch validated, and verify_integrity() reuses the result
  */
-bool verify_integrity(void)
+bool s3_verify_pre_k_state(void)
 {
     tpm_pcr_value_t pcr17, pcr18;
+    tb_hash_t plat_hash;
     struct tpm_if *tpm = get_tpm();
     const struct tpm_if_fp *tpm_fp = get_tpm_fp();
 
+    if ( g_pre_k_checked )
+        return g_pre_k_verified;
+    g_pre_k_checked = true;
+
     /* read PCR 17/18, only for tpm1.2 */
     if ( tpm->major == TPM12_VER_MAJOR ) {
         if ( !tpm_fp->pcr_read(tpm, 2, 17, &pcr17) ||
              !tpm_fp->pcr_read(tpm, 2, 18, &pcr18) )
-            goto error;
+            return false;
         printk(TBOOT_DETA"PCRs before unseal:\n");
         printk(TBOOT_DETA"  PCR 17: ");
         print_hash((tb_hash_t *)&pcr17, TB_HALG_SHA1);
@@ -401,6 +430,60 @@ bool verify_integrity(void)
     if ( !verify_sealed_data(sealed_pre_k_state, sealed_pre_k_state_size,
                              &g_pre_k_s3_state, sizeof(g_pre_k_s3_state),
                              NULL, 0) )
+        return false;
+    g_pre_k_verified = true;
+
+    g_platform_verified = hash_platform_state(&plat_hash) &&
+        are_hashes_equal(&plat_hash, &g_pre_k_s3_state.plat_hash,
+                         TB_HALG_SHA256);
+    printk(TBOOT_INFO"platform state %s since launch\n",
+           g_platform_verified ? "unchanged" : "changed");
+
+    return true;
+}
+
+/* BIOS data and saved MTRRs match what the sealed launch validated */
+bool s3_platform_verified(void)
+{
+    return g_platform_verified;
+}
+
+/*
+ * policy still in memory is the one that was sealed
+ *
+ * The NV policy index is deliberately not re-read: the resume re-extends
+ * the sealed VL measurements, whose first entry records the launch policy
+ * (its control field, and its hash if TB_POLCTL_EXTEND_PCR17 is set), so
+ * that is the policy the PCRs attest to and the one the resume enforces.
+ * A policy written to NV after launch takes effect, and is measured, at
+ * the next full launch.
+ */
+bool s3_policy_unchanged(void)
+{
+    tb_hash_t pol_hash;
+    struct tpm_if *tpm = get_tpm();
+
+    if ( !g_pre_k_verified )
+        return false;
+
+    tb_memset(&pol_hash, 0, sizeof(pol_hash));
+    return hash_policy(&pol_hash, tpm->cur_alg) &&
+           are_hashes_equal(&pol_hash, &g_pre_k_s3_state.pol_hash,
+                            tpm->cur_alg);
+}
+
+/*
+ * verify memory integrity and sealed VL hashes, then re-extend hashes
+ *
+ * this must be called post-launch but before extending any modules or other
+ * measurements into PCRs
+ */
+bool verify_integrity(void)
+{
+    struct tpm_if *tpm = get_tpm();
+    const struct tpm_if_fp *tpm_fp = get_tpm_fp();
+
+    if ( !s3_verify_pre_k_state() )
         goto error;
 
     if ( !tpm_fp->verify_creation(tpm, sealed_post_k_state_size,  sealed_post_k_state) ) {
@@ -58,6 +58,7 @@
 #include <cmdline.h>
 #include <tpm.h>
 #include <efi_memmap.h>
+#include <modreloc.h>
 
 /* copy of kernel/VMM command line so that can append 'tboot=0x1234' */
 static char * volatile new_cmdline = (char *)TBOOT_KERNEL_CMDLINE_ADDR;
@@ -78,6 +79,7 @@ extern bool jump_linux_image(const void *entry_point);
 extern bool is_sinit_acmod(const void *acmod_base, uint32_t acmod_size, 
                            bool quiet);
 extern void apply_policy(tb_error_t error);
+extern void invalidate_module_hashes(void);
 extern uint32_t g_mb_orig_size;
 
 #define LOADER_CTX_BAD(xctx) \
@@ -801,6 +803,8 @@ static bool move_modules_to_high_memory(loader_ctx  *lctx)
     if (LOADER_CTX_BAD(lctx))
         return false;
 
+    invalidate_module_hashes();
+
     /*  Determine the size of memory required to pack all modules together */
     module_count = get_module_count(lctx);
     for( memRequired=0, mod_i=0; mod_i < module_count; mod_i++ ){
@@ -884,6 +888,8 @@ static bool move_modules_above_elf_kernel(  loader_ctx      *lctx,
     if (LOADER_CTX_BAD(lctx))
         return false;
 
+    invalidate_module_hashes();
+
     /* get end address of loaded elf image */
     if ( !get_elf_image_range(kernel_image, &elf_start, &elf_end) ){
         printk(TBOOT_INFO"ERROR: failed to get elf image range\n");
@@ -951,6 +957,79 @@ static bool move_modules_above_elf_kernel(  loader_ctx      *lctx,
     return true;
 }
 
+static reloc_mod_t reloc_mods[MAX_RELOC_MODULES];
+static reloc_step_t reloc_steps[2 * MAX_RELOC_MODULES];
+
+/*
+ * Move modules so that none of them is in the way of the ELF kernel's
+ * expansion and all of them end up where move_modules_above_elf_kernel()
+ * expects them, copying as few bytes as possible.  Returns false without
+ * having moved anything if the planner can't find a safe layout.
+ */
+static bool relocate_modules_for_elf_kernel(loader_ctx *lctx,
+                                            elf_header_t *kernel_image)
+{
+    void *elf_start, *elf_end;
+    uint64_t stage_base = 0, stage_size = 0;
+    uint32_t mem_required = 0, ld_floor, copied = 0;
+    unsigned int module_count, nr_steps, i;
+
+    if (LOADER_CTX_BAD(lctx))
+        return false;
+
+    invalidate_module_hashes();
+
+    module_count = get_module_count(lctx);
+    if ( module_count == 0 || module_count > MAX_RELOC_MODULES )
+        return false;
+
+    if ( !get_elf_image_range(kernel_image, &elf_start, &elf_end) )
+        return false;
+
+    ld_floor = get_tboot_mem_end();
+    ld_floor = (ld_floor < (uint32_t)elf_end)? (uint32_t)elf_end : ld_floor;
+    ld_floor = PAGE_UP(ld_floor);
+
+    tb_memset(reloc_mods, 0, sizeof(reloc_mods));
+    for ( i = 0; i < module_count; i++ ) {
+        module_t *m = get_module(lctx, i);
+        reloc_mods[i].start = m->mod_start;
+        reloc_mods[i].end = m->mod_end;
+        mem_required += PAGE_UP(m->mod_end - m->mod_start);
+    }
+
+    /* staging area is only needed if modules block each other */
+    if ( !efi_memmap_get_highest_sized_ram(mem_required, 0x100000000ULL,
+                                           &stage_base, &stage_size) ) {
+        if ( !e820_get_highest_sized_ram(mem_required, 0x100000000ULL,
+                                         &stage_base, &stage_size) )
+            stage_size = 0;
+    }
+
+    if ( !plan_module_moves(reloc_mods, module_count, ld_floor,
+                            (uint32_t)elf_end, stage_base, stage_size,
+                            reloc_steps, &nr_steps) ) {
+        printk(TBOOT_INFO"no direct module relocation plan found\n");
+        return false;
+    }
+
+    for ( i = 0; i < nr_steps; i++ ) {
+        module_t *m = get_module(lctx, reloc_steps[i].mod_i);
+        uint32_t size = m->mod_end - m->mod_start;
+
+        printk(TBOOT_INFO"moving module %u (%u B) from 0x%08X to 0x%08X\n",
+               reloc_steps[i].mod_i, size, m->mod_start, reloc_steps[i].dest);
+        tb_memcpy((void *)reloc_steps[i].dest, (void *)m->mod_start, size);
+        m->mod_start = reloc_steps[i].dest;
+        m->mod_end = reloc_steps[i].dest + size;
+        copied += size;
+    }
+    printk(TBOOT_INFO"module relocation: %u moves, 0x%x bytes copied\n",
+           nr_steps, copied);
+
+    return true;
+}
+
 static void fixup_modules(loader_ctx *lctx, size_t offset)
 {
     unsigned int module_count = get_module_count(lctx);
@@ -1094,6 +1173,8 @@ move_modules(loader_ctx *lctx)
     if (LOADER_CTX_BAD(lctx))
         return;
 
+    invalidate_module_hashes();
+
     unsigned long lowest = get_lowest_mod_start_below_tboot(lctx);
     unsigned long from = 0;
 
@@ -1388,18 +1469,6 @@ bool launch_kernel(bool is_measured_launch)
             printk(TBOOT_ERR"CRB workaround failed \n");
     }
 
-    /* if using memory logging, reserve log area */
-    if ( g_log_targets & TBOOT_LOG_TARGET_MEMORY ) {
-        uint64_t base = TBOOT_SERIAL_LOG_ADDR;
-        uint64_t size = TBOOT_SERIAL_LOG_SIZE;
-        printk(TBOOT_INFO"reserving tboot memory log (%Lx - %Lx) in e820 table\n", base, (base + size - 1));
-        if ( !e820_protect_region(base, size, E820_RESERVED) )
-            apply_policy(TB_ERR_FATAL);
-        if (!efi_memmap_reserve(base, size)) {
-            apply_policy(TB_ERR_FATAL);
-        }
-    }
-
     /* replace map in loader context with copy */
     replace_e820_map(g_ldr_ctx);
 
@@ -1459,10 +1528,14 @@ bool launch_kernel(bool is_measured_launch)
         /* fix for GRUB2, which may load modules into memory before tboot */
         move_modules(g_ldr_ctx);
 
-        /* move modules out of the way (to top og memory below 4G) */
-        printk(TBOOT_INFO"move modules to high memory\n");
-        if(!move_modules_to_high_memory(g_ldr_ctx))
-            return false;
+        /* move only the modules in the way of the expanded kernel, or,
+           if that can't be planned, all of them to top of memory below 4G */
+        if ( !relocate_modules_for_elf_kernel(g_ldr_ctx,
+                                              (elf_header_t *)kernel_image) ) {
+            printk(TBOOT_INFO"move modules to high memory\n");
+            if(!move_modules_to_high_memory(g_ldr_ctx))
+                return false;
+        }
     }
     else {
         printk(TBOOT_INFO"assuming kernel is Linux format\n");
@@ -1783,13 +1856,25 @@ find_platform_racm(loader_ctx *lctx, void **base, uint32_t *size)
         return false;
     }
 
+    /*
+     * pick the newest RACM for this platform with quiet checks, then
+     * validate only that one verbosely
+     */
+    module_t *best = NULL;
     for ( int i = get_module_count(lctx) - 1; i >= 0; i-- ) {
         module_t *m = get_module(lctx, i);
-        printk(TBOOT_DETA
-               "checking if module %s is an RACM for this platform...\n",
-               get_module_cmd(lctx, m));
         void *base2 = (void *)m->mod_start;
         uint32_t size2 = m->mod_end - (unsigned long)(base2);
+        if ( is_better_platform_acmod(base2, size2, true,
+                       best == NULL ? NULL : (acm_hdr_t *)best->mod_start) )
+            best = m;
+    }
+    if ( best != NULL ) {
+        printk(TBOOT_DETA
+               "checking if module %s is an RACM for this platform...\n",
+               get_module_cmd(lctx, best));
+        void *base2 = (void *)best->mod_start;
+        uint32_t size2 = best->mod_end - (unsigned long)(base2);
         if ( is_racm_acmod(base2, size2, false) &&
              does_acmod_match_platform((acm_hdr_t *)base2) ) {
             if ( base != NULL )
@@ -1822,19 +1907,25 @@ find_platform_sinit_module(loader_ctx *lctx, void **base, uint32_t *size)
         return false;
     }
 
+    /*
+     * pick the newest SINIT for this platform with quiet checks, then
+     * validate only that one verbosely (module 0 is the kernel)
+     */
+    module_t *best = NULL;
     for ( unsigned int i = get_module_count(lctx) - 1; i > 0; i-- ) {
         module_t *m = get_module(lctx, i);
-        if (lctx->type == 1)
-            printk(TBOOT_DETA
-                   "checking if module %s is an SINIT for this platform...\n",
-                   (const char *)m->string);
-        if (lctx->type == 2)
-            printk(TBOOT_DETA
-                   "checking if module %s is an SINIT for this platform...\n",
-                   (const char *)&(m->string));
-
         void *base2 = (void *)m->mod_start;
         uint32_t size2 = m->mod_end - (unsigned long)(base2);
+        if ( is_better_platform_acmod(base2, size2, false,
+                       best == NULL ? NULL : (acm_hdr_t *)best->mod_start) )
+            best = m;
+    }
+    if ( best != NULL ) {
+        printk(TBOOT_DETA
+               "checking if module %s is an SINIT for this platform...\n",
+               get_module_cmd(lctx, best));
+        void *base2 = (void *)best->mod_start;
+        uint32_t size2 = best->mod_end - (unsigned long)(base2);
         if ( is_sinit_acmod(base2, size2, false) &&
              does_acmod_match_platform((acm_hdr_t *)base2) ) {
             if ( base != NULL )
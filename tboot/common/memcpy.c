@@ -31,8 +31,16 @@
  */
 
 /* $FreeBSD: src/sys/powerpc/powerpc/bcopy.c,v 1.5.24.1 2010/02/10 00:26:20 kensmith Exp $ */
+/*
+ * Portions copyright (c) 2010-2021, Intel Corporation
+ */
 
+#include <config.h>
+#include <types.h>
+#include <stdbool.h>
+#include <compiler.h>
 #include <string.h>
+#include <processor.h>
 
 /*
  * sizeof(word) MUST BE A POWER OF TWO
@@ -43,86 +51,211 @@ typedef	int	word;		/* "word" used for optimal copy speed */
 #define	wsize	sizeof(word)
 #define wmask	(wsize - 1)
 
+/*
+ * Macros: loop-t-times; and loop-t-times, t>0
+ */
+#define	TLOOP(s) if (t) TLOOP1(s)
+#define	TLOOP1(s) do { s; } while (--t)
+
+#define CPUID_X86_FEATURE_SSE2		(1<<26)	/* cpuid(1).edx */
+#define CPUID_X86_FEATURE_ERMS		(1<<9)	/* cpuid(7,0).ebx */
+#define CPUID_X86_FEATURE_FSRM		(1<<4)	/* cpuid(7,0).edx */
+
+static bool		mem_features_probed;
+static uint32_t		mem_features;
+
+/*
+ * Probe (once) the CPU features that select the string-op implementation.
+ * tboot runs with interrupts disabled and never touches XMM state, so only
+ * features usable from general purpose registers are reported.
+ */
+uint32_t tb_mem_features(void)
+{
+	uint32_t regs[4];
+
+	if (mem_features_probed)
+		return (mem_features);
+
+	do_cpuid(1, regs);
+	if (regs[3] & CPUID_X86_FEATURE_SSE2)
+		mem_features |= TB_MEM_SSE2;
+
+	if (cpuid_eax(0) >= 7) {
+		do_cpuid1(7, 0, regs);
+		if (regs[1] & CPUID_X86_FEATURE_ERMS)
+			mem_features |= TB_MEM_ERMS;
+		if (regs[3] & CPUID_X86_FEATURE_FSRM)
+			mem_features |= TB_MEM_FSRM;
+	}
+
+	mem_features_probed = true;
+	return (mem_features);
+}
+
+/*
+ * Copy forward with rep movs.  With ERMS/FSRM the microcode picks the best
+ * chunking itself, so a single rep movsb is used; otherwise move dwords and
+ * mop up the trailing bytes.
+ */
+static void copy_rep(char *dst, const char *src, size_t length,
+    uint32_t features)
+{
+	if (features & (TB_MEM_ERMS | TB_MEM_FSRM)) {
+		__asm__ __volatile__ ("cld; rep movsb"
+		    : "+D" (dst), "+S" (src), "+c" (length)
+		    : : "memory");
+		return;
+	}
+
+	size_t t = length / wsize;
+	__asm__ __volatile__ ("cld; rep movsl"
+	    : "+D" (dst), "+S" (src), "+c" (t)
+	    : : "memory");
+	t = length & wmask;
+	__asm__ __volatile__ ("rep movsb"
+	    : "+D" (dst), "+S" (src), "+c" (t)
+	    : : "memory");
+}
+
+/*
+ * Copy forward with non-temporal (movnti) stores so that large copies
+ * (SINIT, kernel/initrd relocation, ELF segment expansion) do not evict
+ * everything else from the cache.  Destination is dword-aligned first.
+ */
+static void copy_nt(char *dst, const char *src, size_t length)
+{
+	size_t t;
+
+	t = (size_t)(-(unsigned long)dst & wmask);
+	length -= t;
+	TLOOP(*dst++ = *src++);
+
+	t = length / (4 * wsize);
+	TLOOP(
+	    __asm__ __volatile__ (
+		"movl   (%1), %%eax\n\t"
+		"movl  4(%1), %%edx\n\t"
+		"movnti %%eax,   (%0)\n\t"
+		"movnti %%edx,  4(%0)\n\t"
+		"movl  8(%1), %%eax\n\t"
+		"movl 12(%1), %%edx\n\t"
+		"movnti %%eax,  8(%0)\n\t"
+		"movnti %%edx, 12(%0)"
+		: : "r" (dst), "r" (src) : "eax", "edx", "memory");
+	    src += 4 * wsize; dst += 4 * wsize);
+
+	/* make the weakly-ordered stores globally visible */
+	__asm__ __volatile__ ("sfence" : : : "memory");
+
+	t = length & (4 * wsize - 1);
+	TLOOP(*dst++ = *src++);
+}
+
+/*
+ * Copy backwards; only used when the regions overlap with dst above src.
+ * Alignment works as in the forward case, except that it takes
+ * (t&wmask) bytes to align, not wsize-(t&wmask).
+ */
+static void copy_backward(char *dst, const char *src, size_t length)
+{
+	size_t t;
+
+	src += length;
+	dst += length;
+	t = (unsigned long)src;
+
+	if ((t | (unsigned long)dst) & wmask) {
+		if ((t ^ (unsigned long)dst) & wmask || length <= wsize) {
+			t = length;
+		} else {
+			t &= wmask;
+		}
+
+		length -= t;
+		TLOOP1(*--dst = *--src);
+	}
+	t = length / wsize;
+	TLOOP(src -= wsize; dst -= wsize;
+	    *(word *)dst = *(const word *)src);
+	t = length & wmask;
+	TLOOP(*--dst = *--src);
+}
+
 /*
  * Copy a block of memory, handling overlap.
- * This is the routine that actually implements
- * (the portable versions of) bcopy, memcpy, and memmove.
+ * This is the routine that implements memcpy and memmove.
  */
 void *tb_memcpy(void *dst0, const void *src0, size_t length)
 {
 	char		*dst;
 	const char	*src;
-	size_t		t;
+	uint32_t	features;
 
 	dst = dst0;
 	src = src0;
 
 	if (dst0 == NULL || src0 == NULL)
 		return NULL;
-	if (length == 0 || dst == src) {	/* nothing to do */
-		goto done;
+	if (length == 0 || dst == src)	/* nothing to do */
+		return (dst0);
+
+	if ((unsigned long)dst > (unsigned long)src &&
+	    (unsigned long)dst - (unsigned long)src < length) {
+		copy_backward(dst, src, length);
+		return (dst0);
 	}
 
-	/*
-	 * Macros: loop-t-times; and loop-t-times, t>0
-	 */
-#define	TLOOP(s) if (t) TLOOP1(s)
-#define	TLOOP1(s) do { s; } while (--t)
+	features = tb_mem_features();
+	/* an overlapping forward copy must not outrun its source */
+	if (length >= TB_MEM_NT_THRESHOLD && (features & TB_MEM_SSE2) &&
+	    (unsigned long)src - (unsigned long)dst >= length)
+		copy_nt(dst, src, length);
+	else
+		copy_rep(dst, src, length, features);
 
-	if ((unsigned long)dst < (unsigned long)src) {
-		/*
-		 * Copy forward.
-		 */
-		t = (int)src;	/* only need low bits */
-
-		if ((t | (int)dst) & wmask) {
-			/*
-			 * Try to align operands.  This cannot be done
-			 * unless the low bits match.
-			 */
-			if ((t ^ (int)dst) & wmask || length < wsize) {
-				t = length;
-			} else {
-				t = wsize - (t & wmask);
-			}
-
-			length -= t;
-			TLOOP1(*dst++ = *src++);
-		}
-		/*
-		 * Copy whole words, then mop up any trailing bytes.
-		 */
-		t = length / wsize;
-		TLOOP(*(word *)dst = *(const word *)src; src += wsize;
-		    dst += wsize);
-		t = length & wmask;
-		TLOOP(*dst++ = *src++);
-	} else {
-		/*
-		 * Copy backwards.  Otherwise essentially the same.
-		 * Alignment works as before, except that it takes
-		 * (t&wmask) bytes to align, not wsize-(t&wmask).
-		 */
-		src += length;
-		dst += length;
-		t = (int)src;
-
-		if ((t | (int)dst) & wmask) {
-			if ((t ^ (int)dst) & wmask || length <= wsize) {
-				t = length;
-			} else {
-				t &= wmask;
-			}
-
-			length -= t;
-			TLOOP1(*--dst = *--src);
-		}
-		t = length / wsize;
-		TLOOP(src -= wsize; dst -= wsize;
-		    *(word *)dst = *(const word *)src);
-		t = length & wmask;
-		TLOOP(*--dst = *--src);
-	}
-done:
 	return (dst0);
 }
+
+/*
+ * Fill a block of memory.  Large fills use non-temporal stores for the
+ * same reason as tb_memcpy().
+ */
+void *tb_memset(void *b, int c, size_t len)
+{
+	char		*bb = b;
+	uint32_t	features, fill;
+	size_t		t;
+
+	features = tb_mem_features();
+	fill = (unsigned char)c;
+	fill |= fill << 8;
+	fill |= fill << 16;
+
+	if (len >= TB_MEM_NT_THRESHOLD && (features & TB_MEM_SSE2)) {
+		t = (size_t)(-(unsigned long)bb & wmask);
+		len -= t;
+		TLOOP(*bb++ = c);
+
+		t = len / wsize;
+		TLOOP(
+		    __asm__ __volatile__ ("movnti %1, (%0)"
+			: : "r" (bb), "r" (fill) : "memory");
+		    bb += wsize);
+		__asm__ __volatile__ ("sfence" : : : "memory");
+
+		len &= wmask;
+	}
+	else if (!(features & (TB_MEM_ERMS | TB_MEM_FSRM))) {
+		t = len / wsize;
+		__asm__ __volatile__ ("cld; rep stosl"
+		    : "+D" (bb), "+c" (t)
+		    : "a" (fill) : "memory");
+		len &= wmask;
+	}
+
+	__asm__ __volatile__ ("cld; rep stosb"
+	    : "+D" (bb), "+c" (len)
+	    : "a" (fill) : "memory");
+
+	return (b);
+}
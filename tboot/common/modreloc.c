@@ -0,0 +1,257 @@
+/*
+ * modreloc.c: planner for moving multiboot modules out of the way of an
+ *             ELF kernel with as few copies as possible
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef IS_INCLUDED     /* host tools include this file directly */
+#include <config.h>
+#include <types.h>
+#include <stdbool.h>
+#include <page.h>
+#include <modreloc.h>
+#endif
+
+/*
+ * Module relocation planner
+ *
+ * move_modules_to_high_memory() followed by move_modules_above_elf_kernel()
+ * copies every module twice, even when none of them is in the way of the
+ * expanded kernel.  The planner below computes, before the kernel is
+ * expanded, the final layout that move_modules_above_elf_kernel() would
+ * produce and moves each module straight there.  Modules already in place
+ * are not copied at all; a module is only staged in high memory when its
+ * final place is still occupied by another module (or the kernel image).
+ *
+ * relocate_modules_for_elf_kernel() in loader.c applies the plan.  The
+ * move_modules_above_elf_kernel() pass after expansion is kept: it finds
+ * every module already in place, and still does the work itself when no
+ * plan could be made.
+ */
+
+static bool ranges_overlap(uint32_t s1, uint32_t e1, uint32_t s2, uint32_t e2)
+{
+    return s1 < e2 && s2 < e1;
+}
+
+static uint32_t reloc_size(const reloc_mod_t *r)
+{
+    return r->end - r->start;
+}
+
+static uint32_t reloc_target_end(const reloc_mod_t *r)
+{
+    return r->target + reloc_size(r);
+}
+
+/* is [start, end) free of every module's current location (except skip)? */
+static bool reloc_range_free(const reloc_mod_t *mods, unsigned int count,
+                             unsigned int skip, uint32_t start, uint32_t end)
+{
+    for ( unsigned int i = 0; i < count; i++ ) {
+        if ( i == skip )
+            continue;
+        if ( ranges_overlap(start, end, mods[i].start, mods[i].end) )
+            return false;
+    }
+    return true;
+}
+
+/* does mods[idx] sit where another module still has to go? */
+static bool reloc_blocks_any(const reloc_mod_t *mods, unsigned int count,
+                             unsigned int idx)
+{
+    for ( unsigned int i = 1; i < count; i++ ) {
+        if ( i == idx || mods[i].start == mods[i].target )
+            continue;
+        if ( ranges_overlap(mods[i].target, reloc_target_end(&mods[i]),
+                            mods[idx].start, mods[idx].end) )
+            return true;
+    }
+    return false;
+}
+
+/*
+ * find a page-aligned slot for mods[idx] in the staging area, as high as
+ * possible, that overlaps neither any module (current or final location)
+ * nor the kernel's expansion range
+ */
+static bool reloc_find_stage(const reloc_mod_t *mods, unsigned int count,
+                             unsigned int idx, uint32_t elf_end,
+                             uint64_t stage_base, uint64_t stage_size,
+                             uint32_t *dest)
+{
+    uint64_t ceiling = stage_base + stage_size;
+    uint32_t size = reloc_size(&mods[idx]);
+
+    /* ends are kept in 32 bits, so nothing may end exactly at 4GB */
+    if ( ceiling > 0x100000000ULL - PAGE_SIZE )
+        ceiling = 0x100000000ULL - PAGE_SIZE;
+
+    while ( ceiling >= stage_base + size ) {
+        uint32_t s = PAGE_DOWN(ceiling - size);
+        uint32_t e = s + size;
+        bool clash = false;
+
+        if ( s < stage_base || s < elf_end )
+            return false;
+        for ( unsigned int i = 0; i < count && !clash; i++ ) {
+            if ( i != idx && ranges_overlap(s, e, mods[i].start, mods[i].end) ) {
+                ceiling = mods[i].start;
+                clash = true;
+            }
+            else if ( i != 0 &&
+                      ranges_overlap(s, e, mods[i].target,
+                                     reloc_target_end(&mods[i])) ) {
+                ceiling = mods[i].target;
+                clash = true;
+            }
+        }
+        if ( !clash ) {
+            *dest = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Compute the moves that bring mods[1..count-1] to their final location,
+ * packed in address order from ld_floor up, while keeping the kernel image
+ * (mods[0]) intact and out of [0, elf_end).  Nothing is modified in memory;
+ * mods[] is updated to the planned state and the moves are returned in
+ * steps[].  Returns false if no plan exists.
+ */
+bool plan_module_moves(reloc_mod_t *mods, unsigned int count,
+                       uint32_t ld_floor, uint32_t elf_end,
+                       uint64_t stage_base, uint64_t stage_size,
+                       reloc_step_t *steps, unsigned int *nr_steps)
+{
+    unsigned int i, pending = 0;
+    uint64_t floor = ld_floor;
+
+    *nr_steps = 0;
+
+    /*
+     * final layout: same order and packing as move_modules_above_elf_kernel.
+     * The kernel image is not part of it: launch_kernel() removes it from
+     * the module list before that pass runs, and its memory is dead once
+     * it has been expanded.  Giving it a slot would push every module above
+     * it off the place that pass puts them, and they would all be copied
+     * again after expansion.
+     */
+    for ( unsigned int placed = 1; placed < count; placed++ ) {
+        unsigned int lowest = 0;
+        for ( i = 1; i < count; i++ ) {
+            if ( mods[i].target != 0 )
+                continue;
+            if ( lowest == 0 || mods[i].start < mods[lowest].start )
+                lowest = i;
+        }
+        if ( floor + reloc_size(&mods[lowest]) >= 0x100000000ULL )
+            return false;
+        mods[lowest].target = (uint32_t)floor;
+        floor = PAGE_UP(floor + reloc_size(&mods[lowest]));
+        if ( mods[lowest].target != mods[lowest].start )
+            pending++;
+    }
+
+    /* the kernel image must survive until it is expanded */
+    bool kernel_in_way = ranges_overlap(0, elf_end, mods[0].start, mods[0].end);
+    for ( i = 1; i < count && !kernel_in_way; i++ )
+        kernel_in_way = ranges_overlap(mods[i].target, reloc_target_end(&mods[i]),
+                                       mods[0].start, mods[0].end);
+    if ( kernel_in_way ) {
+        uint32_t dest;
+        if ( !reloc_find_stage(mods, count, 0, elf_end, stage_base,
+                               stage_size, &dest) )
+            return false;
+        steps[*nr_steps].mod_i = 0;
+        steps[(*nr_steps)++].dest = dest;
+        mods[0].end = dest + reloc_size(&mods[0]);
+        mods[0].start = dest;
+    }
+
+    while ( pending > 0 ) {
+        bool moved = false;
+
+        for ( i = 1; i < count; i++ ) {
+            if ( mods[i].start == mods[i].target )
+                continue;
+            if ( !reloc_range_free(mods, count, i, mods[i].target,
+                                   reloc_target_end(&mods[i])) )
+                continue;
+            steps[*nr_steps].mod_i = i;
+            steps[(*nr_steps)++].dest = mods[i].target;
+            mods[i].end = reloc_target_end(&mods[i]);
+            mods[i].start = mods[i].target;
+            pending--;
+            moved = true;
+        }
+        if ( moved )
+            continue;
+
+        /* every remaining move is blocked: stage one of the blockers */
+        for ( i = 1; i < count; i++ ) {
+            if ( mods[i].start == mods[i].target || mods[i].staged )
+                continue;
+            if ( reloc_blocks_any(mods, count, i) )
+                break;
+        }
+        if ( i == count )
+            return false;
+
+        uint32_t dest;
+        if ( !reloc_find_stage(mods, count, i, elf_end, stage_base,
+                               stage_size, &dest) )
+            return false;
+        steps[*nr_steps].mod_i = i;
+        steps[(*nr_steps)++].dest = dest;
+        mods[i].end = dest + reloc_size(&mods[i]);
+        mods[i].start = dest;
+        mods[i].staged = true;
+    }
+
+    return true;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
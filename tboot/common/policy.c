@@ -133,7 +133,9 @@ static const tb_policy_map_t g_policy_map[] = {
     (( MAX_TB_POLICY_SIZE > sizeof(lcp_policy_t) )  \
         ? MAX_TB_POLICY_SIZE                        \
         : sizeof(lcp_policy_t) )
-static uint8_t _policy_index_buf[MAX_POLICY_SIZE];
+/* (kept across S3 so resume can reuse it once its sealed hash checks out;
+   see s3_policy_unchanged() for why a rewritten NV index is not re-read) */
+static __data uint8_t _policy_index_buf[MAX_POLICY_SIZE];
 
 /* default policy */
 static const tb_policy_t _def_policy = {
@@ -237,51 +239,18 @@ static const tb_policy_t* g_policy = &_def_policy;
  */
 static bool read_policy_from_tpm(uint32_t index, void* policy_index, size_t *policy_index_size)
 {
-#define NV_READ_SEG_SIZE    256
-    unsigned int offset = 0;
-    unsigned int data_size = 0;
-    uint32_t ret, index_size;
-    struct tpm_if *tpm = get_tpm();
-    const struct tpm_if_fp *tpm_fp = get_tpm_fp();
+    uint32_t size;
 
     if ( policy_index_size == NULL ) {
         printk(TBOOT_ERR"size is NULL\n");
         return false;
     }
 
-    ret = tpm_fp->get_nvindex_size(tpm, tpm->cur_loc, index, &index_size);
-    if ( !ret )
-        return false;
-
-    if ( index_size > *policy_index_size ) {
-        printk(TBOOT_WARN"policy in TPM NV %x was too big for buffer\n", index);
-        index_size = *policy_index_size;
-    }
-
-
-    do {
-        /* get data_size */
-        if ( (index_size - offset) > NV_READ_SEG_SIZE )
-            data_size = NV_READ_SEG_SIZE;
-        else
-            data_size = (uint32_t)(index_size - offset);
-
-        /* read! */
-        ret = tpm_fp->nv_read(tpm, tpm->cur_loc, index, offset,
-                             (uint8_t *)policy_index + offset, &data_size);
-        if ( !ret || data_size == 0 )
-            break;
-
-        /* adjust offset */
-        offset += data_size;
-    } while ( offset < index_size );
-
-    if ( offset == 0 && !ret ) {
-        printk(TBOOT_ERR"Error: read TPM error: 0x%x from index %x.\n", ret, index);
+    size = *policy_index_size;
+    if ( !tpm_nv_read_all(index, (uint8_t *)policy_index, &size) )
         return false;
-    }
 
-    *policy_index_size = offset;
+    *policy_index_size = size;
 
     return true;
 }
@@ -289,10 +258,8 @@ static bool read_policy_from_tpm(uint32_t index, void* policy_index, size_t *pol
 bool check_index_attribute(uint32_t index)
 {
     uint32_t attribute;
-    struct tpm_if *tpm = get_tpm();
-    const struct tpm_if_fp *tpm_fp = get_tpm_fp();
 
-    if ( !tpm_fp->get_nvindex_permission(tpm, 0, index, &attribute) ) {
+    if ( !tpm_nv_get_public(index, NULL, &attribute) ) {
         printk(TBOOT_ERR"\treading nv index permission failed\n");
         return false;
     }
@@ -322,7 +289,8 @@ static bool unwrap_lcp_policy(void)
 
     if ( txt_is_launched() ) {
         txt_heap_t *txt_heap = get_txt_heap();
-        os_sinit_data_t *os_sinit_data = get_os_sinit_data_start(txt_heap);
+        os_sinit_data_t *os_sinit_data =
+            get_txt_heap_region(txt_heap, TXT_HEAP_OS_SINIT_DATA);
 
         lcp_base = (void *)(unsigned long)os_sinit_data->lcp_po_base;
         lcp_size = (uint32_t)os_sinit_data->lcp_po_size;
@@ -501,6 +469,183 @@ bool hash_policy(tb_hash_t *hash, uint16_t hash_alg)
                        hash, hash_alg);
 }
 
+/*
+ * image hashes are the expensive part of a module measurement, so they are
+ * kept for the launch, keyed by where the image is and how it was hashed
+ * (module 0 is measured twice, for PCR 18 and for its own policy entry);
+ * anything that moves module images must call invalidate_module_hashes()
+ */
+#define MAX_MODULE_HASHES    16
+
+static struct {
+    uint32_t    base;
+    uint32_t    size;
+    uint8_t     extpol;
+    uint16_t    cur_alg;
+    hash_list_t hl;
+} g_module_hashes[MAX_MODULE_HASHES];
+static unsigned int g_num_module_hashes;
+
+void invalidate_module_hashes(void)
+{
+    g_num_module_hashes = 0;
+}
+
+static int find_module_hash(void *base, size_t size, unsigned int limit)
+{
+    const struct tpm_if *tpm = get_tpm();
+
+    for ( unsigned int i = 0; i < limit; i++ ) {
+        if ( g_module_hashes[i].base == (uint32_t)base &&
+             g_module_hashes[i].size == size &&
+             g_module_hashes[i].extpol == tpm->extpol &&
+             g_module_hashes[i].cur_alg == tpm->cur_alg )
+            return i;
+    }
+    return -1;
+}
+
+/* hash module image with every alg the current extend policy needs */
+static bool hash_module_image(hash_list_t *img_hl, void *base, size_t size)
+{
+    struct tpm_if *tpm = get_tpm();
+    const struct tpm_if_fp *tpm_fp = get_tpm_fp();
+
+    int i = find_module_hash(base, size, g_num_module_hashes);
+    if ( i >= 0 ) {
+        *img_hl = g_module_hashes[i].hl;
+        return true;
+    }
+
+    switch (tpm->extpol) {
+    case TB_EXTPOL_FIXED: 
+        img_hl->count = 1;
+        img_hl->entries[0].alg = tpm->cur_alg;
+        if ( !hash_buffer(base, size, &img_hl->entries[0].hash, tpm->cur_alg) )
+            return false;
+        break;
+
+    case TB_EXTPOL_AGILE: 
+        if ( !tpm_fp->hash(tpm, 2, base, size, img_hl) )
+            return false;
+        break;
+
+    case TB_EXTPOL_EMBEDDED: 
+        img_hl->count = tpm->alg_count;
+        for (unsigned int i=0; i<img_hl->count; i++) {
+            img_hl->entries[i].alg = tpm->algs[i];
+            if ( !hash_buffer(base, size, &img_hl->entries[i].hash,
+                        tpm->algs[i]) )
+                return false;
+        }
+        break;
+
+    default:
+        return false;
+    }
+
+    if ( g_num_module_hashes < MAX_MODULE_HASHES ) {
+        g_module_hashes[g_num_module_hashes].base = (uint32_t)base;
+        g_module_hashes[g_num_module_hashes].size = size;
+        g_module_hashes[g_num_module_hashes].extpol = tpm->extpol;
+        g_module_hashes[g_num_module_hashes].cur_alg = tpm->cur_alg;
+        g_module_hashes[g_num_module_hashes++].hl = *img_hl;
+    }
+
+    return true;
+}
+
+typedef struct {
+    void      *base;
+    size_t     size;
+    uint16_t   alg;
+    tb_hash_t *hash;
+    bool       ok;
+} hash_job_t;
+
+/* algs hash_buffer() handles without printing, which APs must not do */
+static bool can_hash_on_ap(uint16_t alg)
+{
+    return alg == TB_HALG_SHA1 || alg == TB_HALG_SHA256 ||
+           alg == TB_HALG_SHA384 || alg == TB_HALG_SHA512;
+}
+
+static void hash_job(void *data)
+{
+    hash_job_t *job = data;
+
+    job->ok = hash_buffer(job->base, job->size, job->hash, job->alg);
+}
+
+/*
+ * hash all module images up front, one job per (image, alg), spread over
+ * the BSP and the parked APs; the results fill g_module_hashes, so
+ * verify_module() only has to combine them with the cmdline hashes
+ */
+static void prehash_modules(loader_ctx *lctx)
+{
+    static hash_job_t jobs[MAX_MODULE_HASHES * MAX_ALG_NUM];
+    static void *job_ptrs[MAX_MODULE_HASHES * MAX_ALG_NUM];
+    const struct tpm_if *tpm = get_tpm();
+    unsigned int nr = g_num_module_hashes, nr_jobs = 0;
+
+    /* agile extend policy hashes on the TPM, which can't be shared */
+    if ( tpm->extpol != TB_EXTPOL_FIXED && tpm->extpol != TB_EXTPOL_EMBEDDED )
+        return;
+    /* verify_module() reports the unsupported ones */
+    if ( !can_hash_on_ap(tpm->cur_alg) )
+        return;
+    for ( unsigned int j = 0; tpm->extpol == TB_EXTPOL_EMBEDDED &&
+                              j < tpm->alg_count; j++ ) {
+        if ( !can_hash_on_ap(tpm->algs[j]) )
+            return;
+    }
+
+    for ( unsigned int i = 0; i < get_module_count(lctx) &&
+                              nr < MAX_MODULE_HASHES; i++ ) {
+        module_t *module = get_module(lctx, i);
+        if ( module == NULL )
+            continue;
+        void *base = (void *)module->mod_start;
+        size_t size = module->mod_end - module->mod_start;
+        if ( find_module_hash(base, size, nr) >= 0 )
+            continue;
+
+        g_module_hashes[nr].base = (uint32_t)base;
+        g_module_hashes[nr].size = size;
+        g_module_hashes[nr].extpol = tpm->extpol;
+        g_module_hashes[nr].cur_alg = tpm->cur_alg;
+        hash_list_t *hl = &g_module_hashes[nr++].hl;
+        if ( tpm->extpol == TB_EXTPOL_FIXED ) {
+            hl->count = 1;
+            hl->entries[0].alg = tpm->cur_alg;
+        }
+        else {
+            hl->count = tpm->alg_count;
+            for ( unsigned int j = 0; j < hl->count; j++ )
+                hl->entries[j].alg = tpm->algs[j];
+        }
+
+        for ( unsigned int j = 0; j < hl->count; j++ ) {
+            jobs[nr_jobs].base = base;
+            jobs[nr_jobs].size = size;
+            jobs[nr_jobs].alg = hl->entries[j].alg;
+            jobs[nr_jobs].hash = &hl->entries[j].hash;
+            job_ptrs[nr_jobs] = &jobs[nr_jobs];
+            nr_jobs++;
+        }
+    }
+
+    txt_run_on_aps(hash_job, job_ptrs, nr_jobs);
+
+    /* on any failure leave it to verify_module() to hash and report */
+    for ( unsigned int i = 0; i < nr_jobs; i++ ) {
+        if ( !jobs[i].ok )
+            return;
+    }
+    g_num_module_hashes = nr;
+}
+
 /* generate hash by hashing cmdline and module image */
 static bool hash_module(hash_list_t *hl,
                         const char* cmdline, void *base,
@@ -508,6 +653,7 @@ static bool hash_module(hash_list_t *hl,
 {
     struct tpm_if *tpm = get_tpm();
     const struct tpm_if_fp *tpm_fp = get_tpm_fp();
+    hash_list_t img_hl;
 
     if ( hl == NULL ) {
         printk(TBOOT_ERR"Error: input parameter is wrong.\n");
@@ -525,6 +671,9 @@ static bool hash_module(hash_list_t *hl,
     // else
     //    cmdline = skip_filename(cmdline);
 
+    if ( !hash_module_image(&img_hl, base, size) )
+        return false;
+
     switch (tpm->extpol) {
     case TB_EXTPOL_FIXED: 
         hl->count = 1;
@@ -533,26 +682,22 @@ static bool hash_module(hash_list_t *hl,
         if ( !hash_buffer((const unsigned char *)cmdline, tb_strlen(cmdline),
                     &hl->entries[0].hash, tpm->cur_alg) )
             return false;
-        /* hash image and extend into cmdline hash */
-        tb_hash_t img_hash;
-        if ( !hash_buffer(base, size, &img_hash, tpm->cur_alg) )
-            return false;
-        if ( !extend_hash(&hl->entries[0].hash, &img_hash, tpm->cur_alg) )
+        /* extend image hash into cmdline hash */
+        if ( !extend_hash(&hl->entries[0].hash, &img_hl.entries[0].hash,
+                          tpm->cur_alg) )
             return false;
 
         break;
 
     case TB_EXTPOL_AGILE: 
     {
-        hash_list_t img_hl, final_hl;
+        hash_list_t final_hl;
         if ( !tpm_fp->hash(tpm, 2, (const unsigned char *)cmdline,
                 tb_strlen(cmdline), hl) )
             return false;
 
         uint8_t buf[2*sizeof(tb_hash_t)];
 
-        if ( !tpm_fp->hash(tpm, 2, base, size, &img_hl) )
-            return false;
         for (unsigned int i=0; i<hl->count; i++) {
             for (unsigned int j=0; j<img_hl.count; j++) {
                 if (hl->entries[i].alg == img_hl.entries[j].alg) {
@@ -583,7 +728,6 @@ static bool hash_module(hash_list_t *hl,
 
     case TB_EXTPOL_EMBEDDED: 
     {
-        tb_hash_t img_hash;
         hl->count = tpm->alg_count;
         for (unsigned int i=0; i<hl->count; i++) {
             hl->entries[i].alg = tpm->algs[i];
@@ -591,9 +735,8 @@ static bool hash_module(hash_list_t *hl,
                         &hl->entries[i].hash, tpm->algs[i]) )
                 return false;
 
-            if ( !hash_buffer(base, size, &img_hash, tpm->algs[i]) )
-                return false;
-            if ( !extend_hash(&hl->entries[i].hash, &img_hash, tpm->algs[i]) )
+            if ( !extend_hash(&hl->entries[i].hash, &img_hl.entries[i].hash,
+                              tpm->algs[i]) )
                 return false;
         }
 
@@ -619,6 +762,23 @@ static bool is_hash_in_policy_entry(const tb_policy_entry_t *pol_entry,
 
     if ( pol_entry->hash_type == TB_HTYPE_ANY )
         return true;
+    else if ( pol_entry->hash_type == TB_HTYPE_IMAGE &&
+              (g_policy->policy_control & TB_POLCTL_SORTED_HASHES) ) {
+        /* verify_policy() has checked that the hashes are in order */
+        int lo = 0, hi = pol_entry->num_hashes;
+        while ( lo < hi ) {
+            int mid = lo + (hi - lo) / 2;
+            int cmp = compare_policy_hashes(get_policy_entry_hash(pol_entry,
+                                                        hash_alg, mid),
+                                            hash, hash_alg);
+            if ( cmp == 0 )
+                return true;
+            else if ( cmp < 0 )
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
     else if ( pol_entry->hash_type == TB_HTYPE_IMAGE ) {
         for ( int i = 0; i < pol_entry->num_hashes; i++ ) {
             if ( are_hashes_equal(get_policy_entry_hash(pol_entry, hash_alg,
@@ -847,6 +1007,8 @@ void verify_all_modules(loader_ctx *lctx)
     /* assumes mbi is valid */
     verify_g_policy();
 
+    prehash_modules(lctx);
+
     /* module 0 is always extended to PCR 18, so add entry for it */
     apply_policy(verify_module(get_module(lctx, 0), NULL, g_policy->hash_alg));
 
@@ -907,6 +1069,19 @@ static int find_next_nvpolicy_entry(const tb_policy_t *policy, int i)
     return -1;
 }
 
+/* number of NV indices verify_all_nvindices() may measure */
+unsigned int get_policy_nv_entry_count(void)
+{
+    unsigned int count = 0;
+
+    for ( int i = find_first_nvpolicy_entry(g_policy);
+          i >= 0;
+          i = find_next_nvpolicy_entry(g_policy, i) )
+        count++;
+
+    return count;
+}
+
 static uint8_t nv_buf[4096];
 
 static tb_error_t verify_nvindex(tb_policy_entry_t *pol_entry,
@@ -915,8 +1090,6 @@ static tb_error_t verify_nvindex(tb_policy_entry_t *pol_entry,
     size_t nv_size = sizeof(nv_buf);
     tb_hash_t digest;
     uint32_t attribute;
-    struct tpm_if *tpm = get_tpm();
-    const struct tpm_if_fp *tpm_fp = get_tpm_fp();
 
     if ( pol_entry == NULL )
         return TB_ERR_NV_VERIFICATION_FAILED;
@@ -924,8 +1097,7 @@ static tb_error_t verify_nvindex(tb_policy_entry_t *pol_entry,
     printk(TBOOT_INFO"verifying nv index 0x%08X\n", pol_entry->nv_index);
 
     /* check nv attribute */
-    if ( !tpm_fp->get_nvindex_permission(tpm, 0, pol_entry->nv_index,
-                                                   &attribute) ) {
+    if ( !tpm_nv_get_public(pol_entry->nv_index, NULL, &attribute) ) {
         printk(TBOOT_ERR"\t :reading nv index permission failed\n");
         return TB_ERR_NV_VERIFICATION_FAILED;
     }
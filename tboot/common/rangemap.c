@@ -0,0 +1,339 @@
+/*
+ * rangemap.c: sorted, coalescing map of typed physical address ranges
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef IS_INCLUDED     /* host tools include this file directly */
+#include <config.h>
+#include <types.h>
+#include <stdbool.h>
+#include <string.h>
+#include <rangemap.h>
+#endif
+
+/*
+ * range_map_find
+ *
+ * return: index of the first range that ends above addr (map->nr if none)
+ */
+unsigned int range_map_find(const range_map_t *map, uint64_t addr)
+{
+    unsigned int lo = 0, hi = map->nr;
+
+    while ( lo < hi ) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if ( map->ranges[mid].end > addr )
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+static bool can_merge(const range_map_t *map, const range_t *a,
+                      const range_t *b)
+{
+    if ( a->end != b->base || a->type != b->type || a->attr != b->attr ||
+         a->tag != b->tag )
+        return false;
+    return map->can_merge == NULL || map->can_merge(a->type);
+}
+
+/* replace ranges[first..last-1] with new[0..count-1] */
+static bool replace_ranges(range_map_t *map, unsigned int first,
+                           unsigned int last, const range_t *new,
+                           unsigned int count)
+{
+    unsigned int old = last - first;
+
+    if ( map->nr - old + count > map->max )
+        return false;
+
+    if ( count != old && last < map->nr )
+        tb_memmove(&map->ranges[first + count], &map->ranges[last],
+                   (map->nr - last) * sizeof(range_t));
+    tb_memcpy(&map->ranges[first], new, count * sizeof(range_t));
+    map->nr = map->nr - old + count;
+
+    return true;
+}
+
+/*
+ * range_map_set_range
+ *
+ * Make [range->base, range->end) of the range's type, attributes and tag,
+ * overriding whatever was there (including gaps), splitting partially
+ * covered ranges and merging with adjacent ranges of the same type.
+ *
+ * return:  false = no room for the new range(s) or invalid range
+ */
+bool range_map_set_range(range_map_t *map, const range_t *range)
+{
+    range_t new[3];
+    unsigned int first, last, count = 0;
+    uint64_t base = range->base, end = range->end;
+
+    if ( base == end )
+        return true;
+    if ( base > end )
+        return false;
+
+    /* ranges[first..last-1] overlap [base, end) */
+    first = range_map_find(map, base);
+    for ( last = first; last < map->nr && map->ranges[last].base < end;
+          last++ )
+        ;
+
+    if ( first < last && map->ranges[first].base < base ) {
+        new[count] = map->ranges[first];
+        new[count++].end = base;
+    }
+    new[count++] = *range;
+    if ( first < last && map->ranges[last-1].end > end ) {
+        new[count] = map->ranges[last-1];
+        new[count++].base = end;
+    }
+
+    /* merge split remnants of the same type back in */
+    unsigned int n = 0;
+    for ( unsigned int i = 1; i < count; i++ ) {
+        if ( can_merge(map, &new[n], &new[i]) )
+            new[n].end = new[i].end;
+        else
+            new[++n] = new[i];
+    }
+    count = n + 1;
+
+    /* ...and adjacent neighbours of the same type */
+    if ( first > 0 && can_merge(map, &map->ranges[first-1], &new[0]) )
+        new[0].base = map->ranges[--first].base;
+    if ( last < map->nr && can_merge(map, &new[count-1], &map->ranges[last]) )
+        new[count-1].end = map->ranges[last++].end;
+
+    return replace_ranges(map, first, last, new, count);
+}
+
+/*
+ * range_map_set
+ *
+ * range_map_set_range() for an untagged range
+ */
+bool range_map_set(range_map_t *map, uint64_t base, uint64_t end,
+                   uint32_t type, uint64_t attr)
+{
+    range_t range = { base, end, type, attr, 0 };
+
+    return range_map_set_range(map, &range);
+}
+
+/*
+ * range_map_retype
+ *
+ * Change the parts of [base, end) that are covered by ranges whose type
+ * matches to new_type; gaps and other types are left alone.
+ *
+ * return:  false = no room for the split ranges
+ */
+bool range_map_retype(range_map_t *map, uint64_t base, uint64_t end,
+                      range_type_match_t match, uint32_t new_type)
+{
+    unsigned int i = range_map_find(map, base);
+
+    if ( base >= end )
+        return true;
+
+    while ( i < map->nr && map->ranges[i].base < end ) {
+        range_t *r = &map->ranges[i];
+
+        /* already new_type: retyping it would merge it back whole, and a
+           range reaching past end would then be found again forever */
+        if ( !match(r->type) || r->type == new_type ) {
+            i++;
+            continue;
+        }
+
+        range_t new = *r;
+        if ( new.base < base )
+            new.base = base;
+        if ( new.end > end )
+            new.end = end;
+        new.type = new_type;
+
+        uint64_t e = new.end;
+        if ( !range_map_set_range(map, &new) )
+            return false;
+        /* entries may have been split or merged, so look up again */
+        i = range_map_find(map, e);
+    }
+
+    return true;
+}
+
+/*
+ * range_map_retype_batch
+ *
+ * Same as range_map_retype() for each of a set of ranges.  The batch is
+ * sorted in place (and left sorted for the caller), then each range is
+ * applied with its own range_map_retype(), so a batch costs what separate
+ * calls in address order would.
+ */
+bool range_map_retype_batch(range_map_t *map, range_t *batch,
+                            unsigned int count, range_type_match_t match,
+                            uint32_t new_type)
+{
+    /* insertion sort: batches are small and usually already sorted */
+    for ( unsigned int i = 1; i < count; i++ ) {
+        range_t tmp = batch[i];
+        unsigned int j = i;
+        while ( j > 0 && batch[j-1].base > tmp.base ) {
+            batch[j] = batch[j-1];
+            j--;
+        }
+        batch[j] = tmp;
+    }
+
+    for ( unsigned int i = 0; i < count; i++ ) {
+        if ( batch[i].base >= batch[i].end )
+            continue;
+        if ( !range_map_retype(map, batch[i].base, batch[i].end, match,
+                               new_type) )
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * range_map_check
+ *
+ * Given a range, check which kind of range it covers (an empty range is
+ * checked as the single byte at base)
+ *
+ * return: RANGE_MAP_GAP, it covers a gap in the map;
+ *         RANGE_MAP_MIXED, it covers at least two different types;
+ *         the type, it covers ranges of that type only
+ */
+uint32_t range_map_check(const range_map_t *map, uint64_t base, uint64_t end)
+{
+    unsigned int i = range_map_find(map, base);
+    uint64_t pos = base;
+    uint32_t ret = 0, type;
+    bool first = true;
+
+    if ( end <= base )
+        end = base + 1;
+
+    while ( pos < end ) {
+        if ( i < map->nr && map->ranges[i].base <= pos ) {
+            type = map->ranges[i].type;
+            pos = map->ranges[i++].end;
+        }
+        else {
+            type = RANGE_MAP_GAP;
+            pos = (i < map->nr) ? map->ranges[i].base : end;
+        }
+
+        /* any type merged with a gap is a gap, two different types are
+           mixed */
+        if ( first )
+            ret = type;
+        else if ( ret == RANGE_MAP_GAP || type == RANGE_MAP_GAP )
+            ret = RANGE_MAP_GAP;
+        else if ( ret != type )
+            ret = RANGE_MAP_MIXED;
+        first = false;
+    }
+
+    return ret;
+}
+
+/*
+ * range_map_is_valid
+ *
+ * Check the invariants every other function relies on: ranges are
+ * non-empty, sorted, non-overlapping and mergeable neighbours are merged.
+ */
+bool range_map_is_valid(const range_map_t *map)
+{
+    if ( map->nr > map->max )
+        return false;
+
+    for ( unsigned int i = 0; i < map->nr; i++ ) {
+        const range_t *r = &map->ranges[i];
+
+        if ( r->base >= r->end )
+            return false;
+        if ( i > 0 && (r->base < r[-1].end || can_merge(map, &r[-1], r)) )
+            return false;
+    }
+    return true;
+}
+
+/*
+ * range_map_get_highest
+ *
+ * find highest matching range of at least <size> bytes that ends at or
+ * below <limit>
+ */
+bool range_map_get_highest(const range_map_t *map, uint64_t size,
+                           uint64_t limit, range_type_match_t match,
+                           uint64_t *base, uint64_t *length)
+{
+    unsigned int i = range_map_find(map, limit);
+
+    if ( base == NULL || length == NULL )
+        return false;
+
+    /* ranges[0..i-1] all end at or below limit */
+    while ( i-- > 0 ) {
+        const range_t *r = &map->ranges[i];
+        if ( match(r->type) && r->end - r->base >= size ) {
+            *base = r->base;
+            *length = r->end - r->base;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
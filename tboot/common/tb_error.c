@@ -184,6 +184,7 @@ bool write_tb_error_code(tb_error_t error)
         no_err_idx = true;
         return false;
     }
+    tpm_nv_forget(tpm->tb_err_index);
 
     return true;
 }
@@ -228,6 +228,19 @@ static void post_launch(void)
         apply_policy(TB_ERR_FATAL);
     }
 
+    /* if using memory logging, reserve log area (the memory maps are final
+       from here on, as seal_pre_k_state() hashes them) */
+    if ( g_log_targets & TBOOT_LOG_TARGET_MEMORY ) {
+        base = TBOOT_SERIAL_LOG_ADDR;
+        size = TBOOT_SERIAL_LOG_SIZE;
+        printk(TBOOT_INFO"reserving tboot memory log (%Lx - %Lx) in e820 table\n", base, (base + size - 1));
+        if ( !e820_protect_region(base, size, E820_RESERVED) )
+            apply_policy(TB_ERR_FATAL);
+        if (!efi_memmap_reserve(base, size)) {
+            apply_policy(TB_ERR_FATAL);
+        }
+    }
+
     /*
      * verify modules against policy
      */
@@ -432,12 +445,30 @@ void begin_launch(void *addr, uint32_t magic)
     if (!tpm_detect())
        apply_policy(TB_ERR_TPM_NOT_READY);
 
+    /* on the post-launch S3 pass, check the state sealed by the first launch
+       up front so the rest of this pass can skip what it already validated */
+    if ( s3_flag && is_launched() ) {
+        struct tpm_if *tpm = get_tpm();
+        const struct tpm_if_fp *tpm_fp = get_tpm_fp();
+
+        /* load saved tpm2 context for unseal */
+        if ( tpm->major == TPM20_VER_MAJOR ) {
+            tpm_fp->context_flush(tpm, tpm->cur_loc, handle2048);
+            tpm_fp->context_load(tpm, tpm->cur_loc, &tpm2_context_saved, &handle2048);
+        }
+        s3_verify_pre_k_state();
+    }
+
     /* verify SE enablement status */
     verify_IA32_se_svn_status(g_sinit);
 
     /* read tboot verified launch control policy from TPM-NV (will use default if none in TPM-NV) */
-    err = set_policy();
-    apply_policy(err);
+    if ( s3_flag && is_launched() && s3_policy_unchanged() )
+        printk(TBOOT_INFO"reusing Verified Launch Policy sealed at launch\n");
+    else {
+        err = set_policy();
+        apply_policy(err);
+    }
 
     /* if telled to call revocation acm, go with simplified path */
     if ( get_tboot_call_racm() )
@@ -499,14 +530,9 @@ void begin_launch(void *addr, uint32_t magic)
 void s3_launch(void)
 {
     struct tpm_if *tpm = get_tpm();
-    const struct tpm_if_fp *tpm_fp = get_tpm_fp();
     /* restore backed-up s3 wakeup page */
     restore_saved_s3_wakeup_page();
-    /* load saved tpm2 context for unseal */
-    if ( tpm->major == TPM20_VER_MAJOR ) {
-        tpm_fp->context_flush(tpm, tpm->cur_loc, handle2048);
-        tpm_fp->context_load(tpm, tpm->cur_loc, &tpm2_context_saved, &handle2048);
-    }
+    /* saved tpm2 context was loaded for unseal in begin_launch() */
 
     /* remove DMAR table if necessary */
     if ( get_tboot_save_vtd() )
@@ -54,3 +54,7 @@ SECTIONS
 
   _end = . ;
 }
+
+ASSERT(_mle_start == TBOOT_START, "MLE page table does not end at TBOOT_START")
+ASSERT(_mle_end - _mle_start <= TBOOT_MLE_MAX_SIZE,
+       "MLE too big for MLE page table, raise TBOOT_MLE_MAX_SIZE")
@@ -897,8 +897,128 @@ void tpm_print(struct tpm_if *ti)
     printk(TBOOT_INFO"\t extend policy: %d\n", ti->extpol);
     printk(TBOOT_INFO"\t current alg id: 0x%x\n", ti->cur_alg);
     printk(TBOOT_INFO"\t timeout values: A: %u, B: %u, C: %u, D: %u\n", ti->timeout.timeout_a, ti->timeout.timeout_b, ti->timeout.timeout_c, ti->timeout.timeout_d);
+    if ( ti->caps.manufacturer != 0 )
+        printk(TBOOT_INFO"\t manufacturer: 0x%08x, firmware: %08x.%08x\n",
+               ti->caps.manufacturer, ti->caps.fw_version[0], ti->caps.fw_version[1]);
+    printk(TBOOT_INFO"\t NV read chunk: %u bytes\n", ti->caps.nv_buf_max);
 } 
 
+/*
+ * NV public areas (size and attributes) are fetched at most once per index
+ * per boot phase; policy, LCP and measured-NV verification all go through
+ * here.  This is deliberately not __data: the post-launch tboot starts with
+ * an empty cache and refetches what it needs.
+ */
+#define TPM_NV_CACHE_SIZE    8
+
+typedef struct {
+    uint32_t index;
+    uint32_t size;
+    uint32_t attribute;
+} tpm_nv_public_t;
+
+static tpm_nv_public_t g_nv_cache[TPM_NV_CACHE_SIZE];
+static unsigned int g_nv_cache_count;
+
+static const tpm_nv_public_t *find_nv_public(uint32_t index)
+{
+    struct tpm_if *tpm = get_tpm();
+    const struct tpm_if_fp *tpm_fp = get_tpm_fp();
+    tpm_nv_public_t *e;
+    uint32_t size, attribute;
+
+    for ( unsigned int i = 0; i < g_nv_cache_count; i++ ) {
+        if ( g_nv_cache[i].index == index )
+            return &g_nv_cache[i];
+    }
+
+    if ( tpm_fp == NULL )
+        return NULL;
+
+    if ( !tpm_fp->get_nvindex_public(tpm, tpm->cur_loc, index, &size,
+                                     &attribute) )
+        return NULL;
+
+    /* tboot touches only a handful of indices; a full cache reuses slot 0 */
+    if ( g_nv_cache_count < TPM_NV_CACHE_SIZE )
+        e = &g_nv_cache[g_nv_cache_count++];
+    else
+        e = &g_nv_cache[0];
+    e->index = index;
+    e->size = size;
+    e->attribute = attribute;
+
+    return e;
+}
+
+bool tpm_nv_get_public(uint32_t index, uint32_t *size, uint32_t *attribute)
+{
+    const tpm_nv_public_t *e = find_nv_public(index);
+
+    if ( e == NULL )
+        return false;
+
+    if ( size != NULL )
+        *size = e->size;
+    if ( attribute != NULL )
+        *attribute = e->attribute;
+
+    return true;
+}
+
+/* a write may flip TPMA_NV_WRITTEN/WRITELOCKED, so drop the cached copy */
+void tpm_nv_forget(uint32_t index)
+{
+    for ( unsigned int i = 0; i < g_nv_cache_count; i++ ) {
+        if ( g_nv_cache[i].index == index ) {
+            g_nv_cache[i] = g_nv_cache[--g_nv_cache_count];
+            return;
+        }
+    }
+}
+
+/*
+ * read the whole index (or as much as fits in *size) using the largest
+ * chunk the TPM allows; *size is in/out
+ */
+bool tpm_nv_read_all(uint32_t index, uint8_t *buf, uint32_t *size)
+{
+    struct tpm_if *tpm = get_tpm();
+    const struct tpm_if_fp *tpm_fp = get_tpm_fp();
+    uint32_t index_size, offset = 0, chunk;
+
+    if ( buf == NULL || size == NULL || tpm_fp == NULL )
+        return false;
+
+    if ( !tpm_nv_get_public(index, &index_size, NULL) )
+        return false;
+
+    if ( index_size > *size ) {
+        printk(TBOOT_WARN"TPM: NV index 0x%08X was too big for buffer\n", index);
+        index_size = *size;
+    }
+
+    while ( offset < index_size ) {
+        chunk = index_size - offset;
+        if ( tpm->caps.nv_buf_max != 0 && chunk > tpm->caps.nv_buf_max )
+            chunk = tpm->caps.nv_buf_max;
+
+        if ( !tpm_fp->nv_read(tpm, tpm->cur_loc, index, offset, buf + offset,
+                              &chunk) || chunk == 0 )
+            break;
+        offset += chunk;
+    }
+
+    if ( offset == 0 && index_size != 0 ) {
+        printk(TBOOT_ERR"TPM: read error 0x%x from NV index 0x%08X\n",
+               tpm->error, index);
+        return false;
+    }
+
+    *size = offset;
+    return true;
+}
+
 struct tpm_if *get_tpm(void)
 {
     return &g_tpm;
@@ -1441,8 +1441,9 @@ typedef struct __packed {
     uint32_t                data_size;
 } tpm_nv_data_public_t;
 
-static bool tpm12_get_nvindex_size(struct tpm_if *ti, uint32_t locality,
-                                   uint32_t index, uint32_t *size)
+static bool tpm12_get_nvindex_public(struct tpm_if *ti, uint32_t locality,
+                                     uint32_t index, uint32_t *size,
+                                     uint32_t *attribute)
 {
     uint32_t ret, offset, resp_size;
     uint8_t sub_cap[sizeof(index)];
@@ -1452,8 +1453,8 @@ static bool tpm12_get_nvindex_size(struct tpm_if *ti, uint32_t locality,
     if ( ti == NULL )
         return false;
 
-    if ( size == NULL ) {
-        printk(TBOOT_WARN"TPM: tpm12_get_nvindex_size() bad parameter\n");
+    if ( size == NULL && attribute == NULL ) {
+        printk(TBOOT_WARN"TPM: tpm12_get_nvindex_public() bad parameter\n");
         ti->error = TPM_BAD_PARAMETER;
         return false;
     }
@@ -1466,7 +1467,7 @@ static bool tpm12_get_nvindex_size(struct tpm_if *ti, uint32_t locality,
                              sub_cap, &resp_size, resp);
 
 #ifdef TPM_TRACE
-    printk(TBOOT_DETA"TPM: get nvindex size, return value = %08X\n", ret);
+    printk(TBOOT_DETA"TPM: get nvindex public, return value = %08X\n", ret);
 #endif
     if ( ret != TPM_SUCCESS ) {
         printk(TBOOT_DETA"TPM: fail to get public data of 0x%08X in TPM NV\n", index);
@@ -1509,84 +1510,46 @@ static bool tpm12_get_nvindex_size(struct tpm_if *ti, uint32_t locality,
         return false;
     }
 
-    offset = resp_size - sizeof(uint32_t);
-    LOAD_INTEGER(resp, offset, *size);
+    if ( size != NULL ) {
+        offset = resp_size - sizeof(uint32_t);
+        LOAD_INTEGER(resp, offset, *size);
+    }
+    if ( attribute != NULL ) {
+        offset = resp_size - sizeof(uint32_t) - 3 * sizeof(uint8_t) - sizeof(uint32_t);
+        LOAD_INTEGER(resp, offset, *attribute);
+    }
 
     return true;
 }
 
-static bool tpm12_get_nvindex_permission(struct tpm_if *ti, uint32_t locality,
-                                    uint32_t index, uint32_t *attribute)
+static bool tpm12_get_nvindex_size(struct tpm_if *ti, uint32_t locality,
+                                   uint32_t index, uint32_t *size)
 {
-    uint32_t ret, offset, resp_size;
-    uint8_t sub_cap[sizeof(index)];
-    uint8_t resp[sizeof(tpm_nv_data_public_t)];
-    uint32_t idx;
-
     if ( ti == NULL )
         return false;
 
-    if ( attribute == NULL ) {
-        printk(TBOOT_WARN"TPM: tpm12_get_nvindex_permission() bad parameter\n");
+    if ( size == NULL ) {
+        printk(TBOOT_WARN"TPM: tpm12_get_nvindex_size() bad parameter\n");
         ti->error = TPM_BAD_PARAMETER;
         return false;
     }
 
-    offset = 0;
-    UNLOAD_INTEGER(sub_cap, offset, index);
-
-    resp_size = sizeof(resp);
-    ret = tpm12_get_capability(locality, TPM_CAP_NV_INDEX, sizeof(sub_cap),
-                             sub_cap, &resp_size, resp);
-
-#ifdef TPM_TRACE
-    printk(TBOOT_DETA"TPM: get nvindex permission, return value = %08X\n", ret);
-#endif
-    if ( ret != TPM_SUCCESS ) {
-        printk(TBOOT_WARN"TPM: fail to get public data of 0x%08X in TPM NV\n", index);
-        ti->error = ret;
-        return false;
-    }
-
-#ifdef TPM_TRACE
-    {
-        printk(TBOOT_INFO"TPM: ");
-        print_hex(NULL, resp, resp_size);
-    }
-#endif
-
-    /* check size */
-    if ( resp_size == 0 ) {
-        printk(TBOOT_WARN"TPM: Index 0x%08X does not exist\n", index);
-        ti->error = TPM_BADINDEX;
-        return false;
-    }
-
-    /* check index */
-    offset = sizeof(tpm_structure_tag_t);
-    LOAD_INTEGER(resp, offset, idx);
-#ifdef TPM_TRACE
-    printk(TBOOT_DETA"TPM: get index value = %08X\n", idx);
-#endif
+    return tpm12_get_nvindex_public(ti, locality, index, size, NULL);
+}
 
-    if ( idx != index ) {
-        printk(TBOOT_WARN"TPM: Index 0x%08X is not the one expected 0x%08X\n",
-               idx, index);
-        ti->error = TPM_BADINDEX;
+static bool tpm12_get_nvindex_permission(struct tpm_if *ti, uint32_t locality,
+                                    uint32_t index, uint32_t *attribute)
+{
+    if ( ti == NULL )
         return false;
-    }
 
-    if ( resp_size != sizeof(resp) ) {
-        printk(TBOOT_ERR"TPM: public data size of Index 0x%08X responsed incorrect\n",
-               index);
-        ti->error = TPM_FAIL;
+    if ( attribute == NULL ) {
+        printk(TBOOT_WARN"TPM: tpm12_get_nvindex_permission() bad parameter\n");
+        ti->error = TPM_BAD_PARAMETER;
         return false;
     }
 
-    offset = resp_size - sizeof(uint32_t) - 3 * sizeof(uint8_t) - sizeof(uint32_t);
-    LOAD_INTEGER(resp, offset, *attribute);
-
-    return true;
+    return tpm12_get_nvindex_public(ti, locality, index, NULL, attribute);
 }
 
 typedef struct __packed {
@@ -1707,32 +1670,18 @@ static uint32_t tpm12_get_timeout(uint32_t locality,
     return ret;
 }
 
-/* ensure TPM is ready to accept commands */
-static bool tpm12_init(struct tpm_if *ti)
+/*
+ * permanent flags and timeouts cannot change under a running boot, so they
+ * are read once and kept in g_tpm (see tpm_caps_t)
+ */
+static bool tpm12_probe(struct tpm_if *ti)
 {
     tpm_permanent_flags_t pflags;
-    tpm_stclear_flags_t vflags;
     uint32_t timeout[4];
-    uint32_t locality;
+    uint32_t locality = ti->cur_loc;
     uint32_t ret;
 
-    if ( ti == NULL )
-        return false;
-
-    printk(TBOOT_WARN"Warning: TPM1.2 detected, SHA1 is selected as hashing algorithm.\n");
-
-    if (!txt_is_launched())
-        ti->cur_loc = 0;
-    else
-        ti->cur_loc = 2;
-
-    locality = ti->cur_loc;
-    if ( !tpm_validate_locality(locality) ) {
-        printk(TBOOT_WARN"TPM is not available.\n");
-        return false;
-    }
-
-    /* make sure tpm is not disabled/deactivated */
+    /* make sure tpm is not disabled */
     tb_memset(&pflags, 0, sizeof(pflags));
     ret = tpm12_get_flags(locality, TPM_CAP_FLAG_PERMANENT,
                         (uint8_t *)&pflags, sizeof(pflags));
@@ -1745,22 +1694,7 @@ static bool tpm12_init(struct tpm_if *ti)
         printk(TBOOT_WARN"TPM is disabled.\n");
         return false;
     }
-
-    tb_memset(&vflags, 0, sizeof(vflags));
-    ret = tpm12_get_flags(locality, TPM_CAP_FLAG_VOLATILE,
-                        (uint8_t *)&vflags, sizeof(vflags));
-    if ( ret != TPM_SUCCESS ) {
-        printk(TBOOT_WARN"TPM is disabled or deactivated.\n");
-        ti->error = ret;
-        return false;
-    }
-    if ( vflags.deactivated ) {
-        printk(TBOOT_WARN"TPM is deactivated.\n");
-        return false;
-    }
-
-    printk(TBOOT_INFO"TPM is ready\n");
-    printk(TBOOT_DETA"TPM nv_locked: %s\n", (pflags.nv_locked != 0) ? "TRUE" : "FALSE");
+    ti->caps.nv_locked = pflags.nv_locked;
 
     /* get tpm timeout values */
     ret = tpm12_get_timeout(locality, (uint8_t *)&timeout, sizeof(timeout));
@@ -1802,6 +1736,58 @@ static bool tpm12_init(struct tpm_if *ti)
         }
     }
 
+    /* 1.2 has no buffer-size capability, NV_ReadValue is bound by our buffer */
+    ti->caps.nv_buf_max = TPM_NV_READ_VALUE_DATA_SIZE_MAX;
+    ti->caps.family = g_tpm_family;
+    ti->caps.probed = true;
+    return true;
+}
+
+/* ensure TPM is ready to accept commands */
+static bool tpm12_init(struct tpm_if *ti)
+{
+    tpm_stclear_flags_t vflags;
+    uint32_t locality;
+    uint32_t ret;
+
+    if ( ti == NULL )
+        return false;
+
+    printk(TBOOT_WARN"Warning: TPM1.2 detected, SHA1 is selected as hashing algorithm.\n");
+
+    if (!txt_is_launched())
+        ti->cur_loc = 0;
+    else
+        ti->cur_loc = 2;
+
+    locality = ti->cur_loc;
+    if ( !tpm_validate_locality(locality) ) {
+        printk(TBOOT_WARN"TPM is not available.\n");
+        return false;
+    }
+
+    if ( !ti->caps.probed || ti->caps.family != g_tpm_family ) {
+        if ( !tpm12_probe(ti) )
+            return false;
+    }
+
+    /* the OS can deactivate until the next Startup, so always re-check */
+    tb_memset(&vflags, 0, sizeof(vflags));
+    ret = tpm12_get_flags(locality, TPM_CAP_FLAG_VOLATILE,
+                        (uint8_t *)&vflags, sizeof(vflags));
+    if ( ret != TPM_SUCCESS ) {
+        printk(TBOOT_WARN"TPM is disabled or deactivated.\n");
+        ti->error = ret;
+        return false;
+    }
+    if ( vflags.deactivated ) {
+        printk(TBOOT_WARN"TPM is deactivated.\n");
+        return false;
+    }
+
+    printk(TBOOT_INFO"TPM is ready\n");
+    printk(TBOOT_DETA"TPM nv_locked: %s\n", (ti->caps.nv_locked != 0) ? "TRUE" : "FALSE");
+
     /* init version */
     ti->major = TPM12_VER_MAJOR;
     ti->minor = TPM12_VER_MINOR;
@@ -1986,6 +1972,7 @@ const struct tpm_if_fp tpm_12_if_fp = {
     .nv_write = tpm12_nv_write_value,
     .get_nvindex_size = tpm12_get_nvindex_size,
     .get_nvindex_permission = tpm12_get_nvindex_permission,
+    .get_nvindex_public = tpm12_get_nvindex_public,
     .seal = tpm12_seal,
     .unseal = tpm12_unseal,
     .verify_creation = tpm12_verify_creation,
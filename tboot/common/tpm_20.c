@@ -1623,6 +1623,71 @@ static uint32_t _tpm20_get_random(uint32_t locality,
     return ret;
 }
 
+static uint32_t _tpm20_get_capability(uint32_t locality,
+                                      tpm_get_capability_in *in,
+                                      tpm_get_capability_out *out)
+{
+    u32 ret;
+    u32 cmd_size, rsp_size;
+    u16 rsp_tag;
+    void *other;
+    unsigned int i;
+    TPML_TAGGED_TPM_PROPERTY *props;
+
+    /* only TPM properties are decoded for now */
+    if ( in->capability != TPM_CAP_TPM_PROPERTIES )
+        return TPM_RC_FAILURE;
+
+    reverse_copy_header(TPM_CC_GetCapability, 0);
+
+    other = (void *)cmd_buf + CMD_HEAD_SIZE;
+    reverse_copy_in(other, in->capability);
+    reverse_copy_in(other, in->property);
+    reverse_copy_in(other, in->property_count);
+
+    /* Now set the command size field, now that we know the size of the whole command */
+    cmd_size = (u8 *)other - cmd_buf;
+    reverse_copy(cmd_buf + CMD_SIZE_OFFSET, &cmd_size, sizeof(cmd_size));
+
+    rsp_size = sizeof(rsp_buf);
+
+    if (g_tpm_family == TPM_IF_20_FIFO) {
+        if (!tpm_submit_cmd(locality, cmd_buf, cmd_size, rsp_buf, &rsp_size))
+            return TPM_RC_FAILURE;
+        }
+    if (g_tpm_family == TPM_IF_20_CRB) {
+        if (!tpm_submit_cmd_crb(locality, cmd_buf, cmd_size, rsp_buf, &rsp_size))
+            return TPM_RC_FAILURE;
+        }
+
+    reverse_copy(&ret, rsp_buf + RSP_RST_OFFSET, sizeof(ret));
+    if ( ret != TPM_RC_SUCCESS )
+        return ret;
+
+    other = (void *)rsp_buf + RSP_HEAD_SIZE;
+    reverse_copy(&rsp_tag, rsp_buf, sizeof(rsp_tag));
+    if (rsp_tag == TPM_ST_SESSIONS)
+        other += sizeof(u32);
+
+    reverse_copy_out(out->more_data, other);
+    reverse_copy_out(out->data.capability, other);
+    if ( out->data.capability != TPM_CAP_TPM_PROPERTIES )
+        return TPM_RC_FAILURE;
+
+    props = &out->data.data.tpm_properties;
+    reverse_copy_out(props->count, other);
+    if ( props->count > MAX_TPM_PROPERTIES ||
+         (u8 *)other + props->count * sizeof(TPMS_TAGGED_PROPERTY) >
+                 rsp_buf + rsp_size )
+        return TPM_RC_FAILURE;
+    for ( i = 0; i < props->count; i++ ) {
+        reverse_copy_out(props->tpm_property[i].property, other);
+        reverse_copy_out(props->tpm_property[i].value, other);
+    }
+
+    return ret;
+}
+
 static uint32_t _tpm20_shutdown(uint32_t locality, u16 type)
 {
     u32 ret;
@@ -2345,14 +2410,15 @@ static bool tpm20_nv_write(struct tpm_if *ti, uint32_t locality,
     return true;
 }
 
-static bool tpm20_get_nvindex_size(struct tpm_if *ti, uint32_t locality,
-                                   uint32_t index, uint32_t *size)
+static bool tpm20_get_nvindex_public(struct tpm_if *ti, uint32_t locality,
+                                     uint32_t index, uint32_t *size,
+                                     uint32_t *attribute)
 {
     tpm_nv_read_public_in public_in;
     tpm_nv_read_public_out public_out;
     u32 ret;
 
-    if ( ti == NULL || size == NULL )
+    if ( ti == NULL || locality >= TPM_NR_LOCALITIES || index == 0 )
         return false;
 
     public_in.index = index;
@@ -2366,45 +2432,129 @@ static bool tpm20_get_nvindex_size(struct tpm_if *ti, uint32_t locality,
 
     if (index != public_out.nv_public.t.nv_public.index) {
         printk(TBOOT_WARN"TPM: Index 0x%08X is not the one expected 0x%08X\n",
-                index, index);
+                public_out.nv_public.t.nv_public.index, index);
         ti->error = TPM_RC_FAILURE;
         return false;
     }
 
-    *size = public_out.nv_public.t.nv_public.data_size;
+    if ( size != NULL )
+        *size = public_out.nv_public.t.nv_public.data_size;
+    if ( attribute != NULL )
+        *attribute = *(uint32_t*)(&public_out.nv_public.t.nv_public.attr);
 
     return true;
 }
 
+static bool tpm20_get_nvindex_size(struct tpm_if *ti, uint32_t locality,
+                                   uint32_t index, uint32_t *size)
+{
+    if ( size == NULL )
+        return false;
+
+    return tpm20_get_nvindex_public(ti, locality, index, size, NULL);
+}
+
 static bool tpm20_get_nvindex_permission(struct tpm_if *ti, uint32_t locality,
                                     uint32_t index, uint32_t *attribute)
 {
-    tpm_nv_read_public_in public_in;
-    tpm_nv_read_public_out public_out;
+    if ( attribute == NULL )
+        return false;
+
+    return tpm20_get_nvindex_public(ti, locality, index, NULL, attribute);
+}
+
+/*
+ * pull the fixed properties we care about with as few GetCapability calls
+ * as the TPM allows: ask for the whole PT_FIXED..TPM_PT_NV_BUFFER_MAX range
+ * and only continue where the TPM reported more_data
+ */
+static bool tpm20_get_fixed_properties(struct tpm_if *ti)
+{
+    tpm_get_capability_in cap_in;
+    tpm_get_capability_out cap_out;
+    TPML_TAGGED_TPM_PROPERTY *props = &cap_out.data.data.tpm_properties;
+    TPM_PT prop = PT_FIXED;
     u32 ret;
 
-    if ( ti == NULL || locality >= TPM_NR_LOCALITIES
-         || index == 0 || attribute == NULL )
-        return false;
+    ti->caps.nv_buf_max = 0;
+    cap_in.capability = TPM_CAP_TPM_PROPERTIES;
+    do {
+        cap_in.property = prop;
+        cap_in.property_count = TPM_PT_NV_BUFFER_MAX - prop + 1;
 
-    public_in.index = index;
+        ret = _tpm20_get_capability(ti->cur_loc, &cap_in, &cap_out);
+        if ( ret != TPM_RC_SUCCESS ) {
+            printk(TBOOT_WARN"TPM: GetCapability(0x%x) return value = %08X\n",
+                   prop, ret);
+            ti->error = ret;
+            return false;
+        }
+        if ( props->count == 0 )
+            break;
 
-    ret = _tpm20_nv_read_public(locality, &public_in, &public_out);
-    if ( ret != TPM_RC_SUCCESS ) {
-        printk(TBOOT_WARN"TPM: fail to get public data of 0x%08X in TPM NV\n", index);
-        ti->error = ret;
-        return false;
-    }
+        for ( unsigned int i = 0; i < props->count; i++ ) {
+            u32 value = props->tpm_property[i].value;
 
-    if (index != public_out.nv_public.t.nv_public.index) {
-        printk(TBOOT_WARN"TPM: Index 0x%08X is not the one expected 0x%08X\n",
-                index, index);
-        ti->error = TPM_RC_FAILURE;
+            switch ( props->tpm_property[i].property ) {
+            case TPM_PT_MANUFACTURER:
+                ti->caps.manufacturer = value;
+                break;
+            case TPM_PT_FIRMWARE_VERSION_1:
+                ti->caps.fw_version[0] = value;
+                break;
+            case TPM_PT_FIRMWARE_VERSION_2:
+                ti->caps.fw_version[1] = value;
+                break;
+            case TPM_PT_NV_INDEX_MAX:
+                ti->caps.nv_index_max = value;
+                break;
+            case TPM_PT_NV_BUFFER_MAX:
+                ti->caps.nv_buf_max = value;
+                break;
+            default:
+                break;
+            }
+        }
+        prop = props->tpm_property[props->count - 1].property + 1;
+    } while ( cap_out.more_data && prop <= TPM_PT_NV_BUFFER_MAX );
+
+    return true;
+}
+
+/* things only the TPM can tell us; done once per boot, see tpm_caps_t */
+static bool tpm20_probe(struct tpm_if *ti)
+{
+    tpm_pcr_event_in event_in;
+    tpm_pcr_event_out event_out;
+    u32 ret;
+
+    /* init supported alg list for banks */
+    event_in.pcr_handle = 16;
+    event_in.sessions.num_sessions = 1;
+    event_in.sessions.sessions[0] = pw_session;
+    event_in.data.t.size = 4;
+    event_in.data.t.buffer[0] = 0;
+    event_in.data.t.buffer[1] = 0xff;
+    event_in.data.t.buffer[2] = 0x55;
+    event_in.data.t.buffer[3] = 0xaa;
+    ret = _tpm20_pcr_event(ti->cur_loc, &event_in, &event_out);
+    if (ret != TPM_RC_SUCCESS) {
+        printk(TBOOT_WARN"TPM: PcrEvent not successful, return value = %08X\n", ret);
+        ti->error = ret;
         return false;
     }
+    ti->banks = event_out.digests.count;
+    for (unsigned int i=0; i<ti->banks; i++)
+        ti->algs_banks[i] = event_out.digests.digests[i].hash_alg;
 
-    *attribute = *(uint32_t*)(&public_out.nv_public.t.nv_public.attr);
+    /* not fatal, NV reads just fall back to our own buffer size */
+    if ( !tpm20_get_fixed_properties(ti) )
+        printk(TBOOT_WARN"TPM: fixed properties not available\n");
+    if ( ti->caps.nv_buf_max == 0 || ti->caps.nv_buf_max > MAX_NV_INDEX_SIZE )
+        ti->caps.nv_buf_max = MAX_NV_INDEX_SIZE;
 
+    ti->caps.family = g_tpm_family;
+    ti->caps.probed = true;
     return true;
 }
 
@@ -2756,29 +2906,16 @@ static bool tpm20_init(struct tpm_if *ti)
     /* create one common password sesson*/
     create_pw_session(&pw_session);
 
-    /* init supported alg list for banks */
-    tpm_pcr_event_in event_in;
-    tpm_pcr_event_out event_out;
-    event_in.pcr_handle = 16;
-    event_in.sessions.num_sessions = 1;
-    event_in.sessions.sessions[0] = pw_session;
-    event_in.data.t.size = 4;
-    event_in.data.t.buffer[0] = 0;
-    event_in.data.t.buffer[1] = 0xff;
-    event_in.data.t.buffer[2] = 0x55;
-    event_in.data.t.buffer[3] = 0xaa;
-    ret = _tpm20_pcr_event(ti->cur_loc, &event_in, &event_out);
-    if (ret != TPM_RC_SUCCESS) {
-        printk(TBOOT_WARN"TPM: PcrEvent not successful, return value = %08X\n", ret);
-        ti->error = ret;
-        return false;
+    if ( !ti->caps.probed || ti->caps.family != g_tpm_family ) {
+        if ( !tpm20_probe(ti) )
+            return false;
     }
-    ti->banks = event_out.digests.count;
+    else
+        printk(TBOOT_INFO"TPM: reusing capabilities from the first pass\n");
+
     printk(TBOOT_INFO"TPM: supported bank count = %d\n", ti->banks);
-    for (i=0; i<ti->banks; i++) {
-        ti->algs_banks[i] = event_out.digests.digests[i].hash_alg;;
+    for (i=0; i<ti->banks; i++)
         printk(TBOOT_INFO"TPM: bank alg = %08x\n", ti->algs_banks[i]);
-    }
 
     /* init supported alg list */
     ti->alg_count = 0;
@@ -2862,6 +2999,7 @@ const struct tpm_if_fp tpm_20_if_fp = {
     .nv_write = tpm20_nv_write,
     .get_nvindex_size = tpm20_get_nvindex_size,
     .get_nvindex_permission = tpm20_get_nvindex_permission,
+    .get_nvindex_public = tpm20_get_nvindex_public,
     .seal = tpm20_seal,
     .unseal = tpm20_unseal,
     .verify_creation = tpm20_verify_creation,
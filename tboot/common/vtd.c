@@ -32,6 +32,7 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef IS_INCLUDED     /* host tools include this file directly */
 #include <types.h>
 #include <stdbool.h>
 #include <compiler.h>
@@ -44,7 +45,9 @@
 #include <txt/config_regs.h>
 
 #include <vtd.h>
+#endif
 
+#ifndef IS_INCLUDED
 static struct acpi_table_header *g_dmar_table;
 static __data bool g_hide_dmar;
 
@@ -112,6 +115,7 @@ bool vtd_remove_dmar_table(void)
     printk(TBOOT_DETA"DMAR table @ %p removed.\n", hdr);
     return true;
 }
+#endif    /* IS_INCLUDED */
 
 struct dmar_remapping *vtd_get_dmar_remap(uint32_t *remap_length)
 {
@@ -121,35 +125,76 @@ struct dmar_remapping *vtd_get_dmar_remap(uint32_t *remap_length)
         return NULL;
     }
 
-    *remap_length = dmar->hdr.length - sizeof(*dmar);
+    /* table_offsets[1] is the first record, not part of the header */
+    *remap_length = dmar->hdr.length - offsetof(struct acpi_dmar, table_offsets);
     return (struct dmar_remapping*)(dmar->table_offsets);
 }
 
-bool vtd_disable_dma_remap(struct dmar_remapping *rs)
+/*
+ * clear <stat> in GCMD of every unit that has it set, then poll all of them
+ * against one deadline: the units complete in parallel, so a platform with
+ * many DRHDs waits for the slowest one rather than the sum of them
+ */
+static bool disable_units(struct dmar_remapping **units, unsigned int nr,
+                          uint32_t stat, const char *what)
 {
-    if (rs->type != DMAR_REMAPPING_DRHD) {
-        return false;
-    }
-
+    static uint32_t latency[MAX_DRHD_UNITS];
+    uint64_t pending = 0, was_pending, start;
     uint32_t timeout;
-    uint32_t gsts = read_reg32(rs->register_base_address, VTD_GSTS_OFFSET) & 0x96FFFFFF;
-    
-    if (gsts & TE_STAT) {
-        /* Clear TE_STAT bit and write back to GCMD */
-        gsts &= ~TE_STAT;
-        write_reg32(rs->register_base_address, VTD_GCMD_OFFSET, gsts);
+    unsigned int i;
 
-        /* Wait until GSTS indicates that operation is completed */
-        timeout = VTD_OPERATION_TIMEOUT;
-        while (read_reg32(rs->register_base_address, VTD_GSTS_OFFSET) & TE_STAT) {
-            cpu_relax();
-            if (--timeout == 0) {
-                return false;
-            }
+    for ( i = 0; i < nr; i++ ) {
+        uint32_t base = units[i]->register_base_address;
+        uint32_t gsts = read_reg32(base, VTD_GSTS_OFFSET) & 0x96FFFFFF;
+
+        latency[i] = 0;
+        if ( gsts & stat ) {
+            /* Clear status bit and write back to GCMD */
+            write_reg32(base, VTD_GCMD_OFFSET, gsts & ~stat);
+            pending |= 1ULL << i;
         }
     }
 
-    return true;
+    /* Wait until GSTS of every unit indicates the operation is completed */
+    was_pending = pending;
+    start = rdtsc();
+    timeout = VTD_OPERATION_TIMEOUT;
+    while ( pending != 0 ) {
+        for ( i = 0; i < nr; i++ ) {
+            if ( !(pending & (1ULL << i)) )
+                continue;
+            if ( read_reg32(units[i]->register_base_address,
+                            VTD_GSTS_OFFSET) & stat )
+                continue;
+            latency[i] = (uint32_t)((rdtsc() - start) >> 10);
+            pending &= ~(1ULL << i);
+        }
+        if ( pending == 0 )
+            break;
+        cpu_relax();
+        if ( --timeout == 0 )
+            break;
+    }
+
+    for ( i = 0; i < nr; i++ ) {
+        if ( pending & (1ULL << i) )
+            printk(TBOOT_ERR"    DRHD @ 0x%Lx: %s disable timed out\n",
+                   units[i]->register_base_address, what);
+        else if ( was_pending & (1ULL << i) )
+            printk(TBOOT_DETA"    DRHD @ 0x%Lx: %s disabled in %u Kticks\n",
+                   units[i]->register_base_address, what, latency[i]);
+    }
+
+    return pending == 0;
+}
+
+bool vtd_disable_dma_remap(struct dmar_remapping *rs)
+{
+    if (rs->type != DMAR_REMAPPING_DRHD) {
+        return false;
+    }
+
+    return disable_units(&rs, 1, TE_STAT, "DMA remapping");
 }
 
 bool vtd_disable_qie(struct dmar_remapping *rs)
@@ -172,17 +217,8 @@ bool vtd_disable_qie(struct dmar_remapping *rs)
             }
         }
 
-        /* Clear QIE_STAT bit and write back to GCMD */
-        gsts &= ~QIE_STAT;
-        write_reg32(rs->register_base_address, VTD_GCMD_OFFSET, gsts);
-
-        /* Wait until GSTS indicates that operation is completed */
-        timeout = VTD_OPERATION_TIMEOUT;
-        while (read_reg32(rs->register_base_address, VTD_GSTS_OFFSET) & QIE_STAT) {
-            cpu_relax();
-            if (--timeout == 0) {
-                return false;
-            }
+        if (!disable_units(&rs, 1, QIE_STAT, "queued invalidation")) {
+            return false;
         }
 
         /* Set IQT to 0 (IQH was set by HW) */
@@ -198,23 +234,75 @@ bool vtd_disable_ire(struct dmar_remapping *rs)
         return false;
     }
 
-    uint32_t timeout;
-    uint32_t gsts = read_reg32(rs->register_base_address, VTD_GSTS_OFFSET) & 0x96FFFFFF;
-    
-    if (gsts & IRE_STAT) {
-        /* Clear IRE_STAT bit and write back to GCMD */
-        gsts &= ~IRE_STAT;
-        write_reg32(rs->register_base_address, VTD_GCMD_OFFSET, gsts);
+    return disable_units(&rs, 1, IRE_STAT, "interrupt remapping");
+}
 
-        /* Wait until GSTS indicates that operation is completed */
-        timeout = VTD_OPERATION_TIMEOUT;
-        while (read_reg32(rs->register_base_address, VTD_GSTS_OFFSET) & IRE_STAT) {
-            cpu_relax();
-            if (--timeout == 0) {
-                return false;
-            }
+/*
+ * collect up to max DRHD structures after the first <skip> of them,
+ * skipping anything past a malformed record
+ */
+static unsigned int get_drhd_units(struct dmar_remapping **units,
+                                   unsigned int skip, unsigned int max)
+{
+    uint32_t remap_length;
+    struct dmar_remapping *dmar_remap = vtd_get_dmar_remap(&remap_length);
+    struct dmar_remapping *iter, *next, *end;
+    unsigned int nr = 0;
+
+    if (dmar_remap == NULL) {
+        printk("cannot get DMAR remapping structures, skipping configuration\n");
+        return 0;
+    }
+
+    end = ((void *)dmar_remap) + remap_length;
+    for (iter = dmar_remap; iter < end && nr < max; iter = next) {
+        next = (void *)iter + iter->length;
+        if (iter->length == 0) {
+            /* Avoid looping forever on bad ACPI tables */
+            printk("    invalid 0-length structure\n");
+            break;
+        } else if (next > end) {
+            /* Avoid passing table end */
+            printk("    record passes table end\n");
+            break;
+        }
+
+        if (iter->type != DMAR_REMAPPING_DRHD) {
+            continue;
+        }
+        if (skip > 0) {
+            skip--;
+            continue;
         }
+        units[nr++] = iter;
     }
 
-    return true;
-}
\ No newline at end of file
+    return nr;
+}
+
+/*
+ * a batch of MAX_DRHD_UNITS units at a time, until a batch comes back short;
+ * a failed batch does not stop the ones after it from being disabled
+ */
+bool vtd_disable_dma_remap_all(void)
+{
+    struct dmar_remapping *units[MAX_DRHD_UNITS];
+    unsigned int first = 0, nr;
+    bool ok = true;
+
+    do {
+        nr = get_drhd_units(units, first, MAX_DRHD_UNITS);
+        if (nr == 0) {
+            break;
+        }
+
+        printk("configuring DMAR remapping (units %u-%u)\n", first,
+               first + nr - 1);
+        if (!disable_units(units, nr, TE_STAT, "DMA remapping")) {
+            ok = false;
+        }
+        first += nr;
+    } while (nr == MAX_DRHD_UNITS);
+
+    return ok;
+}
@@ -36,6 +36,8 @@
 #ifndef __E820_H__
 #define __E820_H__
 
+#include <rangemap.h>
+
 #ifndef E820_RAM
 #define E820_RAM            1
 #endif
@@ -57,8 +59,8 @@
 #endif
 
 /* these are only used by e820_check_region() */
-#define E820_MIXED          ((uint32_t)-1 - 1)
-#define E820_GAP            ((uint32_t)-1)
+#define E820_MIXED          RANGE_MAP_MIXED
+#define E820_GAP            RANGE_MAP_GAP
 
 #define E820MAX             128
 
@@ -79,11 +81,15 @@ typedef struct {
 
 extern memory_map_t *get_e820_copy(void);
 extern unsigned int get_nr_map(void);
+extern const memory_map_t *get_e820_copy_written(unsigned int *nr_map);
 extern bool copy_e820_map(loader_ctx *lctx);
 extern bool e820_protect_region(uint64_t addr, uint64_t size, uint32_t type);
+extern bool e820_protect_regions(range_t *regions, unsigned int count);
 extern bool e820_reserve_ram(uint64_t base, uint64_t length);
+extern bool e820_reserve_ram_batch(range_t *ranges, unsigned int count);
 extern void print_e820_map(void);
 extern uint32_t e820_check_region(uint64_t base, uint64_t length);
+extern uint64_t e820_get_ram_size(uint64_t base, uint64_t end);
 extern bool get_ram_ranges(uint64_t *min_lo_ram, uint64_t *max_lo_ram,
                            uint64_t *min_hi_ram, uint64_t *max_hi_ram);
 extern bool e820_get_highest_sized_ram(uint64_t size, uint64_t limit,
@@ -38,6 +38,7 @@
 
 #include <types.h>
 #include <config.h>
+#include <rangemap.h>
 
 /* Memory types: */
 #define EFI_RESERVED_TYPE               0
@@ -91,9 +92,11 @@ typedef struct __packed
 bool efi_memmap_copy(loader_ctx *lctx);
 uint32_t efi_memmap_get_addr(uint32_t *descr_size, uint32_t *descr_vers,
                              uint32_t *mmap_size);
+const uint8_t* efi_memmap_get_handed_off(uint32_t *mmap_size);
 efi_mem_descr_t* efi_memmap_walk(efi_mem_descr_t* prev);
 bool efi_memmap_is_free(uint32_t region_type);
 bool efi_memmap_reserve(uint64_t base, uint64_t length);
+bool efi_memmap_reserve_batch(range_t *ranges, uint32_t count);
 bool efi_memmap_get_highest_sized_ram(uint64_t size, uint64_t limit,
                                       uint64_t *ram_base, uint64_t *ram_size);
 void efi_memmap_dump(void);
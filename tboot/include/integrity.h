@@ -64,6 +64,8 @@ typedef struct {
     uint64_t vtd_pmr_hi_size;
     /* VL policy at time of sealing */
     tb_hash_t pol_hash;
+    /* platform state validated by the launch (see hash_platform_state()) */
+    tb_hash_t plat_hash;
     /* verified launch measurements to be re-extended in DRTM PCRs
      * a given PCR may have more than one hash and will get extended in the
      * order it appears in the list */
@@ -90,6 +92,9 @@ extern post_k_s3_state_t g_post_k_s3_state;
 extern bool seal_pre_k_state(void);
 extern bool seal_post_k_state(void);
 extern bool verify_integrity(void);
+extern bool s3_verify_pre_k_state(void);
+extern bool s3_platform_verified(void);
+extern bool s3_policy_unchanged(void);
 
 #endif /* _TBOOT_INTEGRITY_H_ */
 
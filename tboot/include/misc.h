@@ -39,6 +39,7 @@
 extern void print_hex(const char * buf, const void * prtptr, size_t size);
 
 extern void delay(int millisecs);
+extern uint64_t get_tsc_ticks_per_ms(void);
 
 /*
  *  These three "plus overflow" functions take a "x" value
@@ -74,6 +75,7 @@ static inline bool multiply_overflow_u32(uint32_t x, uint32_t y)
 #define ARRAY_SIZE(a)    (sizeof(a) / sizeof(a[0]))
 
 #define AP_WAKE_TRIGGER_DEF   0xffffffff
+#define AP_WAKE_TRIGGER_JOBS  0xfffffffe    /* tboot-internal, see ap_wait() */
 
 #endif    /* __MISC_H__ */
 
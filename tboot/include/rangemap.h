@@ -0,0 +1,94 @@
+/*
+ * rangemap.h: sorted, coalescing map of typed physical address ranges
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef __RANGEMAP_H__
+#define __RANGEMAP_H__
+
+/* only returned by range_map_check() */
+#define RANGE_MAP_MIXED     ((uint32_t)-1 - 1)
+#define RANGE_MAP_GAP       ((uint32_t)-1)
+
+/* [base, end) of one type; end is exclusive */
+typedef struct {
+    uint64_t base;
+    uint64_t end;
+    uint32_t type;
+    uint64_t attr;      /* opaque to the map (e.g. EFI attributes) */
+    uint32_t tag;       /* opaque; ranges with different tags never merge */
+} range_t;
+
+typedef bool (*range_type_match_t)(uint32_t type);
+
+/*
+ * ranges[] is kept sorted by base, non-overlapping, and adjacent ranges of
+ * the same type, attributes and tag are merged (if can_merge is NULL or
+ * accepts the type), so lookups are binary searches
+ */
+typedef struct {
+    range_t            *ranges;
+    unsigned int        nr;
+    unsigned int        max;
+    range_type_match_t  can_merge;
+} range_map_t;
+
+extern unsigned int range_map_find(const range_map_t *map, uint64_t addr);
+extern bool range_map_set(range_map_t *map, uint64_t base, uint64_t end,
+                          uint32_t type, uint64_t attr);
+extern bool range_map_set_range(range_map_t *map, const range_t *range);
+extern bool range_map_retype(range_map_t *map, uint64_t base, uint64_t end,
+                             range_type_match_t match, uint32_t new_type);
+extern bool range_map_retype_batch(range_map_t *map, range_t *batch,
+                                   unsigned int count,
+                                   range_type_match_t match,
+                                   uint32_t new_type);
+extern uint32_t range_map_check(const range_map_t *map, uint64_t base,
+                                uint64_t end);
+extern bool range_map_is_valid(const range_map_t *map);
+extern bool range_map_get_highest(const range_map_t *map, uint64_t size,
+                                  uint64_t limit, range_type_match_t match,
+                                  uint64_t *base, uint64_t *length);
+
+#endif    /* __RANGEMAP_H__ */
+
+
+/*
+ * Local variables:
+ * mode: C
+ * c-set-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
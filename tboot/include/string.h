@@ -50,15 +50,16 @@ int	 tb_snprintf(char *buf, size_t size, const char *fmt, ...);
 int	 tb_vscnprintf(char *buf, size_t size, const char *fmt, va_list ap);
 unsigned long tb_strtoul(const char *nptr, char **endptr, int base);
 
-static inline void *tb_memset(void *b, int c, size_t len)
-{
-	char *bb;
+void	*tb_memset(void *b, int c, size_t len);
 
-	for (bb = (char *)b; len--; )
-		*bb++ = c;
+/* CPU features used by tb_memcpy()/tb_memset(), probed on first use */
+#define TB_MEM_SSE2	(1<<0)	/* movnti available */
+#define TB_MEM_ERMS	(1<<1)	/* enhanced rep movsb/stosb */
+#define TB_MEM_FSRM	(1<<2)	/* fast short rep movsb */
+uint32_t tb_mem_features(void);
 
-	return (b);
-}
+/* copies/fills at least this large bypass the cache (if SSE2 present) */
+#define TB_MEM_NT_THRESHOLD	(256*1024)
 
 static inline void *tb_memmove(void *dest, const void *src, size_t n)
 {
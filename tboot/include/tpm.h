@@ -417,6 +417,22 @@ typedef tpm_digest_t tpm_pcr_value_t;
 extern tpm_pcr_value_t post_launch_pcr17;
 extern tpm_pcr_value_t post_launch_pcr18;
 
+/*
+ * What init learned by asking the TPM.  It lives in g_tpm, which is __data,
+ * so the post-launch and S3 resume passes reuse it (together with the
+ * timeouts and bank list) instead of probing again.
+ */
+typedef struct {
+    bool probed;            /* the rest is valid */
+    u8  family;             /* g_tpm_family it was probed for */
+    u8  nv_locked;          /* 1.2 permanent flag */
+    u8  reserved;
+    u32 manufacturer;       /* 2.0 fixed properties */
+    u32 fw_version[2];
+    u32 nv_index_max;
+    u32 nv_buf_max;         /* largest chunk a single NV read will return */
+} tpm_caps_t;
+
 struct tpm_if;
 struct tpm_if_fp;
 
@@ -453,6 +469,8 @@ struct tpm_if {
     u32 tb_policy_index;
     u32 tb_err_index;
     u32 sgx_svn_index;
+
+    tpm_caps_t caps;
 };
 
 struct tpm_if_fp {
@@ -475,6 +493,7 @@ struct tpm_if_fp {
 #define TPM_NV_PER_OWNERWRITE     (1<<1)
 #define TPM_NV_PER_PPWRITE        (1<<0)
     bool (*get_nvindex_permission)(struct tpm_if *ti, u32 locality, u32 index, u32 *attribute);
+    bool (*get_nvindex_public)(struct tpm_if *ti, u32 locality, u32 index, u32 *size, u32 *attribute);
 
     bool (*seal)(struct tpm_if *ti, u32 locality, u32 in_data_size, const u8 *in_data, u32 *sealed_data_size, u8 *sealed_data);
     bool (*unseal)(struct tpm_if *ti, u32 locality, u32 sealed_data_size, const u8 *sealed_data, u32 *secret_size, u8 *secret);
@@ -513,6 +532,9 @@ extern bool txt_is_launched(void);
 extern bool tpm_workaround_crb(void);
 extern struct tpm_if *get_tpm(void);
 extern const struct tpm_if_fp *get_tpm_fp(void);
+extern bool tpm_nv_get_public(uint32_t index, uint32_t *size, uint32_t *attribute);
+extern bool tpm_nv_read_all(uint32_t index, uint8_t *buf, uint32_t *size);
+extern void tpm_nv_forget(uint32_t index);
 
 
 //#define TPM_UNIT_TEST 1
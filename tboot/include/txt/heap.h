@@ -442,8 +442,37 @@ static inline sinit_mle_data_t *get_sinit_mle_data_start(const txt_heap_t *heap)
                                 sizeof(uint64_t));
 }
 
+/*
+ * index of the heap regions built once by verify_txt_heap(), with every
+ * region checked to lie within the heap
+ */
+enum {
+    TXT_HEAP_BIOS_DATA,
+    TXT_HEAP_OS_MLE_DATA,
+    TXT_HEAP_OS_SINIT_DATA,
+    TXT_HEAP_SINIT_MLE_DATA,
+    TXT_HEAP_NR_REGIONS
+};
+
+typedef struct {
+    uint64_t    size;       /* including the size field */
+    void        *data;
+} txt_heap_region_t;
+
+typedef struct {
+    const txt_heap_t    *heap;
+    uint64_t            heap_size;
+    unsigned int        nr_regions;
+    txt_heap_region_t   regions[TXT_HEAP_NR_REGIONS];
+} txt_heap_index_t;
+
+extern unsigned int index_txt_heap(const txt_heap_t *heap, uint64_t heap_size,
+                                   unsigned int nr_regions,
+                                   txt_heap_index_t *index);
+extern void *get_txt_heap_region(const txt_heap_t *heap, unsigned int region);
 extern uint64_t calc_os_sinit_data_size(uint32_t version);
-extern bool verify_txt_heap(const txt_heap_t *txt_heap, bool bios_data_only);
+extern bool verify_txt_heap(const txt_heap_t *txt_heap, bool bios_data_only,
+                            bool check_bios_data);
 extern bool verify_bios_data(const txt_heap_t *txt_heap);
 extern void print_os_sinit_data(const os_sinit_data_t *os_sinit_data);
 extern void print_os_sinit_data_vtdpmr(const os_sinit_data_t *os_sinit_data);
@@ -60,6 +60,8 @@ extern bool txt_s3_launch_environment(void);
 extern void txt_shutdown(void);
 extern bool txt_is_powercycle_required(void);
 extern void ap_wait(unsigned int cpuid);
+typedef void (*ap_job_fn_t)(void *data);
+extern void txt_run_on_aps(ap_job_fn_t fn, void **data, uint32_t count);
 extern int get_evtlog_type(void);
 
 extern uint32_t g_using_da;
@@ -36,9 +36,17 @@
 #ifndef __TXT_VERIFY_H__
 #define __TXT_VERIFY_H__
 
+/* RAM extents and the VT-d PMRs (2MB granular) that protect them */
+typedef struct {
+    uint64_t min_lo_ram, max_lo_ram;
+    uint64_t min_hi_ram, max_hi_ram;
+    uint64_t lo_base, lo_size;
+    uint64_t hi_base, hi_size;
+} vtd_pmr_plan_t;
+
+extern bool plan_vtd_pmrs(vtd_pmr_plan_t *plan);
 extern void set_vtd_pmrs(os_sinit_data_t *os_sinit_data,
-                         uint64_t min_lo_ram, uint64_t max_lo_ram,
-                         uint64_t min_hi_ram, uint64_t max_hi_ram);
+                         const vtd_pmr_plan_t *plan);
 extern bool verify_e820_map(sinit_mdr_t* mdrs_base, uint32_t num_mdrs);
 extern bool verify_stm(unsigned int cpuid);
 extern bool use_mwait(void);
@@ -37,6 +37,9 @@
 #define __VTD_H__
 
 #define VTD_OPERATION_TIMEOUT 0x10000000
+
+/* DRHD units disabled in one batch by vtd_disable_dma_remap_all() */
+#define MAX_DRHD_UNITS         64
  
 #define VTD_GCMD_OFFSET        0x18
   #define TE_EN                (1 << 31)
@@ -60,5 +63,6 @@ struct dmar_remapping *vtd_get_dmar_remap(uint32_t *remap_length);
 bool vtd_disable_dma_remap(struct dmar_remapping *rs);
 bool vtd_disable_qie(struct dmar_remapping *rs);
 bool vtd_disable_ire(struct dmar_remapping *rs);
+bool vtd_disable_dma_remap_all(void);
 
 #endif
\ No newline at end of file
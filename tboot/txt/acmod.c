@@ -56,7 +56,7 @@
 #include <tpm.h>
 #endif    /* IS_INCLUDED */
 
-static acm_info_table_t *get_acmod_info_table(const acm_hdr_t* hdr)
+static acm_info_table_t *parse_acmod_info_table(const acm_hdr_t* hdr)
 {
     uint32_t user_area_off;
 
@@ -99,17 +99,14 @@ static acm_info_table_t *get_acmod_info_table(const acm_hdr_t* hdr)
     return (acm_info_table_t *)((unsigned long)hdr + user_area_off);
 }
 
-static acm_chipset_id_list_t *get_acmod_chipset_list(const acm_hdr_t* hdr)
+static acm_chipset_id_list_t *parse_acmod_chipset_list(const acm_hdr_t* hdr,
+                                   const acm_info_table_t *info_table)
 {
-    acm_info_table_t* info_table;
     uint32_t size, id_list_off;
     acm_chipset_id_list_t *chipset_id_list;
 
     /* this fn assumes that the ACM has already passed the is_acmod() checks */
 
-    info_table = get_acmod_info_table(hdr);
-    if ( info_table == NULL )
-        return NULL;
     id_list_off = info_table->chipset_id_list;
 
     size = hdr->size * 4;
@@ -159,17 +156,14 @@ static acm_chipset_id_list_t *get_acmod_chipset_list(const acm_hdr_t* hdr)
     return chipset_id_list;
 }
 
-static acm_processor_id_list_t *get_acmod_processor_list(const acm_hdr_t* hdr)
+static acm_processor_id_list_t *parse_acmod_processor_list(const acm_hdr_t* hdr,
+                                   const acm_info_table_t *info_table)
 {
-    acm_info_table_t* info_table;
     uint32_t size, id_list_off;
     acm_processor_id_list_t *proc_id_list;
 
     /* this fn assumes that the ACM has already passed the is_acmod() checks */
 
-    info_table = get_acmod_info_table(hdr);
-    if ( info_table == NULL )
-        return NULL;
     id_list_off = info_table->processor_id_list;
 
     size = hdr->size * 4;
@@ -219,17 +213,14 @@ static acm_processor_id_list_t *get_acmod_processor_list(const acm_hdr_t* hdr)
     return proc_id_list;
 }
 
-tpm_info_list_t *get_tpm_info_list(const acm_hdr_t* hdr)
+static tpm_info_list_t *parse_tpm_info_list(const acm_hdr_t* hdr,
+                                            const acm_info_table_t *info_table)
 {
-    acm_info_table_t* info_table;
     uint32_t size, tpm_info_off;
     tpm_info_list_t *tpm_info;
 
     /* this fn assumes that the ACM has already passed the is_acmod() checks */
 
-    info_table = get_acmod_info_table(hdr);
-    if ( info_table == NULL )
-        return NULL;
     tpm_info_off = info_table->tpm_info_list_off;
 
     size = hdr->size * 4;
@@ -279,6 +270,109 @@ tpm_info_list_t *get_tpm_info_list(const acm_hdr_t* hdr)
     return tpm_info;
 }
 
+/*
+ * parsed ACM descriptors: the info table and ID lists of an image are only
+ * bounds-checked the first time they are asked for; images are keyed by
+ * address, size and date, and copy_sinit()/copy_racm() drop the descriptor
+ * of the region they overwrite
+ */
+#define MAX_ACM_DESCS    4
+
+#define ACM_DESC_CHIPSETS    0x01
+#define ACM_DESC_PROCS       0x02
+#define ACM_DESC_TPM_INFO    0x04
+
+typedef struct {
+    const acm_hdr_t           *hdr;
+    uint32_t                  size;
+    uint32_t                  date;
+    uint32_t                  parsed;     /* ACM_DESC_* lists looked at */
+    acm_info_table_t          *info_table;
+    acm_chipset_id_list_t     *chipset_list;
+    acm_processor_id_list_t   *proc_list;
+    tpm_info_list_t           *tpm_info;
+} acm_desc_t;
+
+static acm_desc_t g_acm_descs[MAX_ACM_DESCS];
+static unsigned int g_next_acm_desc;
+
+static acm_desc_t *get_acm_desc(const acm_hdr_t *hdr)
+{
+    acm_desc_t *desc;
+
+    for ( unsigned int i = 0; i < MAX_ACM_DESCS; i++ ) {
+        desc = &g_acm_descs[i];
+        if ( desc->hdr == hdr && desc->size == hdr->size &&
+             desc->date == hdr->date )
+            return desc;
+    }
+
+    acm_info_table_t *info_table = parse_acmod_info_table(hdr);
+    if ( info_table == NULL )
+        return NULL;
+
+    desc = &g_acm_descs[g_next_acm_desc++ % MAX_ACM_DESCS];
+    *desc = (acm_desc_t){ .hdr = hdr, .size = hdr->size, .date = hdr->date,
+                          .info_table = info_table };
+    return desc;
+}
+
+#ifndef IS_INCLUDED
+static void forget_acm_desc(const acm_hdr_t *hdr)
+{
+    for ( unsigned int i = 0; i < MAX_ACM_DESCS; i++ ) {
+        if ( g_acm_descs[i].hdr == hdr )
+            g_acm_descs[i].hdr = NULL;
+    }
+}
+#endif
+
+static acm_info_table_t *get_acmod_info_table(const acm_hdr_t* hdr)
+{
+    acm_desc_t *desc = get_acm_desc(hdr);
+
+    return ( desc == NULL ) ? NULL : desc->info_table;
+}
+
+static acm_chipset_id_list_t *get_acmod_chipset_list(const acm_hdr_t* hdr)
+{
+    acm_desc_t *desc = get_acm_desc(hdr);
+
+    if ( desc == NULL )
+        return NULL;
+    if ( !(desc->parsed & ACM_DESC_CHIPSETS) ) {
+        desc->chipset_list = parse_acmod_chipset_list(hdr, desc->info_table);
+        desc->parsed |= ACM_DESC_CHIPSETS;
+    }
+    return desc->chipset_list;
+}
+
+static acm_processor_id_list_t *get_acmod_processor_list(const acm_hdr_t* hdr)
+{
+    acm_desc_t *desc = get_acm_desc(hdr);
+
+    if ( desc == NULL )
+        return NULL;
+    if ( !(desc->parsed & ACM_DESC_PROCS) ) {
+        desc->proc_list = parse_acmod_processor_list(hdr, desc->info_table);
+        desc->parsed |= ACM_DESC_PROCS;
+    }
+    return desc->proc_list;
+}
+
+tpm_info_list_t *get_tpm_info_list(const acm_hdr_t* hdr)
+{
+    acm_desc_t *desc = get_acm_desc(hdr);
+
+    if ( desc == NULL )
+        return NULL;
+    if ( !(desc->parsed & ACM_DESC_TPM_INFO) ) {
+        desc->tpm_info = parse_tpm_info_list(hdr, desc->info_table);
+        desc->parsed |= ACM_DESC_TPM_INFO;
+    }
+    return desc->tpm_info;
+}
+
 void print_txt_caps(const char *prefix, txt_caps_t caps)
 {
     printk(TBOOT_DETA"%scapabilities: 0x%08x\n", prefix, caps._raw);
@@ -576,10 +670,45 @@ bool is_sinit_acmod(const void *acmod_base, uint32_t acmod_size, bool quiet)
     return true;
 }
 
-bool does_acmod_match_platform(const acm_hdr_t* hdr)
+/* chipset and processor IDs an ACM is matched against; fixed for the boot */
+typedef struct {
+    txt_didvid_t            didvid;
+    txt_ver_fsbif_qpiif_t   ver;
+    uint32_t                fms;
+    uint64_t                platform_id;
+} acm_platform_ids_t;
+
+static const acm_platform_ids_t *get_platform_ids(void)
 {
-    /* used to ensure we don't print chipset/proc info for each module */
-    static bool printed_host_info;
+    static acm_platform_ids_t ids;
+    static bool have_ids;
+
+    if ( have_ids )
+        return &ids;
+
+    /* get chipset fusing, device, and vendor id info */
+    ids.didvid._raw = read_pub_config_reg(TXTCR_DIDVID);
+    ids.ver._raw = read_pub_config_reg(TXTCR_VER_FSBIF);
+    if ( (ids.ver._raw & 0xffffffff) == 0xffffffff ||
+         (ids.ver._raw & 0xffffffff) == 0x00 )     /* need to use VER.QPIIF */
+        ids.ver._raw = read_pub_config_reg(TXTCR_VER_QPIIF);
+    printk(TBOOT_DETA"chipset production fused: %x\n", ids.ver.prod_fused );
+    printk(TBOOT_DETA"chipset ids: vendor: 0x%x, device: 0x%x, revision: 0x%x\n",
+           ids.didvid.vendor_id, ids.didvid.device_id, ids.didvid.revision_id);
+
+    /* get processor family/model/stepping and platform ID */
+    ids.fms = cpuid_eax(1);
+    ids.platform_id = rdmsr(MSR_IA32_PLATFORM_ID);
+    printk(TBOOT_DETA"processor family/model/stepping: 0x%x\n", ids.fms );
+    printk(TBOOT_DETA"platform id: 0x%Lx\n", (unsigned long long)ids.platform_id);
+
+    have_ids = true;
+    return &ids;
+}
+
+static bool acmod_matches_platform(const acm_hdr_t* hdr, bool quiet)
+{
+    const acm_platform_ids_t *ids = get_platform_ids();
 
     /* this fn assumes that the ACM has already passed the is_acmod() checks */
     acm_info_table_t *info_table = get_acmod_info_table(hdr);
@@ -594,45 +723,24 @@ bool does_acmod_match_platform(const acm_hdr_t* hdr)
         uint32_t sinit_type = info_table->capabilities.platform_type;
 
         if (bios_type == PLATFORM_TYPE_CLIENT && sinit_type != PLATFORM_TYPE_CLIENT) {
-            printk(TBOOT_ERR"Error: Non-client ACM on client platform\n");
+            if ( !quiet )
+                printk(TBOOT_ERR"Error: Non-client ACM on client platform\n");
             return false;
         }
 
         if (bios_type == PLATFORM_TYPE_SERVER && sinit_type != PLATFORM_TYPE_SERVER) {
-            printk(TBOOT_ERR"Error: Non-server ACM on server platform\n");
+            if ( !quiet )
+                printk(TBOOT_ERR"Error: Non-server ACM on server platform\n");
             return false;
         }
     }
 
-    /* get chipset fusing, device, and vendor id info */
-    txt_didvid_t didvid;
-    didvid._raw = read_pub_config_reg(TXTCR_DIDVID);
-    txt_ver_fsbif_qpiif_t ver;
-    ver._raw = read_pub_config_reg(TXTCR_VER_FSBIF);
-    if ( (ver._raw & 0xffffffff) == 0xffffffff ||
-         (ver._raw & 0xffffffff) == 0x00 )         /* need to use VER.QPIIF */
-        ver._raw = read_pub_config_reg(TXTCR_VER_QPIIF);
-    if ( !printed_host_info ) {
-        printk(TBOOT_DETA"chipset production fused: %x\n", ver.prod_fused );
-        printk(TBOOT_DETA"chipset ids: vendor: 0x%x, device: 0x%x, revision: 0x%x\n",
-               didvid.vendor_id, didvid.device_id, didvid.revision_id);
-    }
-
-    /* get processor family/model/stepping and platform ID */
-    uint64_t platform_id;
-    uint32_t fms = cpuid_eax(1);
-    platform_id = rdmsr(MSR_IA32_PLATFORM_ID);
-    if ( !printed_host_info ) {
-        printk(TBOOT_DETA"processor family/model/stepping: 0x%x\n", fms );
-        printk(TBOOT_DETA"platform id: 0x%Lx\n", (unsigned long long)platform_id);
-    }
-    printed_host_info = true;
-
     /*
      * check if chipset fusing is same
      */
-    if ( ver.prod_fused != !hdr->flags.debug_signed ) {
-        printk(TBOOT_ERR"\t production/debug mismatch between chipset and ACM\n");
+    if ( ids->ver.prod_fused != !hdr->flags.debug_signed ) {
+        if ( !quiet )
+            printk(TBOOT_ERR"\t production/debug mismatch between chipset and ACM\n");
         return false;
     }
 
@@ -643,26 +751,29 @@ bool does_acmod_match_platform(const acm_hdr_t* hdr)
     if ( chipset_id_list == NULL )
         return false;
 
-    printk(TBOOT_DETA"\t %x ACM chipset id entries:\n", chipset_id_list->count);
+    if ( !quiet )
+        printk(TBOOT_DETA"\t %x ACM chipset id entries:\n", chipset_id_list->count);
     unsigned int i;
     for ( i = 0; i < chipset_id_list->count; i++ ) {
         acm_chipset_id_t *chipset_id = &(chipset_id_list->chipset_ids[i]);
-        printk(TBOOT_DETA"\t     vendor: 0x%x, device: 0x%x, flags: 0x%x, "
-               "revision: 0x%x, extended: 0x%x\n",
-               (uint32_t)chipset_id->vendor_id,
-               (uint32_t)chipset_id->device_id, chipset_id->flags,
-               (uint32_t)chipset_id->revision_id, chipset_id->extended_id);
-
-        if ( (didvid.vendor_id == chipset_id->vendor_id ) &&
-             (didvid.device_id == chipset_id->device_id ) &&
+        if ( !quiet )
+            printk(TBOOT_DETA"\t     vendor: 0x%x, device: 0x%x, flags: 0x%x, "
+                   "revision: 0x%x, extended: 0x%x\n",
+                   (uint32_t)chipset_id->vendor_id,
+                   (uint32_t)chipset_id->device_id, chipset_id->flags,
+                   (uint32_t)chipset_id->revision_id, chipset_id->extended_id);
+
+        if ( (ids->didvid.vendor_id == chipset_id->vendor_id ) &&
+             (ids->didvid.device_id == chipset_id->device_id ) &&
              ( ( ( (chipset_id->flags & 0x1) == 0) &&
-                 (didvid.revision_id == chipset_id->revision_id) ) ||
+                 (ids->didvid.revision_id == chipset_id->revision_id) ) ||
                ( ( (chipset_id->flags & 0x1) == 1) &&
-                 ( (didvid.revision_id & chipset_id->revision_id) != 0 ) ) ) )
+                 ( (ids->didvid.revision_id & chipset_id->revision_id) != 0 ) ) ) )
             break;
     }
     if ( i >= chipset_id_list->count ) {
-        printk(TBOOT_ERR"\t chipset id mismatch\n");
+        if ( !quiet )
+            printk(TBOOT_ERR"\t chipset id mismatch\n");
         return false;
     }
 
@@ -674,22 +785,25 @@ bool does_acmod_match_platform(const acm_hdr_t* hdr)
         if ( proc_id_list == NULL )
             return false;
 
-        printk(TBOOT_DETA"\t %x ACM processor id entries:\n", proc_id_list->count);
+        if ( !quiet )
+            printk(TBOOT_DETA"\t %x ACM processor id entries:\n", proc_id_list->count);
         for ( i = 0; i < proc_id_list->count; i++ ) {
             acm_processor_id_t *proc_id = &(proc_id_list->processor_ids[i]);
-            printk(TBOOT_DETA"\t     fms: 0x%x, fms_mask: 0x%x, platform_id: 0x%Lx, "
-                   "platform_mask: 0x%Lx\n",
-                   proc_id->fms, proc_id->fms_mask,
-                   (unsigned long long)proc_id->platform_id,
-                   (unsigned long long)proc_id->platform_mask);
-
-            if ( (proc_id->fms == (fms & proc_id->fms_mask)) &&
-                 (proc_id->platform_id == (platform_id & proc_id->platform_mask))
+            if ( !quiet )
+                printk(TBOOT_DETA"\t     fms: 0x%x, fms_mask: 0x%x, platform_id: 0x%Lx, "
+                       "platform_mask: 0x%Lx\n",
+                       proc_id->fms, proc_id->fms_mask,
+                       (unsigned long long)proc_id->platform_id,
+                       (unsigned long long)proc_id->platform_mask);
+
+            if ( (proc_id->fms == (ids->fms & proc_id->fms_mask)) &&
+                 (proc_id->platform_id == (ids->platform_id & proc_id->platform_mask))
                )
                 break;
         }
         if ( i >= proc_id_list->count ) {
-            printk(TBOOT_ERR"\t processor mismatch\n");
+            if ( !quiet )
+                printk(TBOOT_ERR"\t processor mismatch\n");
             return false;
         }
     }
@@ -697,6 +811,47 @@ bool does_acmod_match_platform(const acm_hdr_t* hdr)
     return true;
 }
 
+bool does_acmod_match_platform(const acm_hdr_t* hdr)
+{
+    return acmod_matches_platform(hdr, false);
+}
+
+/*
+ * quiet pre-filter used when picking an ACM out of many modules: returns
+ * true if the module is an ACM of the wanted kind (SINIT or revocation)
+ * that matches this platform and is newer than 'best' (which may be NULL);
+ * the caller fully (and verbosely) validates only the module that wins
+ */
+bool is_better_platform_acmod(const void *acmod_base, uint32_t acmod_size,
+                              bool racm, const acm_hdr_t *best)
+{
+    const acm_hdr_t *hdr = (const acm_hdr_t *)acmod_base;
+    uint8_t type;
+
+    /* cheap header fields first, so most foreign modules cost nothing */
+    if ( acmod_size < sizeof(acm_hdr_t) ||
+         hdr->module_type != ACM_TYPE_CHIPSET ||
+         hdr->module_vendor != ACM_VENDOR_INTEL )
+        return false;
+    if ( racm && acmod_size != 0x8000 && acmod_size != 0x10000 )
+        return false;
+    /* ACM dates are BCD (0xYYYYMMDD), so they compare as integers */
+    if ( best != NULL && hdr->date <= best->date )
+        return false;
+
+    if ( !is_acmod(acmod_base, acmod_size, &type, true) )
+        return false;
+    if ( racm ) {
+        if ( type != ACM_CHIPSET_TYPE_BIOS_REVOC &&
+             type != ACM_CHIPSET_TYPE_SINIT_REVOC )
+            return false;
+    }
+    else if ( type != ACM_CHIPSET_TYPE_SINIT )
+        return false;
+
+    return acmod_matches_platform(hdr, true);
+}
+
 #ifndef IS_INCLUDED
 acm_hdr_t *get_bios_sinit(const void *sinit_region_base)
 {
@@ -735,6 +890,7 @@ acm_hdr_t *copy_racm(const acm_hdr_t *racm)
 
     /* copy it there */
     tb_memcpy(racm_region_base, racm, racm->size*4);
+    forget_acm_desc(racm_region_base);
 
     printk(TBOOT_DETA"copied RACM (size=%x) to %p\n", racm->size*4,
            racm_region_base);
@@ -792,8 +948,24 @@ acm_hdr_t *copy_sinit(const acm_hdr_t *sinit)
     if ( sinit_region_base == NULL )
        return NULL;
 
+    /*
+     * the region may already hold this very module (e.g. left there by an
+     * earlier launch without BIOS reporting it); comparing is read-only, so
+     * it is cheaper than re-copying and leaves the region's lines clean
+     */
+    acm_hdr_t *region_hdr = (acm_hdr_t *)sinit_region_base;
+    if ( region_hdr->size == sinit->size && region_hdr->date == sinit->date &&
+         tb_memcmp(region_hdr->rsa2048_sig, sinit->rsa2048_sig,
+                   sizeof(sinit->rsa2048_sig)) == 0 &&
+         tb_memcmp(sinit_region_base, sinit, sinit->size*4) == 0 ) {
+        printk(TBOOT_DETA"SINIT (size=%x) already present at %p\n",
+               sinit->size*4, sinit_region_base);
+        return region_hdr;
+    }
+
     /* copy it there */
     tb_memcpy(sinit_region_base, sinit, sinit->size*4);
+    forget_acm_desc(sinit_region_base);
 
     printk(TBOOT_DETA"copied SINIT (size=%x) to %p\n", sinit->size*4,
            sinit_region_base);
@@ -902,6 +1074,7 @@ void verify_IA32_se_svn_status(const acm_hdr_t *acm_hdr)
             printk(TBOOT_ERR"Write sgx_svn_index 0x%x failed. \n", tpm->sgx_svn_index);
         else
             printk(TBOOT_INFO"Write sgx_svn_index with 0x%x successful.\n", acm_hdr->se_svn);
+        tpm_nv_forget(tpm->sgx_svn_index);
 
         if ((rdmsr(MSR_IA32_SE_SVN_STATUS) & 0X00000001) !=0)  /* reset platform */
         // printk(TBOOT_INFO"SGX:A reset is required in this boot\n");
@@ -423,6 +423,40 @@ static void print_bios_data(const bios_data_t *bios_data, uint64_t size)
         print_ext_data_elts(bios_data->ext_data_elts);
 }
 
+/*
+ * index_txt_heap
+ *
+ * Walk the size fields of the first nr_regions heap regions once, checking
+ * that each region lies within heap_size, and record where each starts.
+ *
+ * return: number of well-formed regions (< nr_regions if one is not)
+ */
+unsigned int index_txt_heap(const txt_heap_t *heap, uint64_t heap_size,
+                            unsigned int nr_regions, txt_heap_index_t *index)
+{
+    uint64_t off = 0;
+    unsigned int i;
+
+    index->heap = heap;
+    index->heap_size = heap_size;
+    for ( i = 0; i < nr_regions && i < TXT_HEAP_NR_REGIONS; i++ ) {
+        uint64_t size;
+
+        if ( heap_size - off < sizeof(uint64_t) )
+            break;
+        size = *(const uint64_t *)((const uint8_t *)heap + off);
+        if ( size < sizeof(uint64_t) || size > heap_size - off )
+            break;
+
+        index->regions[i].size = size;
+        index->regions[i].data = (uint8_t *)heap + off + sizeof(uint64_t);
+        off += size;
+    }
+    index->nr_regions = i;
+
+    return i;
+}
+
 #ifndef IS_INCLUDED
 
 static bool verify_bios_spec_ver_elt(const heap_ext_data_element_t *elt)
@@ -586,30 +620,39 @@ static bool verify_ext_data_elts(const heap_ext_data_element_t elts[],
     return true;
 }
 
-bool verify_bios_data(const txt_heap_t *txt_heap)
-{
-    uint64_t heap_base = read_pub_config_reg(TXTCR_HEAP_BASE);
-    uint64_t heap_size = read_pub_config_reg(TXTCR_HEAP_SIZE);
-    printk(TBOOT_DETA"TXT.HEAP.BASE: 0x%jx\n", heap_base);
-    printk(TBOOT_DETA"TXT.HEAP.SIZE: 0x%jx (%ju)\n", heap_size, heap_size);
+static txt_heap_index_t g_heap_index;
 
-    /* verify that heap base/size are valid */
-    if ( txt_heap == NULL || heap_base == 0 || heap_size == 0 )
-        return false;
+static const char *g_heap_region_names[TXT_HEAP_NR_REGIONS] = {
+    "BIOS data", "OS to MLE data", "OS to SINIT data", "SINIT to MLE data"
+};
 
-    /* check size */
-    uint64_t size = get_bios_data_size(txt_heap);
-    if ( size == 0 ) {
-        printk(TBOOT_ERR"BIOS data size is 0\n");
-        return false;
-    }
-    if ( size > heap_size ) {
-        printk(TBOOT_ERR"BIOS data size is larger than heap size "
-               "(%jx, heap size=%jx)\n", size, heap_size);
-        return false;
+/*
+ * region start from the index verify_txt_heap() built for this heap, or
+ * from the size fields if that region has not been verified
+ */
+void *get_txt_heap_region(const txt_heap_t *heap, unsigned int region)
+{
+    if ( g_heap_index.heap == heap && region < g_heap_index.nr_regions )
+        return g_heap_index.regions[region].data;
+
+    switch ( region ) {
+        case TXT_HEAP_BIOS_DATA:
+            return get_bios_data_start(heap);
+        case TXT_HEAP_OS_MLE_DATA:
+            return get_os_mle_data_start(heap);
+        case TXT_HEAP_OS_SINIT_DATA:
+            return get_os_sinit_data_start(heap);
+        case TXT_HEAP_SINIT_MLE_DATA:
+            return get_sinit_mle_data_start(heap);
+        default:
+            return NULL;
     }
+}
 
-    bios_data_t *bios_data = get_bios_data_start(txt_heap);
+static bool verify_bios_data_region(const txt_heap_region_t *region)
+{
+    uint64_t size = region->size;
+    bios_data_t *bios_data = region->data;
 
     /* check version */
     if ( bios_data->version < 2 ) {
@@ -638,11 +681,14 @@ bool verify_bios_data(const txt_heap_t *txt_heap)
             return false;
     }
 
-    print_bios_data(bios_data, size);
-
     return true;
 }
 
+bool verify_bios_data(const txt_heap_t *txt_heap)
+{
+    return verify_txt_heap(txt_heap, true, true);
+}
+
 static void print_os_mle_data(const os_mle_data_t *os_mle_data)
 {
     printk(TBOOT_DETA"os_mle_data (@%p, %Lx):\n", os_mle_data,
@@ -652,31 +698,18 @@ static void print_os_mle_data(const os_mle_data_t *os_mle_data)
     printk(TBOOT_DETA"\t loader context addr: %p\n", os_mle_data->lctx_addr);
 }
 
-static bool verify_os_mle_data(const txt_heap_t *txt_heap)
+static bool verify_os_mle_data(const txt_heap_region_t *region)
 {
-    uint64_t size, heap_size;
-    os_mle_data_t *os_mle_data;
+    uint64_t size = region->size;
+    os_mle_data_t *os_mle_data = region->data;
 
-    /* check size */
-    heap_size = read_priv_config_reg(TXTCR_HEAP_SIZE);
-    size = get_os_mle_data_size(txt_heap);
-    if ( size == 0 ) {
-        printk(TBOOT_ERR"OS to MLE data size is 0\n");
-        return false;
-    }
-    if ( size > heap_size ) {
-        printk(TBOOT_ERR"OS to MLE data size is larger than heap size "
-               "(%Lx, heap size=%Lx)\n", size, heap_size);
-        return false;
-    }
-    if ( size != (sizeof(os_mle_data_t) + sizeof(size)) ) {
-        printk(TBOOT_ERR"OS to MLE data size (%Lx) is not equal to "
+    /* anything past os_mle_data_t is more room for the event logs */
+    if ( size < (sizeof(os_mle_data_t) + sizeof(size)) ) {
+        printk(TBOOT_ERR"OS to MLE data size (%Lx) is smaller than "
                "os_mle_data_t size (%x)\n", size, sizeof(os_mle_data_t));
         return false;
     }
 
-    os_mle_data = get_os_mle_data_start(txt_heap);
-
     /* check version */
     /* since this data is from our pre-launch to post-launch code only, it */
     /* should always be this */
@@ -692,8 +725,6 @@ static bool verify_os_mle_data(const txt_heap_t *txt_heap)
         return false;
     }
 
-    print_os_mle_data(os_mle_data);
-
     return true;
 }
 
@@ -765,25 +796,10 @@ void print_os_sinit_data(const os_sinit_data_t *os_sinit_data)
         print_ext_data_elts(os_sinit_data->ext_data_elts);
 }
 
-static bool verify_os_sinit_data(const txt_heap_t *txt_heap)
+static bool verify_os_sinit_data(const txt_heap_region_t *region)
 {
-    uint64_t size, heap_size;
-    os_sinit_data_t *os_sinit_data;
-
-    /* check size */
-    heap_size = read_priv_config_reg(TXTCR_HEAP_SIZE);
-    size = get_os_sinit_data_size(txt_heap);
-    if ( size == 0 ) {
-        printk(TBOOT_ERR"OS to SINIT data size is 0\n");
-        return false;
-    }
-    if ( size > heap_size ) {
-        printk(TBOOT_ERR"OS to SINIT data size is larger than heap size "
-               "(%Lx, heap size=%Lx)\n", size, heap_size);
-        return false;
-    }
-
-    os_sinit_data = get_os_sinit_data_start(txt_heap);
+    uint64_t size = region->size;
+    os_sinit_data_t *os_sinit_data = region->data;
 
     /* check version (but since we create this, it should always be OK) */
     if ( os_sinit_data->version < MIN_OS_SINIT_DATA_VER ||
@@ -805,8 +821,6 @@ static bool verify_os_sinit_data(const txt_heap_t *txt_heap)
             return false;
     }
 
-    print_os_sinit_data(os_sinit_data);
-
     return true;
 }
 
@@ -859,26 +873,16 @@ static void print_sinit_mle_data(const sinit_mle_data_t *sinit_mle_data)
         print_ext_data_elts(sinit_mle_data->ext_data_elts);
 }
 
-static bool verify_sinit_mle_data(const txt_heap_t *txt_heap)
+static bool verify_sinit_mle_data(const txt_heap_region_t *region)
 {
-    uint64_t size, heap_size;
-    sinit_mle_data_t *sinit_mle_data;
+    uint64_t size = region->size;
+    sinit_mle_data_t *sinit_mle_data = region->data;
 
-    /* check size */
-    heap_size = read_priv_config_reg(TXTCR_HEAP_SIZE);
-    size = get_sinit_mle_data_size(txt_heap);
-    if ( size == 0 ) {
-        printk(TBOOT_ERR"SINIT to MLE data size is 0\n");
-        return false;
-    }
-    if ( size > heap_size ) {
-        printk(TBOOT_ERR"SINIT to MLE data size is larger than heap size\n"
-               "(%Lx, heap size=%Lx)\n", size, heap_size);
+    if ( size < sizeof(size) + offsetof(sinit_mle_data_t, proc_scrtm_status) ) {
+        printk(TBOOT_ERR"SINIT to MLE data size (%Lx) is too small\n", size);
         return false;
     }
 
-    sinit_mle_data = get_sinit_mle_data_start(txt_heap);
-
     /* check version */
     if ( sinit_mle_data->version < 6 ) {
         printk(TBOOT_ERR"unsupported SINIT to MLE data version (%u)\n",
@@ -891,63 +895,80 @@ static bool verify_sinit_mle_data(const txt_heap_t *txt_heap)
     }
 
     /* this data is generated by SINIT and so is implicitly trustworthy, */
-    /* so we don't need to validate it's fields */
-
-    print_sinit_mle_data(sinit_mle_data);
+    /* so we don't need to validate it's fields; but the MDR table is used */
+    /* in place, so make sure it is within the region */
+    if ( sinit_mle_data->mdrs_off > size ||
+         (uint64_t)sinit_mle_data->num_mdrs * sizeof(sinit_mdr_t) >
+             size - sinit_mle_data->mdrs_off ) {
+        printk(TBOOT_ERR"SINIT to MLE data MDRs (%u @ 0x%x) run past its end\n",
+               sinit_mle_data->num_mdrs, sinit_mle_data->mdrs_off);
+        return false;
+    }
 
     return true;
 }
 
-bool verify_txt_heap(const txt_heap_t *txt_heap, bool bios_data_only)
+/*
+ * index the heap and verify its regions: BIOS to OS data only if
+ * bios_data_only, and all but BIOS to OS data if !check_bios_data (S3
+ * resume, once it is known to be what the first launch verified)
+ */
+bool verify_txt_heap(const txt_heap_t *txt_heap, bool bios_data_only,
+                     bool check_bios_data)
 {
-    /* verify BIOS to OS data */
-    if ( !verify_bios_data(txt_heap) )
-        return false;
-
-    if ( bios_data_only )
-        return true;
-
-    /* check that total size is within the heap */
-    uint64_t size1 = get_bios_data_size(txt_heap);
-    uint64_t size2 = get_os_mle_data_size(txt_heap);
-    uint64_t size3 = get_os_sinit_data_size(txt_heap);
-    uint64_t size4 = get_sinit_mle_data_size(txt_heap);
+    uint64_t heap_base = read_pub_config_reg(TXTCR_HEAP_BASE);
+    uint64_t heap_size = read_pub_config_reg(TXTCR_HEAP_SIZE);
+    unsigned int nr_regions = bios_data_only ? 1 : TXT_HEAP_NR_REGIONS;
+    txt_heap_index_t *index = &g_heap_index;
+    printk(TBOOT_DETA"TXT.HEAP.BASE: 0x%jx\n", heap_base);
+    printk(TBOOT_DETA"TXT.HEAP.SIZE: 0x%jx (%ju)\n", heap_size, heap_size);
 
-    /* overflow? */
-    if ( plus_overflow_u64(size1, size2) ) {
-        printk(TBOOT_ERR"TXT heap data size overflows\n");
-        return false;
-    }
-    if ( plus_overflow_u64(size3, size4) ) {
-        printk(TBOOT_ERR"TXT heap data size overflows\n");
-        return false;
-    }
-    if ( plus_overflow_u64(size1 + size2, size3 + size4) ) {
-        printk(TBOOT_ERR"TXT heap data size overflows\n");
+    /* verify that heap base/size are valid */
+    if ( txt_heap == NULL || heap_base == 0 || heap_size == 0 )
         return false;
-    }
 
-    if ( (size1 + size2 + size3 + size4) >
-         read_priv_config_reg(TXTCR_HEAP_SIZE) ) {
-        printk(TBOOT_ERR"TXT heap data sizes (%Lx, %Lx, %Lx, %Lx) are larger than\n"
-               "heap total size (%Lx)\n", size1, size2, size3, size4,
-               read_priv_config_reg(TXTCR_HEAP_SIZE));
+    /* one walk over the region sizes, each checked to be within the heap */
+    if ( index_txt_heap(txt_heap, heap_size, nr_regions, index)
+             < nr_regions ) {
+        printk(TBOOT_ERR"%s size is 0 or runs past the end of the heap "
+               "(heap size=%jx)\n", g_heap_region_names[index->nr_regions],
+               heap_size);
+        index->nr_regions = 0;
         return false;
     }
 
-    /* verify OS to MLE data */
-    if ( !verify_os_mle_data(txt_heap) )
-        return false;
+    /* verify BIOS to OS data */
+    if ( check_bios_data &&
+         !verify_bios_data_region(&index->regions[TXT_HEAP_BIOS_DATA]) )
+        goto fail;
 
-    /* verify OS to SINIT data */
-    if ( !verify_os_sinit_data(txt_heap) )
-        return false;
+    if ( !bios_data_only ) {
+        /* verify OS to MLE data */
+        if ( !verify_os_mle_data(&index->regions[TXT_HEAP_OS_MLE_DATA]) )
+            goto fail;
 
-    /* verify SINIT to MLE data */
-    if ( !verify_sinit_mle_data(txt_heap) )
-        return false;
+        /* verify OS to SINIT data */
+        if ( !verify_os_sinit_data(&index->regions[TXT_HEAP_OS_SINIT_DATA]) )
+            goto fail;
+
+        /* verify SINIT to MLE data */
+        if ( !verify_sinit_mle_data(&index->regions[TXT_HEAP_SINIT_MLE_DATA]) )
+            goto fail;
+    }
+
+    print_bios_data(index->regions[TXT_HEAP_BIOS_DATA].data,
+                    index->regions[TXT_HEAP_BIOS_DATA].size);
+    if ( !bios_data_only ) {
+        print_os_mle_data(index->regions[TXT_HEAP_OS_MLE_DATA].data);
+        print_os_sinit_data(index->regions[TXT_HEAP_OS_SINIT_DATA].data);
+        print_sinit_mle_data(index->regions[TXT_HEAP_SINIT_MLE_DATA].data);
+    }
 
     return true;
+
+fail:
+    index->nr_regions = 0;
+    return false;
 }
 
 #endif
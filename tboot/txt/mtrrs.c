@@ -33,6 +33,7 @@
  *
  */
 
+#ifndef IS_INCLUDED     /* host tools include this file directly */
 #include <config.h>
 #include <types.h>
 #include <stdbool.h>
@@ -51,6 +52,8 @@
 #include <txt/mtrrs.h>
 #include <txt/acmod.h>
 #include <tpm.h>
+#include <rangemap.h>
+#endif    /* IS_INCLUDED */
 
 #define MTRR_TYPE_MIXED         -1
 #define MMIO_APIC_BASE          0xFEE00000
@@ -59,6 +62,7 @@
 #define NR_MMIO_PCICFG_PAGES    1
 #define SINIT_MTRR_MASK         0xFFFFFF  /* SINIT requires 36b mask */
 
+#ifndef IS_INCLUDED
 /* saved MTRR state or NULL if orig. MTRRs have not been changed */
 static __data mtrr_state_t *g_saved_mtrrs = NULL;
 
@@ -194,46 +198,79 @@ static void print_mtrrs(const mtrr_state_t *saved_state)
                saved_state->mtrr_physmasks[i].v );
     }
 }
+#endif    /* IS_INCLUDED */
 
-/* base should be 4k-bytes aligned, no invalid overlap combination */
-static int get_page_type(const mtrr_state_t *saved_state, uint32_t base)
+/*
+ * effective (variable MTRR) memory types of the physical address space as
+ * sorted intervals: painting the default type, then every other type in
+ * MTRR order, then WT and finally UC over it gives the same precedence as
+ * the processor (UC > WT > others; invalid overlaps are rejected earlier)
+ */
+typedef struct {
+    range_map_t map;
+    range_t     ranges[2 * MAX_VARIABLE_MTRRS + 1];
+} mtrr_model_t;
+
+/* fails if a valid var MTRR does not describe a single contiguous range */
+static bool build_mtrr_model(const mtrr_state_t *saved_state,
+                             uint64_t maxphyaddr_mask, mtrr_model_t *model)
 {
-    int type = -1;
-    bool wt = false;
-    uint64_t maxphyaddr_mask = get_maxphyaddr_mask();
+    static const int pass_types[] = { -1, MTRR_TYPE_WRTHROUGH,
+                                      MTRR_TYPE_UNCACHABLE };
+    uint64_t limit = (maxphyaddr_mask + 1) << PAGE_SHIFT;
+
+    model->map.ranges = model->ranges;
+    model->map.nr = 0;
+    model->map.max = ARRAY_SIZE(model->ranges);
+    model->map.can_merge = NULL;
 
     /* omit whether the fix mtrrs are enabled, just check var mtrrs */
+    if ( saved_state->mtrr_def_type.e == 0 )
+        return range_map_set(&model->map, 0, limit, MTRR_TYPE_UNCACHABLE, 0);
+    if ( !range_map_set(&model->map, 0, limit,
+                        saved_state->mtrr_def_type.type, 0) )
+        return false;
 
-    base >>= PAGE_SHIFT;
-    for ( unsigned int i = 0; i < saved_state->num_var_mtrrs; i++ ) {
-        const mtrr_physbase_t *base_i = &saved_state->mtrr_physbases[i];
-        const mtrr_physmask_t *mask_i = &saved_state->mtrr_physmasks[i];
+    for ( unsigned int pass = 0; pass < ARRAY_SIZE(pass_types); pass++ ) {
+        for ( unsigned int i = 0; i < saved_state->num_var_mtrrs; i++ ) {
+            const mtrr_physbase_t *base_i = &saved_state->mtrr_physbases[i];
+            const mtrr_physmask_t *mask_i = &saved_state->mtrr_physmasks[i];
+            uint64_t mask, low;
+            int type = base_i->type;
 
-        if ( mask_i->v == 0 )
-            continue;
-        if ( (base & mask_i->mask & maxphyaddr_mask) !=
-             (base_i->base & mask_i->mask & maxphyaddr_mask) )
-            continue;
+            if ( mask_i->v == 0 )
+                continue;
+            if ( pass_types[pass] == -1 ) {
+                if ( type == MTRR_TYPE_WRTHROUGH ||
+                     type == MTRR_TYPE_UNCACHABLE )
+                    continue;
+            }
+            else if ( type != pass_types[pass] )
+                continue;
 
-        type = base_i->type;
-        if ( type == MTRR_TYPE_UNCACHABLE )
-            return MTRR_TYPE_UNCACHABLE;
-        if ( type == MTRR_TYPE_WRTHROUGH )
-            wt = true;
+            /* mask of ones from bit <low> up to MAXPHYADDR */
+            mask = mask_i->mask & maxphyaddr_mask;
+            low = mask & (~mask + 1);
+            if ( mask == 0 )
+                low = maxphyaddr_mask + 1;
+            else if ( (mask | (low - 1)) != maxphyaddr_mask )
+                return false;
+
+            if ( !range_map_set(&model->map,
+                                (base_i->base & mask) << PAGE_SHIFT,
+                                ((base_i->base & mask) + low) << PAGE_SHIFT,
+                                type, 0) )
+                return false;
+        }
     }
-    if ( wt )
-        return MTRR_TYPE_WRTHROUGH;
-    if ( type != -1 )
-        return type;
 
-    return saved_state->mtrr_def_type.type;
+    return true;
 }
 
-static int get_region_type(const mtrr_state_t *saved_state,
+static int get_region_type(const mtrr_model_t *model,
                            uint32_t base, uint32_t pages)
 {
-    int type;
-    uint32_t end;
+    uint32_t type;
 
     if ( pages == 0 )
         return MTRR_TYPE_MIXED;
@@ -242,29 +279,31 @@ static int get_region_type(const mtrr_state_t *saved_state,
     if ( ((uint32_t)(~0) - base) < (pages << PAGE_SHIFT) )
         return MTRR_TYPE_MIXED;
 
-    if ( saved_state->mtrr_def_type.e == 0 )
-        return MTRR_TYPE_UNCACHABLE;
-
     /* align to 4k page boundary */
     base &= PAGE_MASK;
-    end = base + (pages << PAGE_SHIFT);
 
-    type = get_page_type(saved_state, base);
-    base += PAGE_SIZE;
-    for ( ; base < end; base += PAGE_SIZE )
-        if ( type != get_page_type(saved_state, base) )
-            return MTRR_TYPE_MIXED;
+    type = range_map_check(&model->map, base,
+                           (uint64_t)base + (pages << PAGE_SHIFT));
+    if ( type == RANGE_MAP_MIXED || type == RANGE_MAP_GAP )
+        return MTRR_TYPE_MIXED;
 
     return type;
 }
 
+#ifndef IS_INCLUDED
 static bool validate_mmio_regions(const mtrr_state_t *saved_state)
 {
     acpi_table_mcfg_t *acpi_table_mcfg;
     acpi_table_ioapic_t *acpi_table_ioapic;
+    mtrr_model_t model;
+
+    if ( !build_mtrr_model(saved_state, get_maxphyaddr_mask(), &model) ) {
+        printk(TBOOT_ERR"var MTRRs cannot be resolved into ranges\n");
+        return false;
+    }
 
     /* mmio space for TXT private config space should be UC */
-    if ( get_region_type(saved_state, TXT_PRIV_CONFIG_REGS_BASE,
+    if ( get_region_type(&model, TXT_PRIV_CONFIG_REGS_BASE,
                          TXT_CONFIG_REGS_SIZE >> PAGE_SHIFT)
            != MTRR_TYPE_UNCACHABLE ) {
         printk(TBOOT_ERR"MMIO space for TXT private config space should be UC\n");
@@ -272,7 +311,7 @@ static bool validate_mmio_regions(const mtrr_state_t *saved_state)
     }
 
     /* mmio space for TXT public config space should be UC */
-    if ( get_region_type(saved_state, TXT_PUB_CONFIG_REGS_BASE,
+    if ( get_region_type(&model, TXT_PUB_CONFIG_REGS_BASE,
                          TXT_CONFIG_REGS_SIZE >> PAGE_SHIFT)
            != MTRR_TYPE_UNCACHABLE ) {
         printk(TBOOT_ERR"MMIO space for TXT public config space should be UC\n");
@@ -280,7 +319,7 @@ static bool validate_mmio_regions(const mtrr_state_t *saved_state)
     }
 
     /* mmio space for TPM should be UC */
-    if ( get_region_type(saved_state, TPM_LOCALITY_BASE,
+    if ( get_region_type(&model, TPM_LOCALITY_BASE,
                          NR_TPM_LOCALITY_PAGES * TPM_NR_LOCALITIES)
            != MTRR_TYPE_UNCACHABLE ) {
         printk(TBOOT_ERR"MMIO space for TPM should be UC\n");
@@ -288,7 +327,7 @@ static bool validate_mmio_regions(const mtrr_state_t *saved_state)
     }
 
     /* mmio space for APIC should be UC */
-    if ( get_region_type(saved_state, MMIO_APIC_BASE, NR_MMIO_APIC_PAGES)
+    if ( get_region_type(&model, MMIO_APIC_BASE, NR_MMIO_APIC_PAGES)
            != MTRR_TYPE_UNCACHABLE ) {
         printk(TBOOT_ERR"MMIO space for APIC should be UC\n");
         return false;
@@ -303,7 +342,7 @@ static bool validate_mmio_regions(const mtrr_state_t *saved_state)
     }
     printk(TBOOT_DETA"acpi_table_ioapic @ %p, .address = %x\n",
            acpi_table_ioapic, acpi_table_ioapic->address);
-    if ( get_region_type(saved_state, acpi_table_ioapic->address,
+    if ( get_region_type(&model, acpi_table_ioapic->address,
                          NR_MMIO_IOAPIC_PAGES)
            != MTRR_TYPE_UNCACHABLE ) {
         printk(TBOOT_ERR"MMIO space(%x) for IOAPIC should be UC\n",
@@ -320,7 +359,7 @@ static bool validate_mmio_regions(const mtrr_state_t *saved_state)
     }
     printk(TBOOT_DETA"acpi_table_mcfg @ %p, .base_address = %x\n",
            acpi_table_mcfg, acpi_table_mcfg->base_address);
-    if ( get_region_type(saved_state, acpi_table_mcfg->base_address,
+    if ( get_region_type(&model, acpi_table_mcfg->base_address,
                          NR_MMIO_PCICFG_PAGES)
            != MTRR_TYPE_UNCACHABLE ) {
         printk(TBOOT_ERR"MMIO space(%x) for PCI config space should be UC\n",
@@ -479,7 +518,115 @@ void restore_mtrrs(const mtrr_state_t *saved_state)
     /* IA32_MTRR_DEF_TYPE MSR */
     wrmsr(MSR_MTRRdefType, saved_state->mtrr_def_type.raw);
 }
+#endif    /* IS_INCLUDED */
+
+/*
+ * append the aligned power-of-2 blocks exactly covering pages [start, end)
+ * to plan (if not NULL and there is room)
+ *
+ * return: number of blocks needed
+ */
+static unsigned int plan_aligned_blocks(mtrr_state_t *plan, uint32_t start,
+                                        uint32_t end, uint32_t type)
+{
+    unsigned int n = 0;
+
+    while ( start < end ) {
+        uint32_t pages = 1u << (fls(end - start) - 1);
+        while ( (start & (pages - 1)) != 0 )
+            pages >>= 1;
+
+        if ( plan != NULL && plan->num_var_mtrrs < MAX_VARIABLE_MTRRS ) {
+            unsigned int i = plan->num_var_mtrrs++;
+            plan->mtrr_physbases[i].base = start;
+            plan->mtrr_physbases[i].type = type;
+            plan->mtrr_physmasks[i].mask = ~(pages - 1) & SINIT_MTRR_MASK;
+            plan->mtrr_physmasks[i].v = 1;
+        }
+        start += pages;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * compute the var MTRRs that make pages [start, end) mem_type and all other
+ * memory UC (the default type); if the exact power-of-2 split does not fit,
+ * cover an aligned superset instead and carve the excess back out with UC
+ * MTRRs (UC always wins), picking the superset that needs fewest MTRRs
+ */
+static bool plan_mem_type(uint32_t start, uint32_t end, uint32_t mem_type,
+                          unsigned int max_mtrrs, mtrr_state_t *plan)
+{
+    uint32_t lo = start, hi = end;
+    unsigned int best = plan_aligned_blocks(NULL, start, end, mem_type);
+
+    if ( best > max_mtrrs && mem_type != MTRR_TYPE_UNCACHABLE ) {
+        for ( unsigned int k = 1; k <= 24; k++ ) {
+            uint32_t lo_k = start & ~((1u << k) - 1);
+
+            for ( unsigned int l = 1; l <= 24; l++ ) {
+                uint64_t hi_l = ((uint64_t)end + (1u << l) - 1)
+                                & ~(uint64_t)((1u << l) - 1);
+                unsigned int cost;
+
+                if ( hi_l > (uint64_t)SINIT_MTRR_MASK + 1 )
+                    break;
+                cost = plan_aligned_blocks(NULL, lo_k, hi_l, mem_type) +
+                       plan_aligned_blocks(NULL, lo_k, start,
+                                           MTRR_TYPE_UNCACHABLE) +
+                       plan_aligned_blocks(NULL, end, hi_l,
+                                           MTRR_TYPE_UNCACHABLE);
+                if ( cost < best ) {
+                    best = cost;
+                    lo = lo_k;
+                    hi = hi_l;
+                }
+            }
+        }
+    }
+    if ( best > max_mtrrs ) {
+        printk(TBOOT_ERR"range needs %u var MTRRs, only %u available\n",
+               best, max_mtrrs);
+        return false;
+    }
+
+    tb_memset(plan, 0, sizeof(*plan));
+    plan->mtrr_def_type.e = 1;
+    plan->mtrr_def_type.type = MTRR_TYPE_UNCACHABLE;
+    plan_aligned_blocks(plan, lo, hi, mem_type);
+    plan_aligned_blocks(plan, lo, start, MTRR_TYPE_UNCACHABLE);
+    plan_aligned_blocks(plan, end, hi, MTRR_TYPE_UNCACHABLE);
+
+    return true;
+}
+
+/* check the effective types of the plan: mem_type in [start, end), UC else */
+static bool verify_mem_type_plan(const mtrr_state_t *plan, uint32_t start,
+                                 uint32_t end, uint32_t mem_type)
+{
+    mtrr_model_t model;
+    uint64_t limit = (uint64_t)SINIT_MTRR_MASK + 1;
+
+    if ( !build_mtrr_model(plan, SINIT_MTRR_MASK, &model) )
+        return false;
+    if ( range_map_check(&model.map, (uint64_t)start << PAGE_SHIFT,
+                         (uint64_t)end << PAGE_SHIFT) != mem_type )
+        return false;
+    if ( start > 0 &&
+         range_map_check(&model.map, 0, (uint64_t)start << PAGE_SHIFT)
+             != MTRR_TYPE_UNCACHABLE )
+        return false;
+    if ( end < limit &&
+         range_map_check(&model.map, (uint64_t)end << PAGE_SHIFT,
+                         limit << PAGE_SHIFT) != MTRR_TYPE_UNCACHABLE )
+        return false;
+
+    return true;
+}
 
+#ifndef IS_INCLUDED
 /*
  * set the memory type for specified range (base to base+size)
  * to mem_type and everything else to UC
@@ -488,10 +635,40 @@ bool set_mem_type(const void *base, uint32_t size, uint32_t mem_type)
 {
     int num_pages;
     int ndx;
+    uint32_t start;
+    unsigned int max_mtrrs, nr_uc = 0;
     mtrr_def_type_t mtrr_def_type;
     mtrr_cap_t mtrr_cap;
     mtrr_physmask_t mtrr_physmask;
     mtrr_physbase_t mtrr_physbase;
+    mtrr_state_t plan;
+
+    /*
+     * work out the var MTRRs before touching any of them
+     */
+    mtrr_cap.raw = rdmsr(MSR_MTRRcap);
+    max_mtrrs = mtrr_cap.vcnt;
+    if ( max_mtrrs > MAX_VARIABLE_MTRRS )
+        max_mtrrs = MAX_VARIABLE_MTRRS;
+
+    num_pages = PAGE_UP(size) >> PAGE_SHIFT;
+    start = ((unsigned long)base >> PAGE_SHIFT) & SINIT_MTRR_MASK;
+
+    printk(TBOOT_DETA"setting MTRRs for acmod: base=%p, size=%x, num_pages=%d\n",
+           base, size, num_pages);
+    if ( !plan_mem_type(start, start + num_pages, mem_type, max_mtrrs,
+                        &plan) )
+        return false;
+    if ( !verify_mem_type_plan(&plan, start, start + num_pages, mem_type) ) {
+        printk(TBOOT_ERR"var MTRRs planned for range do not cover it\n");
+        print_mtrrs(&plan);
+        return false;
+    }
+    for ( unsigned int i = 0; i < plan.num_var_mtrrs; i++ )
+        if ( plan.mtrr_physbases[i].type == MTRR_TYPE_UNCACHABLE )
+            nr_uc++;
+    printk(TBOOT_DETA"using %u var MTRRs (%u UC)\n", plan.num_var_mtrrs,
+           nr_uc);
 
     /*
      * disable all fixed MTRRs
@@ -505,7 +682,6 @@ bool set_mem_type(const void *base, uint32_t size, uint32_t mem_type)
     /*
      * initially disable all variable MTRRs (we'll enable the ones we use)
      */
-    mtrr_cap.raw = rdmsr(MSR_MTRRcap);
     for ( ndx = 0; ndx < mtrr_cap.vcnt; ndx++ ) {
         mtrr_physmask.raw = rdmsr(MTRR_PHYS_MASK0_MSR + ndx*2);
         mtrr_physmask.v = 0;
@@ -515,86 +691,18 @@ bool set_mem_type(const void *base, uint32_t size, uint32_t mem_type)
     /*
      * map all AC module pages as mem_type
      */
-
-    num_pages = PAGE_UP(size) >> PAGE_SHIFT;
-    ndx = 0;
-
-    printk(TBOOT_DETA"setting MTRRs for acmod: base=%p, size=%x, num_pages=%d\n",
-           base, size, num_pages);
-    /*
-     * Each VAR MTRR base must be a multiple if that MTRR's Size
-    */
-    unsigned long base_v;
-    base_v = (unsigned long) base;
-    int i =0;   
-    // mtrr size in pages
-    int mtrr_s = 1;
-    while ((base_v & 0x01) == 0) {
-          i++;
-          base_v = base_v >>1 ;
-
-    }
-    for (int j=i-12; j>0; j--) mtrr_s =mtrr_s*2; //mtrr_s = mtrr_s << 1
-    printk(TBOOT_DETA"The maximum allowed MTRR range size=%d Pages \n", mtrr_s);
-	
-    while (num_pages >= mtrr_s){
-	
-	/* set the base of the current MTRR */
+    for ( ndx = 0; ndx < (int)plan.num_var_mtrrs; ndx++ ) {
         mtrr_physbase.raw = rdmsr(MTRR_PHYS_BASE0_MSR + ndx*2);
-        mtrr_physbase.base = ((unsigned long)base >> PAGE_SHIFT) &
-	                     SINIT_MTRR_MASK;
-        mtrr_physbase.type = mem_type;
+        mtrr_physbase.base = plan.mtrr_physbases[ndx].base;
+        mtrr_physbase.type = plan.mtrr_physbases[ndx].type;
         wrmsr(MTRR_PHYS_BASE0_MSR + ndx*2, mtrr_physbase.raw);
 
         mtrr_physmask.raw = rdmsr(MTRR_PHYS_MASK0_MSR + ndx*2);
-        mtrr_physmask.mask = ~(mtrr_s - 1) & SINIT_MTRR_MASK;
+        mtrr_physmask.mask = plan.mtrr_physmasks[ndx].mask;
         mtrr_physmask.v = 1;
         wrmsr(MTRR_PHYS_MASK0_MSR + ndx*2, mtrr_physmask.raw);
-		
-        base += (mtrr_s * PAGE_SIZE);
-        num_pages -= mtrr_s;
-        ndx++;
-        if ( ndx == mtrr_cap.vcnt ) {
-            printk(TBOOT_ERR"exceeded number of var MTRRs when mapping range\n");
-            return false;
-        }
     }
-    while ( num_pages > 0 ) {
-        uint32_t pages_in_range;
 
-        /* set the base of the current MTRR */
-        mtrr_physbase.raw = rdmsr(MTRR_PHYS_BASE0_MSR + ndx*2);
-        mtrr_physbase.base = ((unsigned long)base >> PAGE_SHIFT) &
-	                     SINIT_MTRR_MASK;
-        mtrr_physbase.type = mem_type;
-        wrmsr(MTRR_PHYS_BASE0_MSR + ndx*2, mtrr_physbase.raw);
-
-        /*
-         * calculate MTRR mask
-         * MTRRs can map pages in power of 2
-         * may need to use multiple MTRRS to map all of region
-         */
-        pages_in_range = 1 << (fls(num_pages) - 1);
-
-        mtrr_physmask.raw = rdmsr(MTRR_PHYS_MASK0_MSR + ndx*2);
-        mtrr_physmask.mask = ~(pages_in_range - 1) & SINIT_MTRR_MASK;
-        mtrr_physmask.v = 1;
-        wrmsr(MTRR_PHYS_MASK0_MSR + ndx*2, mtrr_physmask.raw);
-
-        /*prepare for the next loop depending on number of pages
-         * We figure out from the above how many pages could be used in this
-         * mtrr. Then we decrement the count, increment the base,
-         * increment the mtrr we are dealing with, and if num_pages is
-         * still not zero, we do it again.
-         */
-        base += (pages_in_range * PAGE_SIZE);
-        num_pages -= pages_in_range;
-        ndx++;
-        if ( ndx == mtrr_cap.vcnt ) {
-            printk(TBOOT_ERR"exceeded number of var MTRRs when mapping range\n");
-            return false;
-        }
-    }
     return true;
 }
 
@@ -607,6 +715,7 @@ void set_all_mtrrs(bool enable)
     mtrr_def_type.e = enable ? 1 : 0;
     wrmsr(MSR_MTRRdefType, mtrr_def_type.raw);
 }
+#endif    /* IS_INCLUDED */
 
 /*
  * Local variables:
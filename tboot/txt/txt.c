@@ -34,6 +34,7 @@
  *
  */
 
+#ifndef IS_INCLUDED     /* host tools include this file directly */
 #include <config.h>
 #include <stdbool.h>
 #include <types.h>
@@ -67,9 +68,11 @@
 #include <txt/verify.h>
 #include <txt/vmcs.h>
 #include <io.h>
+#endif    /* IS_INCLUDED */
 
+#ifndef IS_INCLUDED
 /* counter timeout for waiting for all APs to enter wait-for-sipi */
-#define AP_WFS_TIMEOUT     0x10000000
+#define AP_WFS_TIMEOUT_MS  5000
 
 __data struct acpi_rsdp g_rsdp;
 extern char _start[];             /* start of module */
@@ -90,6 +93,7 @@ extern void cpu_wakeup(uint32_t cpuid, uint32_t sipi_vec);
 extern void print_event(const tpm12_pcr_event_t *evt);
 extern void print_event_2(void *evt, uint16_t alg);
 extern uint32_t print_event_2_1(void *evt);
+extern unsigned int get_policy_nv_entry_count(void);
 
 extern void __enable_nmi(void);
 
@@ -117,6 +121,13 @@ static __text const mle_hdr_t g_mle_hdr = {
 /* count of APs in WAIT-FOR-SIPI */
 atomic_t ap_wfs_count;
 
+/*
+ * per-AP join time (TSC), each slot written only by its own AP, for the
+ * bring-up latency report; g_ap_wake_tsc is when the BSP released them
+ */
+static uint64_t g_ap_join_tsc[NR_CPUS];
+static uint64_t g_ap_wake_tsc;
+
 static void print_file_info(void)
 {
     printk(TBOOT_DETA"file addresses:\n");
@@ -142,6 +153,7 @@ static void print_mle_hdr(const mle_hdr_t *mle_hdr)
     printk(TBOOT_DETA"\t mle_end_off=%x\n", mle_hdr->mle_end_off);
     print_txt_caps("\t ", mle_hdr->capabilities);
 }
+#endif    /* IS_INCLUDED */
 
 /*
  * build_mle_pagetable()
@@ -150,28 +162,23 @@ static void print_mle_hdr(const mle_hdr_t *mle_hdr)
 /* page dir/table entry is phys addr + P + R/W + PWT */
 #define MAKE_PDTE(addr)  (((uint64_t)(unsigned long)(addr) & PAGE_MASK) | 0x01)
 
-/* we assume/know that our image is <2MB and thus fits w/in a single */
-/* PT (512*4KB = 2MB) and thus fixed to 1 pg dir ptr and 1 pgdir and */
-/* 1 ptable = 3 pages and just 1 loop loop for ptable MLE page table */
-/* can only contain 4k pages */
+/* SINIT walks the table from linear address 0 and only takes 4KB pages, */
+/* so the MLE is mapped by consecutive PTEs: 1 pg dir ptr table, 1 pg dir */
+/* per GB and 1 ptable per 2MB; the size is fixed by TBOOT_MLE_MAX_SIZE so */
+/* that the table (in .mlept) ends right at TBOOT_START */
+
+#define PTES_PER_PAGE    (PAGE_SIZE / sizeof(uint64_t))
 
-static __mlept uint8_t g_mle_pt[3 * PAGE_SIZE];  
-/* pgdir ptr + pgdir + ptab = 3 */
+static __mlept uint8_t g_mle_pt[TBOOT_MLE_PT_PAGES * PAGE_SIZE];
 
 static void *build_mle_pagetable(uint32_t mle_start, uint32_t mle_size)
 {
     void *ptab_base;
-    uint32_t ptab_size, mle_off;
-    void *pg_dir_ptr_tab, *pg_dir, *pg_tab;
-    uint64_t *pte;
+    uint32_t ptab_size, nr_pages, nr_ptabs, nr_pdirs;
+    uint64_t *pg_dir_ptr_tab, *pg_dir, *pg_tab;
 
     printk(TBOOT_DETA"MLE start=0x%x, end=0x%x, size=0x%x\n", 
            mle_start, mle_start+mle_size, mle_size);
-    if ( mle_size > 512*PAGE_SIZE ) {
-        printk(TBOOT_ERR"MLE size too big for single page table\n");
-        return NULL;
-    }
-
 
     /* should start on page boundary */
     if ( mle_start & ~PAGE_MASK ) {
@@ -179,39 +186,130 @@ static void *build_mle_pagetable(uint32_t mle_start, uint32_t mle_size)
         return NULL;
     }
 
+    nr_pages = PAGE_UP(mle_size) >> PAGE_SHIFT;
+    if ( nr_pages == 0 )
+        nr_pages = 1;
+    nr_ptabs = (nr_pages + PTES_PER_PAGE - 1) / PTES_PER_PAGE;
+    nr_pdirs = (nr_ptabs + PTES_PER_PAGE - 1) / PTES_PER_PAGE;
+    ptab_size = (1 + nr_pdirs + nr_ptabs) * PAGE_SIZE;
+    if ( nr_pdirs > 4 || ptab_size > sizeof(g_mle_pt) ) {
+        printk(TBOOT_ERR"MLE size too big for MLE page table (%u pages)\n",
+               (uint32_t)(sizeof(g_mle_pt) >> PAGE_SHIFT));
+        return NULL;
+    }
+
     /* place ptab_base below MLE */
-    ptab_size = sizeof(g_mle_pt);
     ptab_base = &g_mle_pt;
     tb_memset(ptab_base, 0, ptab_size);
     printk(TBOOT_DETA"ptab_size=%x, ptab_base=%p\n", ptab_size, ptab_base);
 
+    /* pg dir ptr table, then all pg dirs, then all ptables */
     pg_dir_ptr_tab = ptab_base;
-    pg_dir         = pg_dir_ptr_tab + PAGE_SIZE;
-    pg_tab         = pg_dir + PAGE_SIZE;
+    pg_dir         = ptab_base + PAGE_SIZE;
+    pg_tab         = ptab_base + (1 + nr_pdirs) * PAGE_SIZE;
 
-    /* only use first entry in page dir ptr table */
-    *(uint64_t *)pg_dir_ptr_tab = MAKE_PDTE(pg_dir);
+    for ( uint32_t i = 0; i < nr_pdirs; i++ )
+        pg_dir_ptr_tab[i] = MAKE_PDTE((void *)pg_dir + i * PAGE_SIZE);
 
-    /* only use first entry in page dir */
-    *(uint64_t *)pg_dir = MAKE_PDTE(pg_tab);
+    /* pg dirs and ptables are contiguous, so entries index straight in */
+    for ( uint32_t i = 0; i < nr_ptabs; i++ )
+        pg_dir[i] = MAKE_PDTE((void *)pg_tab + i * PAGE_SIZE);
 
-    pte = pg_tab;
-    mle_off = 0;
-    do {
-        *pte = MAKE_PDTE(mle_start + mle_off);
-
-        pte++;
-        mle_off += PAGE_SIZE;
-    } while ( mle_off < mle_size );
+    for ( uint32_t i = 0; i < nr_pages; i++ )
+        pg_tab[i] = MAKE_PDTE(mle_start + i * PAGE_SIZE);
 
     return ptab_base;
 }
 
-
+#ifndef IS_INCLUDED
 static __data event_log_container_t *g_elog = NULL;
 static __data heap_event_log_ptr_elt2_t *g_elog_2 = NULL;
 static __data heap_event_log_ptr_elt2_1_t *g_elog_2_1 = NULL;
 
+/*
+ * TPM 2.0 logs start at os_mle_data->event_log_buffer and may run past it
+ * into the rest of the OS to MLE heap region, which init_txt_heap() sizes
+ * with plan_event_log_size() (legacy logs are g_evtlog_bank_size each)
+ */
+static __data uint32_t g_evtlog_size = MAX_EVENT_LOG_SIZE;
+static __data uint32_t g_evtlog_bank_size = 4096;
+static int g_evtlog_type = EVTLOG_UNKNOWN;
+
+/* room for SINIT's own events at the start of each log */
+#define EVTLOG_SINIT_RESERVE     (4*1024)
+/* heap left after OS to SINIT data for SINIT to MLE data, which SINIT sizes */
+#define SINIT_MLE_DATA_RESERVE   (16*1024)
+
+static uint32_t get_evtlog_bank_count(void)
+{
+    struct tpm_if *tpm = get_tpm();
+
+    if ( tpm->extpol == TB_EXTPOL_AGILE )
+        return tpm->banks;
+    else if ( tpm->extpol == TB_EXTPOL_EMBEDDED )
+        return tpm->alg_count;
+    else
+        return 1;
+}
+
+/*
+ * work out how big the TPM 2.0 logs need to be: SINIT's events plus every
+ * measurement tboot may add (policy control and its DA copy, module 0 into
+ * PCR 18, each module and each NV policy entry), sized for SHA-512 so the
+ * bank mix doesn't matter
+ */
+static void plan_event_log_size(loader_ctx *lctx)
+{
+    uint32_t nr_events, banks = get_evtlog_bank_count();
+    int log_type = get_evtlog_type();
+
+    nr_events = 3 + get_module_count(lctx) + get_policy_nv_entry_count();
+    if ( nr_events > MAX_VL_HASHES )
+        nr_events = MAX_VL_HASHES;
+
+    g_evtlog_size = MAX_EVENT_LOG_SIZE;
+    g_evtlog_bank_size = 4096;
+    if ( log_type == EVTLOG_TPM2_TCG ) {
+        uint32_t record_size = 4*sizeof(uint32_t) +
+                               banks * (sizeof(uint16_t) + SHA512_LENGTH);
+        uint32_t size = PAGE_UP(EVTLOG_SINIT_RESERVE + nr_events*record_size);
+        if ( size > g_evtlog_size )
+            g_evtlog_size = size;
+    }
+    else if ( log_type == EVTLOG_TPM2_LEGACY ) {
+        uint32_t record_size = 3*sizeof(uint32_t) + SHA512_LENGTH;
+        uint32_t size = PAGE_UP(EVTLOG_SINIT_RESERVE + nr_events*record_size);
+        if ( size > g_evtlog_bank_size )
+            g_evtlog_bank_size = size;
+        if ( banks * g_evtlog_bank_size > g_evtlog_size )
+            g_evtlog_size = banks * g_evtlog_bank_size;
+    }
+}
+
+/* bytes needed to log count events with the digests in hl */
+static uint32_t evtlog_bytes_needed(const hash_list_t *hl, unsigned int count,
+                                    uint16_t bank_alg)
+{
+    uint32_t record_size = 0;
+
+    switch ( g_evtlog_type ) {
+    case EVTLOG_TPM12:
+        record_size = sizeof(tpm12_pcr_event_t);
+        break;
+    case EVTLOG_TPM2_LEGACY:
+        record_size = 3*sizeof(uint32_t) + get_hash_size(bank_alg);
+        break;
+    case EVTLOG_TPM2_TCG:
+        record_size = 4*sizeof(uint32_t);
+        for ( unsigned int i = 0; i < hl->count; i++ )
+            record_size += sizeof(uint16_t) + get_hash_size(hl->entries[i].alg);
+        break;
+    default:
+        break;
+    }
+    return count * record_size;
+}
+
 /* should be called after os_mle_data initialized */
 static void *init_event_log(void)
 {
@@ -237,7 +335,7 @@ static void init_evtlog_desc_1(heap_event_log_ptr_elt2_1_t *evt_log)
     os_mle_data_t *os_mle_data = get_os_mle_data_start(get_txt_heap());
    
     evt_log->phys_addr = (uint64_t)(unsigned long)(os_mle_data->event_log_buffer);
-    evt_log->allcoated_event_container_size = 2*PAGE_SIZE;
+    evt_log->allcoated_event_container_size = g_evtlog_size;
     evt_log->first_record_offset = 0;
     evt_log->next_record_offset = 0;
     printk(TBOOT_DETA"TCG compliant TPM 2.0 event log descriptor:\n");
@@ -257,8 +355,8 @@ static void init_evtlog_desc(heap_event_log_ptr_elt2_t *evt_log)
         for (i=0; i<evt_log->count; i++) {
             evt_log->event_log_descr[i].alg = tpm->algs_banks[i];
             evt_log->event_log_descr[i].phys_addr =
-                    (uint64_t)(unsigned long)(os_mle_data->event_log_buffer + i*4096);
-            evt_log->event_log_descr[i].size = 4096;
+                    (uint64_t)(unsigned long)(os_mle_data->event_log_buffer + i*g_evtlog_bank_size);
+            evt_log->event_log_descr[i].size = g_evtlog_bank_size;
             evt_log->event_log_descr[i].pcr_events_offset = 0;
             evt_log->event_log_descr[i].next_event_offset = 0;
         }
@@ -267,8 +365,8 @@ static void init_evtlog_desc(heap_event_log_ptr_elt2_t *evt_log)
         for (i=0; i<evt_log->count; i++) {
             evt_log->event_log_descr[i].alg = tpm->algs[i];
             evt_log->event_log_descr[i].phys_addr =
-                    (uint64_t)(unsigned long)(os_mle_data->event_log_buffer + i*4096);
-            evt_log->event_log_descr[i].size = 4096;
+                    (uint64_t)(unsigned long)(os_mle_data->event_log_buffer + i*g_evtlog_bank_size);
+            evt_log->event_log_descr[i].size = g_evtlog_bank_size;
             evt_log->event_log_descr[i].pcr_events_offset = 0;
             evt_log->event_log_descr[i].next_event_offset = 0;
         }
@@ -277,7 +375,7 @@ static void init_evtlog_desc(heap_event_log_ptr_elt2_t *evt_log)
         evt_log->event_log_descr[0].alg = tpm->cur_alg;
         evt_log->event_log_descr[0].phys_addr =
                     (uint64_t)(unsigned long)os_mle_data->event_log_buffer;
-        evt_log->event_log_descr[0].size = 4096;
+        evt_log->event_log_descr[0].size = g_evtlog_bank_size;
         evt_log->event_log_descr[0].pcr_events_offset = 0;
         evt_log->event_log_descr[0].next_event_offset = 0;
         break;
@@ -353,6 +451,16 @@ static void init_os_sinit_ext_data(heap_ext_data_element_t* elts)
     elt->size = sizeof(*elt);
 }
 
+/*
+ * appended events are echoed in one go by evtlog_print_appended(), and only
+ * in full at TBOOT_DETA level, rather than one printk per digest line as
+ * they are written
+ */
+static struct {
+    uint32_t count;                 /* events not yet echoed */
+    uint32_t start[MAX_ALG_NUM];    /* offset of the first one, per log */
+} g_evtlog_pending;
+
 bool evtlog_append_tpm12(uint8_t pcr, tb_hash_t *hash, uint32_t type)
 {
     if ( g_elog == NULL )
@@ -361,17 +469,20 @@ bool evtlog_append_tpm12(uint8_t pcr, tb_hash_t *hash, uint32_t type)
     tpm12_pcr_event_t *next = (tpm12_pcr_event_t *)
                               ((void*)g_elog + g_elog->next_event_offset);
     
-    if ( g_elog->next_event_offset + sizeof(*next) > g_elog->size )
+    if ( g_elog->next_event_offset + sizeof(*next) > g_elog->size ) {
+        printk(TBOOT_ERR"event log is full\n");
         return false;
+    }
 
     next->pcr_index = pcr;
     next->type = type;
     tb_memcpy(next->digest, hash, sizeof(next->digest));
     next->data_size = 0;
 
+    if ( g_evtlog_pending.count++ == 0 )
+        g_evtlog_pending.start[0] = g_elog->next_event_offset;
     g_elog->next_event_offset += sizeof(*next) + next->data_size;
 
-    print_event(next);
     return true;
 }
 
@@ -416,7 +527,7 @@ bool evtlog_append_tpm2_legacy(uint8_t pcr, uint16_t alg, tb_hash_t *hash, uint3
 {
     heap_event_log_descr_t *cur_desc = NULL;
     uint32_t hash_size; 
-    void *cur, *next;
+    void *next;
 
     for ( unsigned int i=0; i<g_elog_2->count; i++ ) {
         if ( g_elog_2->event_log_descr[i].alg == alg ) {
@@ -431,10 +542,13 @@ bool evtlog_append_tpm2_legacy(uint8_t pcr, uint16_t alg, tb_hash_t *hash, uint3
     if ( hash_size == 0 )
         return false;
 
-    if ( cur_desc->next_event_offset + 32 > cur_desc->size )
+    if ( cur_desc->next_event_offset + 3*sizeof(uint32_t) + hash_size >
+         cur_desc->size ) {
+        printk(TBOOT_ERR"event log for alg %u is full\n", alg);
         return false;
+    }
 
-    cur = next = (void *)(unsigned long)cur_desc->phys_addr +
+    next = (void *)(unsigned long)cur_desc->phys_addr +
                      cur_desc->next_event_offset;
     *((u32 *)next) = pcr;
     next += sizeof(u32);
@@ -445,38 +559,74 @@ bool evtlog_append_tpm2_legacy(uint8_t pcr, uint16_t alg, tb_hash_t *hash, uint3
     *((u32 *)next) = 0;
     cur_desc->next_event_offset += 3*sizeof(uint32_t) + hash_size; 
 
-    print_event_2(cur, alg);
     return true;
 }
 
-bool evtlog_append_tpm2_tcg(uint8_t pcr, uint32_t type, hash_list_t *hl)
+/*
+ * every record tboot appends to the TCG log carries the same banks, so the
+ * digest layout and record size are worked out once per bank set
+ */
+static struct {
+    uint32_t count;
+    uint16_t algs[MAX_ALG_NUM];
+    uint16_t sizes[MAX_ALG_NUM];
+    uint32_t record_size;
+} g_tcg_tmpl;
+
+static bool get_tcg_tmpl(const hash_list_t *hl)
 {
-    uint32_t i, event_size;
-    unsigned int hash_size;
-    tcg_pcr_event2 *event;
-    uint8_t *hash_entry;
     tcg_pcr_event2 dummy;
+    uint32_t i;
+
+    if ( hl->count > MAX_ALG_NUM )
+        return false;
+
+    if ( hl->count == g_tcg_tmpl.count && g_tcg_tmpl.record_size != 0 ) {
+        for ( i = 0; i < hl->count; i++ ) {
+            if ( hl->entries[i].alg != g_tcg_tmpl.algs[i] )
+                break;
+        }
+        if ( i == hl->count )
+            return true;
+    }
 
     /*
      * Dont't use sizeof(tcg_pcr_event2) since that has TPML_DIGESTV_VALUES_1.digests
      * set to 5. Compute the static size as pcr_index + event_type +
      * digest.count + event_size. Then add the space taken up by the hashes.
      */
-    event_size = sizeof(dummy.pcr_index) + sizeof(dummy.event_type) +
+    g_tcg_tmpl.record_size = 0;
+    uint32_t record_size = sizeof(dummy.pcr_index) + sizeof(dummy.event_type) +
         sizeof(dummy.digest.count) + sizeof(dummy.event_size);
 
     for (i = 0; i < hl->count; i++) {
-        hash_size = get_hash_size(hl->entries[i].alg);
+        unsigned int hash_size = get_hash_size(hl->entries[i].alg);
         if (hash_size == 0) {
             return false;
         }
-        event_size += sizeof(uint16_t); // hash_alg field
-        event_size += hash_size;
+        g_tcg_tmpl.algs[i] = hl->entries[i].alg;
+        g_tcg_tmpl.sizes[i] = hash_size;
+        record_size += sizeof(uint16_t); // hash_alg field
+        record_size += hash_size;
     }
+    g_tcg_tmpl.count = hl->count;
+    g_tcg_tmpl.record_size = record_size;
+
+    return true;
+}
+
+bool evtlog_append_tpm2_tcg(uint8_t pcr, uint32_t type, hash_list_t *hl)
+{
+    tcg_pcr_event2 *event;
+    uint8_t *hash_entry;
+
+    if ( !get_tcg_tmpl(hl) )
+        return false;
 
     // Check if event will fit in buffer.
-    if (event_size + g_elog_2_1->next_record_offset >
+    if (g_tcg_tmpl.record_size + g_elog_2_1->next_record_offset >
         g_elog_2_1->allcoated_event_container_size) {
+        printk(TBOOT_ERR"TCG event log is full\n");
         return false;
     }
 
@@ -484,33 +634,42 @@ bool evtlog_append_tpm2_tcg(uint8_t pcr, uint32_t type, hash_list_t *hl)
         g_elog_2_1->next_record_offset);
     event->pcr_index = pcr;
     event->event_type = type;
-    event->event_size = 0;  // No event data passed by tboot.
     event->digest.count = hl->count;
 
     hash_entry = (uint8_t *)&event->digest.digests[0];
-    for (i = 0; i < hl->count; i++) {
+    for (uint32_t i = 0; i < hl->count; i++) {
         // Populate individual TPMT_HA_1 structs.
-        *((uint16_t *)hash_entry) = hl->entries[i].alg; // TPMT_HA_1.hash_alg
+        *((uint16_t *)hash_entry) = g_tcg_tmpl.algs[i]; // TPMT_HA_1.hash_alg
         hash_entry += sizeof(uint16_t);
-        hash_size = get_hash_size(hl->entries[i].alg);  // already checked above
-        tb_memcpy(hash_entry, &(hl->entries[i].hash), hash_size);
-        hash_entry += hash_size;
+        tb_memcpy(hash_entry, &(hl->entries[i].hash), g_tcg_tmpl.sizes[i]);
+        hash_entry += g_tcg_tmpl.sizes[i];
     }
+    *((uint32_t *)hash_entry) = 0;  // event_size: no event data passed by tboot.
 
-    g_elog_2_1->next_record_offset += event_size;
-    print_event_2_1(event);
+    if ( g_evtlog_pending.count++ == 0 )
+        g_evtlog_pending.start[0] = g_elog_2_1->next_record_offset;
+    g_elog_2_1->next_record_offset += g_tcg_tmpl.record_size;
     return true;
 }
 
 bool evtlog_append(uint8_t pcr, hash_list_t *hl, uint32_t type)
 {
-    int log_type = get_evtlog_type();
-    switch (log_type) {
+    /* log type can't change after launch, and is costly to work out */
+    if ( g_evtlog_type == EVTLOG_UNKNOWN )
+        g_evtlog_type = get_evtlog_type();
+
+    switch (g_evtlog_type) {
     case EVTLOG_TPM12:
         if ( !evtlog_append_tpm12(pcr, &hl->entries[0].hash, type) )
             return false;
         break;
     case EVTLOG_TPM2_LEGACY:
+        if ( g_evtlog_pending.count++ == 0 ) {
+            for ( unsigned int i = 0; i < g_elog_2->count &&
+                                      i < MAX_ALG_NUM; i++ )
+                g_evtlog_pending.start[i] =
+                    g_elog_2->event_log_descr[i].next_event_offset;
+        }
         for (unsigned int i=0; i<hl->count; i++) {
             if ( !evtlog_append_tpm2_legacy(pcr, hl->entries[i].alg,
                 &hl->entries[i].hash, type))
@@ -528,43 +687,102 @@ bool evtlog_append(uint8_t pcr, hash_list_t *hl, uint32_t type)
     return true;
 }
 
-__data uint32_t g_using_da = 0;
-__data acm_hdr_t *g_sinit = 0;
-
-static void configure_vtd(void)
+/*
+ * check that count events with hl's digests fit, so that callers can find
+ * out before extending any PCR rather than leave the log short of them
+ */
+bool evtlog_has_room(const hash_list_t *hl, unsigned int count)
 {
-    uint32_t remap_length;
-    struct dmar_remapping *dmar_remap = vtd_get_dmar_remap(&remap_length);
+    if ( g_evtlog_type == EVTLOG_UNKNOWN )
+        g_evtlog_type = get_evtlog_type();
 
-    if (dmar_remap == NULL) {
-        printk("cannot get DMAR remapping structures, skipping configuration\n");
-        return;
-    } else {
-        printk("configuring DMAR remapping\n");
+    switch (g_evtlog_type) {
+    case EVTLOG_TPM12:
+        return g_elog == NULL ||
+               g_elog->next_event_offset + evtlog_bytes_needed(hl, count, 0)
+                   <= g_elog->size;
+    case EVTLOG_TPM2_LEGACY:
+        for ( unsigned int i = 0; i < g_elog_2->count; i++ ) {
+            heap_event_log_descr_t *log_descr = &g_elog_2->event_log_descr[i];
+            if ( log_descr->next_event_offset +
+                 evtlog_bytes_needed(hl, count, log_descr->alg) >
+                 log_descr->size )
+                return false;
+        }
+        return true;
+    case EVTLOG_TPM2_TCG:
+        return g_elog_2_1->next_record_offset +
+               evtlog_bytes_needed(hl, count, 0) <=
+               g_elog_2_1->allcoated_event_container_size;
+    default:
+        return false;
     }
+}
 
-    struct dmar_remapping *iter, *next;
-    struct dmar_remapping *end = ((void *)dmar_remap) + remap_length;
+/* echo the events appended since the last call */
+void evtlog_print_appended(void)
+{
+    void *curr, *end;
 
-    for (iter = dmar_remap; iter < end; iter = next) {
-        next = (void *)iter + iter->length;
-        if (iter->length == 0) {
-            /* Avoid looping forever on bad ACPI tables */
-            printk("    invalid 0-length structure\n");
-            break;
-        } else if (next > end) {
-            /* Avoid passing table end */
-            printk("    record passes table end\n");
-            break;
-        }
+    if ( g_evtlog_pending.count == 0 )
+        return;
 
-        if (iter->type == DMAR_REMAPPING_DRHD) {
-            if (!vtd_disable_dma_remap(iter)) {
-                printk("    vtd_disable_dma_remap failed!\n");
+    printk(TBOOT_INFO"appended %u events to event log\n",
+           g_evtlog_pending.count);
+
+    if ( g_log_level & TBOOT_LOG_LEVEL_DETA ) {
+        switch (g_evtlog_type) {
+        case EVTLOG_TPM12:
+            curr = (void *)g_elog + g_evtlog_pending.start[0];
+            end = (void *)g_elog + g_elog->next_event_offset;
+            while ( curr < end ) {
+                print_event(curr);
+                curr += sizeof(tpm12_pcr_event_t) +
+                        ((tpm12_pcr_event_t *)curr)->data_size;
+            }
+            break;
+        case EVTLOG_TPM2_LEGACY:
+            for ( unsigned int i = 0; i < g_elog_2->count &&
+                                      i < MAX_ALG_NUM; i++ ) {
+                heap_event_log_descr_t *log_descr = &g_elog_2->event_log_descr[i];
+                uint32_t hash_size = get_hash_size(log_descr->alg);
+                if ( hash_size == 0 )
+                    continue;
+                curr = (void *)(unsigned long)log_descr->phys_addr +
+                       g_evtlog_pending.start[i];
+                end = (void *)(unsigned long)log_descr->phys_addr +
+                      log_descr->next_event_offset;
+                while ( curr < end ) {
+                    print_event_2(curr, log_descr->alg);
+                    curr += 3*sizeof(uint32_t) + hash_size +
+                            *(uint32_t *)(curr + 2*sizeof(uint32_t) + hash_size);
+                }
             }
+            break;
+        case EVTLOG_TPM2_TCG:
+            curr = (void *)(unsigned long)g_elog_2_1->phys_addr +
+                   g_evtlog_pending.start[0];
+            end = (void *)(unsigned long)g_elog_2_1->phys_addr +
+                  g_elog_2_1->next_record_offset;
+            while ( curr < end )
+                curr += print_event_2_1(curr);
+            break;
+        default:
+            break;
         }
     }
 
+    g_evtlog_pending.count = 0;
+}
+
+__data uint32_t g_using_da = 0;
+__data acm_hdr_t *g_sinit = 0;
+
+static void configure_vtd(void)
+{
+    if (!vtd_disable_dma_remap_all()) {
+        printk("    vtd_disable_dma_remap failed!\n");
+    }
 }
 
 /*
@@ -581,7 +799,7 @@ static txt_heap_t *init_txt_heap(void *ptab_base, acm_hdr_t *sinit, loader_ctx *
     /*
      * BIOS data already setup by BIOS
      */
-    if ( !verify_txt_heap(txt_heap, true) )
+    if ( !verify_txt_heap(txt_heap, true, true) )
         return NULL;
 
     /*
@@ -589,8 +807,29 @@ static txt_heap_t *init_txt_heap(void *ptab_base, acm_hdr_t *sinit, loader_ctx *
      */
     os_mle_data_t *os_mle_data = get_os_mle_data_start(txt_heap);
     size = (uint64_t *)((uint32_t)os_mle_data - sizeof(uint64_t));
-    *size = sizeof(*os_mle_data) + sizeof(uint64_t);
-    tb_memset(os_mle_data, 0, sizeof(*os_mle_data));
+
+    /* grow the region past event_log_buffer if the logs need more room */
+    plan_event_log_size(lctx);
+    uint64_t heap_size = read_pub_config_reg(TXTCR_HEAP_SIZE);
+    uint64_t heap_used = get_bios_data_size(txt_heap) + sizeof(*os_mle_data) +
+                         sizeof(uint64_t) +
+                         calc_os_sinit_data_size(MAX_OS_SINIT_DATA_VER) +
+                         SINIT_MLE_DATA_RESERVE;
+    uint32_t extra = g_evtlog_size - MAX_EVENT_LOG_SIZE;
+    if ( heap_used + extra > heap_size ) {
+        extra = heap_used < heap_size ? (heap_size - heap_used) & PAGE_MASK : 0;
+        printk(TBOOT_WARN"TXT heap too small for planned event log (%u), "
+               "using %u bytes\n", g_evtlog_size, MAX_EVENT_LOG_SIZE + extra);
+        if ( g_evtlog_bank_size * get_evtlog_bank_count() >
+             MAX_EVENT_LOG_SIZE + extra )
+            g_evtlog_bank_size = ((MAX_EVENT_LOG_SIZE + extra) /
+                                  get_evtlog_bank_count()) & PAGE_MASK;
+        g_evtlog_size = MAX_EVENT_LOG_SIZE + extra;
+    }
+    printk(TBOOT_DETA"event log size: 0x%x\n", g_evtlog_size);
+
+    *size = sizeof(*os_mle_data) + extra + sizeof(uint64_t);
+    tb_memset(os_mle_data, 0, sizeof(*os_mle_data) + extra);
     os_mle_data->version = 3;
     os_mle_data->lctx_addr = lctx->addr;
     os_mle_data->saved_misc_enable_msr = rdmsr(MSR_IA32_MISC_ENABLE);
@@ -621,13 +860,12 @@ static txt_heap_t *init_txt_heap(void *ptab_base, acm_hdr_t *sinit, loader_ctx *
     os_sinit_data->mle_hdr_base = (uint64_t)(unsigned long)&g_mle_hdr -
         (uint64_t)(unsigned long)&_mle_start;
     /* VT-d PMRs */
-    uint64_t min_lo_ram, max_lo_ram, min_hi_ram, max_hi_ram;
-    
-    if ( !get_ram_ranges(&min_lo_ram, &max_lo_ram, &min_hi_ram, &max_hi_ram) )
+    vtd_pmr_plan_t pmr_plan;
+
+    if ( !plan_vtd_pmrs(&pmr_plan) )
         return NULL;
 
-    set_vtd_pmrs(os_sinit_data, min_lo_ram, max_lo_ram, min_hi_ram,
-                 max_hi_ram);
+    set_vtd_pmrs(os_sinit_data, &pmr_plan);
     /* LCP owner policy data */
     void *lcp_base = NULL;
     uint32_t lcp_size = 0;
@@ -730,6 +968,43 @@ static txt_heap_t *init_txt_heap(void *ptab_base, acm_hdr_t *sinit, loader_ctx *
     return txt_heap;
 }
 
+static void print_ap_join_latency(void)
+{
+    /* in units of 1024 ticks; only the sum needs 64 bits */
+    uint32_t min = ~0U, max = 0, avg, rem;
+    uint64_t sum = 0;
+    unsigned int joined = 0, slowest = 0;
+
+    for ( unsigned int i = 0; i < NR_CPUS; i++ ) {
+        uint32_t t;
+
+        if ( g_ap_join_tsc[i] == 0 )
+            continue;
+        t = (g_ap_join_tsc[i] > g_ap_wake_tsc) ?
+                (uint32_t)((g_ap_join_tsc[i] - g_ap_wake_tsc) >> 10) : 0;
+        printk(TBOOT_DETA"cpu %u joined after %u Kticks\n", i, t);
+        if ( t < min )
+            min = t;
+        if ( t > max ) {
+            max = t;
+            slowest = i;
+        }
+        sum += t;
+        joined++;
+    }
+    if ( joined == 0 )
+        return;
+
+    /* the average is at most max, so it fits the 32-bit quotient of divl
+       (as in vsprintf.c, "/" would need __udivdi3) */
+    __asm__ ( "divl %2"
+              : "=a" (avg), "=d" (rem)
+              : "r" (joined), "a" ((uint32_t)sum),
+                "d" ((uint32_t)(sum >> 32)) );
+    printk(TBOOT_INFO"AP join latency (Kticks): min %u, avg %u, "
+           "max %u (cpu %u), %u APs\n", min, avg, max, slowest, joined);
+}
+
 static void txt_wakeup_cpus(void)
 {
     uint16_t cs;
@@ -765,11 +1040,19 @@ static void txt_wakeup_cpus(void)
 
     mtx_init(&ap_lock);
 
+    /* APs read the MADT summary without ap_lock, so have it built (and
+       found) before any of them wakes up */
+    if ( get_madt_apic_base() == 0 ) {
+        printk(TBOOT_ERR"not able to get apci base from MADT\n");
+        apply_policy(TB_ERR_FATAL);
+    }
+
     txt_heap_t *txt_heap = get_txt_heap();
     sinit_mle_data_t *sinit_mle_data = get_sinit_mle_data_start(txt_heap);
     os_sinit_data_t *os_sinit_data = get_os_sinit_data_start(txt_heap);
 
     /* choose wakeup mechanism based on capabilities used */
+    g_ap_wake_tsc = rdtsc();
     if ( os_sinit_data->capabilities.rlp_wake_monitor ) {
         printk(TBOOT_INFO"joining RLPs to MLE with MONITOR wakeup\n");
         printk(TBOOT_DETA"rlp_wakeup_addr = 0x%x\n", sinit_mle_data->rlp_wakeup_addr);
@@ -794,23 +1077,23 @@ static void txt_wakeup_cpus(void)
 
     printk(TBOOT_INFO"waiting for all APs (%d) to enter wait-for-sipi...\n",
            ap_wakeup_count);
-    /* wait for all APs that woke up to have entered wait-for-sipi */
-    uint32_t timeout = AP_WFS_TIMEOUT;
-    do {
-        if ( timeout % 0x8000 == 0 )
-            printk(TBOOT_INFO".");
-        else
-            cpu_relax();
-        if ( timeout % 0x200000 == 0 )
-            printk(TBOOT_INFO"\n");
-        timeout--;
-    } while ( ( atomic_read(&ap_wfs_count) < ap_wakeup_count ) &&
-              timeout > 0 );
-    printk(TBOOT_INFO"\n");
-    if ( timeout == 0 )
+    /* wait for all APs that woke up to have entered wait-for-sipi; no
+       progress dots, they would only fight the APs for print_lock, so the
+       timeout is in TSC ticks rather than loop iterations */
+    uint64_t deadline = rdtsc() + AP_WFS_TIMEOUT_MS * get_tsc_ticks_per_ms();
+    bool timed_out = false;
+    while ( atomic_read(&ap_wfs_count) < ap_wakeup_count ) {
+        if ( rdtsc() >= deadline ) {
+            timed_out = true;
+            break;
+        }
+        cpu_relax();
+    }
+    if ( timed_out )
         printk(TBOOT_INFO"wait-for-sipi loop timed-out\n");
     else
         printk(TBOOT_INFO"all APs in wait-for-sipi\n");
+    print_ap_join_latency();
 }
 
 bool txt_is_launched(void)
@@ -1143,10 +1426,152 @@ void txt_post_launch(void)
     printk(TBOOT_INFO"opened TPM locality 1\n");
 }
 
+/*
+ * APs parked in ap_wait() can be lent out for independent jobs before the
+ * kernel takes them: the BSP publishes a batch and writes
+ * AP_WAKE_TRIGGER_JOBS to the monitored trigger, then it and every parked
+ * AP claim jobs until none are left
+ */
+static struct {
+    ap_job_fn_t  fn;
+    void       **data;
+    uint32_t     count;
+    uint32_t     gen;       /* batch number, so APs join each batch once */
+    atomic_t     next;      /* next job to claim */
+    atomic_t     done;
+    atomic_t     busy;      /* APs inside ap_join_jobs() */
+    atomic_t     workers;   /* job stacks handed out in this batch */
+    atomic_t     aborted;   /* a job overran its stack */
+} g_ap_jobs;
+
+/*
+ * the AP_STACK_SIZE stacks (see boot.S) APs wait on are too small for jobs
+ * like hashing (sha512_compress() alone needs ~1KB), so APs run jobs on
+ * one of these; each sits on a guard as large as itself, which the worker
+ * checks after every job, so an overrun stops the batch before the stack
+ * below it is reached
+ */
+#define AP_JOB_WORKERS          8
+#define AP_JOB_STACK_SIZE       0x1000
+#define AP_JOB_GUARD_SIZE       AP_JOB_STACK_SIZE
+#define AP_JOB_GUARD_BYTE       0xa5
+
+static struct {
+    uint8_t guard[AP_JOB_GUARD_SIZE];
+    uint8_t stack[AP_JOB_STACK_SIZE];
+} g_ap_job_stacks[AP_JOB_WORKERS] __attribute__ ((aligned (16)));
+
+/* call fn(arg) with its stack at stack_top */
+static void call_on_stack(void (*fn)(const uint8_t *), const uint8_t *arg,
+                          void *stack_top)
+{
+    const uint8_t **args = (const uint8_t **)stack_top - 1;
+
+    /* fn's argument is the first thing on the new stack */
+    *args = arg;
+    __asm__ __volatile__ ( "mov %%esp, %%esi\n\t"
+                           "mov %0, %%esp\n\t"
+                           "call *%1\n\t"
+                           "mov %%esi, %%esp"
+                           : : "r" (args), "r" (fn)
+                           : "eax", "ecx", "edx", "esi", "memory", "cc" );
+}
+
+static bool ap_job_guard_intact(const uint8_t *guard)
+{
+    for ( unsigned int i = 0; i < AP_JOB_GUARD_SIZE; i++ ) {
+        if ( guard[i] != AP_JOB_GUARD_BYTE )
+            return false;
+    }
+    return true;
+}
+
+/* claim and run jobs; guard is that of the job stack we are on, if any */
+static void run_ap_jobs(const uint8_t *guard)
+{
+    uint32_t i;
+
+    while ( atomic_read(&g_ap_jobs.aborted) == 0 &&
+            (i = atomic_fetchadd_int(&g_ap_jobs.next, 1)) < g_ap_jobs.count ) {
+        g_ap_jobs.fn(g_ap_jobs.data[i]);
+        if ( guard != NULL && !ap_job_guard_intact(guard) ) {
+            atomic_inc(&g_ap_jobs.aborted);
+            return;
+        }
+        atomic_inc(&g_ap_jobs.done);
+    }
+}
+
+static void ap_join_jobs(void)
+{
+    atomic_inc(&g_ap_jobs.busy);
+    /* the BSP may have closed the batch since we looked */
+    if ( _tboot_shared.ap_wake_trigger == AP_WAKE_TRIGGER_JOBS ) {
+        uint32_t w = atomic_fetchadd_int(&g_ap_jobs.workers, 1);
+
+        /* past AP_JOB_WORKERS, leave the jobs to the others */
+        if ( w < AP_JOB_WORKERS )
+            call_on_stack(run_ap_jobs, g_ap_job_stacks[w].guard,
+                          g_ap_job_stacks[w].stack + AP_JOB_STACK_SIZE);
+    }
+    atomic_dec(&g_ap_jobs.busy);
+}
+
+/*
+ * run fn(data[i]) for every i, on the BSP and any APs waiting in ap_wait();
+ * jobs must be reentrant, must not use the TPM or printk, and have to fit
+ * in AP_JOB_STACK_SIZE. returns when all are done
+ */
+void txt_run_on_aps(ap_job_fn_t fn, void **data, uint32_t count)
+{
+    uint32_t saved_trigger = 0;
+
+    if ( count == 0 )
+        return;
+
+    g_ap_jobs.fn = fn;
+    g_ap_jobs.data = data;
+    g_ap_jobs.count = count;
+    g_ap_jobs.next = 0;
+    g_ap_jobs.done = 0;
+    g_ap_jobs.workers = 0;
+    g_ap_jobs.aborted = 0;
+
+    if ( use_mwait() ) {
+        for ( unsigned int w = 0; w < AP_JOB_WORKERS; w++ )
+            tb_memset(g_ap_job_stacks[w].guard, AP_JOB_GUARD_BYTE,
+                      AP_JOB_GUARD_SIZE);
+        g_ap_jobs.gen++;
+        mb();
+        saved_trigger = _tboot_shared.ap_wake_trigger;
+        _tboot_shared.ap_wake_trigger = AP_WAKE_TRIGGER_JOBS;
+    }
+
+    run_ap_jobs(NULL);
+    while ( atomic_read(&g_ap_jobs.done) < count &&
+            atomic_read(&g_ap_jobs.aborted) == 0 )
+        cpu_relax();
+
+    if ( use_mwait() ) {
+        _tboot_shared.ap_wake_trigger = saved_trigger;
+        mb();
+
+        /* the overrun stack's AP may be lost, so don't wait for it */
+        if ( atomic_read(&g_ap_jobs.aborted) != 0 ) {
+            printk(TBOOT_ERR"AP job overran its stack\n");
+            apply_policy(TB_ERR_FATAL);
+        }
+
+        while ( atomic_read(&g_ap_jobs.busy) > 0 )
+            cpu_relax();
+    }
+}
+
 void ap_wait(unsigned int cpuid)
 {
+    /* no printk here: APs wait (and run jobs) while the BSP is logging;
+       txt_cpu_wakeup() has already reported a bad cpuid */
     if ( cpuid >= NR_CPUS ) {
-        printk(TBOOT_ERR"cpuid (%u) exceeds # supported CPUs\n", cpuid);
         apply_policy(TB_ERR_FATAL);
         mtx_leave(&ap_lock);
         return;
@@ -1162,12 +1587,18 @@ void ap_wait(unsigned int cpuid)
     atomic_inc((atomic_t *)&_tboot_shared.num_in_wfs);
     mtx_leave(&ap_lock);
 
-    printk(TBOOT_INFO"cpu %u mwait'ing\n", cpuid);
+    uint32_t jobs_gen = 0;
     while ( _tboot_shared.ap_wake_trigger != cpuid ) {
         cpu_monitor(&_tboot_shared.ap_wake_trigger, 0, 0);
         mb();
         if ( _tboot_shared.ap_wake_trigger == cpuid )
             break;
+        if ( _tboot_shared.ap_wake_trigger == AP_WAKE_TRIGGER_JOBS &&
+             g_ap_jobs.gen != jobs_gen ) {
+            jobs_gen = g_ap_jobs.gen;
+            ap_join_jobs();
+            continue;
+        }
         cpu_mwait(0, 0);
     }
 
@@ -1177,6 +1608,17 @@ void ap_wait(unsigned int cpuid)
     cpu_wakeup(cpuid, sipi_vec);
 }
 
+/*
+ * apply_policy() from an AP, which may shut the platform down: under
+ * ap_lock, so APs still get there one at a time
+ */
+static void ap_apply_policy(tb_error_t error)
+{
+    mtx_enter(&ap_lock);
+    apply_policy(error);
+    mtx_leave(&ap_lock);
+}
+
 void txt_cpu_wakeup(void)
 {
     txt_heap_t *txt_heap;
@@ -1190,15 +1632,13 @@ void txt_cpu_wakeup(void)
         return;
     }
 
-    mtx_enter(&ap_lock);
-
     printk(TBOOT_INFO"cpu %u waking up from TXT sleep\n", cpuid);
 
     /* restore LAPIC base address for AP */
     madt_apicbase = (uint64_t)get_madt_apic_base();
     if ( madt_apicbase == 0 ) {
         printk(TBOOT_ERR"not able to get apci base from MADT\n");
-        apply_policy(TB_ERR_FATAL);
+        ap_apply_policy(TB_ERR_FATAL);
         return;
     }
     msr_apicbase = rdmsr(MSR_APICBASE);
@@ -1217,13 +1657,17 @@ void txt_cpu_wakeup(void)
     wrmsr(MSR_IA32_MISC_ENABLE, os_mle_data->saved_misc_enable_msr);
 
     if ( !verify_stm(cpuid) )
-        apply_policy(TB_ERR_POST_LAUNCH_VERIFICATION);
+        ap_apply_policy(TB_ERR_POST_LAUNCH_VERIFICATION);
 
     /* enable SMIs and NMI */
     printk(TBOOT_DETA"enabling SMIs and NMI on cpu %u\n", cpuid);
     __getsec_smctrl();
     __enable_nmi();
 
+    /* everything above is per-CPU; only the wait-for-sipi setup below
+       touches shared state (the TSS descriptor used for the mini guest) */
+    g_ap_join_tsc[cpuid] = rdtsc();
+    mtx_enter(&ap_lock);
     atomic_inc(&ap_wfs_count);
     if ( use_mwait() )
         ap_wait(cpuid);
@@ -1233,7 +1677,7 @@ void txt_cpu_wakeup(void)
 
 tb_error_t txt_protect_mem_regions(void)
 {
-    uint64_t base, size;
+    range_t regions[3];
 
     /*
      * TXT has 2 regions of RAM that need to be reserved for use by only the
@@ -1242,43 +1686,36 @@ tb_error_t txt_protect_mem_regions(void)
      */
 
     /* TXT heap */
-    base = read_pub_config_reg(TXTCR_HEAP_BASE);
-    size = read_pub_config_reg(TXTCR_HEAP_SIZE);
-    printk(TBOOT_INFO"protecting TXT heap (%Lx - %Lx) in e820 table\n", base,
-           (base + size - 1));
-    if ( !e820_protect_region(base, size, E820_RESERVED) )
-        return TB_ERR_FATAL;
-    if (!efi_memmap_reserve(base, size)) {
-        return TB_ERR_FATAL;
-    }
+    regions[0].base = read_pub_config_reg(TXTCR_HEAP_BASE);
+    regions[0].end = regions[0].base + read_pub_config_reg(TXTCR_HEAP_SIZE);
+    printk(TBOOT_INFO"protecting TXT heap (%Lx - %Lx) in e820 table\n",
+           regions[0].base, (regions[0].end - 1));
 
     /* SINIT */
-    base = read_pub_config_reg(TXTCR_SINIT_BASE);
-    size = read_pub_config_reg(TXTCR_SINIT_SIZE);
-    printk(TBOOT_INFO"protecting SINIT (%Lx - %Lx) in e820 table\n", base,
-           (base + size - 1));
-    if ( !e820_protect_region(base, size, E820_RESERVED) )
-        return TB_ERR_FATAL;
-    if (!efi_memmap_reserve(base, size)) {
-        return TB_ERR_FATAL;
-    }
+    regions[1].base = read_pub_config_reg(TXTCR_SINIT_BASE);
+    regions[1].end = regions[1].base + read_pub_config_reg(TXTCR_SINIT_SIZE);
+    printk(TBOOT_INFO"protecting SINIT (%Lx - %Lx) in e820 table\n",
+           regions[1].base, (regions[1].end - 1));
 
     /* TXT private space */
-    base = TXT_PRIV_CONFIG_REGS_BASE;
-    size = TXT_CONFIG_REGS_SIZE;
+    regions[2].base = TXT_PRIV_CONFIG_REGS_BASE;
+    regions[2].end = regions[2].base + TXT_CONFIG_REGS_SIZE;
     printk(TBOOT_INFO
            "protecting TXT Private Space (%Lx - %Lx) in e820 table\n",
-           base, (base + size - 1));
-    if ( !e820_protect_region(base, size, E820_RESERVED) )
-        return TB_ERR_FATAL;
-    if (!efi_memmap_reserve(base, size)) {
-        return TB_ERR_FATAL;
+           regions[2].base, (regions[2].end - 1));
+
+    for ( unsigned int i = 0; i < ARRAY_SIZE(regions); i++ ) {
+        regions[i].type = E820_RESERVED;
+        regions[i].attr = 0;
     }
+    if ( !e820_protect_regions(regions, ARRAY_SIZE(regions)) )
+        return TB_ERR_FATAL;
 
     /* ensure that memory not marked as good RAM by the MDRs is RESERVED in
        the e820 table */
     txt_heap_t* txt_heap = get_txt_heap();
-    sinit_mle_data_t *sinit_mle_data = get_sinit_mle_data_start(txt_heap);
+    sinit_mle_data_t *sinit_mle_data =
+        get_txt_heap_region(txt_heap, TXT_HEAP_SINIT_MLE_DATA);
     uint32_t num_mdrs = sinit_mle_data->num_mdrs;
     sinit_mdr_t *mdrs_base = (sinit_mdr_t *)(((void *)sinit_mle_data
                                               - sizeof(uint64_t)) +
@@ -1428,6 +1865,7 @@ bool get_parameters(getsec_parameters_t *params)
 
     return true;
 }
+#endif    /* IS_INCLUDED */
 
 
 /*
@@ -33,6 +33,7 @@
  *
  */
 
+#ifndef IS_INCLUDED     /* host tools include this file directly */
 #include <config.h>
 #include <types.h>
 #include <stdbool.h>
@@ -52,6 +53,7 @@
 #include <mle.h>
 #include <hash.h>
 #include <integrity.h>
+#include <tpm.h>
 #include <cmdline.h>
 #include <vtd.h>
 #include <efi_memmap.h>
@@ -61,7 +63,9 @@
 #include <txt/config_regs.h>
 #include <txt/heap.h>
 #include <txt/verify.h>
+#endif    /* IS_INCLUDED */
 
+#ifndef IS_INCLUDED
 extern long s3_flag;
 
 /*
@@ -238,50 +242,85 @@ tb_error_t supports_txt(void)
 
     return TB_ERR_TXT_NOT_SUPPORTED;
 }
+#endif    /* IS_INCLUDED */
 
-static bool reserve_vtd_delta_mem(uint64_t min_lo_ram, uint64_t max_lo_ram,
-                                  uint64_t min_hi_ram, uint64_t max_hi_ram)
+/*
+ * base must be 2M-aligned and size must be multiple of 2M
+ * (so round bases and sizes down--rounding size up might conflict
+ *  with a BIOS-reserved region and cause problems; in practice, rounding
+ *  base down doesn't)
+ * we want to protect all of usable mem so that any kernel allocations
+ * before VT-d remapping is enabled are protected
+ */
+static void plan_vtd_pmrs_for_ram(vtd_pmr_plan_t *plan)
 {
-    uint64_t base, length;
-    (void)min_lo_ram; (void)min_hi_ram;/* portably suppress compiler warning */
+    plan->lo_base = plan->min_lo_ram & ~0x1fffffULL;
+    plan->lo_size = (plan->max_lo_ram - plan->lo_base) & ~0x1fffffULL;
+    plan->hi_base = plan->min_hi_ram & ~0x1fffffULL;
+    plan->hi_size = (plan->max_hi_ram - plan->hi_base) & ~0x1fffffULL;
+}
 
-    txt_heap_t* txt_heap = get_txt_heap();
-    os_sinit_data_t *os_sinit_data = get_os_sinit_data_start(txt_heap);
+/*
+ * plan_vtd_pmrs
+ *
+ * Work out the PMRs from a single pass over the (sorted) e820 map and
+ * report how much RAM they leave uncovered; that is the RAM between the
+ * rounded down PMR ends and max_lo/hi_ram, which post-launch reserves.
+ */
+bool plan_vtd_pmrs(vtd_pmr_plan_t *plan)
+{
+    uint64_t total, covered;
 
-    if ( max_lo_ram != (os_sinit_data->vtd_pmr_lo_base +
-                        os_sinit_data->vtd_pmr_lo_size) ) {
-        base = os_sinit_data->vtd_pmr_lo_base + os_sinit_data->vtd_pmr_lo_size;
-        length = max_lo_ram - base;
-        printk(TBOOT_INFO"reserving 0x%Lx - 0x%Lx, which was truncated for VT-d\n",
-               base, base + length);
-        if ( !e820_reserve_ram(base, length) )
-            return false;
-        if (!efi_memmap_reserve(base, length)) {
-           return false;
-        }
+    if ( !get_ram_ranges(&plan->min_lo_ram, &plan->max_lo_ram,
+                         &plan->min_hi_ram, &plan->max_hi_ram) )
+        return false;
+    plan_vtd_pmrs_for_ram(plan);
+
+    total = e820_get_ram_size(0, ~0ULL);
+    covered = e820_get_ram_size(plan->lo_base, plan->lo_base + plan->lo_size)
+              + e820_get_ram_size(plan->hi_base,
+                                  plan->hi_base + plan->hi_size);
+    printk(TBOOT_DETA"VT-d PMRs cover 0x%Lx of 0x%Lx bytes RAM (0x%Lx uncovered)\n",
+           covered, total, total - covered);
+
+    return true;
+}
+
+static bool reserve_vtd_delta_mem(const vtd_pmr_plan_t *plan)
+{
+    range_t delta[2];
+    unsigned int count = 0;
+
+    if ( plan->max_lo_ram != plan->lo_base + plan->lo_size ) {
+        delta[count].base = plan->lo_base + plan->lo_size;
+        delta[count++].end = plan->max_lo_ram;
+    }
+    if ( plan->max_hi_ram != plan->hi_base + plan->hi_size ) {
+        delta[count].base = plan->hi_base + plan->hi_size;
+        delta[count++].end = plan->max_hi_ram;
     }
-    if ( max_hi_ram != (os_sinit_data->vtd_pmr_hi_base +
-                        os_sinit_data->vtd_pmr_hi_size) ) {
-        base = os_sinit_data->vtd_pmr_hi_base + os_sinit_data->vtd_pmr_hi_size;
-        length = max_hi_ram - base;
+
+    for ( unsigned int i = 0; i < count; i++ ) {
+        delta[i].type = 0;
+        delta[i].attr = 0;
         printk(TBOOT_INFO"reserving 0x%Lx - 0x%Lx, which was truncated for VT-d\n",
-               base, base + length);
-        if ( !e820_reserve_ram(base, length) )
-            return false;
-        if (!efi_memmap_reserve(base, length)) {
-           return false;
-        }
+               delta[i].base, delta[i].end);
     }
+    if ( count == 0 )
+        return true;
 
-    return true;
+    if ( !e820_reserve_ram_batch(delta, count) )
+        return false;
+    return efi_memmap_reserve_batch(delta, count);
 }
 
+#ifndef IS_INCLUDED
 static bool verify_vtd_pmrs(txt_heap_t *txt_heap)
 {
-    os_sinit_data_t *os_sinit_data, tmp_os_sinit_data;
-    uint64_t min_lo_ram, max_lo_ram, min_hi_ram, max_hi_ram;
+    os_sinit_data_t *os_sinit_data;
+    vtd_pmr_plan_t plan;
 
-    os_sinit_data = get_os_sinit_data_start(txt_heap);
+    os_sinit_data = get_txt_heap_region(txt_heap, TXT_HEAP_OS_SINIT_DATA);
 
     /*
      * make sure the VT-d PMRs were actually set to cover what
@@ -291,40 +330,24 @@ static bool verify_vtd_pmrs(txt_heap_t *txt_heap)
     /* calculate what they should have been */
     /* no e820 table on S3 resume, so use saved (sealed) values */
     if ( s3_flag ) {
-        min_lo_ram = g_pre_k_s3_state.vtd_pmr_lo_base;
-        max_lo_ram = min_lo_ram + g_pre_k_s3_state.vtd_pmr_lo_size;
-        min_hi_ram = g_pre_k_s3_state.vtd_pmr_hi_base;
-        max_hi_ram = min_hi_ram + g_pre_k_s3_state.vtd_pmr_hi_size;
-    }
-    else {
-        if ( !get_ram_ranges(&min_lo_ram, &max_lo_ram,
-                             &min_hi_ram, &max_hi_ram) )
-            return false;
-
-        /* if vtd_pmr_lo/hi sizes rounded to 2MB granularity are less than the
-           max_lo/hi_ram values determined from the e820 table, then we must
-           reserve the differences in e820 table so that unprotected memory is
-           not used by the kernel */
-        if ( !reserve_vtd_delta_mem(min_lo_ram, max_lo_ram, min_hi_ram,
-                                    max_hi_ram) ) {
-            printk(TBOOT_ERR"failed to reserve VT-d PMR delta memory\n");
-            return false;
-        }
+        plan.min_lo_ram = g_pre_k_s3_state.vtd_pmr_lo_base;
+        plan.max_lo_ram = plan.min_lo_ram + g_pre_k_s3_state.vtd_pmr_lo_size;
+        plan.min_hi_ram = g_pre_k_s3_state.vtd_pmr_hi_base;
+        plan.max_hi_ram = plan.min_hi_ram + g_pre_k_s3_state.vtd_pmr_hi_size;
+        plan_vtd_pmrs_for_ram(&plan);
     }
+    else if ( !plan_vtd_pmrs(&plan) )
+        return false;
 
     /* compare to current values */
-    tb_memset(&tmp_os_sinit_data, 0, sizeof(tmp_os_sinit_data));
-    tmp_os_sinit_data.version = os_sinit_data->version;
-    set_vtd_pmrs(&tmp_os_sinit_data, min_lo_ram, max_lo_ram, min_hi_ram,
-                 max_hi_ram);
-    if ( (tmp_os_sinit_data.vtd_pmr_lo_base !=
-          os_sinit_data->vtd_pmr_lo_base) ||
-         (tmp_os_sinit_data.vtd_pmr_lo_size !=
-          os_sinit_data->vtd_pmr_lo_size) ||
-         (tmp_os_sinit_data.vtd_pmr_hi_base !=
-          os_sinit_data->vtd_pmr_hi_base) ||
-         (tmp_os_sinit_data.vtd_pmr_hi_size !=
-          os_sinit_data->vtd_pmr_hi_size) ) {
+    if ( (plan.lo_base != os_sinit_data->vtd_pmr_lo_base) ||
+         (plan.lo_size != os_sinit_data->vtd_pmr_lo_size) ||
+         (plan.hi_base != os_sinit_data->vtd_pmr_hi_base) ||
+         (plan.hi_size != os_sinit_data->vtd_pmr_hi_size) ) {
+        os_sinit_data_t tmp_os_sinit_data;
+
+        tb_memset(&tmp_os_sinit_data, 0, sizeof(tmp_os_sinit_data));
+        set_vtd_pmrs(&tmp_os_sinit_data, &plan);
         printk(TBOOT_ERR"OS to SINIT data VT-d PMR settings do not match:\n");
         print_os_sinit_data_vtdpmr(&tmp_os_sinit_data);
         print_os_sinit_data_vtdpmr(os_sinit_data);
@@ -332,6 +355,15 @@ static bool verify_vtd_pmrs(txt_heap_t *txt_heap)
     }
 
     if ( !s3_flag ) {
+        /* if vtd_pmr_lo/hi sizes rounded to 2MB granularity are less than the
+           max_lo/hi_ram values determined from the e820 table, then we must
+           reserve the differences in e820 table so that unprotected memory is
+           not used by the kernel */
+        if ( !reserve_vtd_delta_mem(&plan) ) {
+            printk(TBOOT_ERR"failed to reserve VT-d PMR delta memory\n");
+            return false;
+        }
+
         /* save the verified values so that they can be sealed for S3 */
         g_pre_k_s3_state.vtd_pmr_lo_base = os_sinit_data->vtd_pmr_lo_base;
         g_pre_k_s3_state.vtd_pmr_lo_size = os_sinit_data->vtd_pmr_lo_size;
@@ -342,31 +374,17 @@ static bool verify_vtd_pmrs(txt_heap_t *txt_heap)
     return true;
 }
 
-void set_vtd_pmrs(os_sinit_data_t *os_sinit_data,
-                  uint64_t min_lo_ram, uint64_t max_lo_ram,
-                  uint64_t min_hi_ram, uint64_t max_hi_ram)
+void set_vtd_pmrs(os_sinit_data_t *os_sinit_data, const vtd_pmr_plan_t *plan)
 {
-    printk(TBOOT_DETA"min_lo_ram: 0x%Lx, max_lo_ram: 0x%Lx\n", min_lo_ram, max_lo_ram);
-    printk(TBOOT_DETA"min_hi_ram: 0x%Lx, max_hi_ram: 0x%Lx\n", min_hi_ram, max_hi_ram);
-
-    /*
-     * base must be 2M-aligned and size must be multiple of 2M
-     * (so round bases and sizes down--rounding size up might conflict
-     *  with a BIOS-reserved region and cause problems; in practice, rounding
-     *  base down doesn't)
-     * we want to protect all of usable mem so that any kernel allocations
-     * before VT-d remapping is enabled are protected
-     */
-
-    min_lo_ram &= ~0x1fffffULL;
-    uint64_t lo_size = (max_lo_ram - min_lo_ram) & ~0x1fffffULL;
-    os_sinit_data->vtd_pmr_lo_base = min_lo_ram;
-    os_sinit_data->vtd_pmr_lo_size = lo_size;
-
-    min_hi_ram &= ~0x1fffffULL;
-    uint64_t hi_size = (max_hi_ram - min_hi_ram) & ~0x1fffffULL;
-    os_sinit_data->vtd_pmr_hi_base = min_hi_ram;
-    os_sinit_data->vtd_pmr_hi_size = hi_size;
+    printk(TBOOT_DETA"min_lo_ram: 0x%Lx, max_lo_ram: 0x%Lx\n",
+           plan->min_lo_ram, plan->max_lo_ram);
+    printk(TBOOT_DETA"min_hi_ram: 0x%Lx, max_hi_ram: 0x%Lx\n",
+           plan->min_hi_ram, plan->max_hi_ram);
+
+    os_sinit_data->vtd_pmr_lo_base = plan->lo_base;
+    os_sinit_data->vtd_pmr_lo_size = plan->lo_size;
+    os_sinit_data->vtd_pmr_hi_base = plan->hi_base;
+    os_sinit_data->vtd_pmr_hi_size = plan->hi_size;
 }
 
 tb_error_t txt_verify_platform(void)
@@ -391,18 +409,78 @@ tb_error_t txt_verify_platform(void)
         return TB_ERR_SMX_NOT_SUPPORTED;
     }
 
-    /* verify BIOS to OS data */
+    /* verify BIOS to OS data, unless the first launch already did and it
+       has not changed since (S3 resume) */
     txt_heap = get_txt_heap();
-    if ( !verify_bios_data(txt_heap) )
+    if ( !s3_platform_verified() && !verify_bios_data(txt_heap) )
         return TB_ERR_TXT_NOT_SUPPORTED;
 
     return TB_ERR_NONE;
 }
 
-static bool verify_saved_mtrrs(txt_heap_t *txt_heap)
+/*
+ * digest of the platform state that the first launch validated and that
+ * S3 resume can reuse: BIOS to OS data, the pre-SENTER MTRRs saved in OS
+ * to MLE data and the e820 and EFI memory maps handed to the kernel; it is
+ * sealed as part of the pre-kernel S3 state
+ */
+bool hash_platform_state(tb_hash_t *hash)
 {
+    txt_heap_t *txt_heap = get_txt_heap();
     os_mle_data_t *os_mle_data;
+    const memory_map_t *e820;
+    const uint8_t *efi_descr;
+    unsigned int nr_map;
+    uint32_t efi_size;
+    uint64_t size;
+    tb_hash_t part;
+
+    if ( hash == NULL )
+        return false;
+
+    size = get_bios_data_size(txt_heap);
+    if ( size <= sizeof(uint64_t) ||
+         size > read_pub_config_reg(TXTCR_HEAP_SIZE) )
+        return false;
+
+    tb_memset(hash, 0, sizeof(*hash));
+    if ( !hash_buffer((const unsigned char *)get_bios_data_start(txt_heap),
+                      size - sizeof(uint64_t), &part, TB_HALG_SHA256) ||
+         !extend_hash(hash, &part, TB_HALG_SHA256) )
+        return false;
+
     os_mle_data = get_os_mle_data_start(txt_heap);
+    if ( !hash_buffer((const unsigned char *)&os_mle_data->saved_mtrr_state,
+                      sizeof(os_mle_data->saved_mtrr_state), &part,
+                      TB_HALG_SHA256) ||
+         !extend_hash(hash, &part, TB_HALG_SHA256) )
+        return false;
+
+    /* the launch writes the maps out as the kernel will get them (nothing
+       changes them after sealing); S3 resume has only those copies */
+    if ( !s3_flag ) {
+        get_e820_copy();
+        efi_memmap_get_addr(NULL, NULL, NULL);
+    }
+    e820 = get_e820_copy_written(&nr_map);
+    if ( !hash_buffer((const unsigned char *)e820,
+                      nr_map * sizeof(memory_map_t), &part,
+                      TB_HALG_SHA256) ||
+         !extend_hash(hash, &part, TB_HALG_SHA256) )
+        return false;
+
+    efi_descr = efi_memmap_get_handed_off(&efi_size);
+    if ( !hash_buffer(efi_descr, efi_size, &part, TB_HALG_SHA256) ||
+         !extend_hash(hash, &part, TB_HALG_SHA256) )
+        return false;
+
+    return true;
+}
+
+static bool verify_saved_mtrrs(txt_heap_t *txt_heap)
+{
+    os_mle_data_t *os_mle_data;
+    os_mle_data = get_txt_heap_region(txt_heap, TXT_HEAP_OS_MLE_DATA);
 
     return validate_mtrrs(&(os_mle_data->saved_mtrr_state));
 }
@@ -412,15 +490,17 @@ tb_error_t txt_post_launch_verify_platform(void)
     txt_heap_t *txt_heap;
 
     /*
-     * verify some of the heap structures
+     * verify some of the heap structures (BIOS to OS data is skipped where
+     * txt_verify_platform() skipped it)
      */
     txt_heap = get_txt_heap();
 
-    if ( !verify_txt_heap(txt_heap, false) )
+    if ( !verify_txt_heap(txt_heap, false, !s3_platform_verified()) )
         return TB_ERR_POST_LAUNCH_VERIFICATION;
 
-    /* verify the saved MTRRs */
-    if ( !verify_saved_mtrrs(txt_heap) )
+    /* verify the saved MTRRs (S3 resume restores the same ones the first
+       launch verified, so only redo it if they have changed) */
+    if ( !s3_platform_verified() && !verify_saved_mtrrs(txt_heap) )
         return TB_ERR_POST_LAUNCH_VERIFICATION;
 
     /* verify that VT-d PMRs were really set as required */
@@ -429,56 +509,91 @@ tb_error_t txt_post_launch_verify_platform(void)
 
     return TB_ERR_NONE;
 }
+#endif    /* IS_INCLUDED */
+
+static bool mdr_less(const sinit_mdr_t *a, const sinit_mdr_t *b)
+{
+    return ( a->base < b->base ) ||
+           ( a->base == b->base && a->length < b->length );
+}
+
+static void mdr_sift_down(sinit_mdr_t *mdrs, uint32_t root, uint32_t num)
+{
+    sinit_mdr_t tmp;
+
+    for ( uint32_t child = 2 * root + 1; child < num;
+          root = child, child = 2 * root + 1 ) {
+        if ( child + 1 < num && mdr_less(&mdrs[child], &mdrs[child + 1]) )
+            child++;
+        if ( !mdr_less(&mdrs[root], &mdrs[child]) )
+            return;
+        tmp = mdrs[root];
+        mdrs[root] = mdrs[child];
+        mdrs[child] = tmp;
+    }
+}
+
+/* heapsort by (base, length): SINIT can report hundreds of MDRs */
+static void sort_mdrs(sinit_mdr_t *mdrs, uint32_t num)
+{
+    sinit_mdr_t tmp;
+
+    for ( uint32_t i = num / 2; i-- > 0; )
+        mdr_sift_down(mdrs, i, num);
+    for ( uint32_t end = num; end-- > 1; ) {
+        tmp = mdrs[0];
+        mdrs[0] = mdrs[end];
+        mdrs[end] = tmp;
+        mdr_sift_down(mdrs, 0, end);
+    }
+}
+
+#define MDR_GAP_BATCH    16
 
 bool verify_e820_map(sinit_mdr_t* mdrs_base, uint32_t num_mdrs)
 {
-    sinit_mdr_t* mdr_entry;
-    sinit_mdr_t tmp_entry;
-    uint64_t base, length;
-    uint32_t i, j, pos;
+    range_t gaps[MDR_GAP_BATCH];
+    unsigned int nr_gaps = 0;
+    uint64_t base, end;
 
     if ( (mdrs_base == NULL) || (num_mdrs == 0) )
         return false;
 
-    /* sort mdrs */
-    for( i = 0; i < num_mdrs; i++ ) {
-        tb_memcpy(&tmp_entry, &mdrs_base[i], sizeof(sinit_mdr_t));
-        pos = i;
-        for ( j = i + 1; j < num_mdrs; j++ ) {
-            if ( ( tmp_entry.base > mdrs_base[j].base )
-                 || (( tmp_entry.base == mdrs_base[j].base ) &&
-                     ( tmp_entry.length > mdrs_base[j].length )) ) {
-                tb_memcpy(&tmp_entry, &mdrs_base[j], sizeof(sinit_mdr_t));
-                pos = j;
-            }
-        }
-        if ( pos > i ) {
-            tb_memcpy(&mdrs_base[pos], &mdrs_base[i], sizeof(sinit_mdr_t));
-            tb_memcpy(&mdrs_base[i], &tmp_entry, sizeof(sinit_mdr_t));
-        }
-    }
+    sort_mdrs(mdrs_base, num_mdrs);
 
     /* verify e820 map against mdrs */
     /* find all ranges *not* in MDRs:
-       if any of it is in e820 as RAM then set that to RESERVED. */
-    i = 0;
+       if any of it is in e820 as RAM then set that to RESERVED.
+       the gaps come out sorted, so each batch is applied to the e820 map
+       in a single pass */
     base = 0;
-    while ( i < num_mdrs ) {
-        mdr_entry = &mdrs_base[i];
-        i++;
+    for ( uint32_t i = 0; i < num_mdrs; i++ ) {
+        const sinit_mdr_t *mdr_entry = &mdrs_base[i];
+
         if ( mdr_entry->mem_type > MDR_MEMTYPE_GOOD )
             continue;
-        length = mdr_entry->base - base;
-        if ( (length > 0) && (!e820_reserve_ram(base, length)) )
-            return false;
-        base = mdr_entry->base + mdr_entry->length;
+        if ( mdr_entry->base > base ) {
+            if ( nr_gaps == MDR_GAP_BATCH ) {
+                if ( !e820_reserve_ram_batch(gaps, nr_gaps) )
+                    return false;
+                nr_gaps = 0;
+            }
+            gaps[nr_gaps].base = base;
+            gaps[nr_gaps++].end = mdr_entry->base;
+        }
+        /* overlapping MDRs must not move the covered end backwards */
+        end = mdr_entry->base + mdr_entry->length;
+        if ( end > base )
+            base = end;
     }
+    if ( nr_gaps > 0 && !e820_reserve_ram_batch(gaps, nr_gaps) )
+        return false;
 
     /* deal with the last gap */
-    length = (uint64_t)-1 - base;
-    return e820_reserve_ram(base, length);
+    return e820_reserve_ram(base, (uint64_t)-1 - base);
 }
 
+#ifndef IS_INCLUDED
 static void print_mseg_hdr(mseg_hdr_t *mseg_hdr)
 {
     printk(TBOOT_DETA"MSEG header dump for 0x%x:\n", (uint32_t)mseg_hdr);
@@ -534,7 +649,8 @@ static bool are_mseg_hdrs_equal(void *mseg_base1, void *mseg_base2)
 static bool verify_mseg(uint64_t smm_mon_ctl)
 {
     txt_heap_t *txt_heap = get_txt_heap();
-    sinit_mle_data_t *sinit_mle_data = get_sinit_mle_data_start(txt_heap);
+    sinit_mle_data_t *sinit_mle_data =
+        get_txt_heap_region(txt_heap, TXT_HEAP_SINIT_MLE_DATA);
     void *mseg_base, *txt_mseg_base;
 
     /* opt-out */
@@ -588,20 +704,24 @@ bool verify_stm(unsigned int cpuid)
         printk(TBOOT_DETA"MSR for SMM monitor control on cpu %u is 0x%Lx\n",
                cpuid, smm_mon_ctl);
 
-        /* verify ILP's SMM MSR == RLP's SMM MSR */
-        printk(TBOOT_INFO"verifying ILP's MSR_IA32_SMM_MONITOR_CTL with cpu %u\n\t",
-               cpuid);
+        /*
+         * verify ILP's SMM MSR == RLP's SMM MSR; APs get here in parallel,
+         * so each result is a single printk() that can't be interleaved
+         */
         if ( smm_mon_ctl != ilp_smm_mon_ctl ) {
-            printk(TBOOT_ERR" : failed.\n");
+            printk(TBOOT_ERR"verifying ILP's MSR_IA32_SMM_MONITOR_CTL with "
+                   "cpu %u\n\t : failed.\n", cpuid);
             return false;
         }
-        printk(TBOOT_INFO" : succeeded.\n");
+        printk(TBOOT_INFO"verifying ILP's MSR_IA32_SMM_MONITOR_CTL with "
+               "cpu %u\n\t : succeeded.\n", cpuid);
 
         /* since the RLP's MSR is the same. No need to verify MSEG header */
     }
 
     return true;
 }
+#endif    /* IS_INCLUDED */
 
 /*
  * Local variables:
@@ -58,9 +58,10 @@
 static struct file_operations fops;
 static int dev_major;
 
-#define TBOOT_MEM_BASE      (TBOOT_START - 4*PAGE_SIZE)
+#define TBOOT_MEM_BASE      TBOOT_BASE_ADDR
                                /* 0x8c000 is Xen's start of trampoline code */
-#define TBOOT_MEM_SIZE      (0x4f000 + 3*PAGE_SIZE)
+#define TBOOT_MEM_SIZE      (0x4f000 + (TBOOT_MLE_PT_PAGES + 1)*PAGE_SIZE)
+                               /* + MLE page table and multiboot hdr pages */
 
 #define TXT_CONFIG_REGS_SIZE        (NR_TXT_CONFIG_PAGES*PAGE_SIZE)
 #define TPM_LOCALITY_SIZE           (NR_TPM_LOCALITY_PAGES*PAGE_SIZE)
@@ -0,0 +1,127 @@
+/*
+ * host-test.h: setup shared by the utils/test-* host tests, which #include
+ *              tboot sources directly
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Include this first.  It sets up libc's types and string routines in
+ * place of tboot's and sends printk() to stdout when TEST_VERBOSE is set
+ * (a test that wants to look at the log defines printk itself first).
+ *
+ *   HOST_TEST_OWN_TB_MEM   the test builds tboot's own tb_mem*() routines,
+ *                          so they are not aliased to libc's
+ *   HOST_TEST_TXT_HEAP     also include txt/heap.h, as txt-stat does
+ *   HOST_TEST_EFI_STUBS    stub out the EFI map reservations, for tests
+ *                          of the e820 side only
+ */
+
+#ifndef __HOST_TEST_H__
+#define __HOST_TEST_H__
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* use libc's types, tboot's types.h would clash with them */
+#define __TYPES_H__
+typedef uint64_t u64;
+typedef struct { void *addr; uint32_t type; } loader_ctx;
+
+#ifndef HOST_TEST_OWN_TB_MEM
+#define tb_memcpy  memcpy
+#define tb_memmove memmove
+#define tb_memset  memset
+#endif
+
+static bool verbose;
+
+#ifndef printk
+#define printk     test_printk
+
+static void __attribute__ ((unused)) test_printk(const char *fmt, ...)
+{
+    va_list ap;
+
+    if ( !verbose )
+        return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+#endif
+
+#define IS_INCLUDED    /* disable some codes in included files */
+#include "../include/config.h"
+#include "../tboot/include/compiler.h"
+
+#ifdef HOST_TEST_TXT_HEAP
+#include "../include/uuid.h"
+#include "../include/hash.h"
+/* heap.h only for its structures; nothing reads the TXT config regs */
+static inline uint64_t read_config_reg(uint32_t config_regs_base, uint32_t reg)
+{
+    (void)config_regs_base;
+    (void)reg;
+    return 0;
+}
+#include "../tboot/include/txt/config_regs.h"
+typedef uint8_t mtrr_state_t;
+typedef uint8_t txt_caps_t;
+#include "../tboot/include/txt/heap.h"
+#endif    /* HOST_TEST_TXT_HEAP */
+
+#ifdef HOST_TEST_EFI_STUBS
+#include "../tboot/include/rangemap.h"
+#include "../tboot/include/efi_memmap.h"
+/* the EFI map is test-memmap's business */
+bool efi_memmap_reserve(uint64_t base, uint64_t length)
+{
+    (void)base;
+    (void)length;
+    return true;
+}
+
+bool efi_memmap_reserve_batch(range_t *ranges, uint32_t count)
+{
+    (void)ranges;
+    (void)count;
+    return true;
+}
+#endif    /* HOST_TEST_EFI_STUBS */
+
+#endif    /* __HOST_TEST_H__ */
@@ -0,0 +1,419 @@
+/*
+ * test-mdrs: host replay test of the SINIT MDR / e820 reconciliation
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Replays SINIT MDR tables against e820 maps through verify_e820_map():
+ * the synthetic tables in mdrs/ (hand-written in the format tboot and
+ * Linux log them, not dumps from real machines) and random tables
+ * with the nested, duplicate, empty and non-GOOD MDRs SINIT may report.
+ * The MDRs must come back sorted and otherwise untouched, and the e820
+ * map must be exactly the original one with every RAM byte outside all
+ * GOOD MDRs turned into reserved memory, which a coverage count over all
+ * MDR and e820 edges computes independently of the merge walk.
+ *
+ *   test-mdrs [seed [dir]]
+ */
+
+#include <dirent.h>
+
+#define HOST_TEST_TXT_HEAP
+#define HOST_TEST_EFI_STUBS
+#include "host-test.h"
+#include "../tboot/include/multiboot.h"
+#include "../tboot/include/e820.h"
+#include "../tboot/include/txt/verify.h"
+#include "../tboot/common/rangemap.c"
+#include "../tboot/common/e820.c"
+#include "../tboot/txt/verify.c"
+
+#define CORPUS_DIR      "mdrs"
+#define RANDOM_TABLES   2000
+#define MAX_E820        128
+#define MAX_MDRS        1024
+#define MAX_EDGES       (2 * (MAX_E820 + MAX_MDRS))
+#define PAGE            0x1000ULL
+
+typedef struct {
+    unsigned n;
+    range_t  e820[MAX_E820];
+    unsigned nr_mdrs;
+    sinit_mdr_t mdrs[MAX_MDRS];
+} table_t;
+
+static const char *cur_name;
+static unsigned long nr_checks;
+
+static void fail(const char *what)
+{
+    printf("test-mdrs: %s: %s\n", cur_name, what);
+    printf("e820 map:\n");
+    for ( unsigned i = 0; i < g_e820_map.nr; i++ )
+        printf("  %016llx - %016llx (%u)\n",
+               (unsigned long long)g_e820_ranges[i].base,
+               (unsigned long long)g_e820_ranges[i].end,
+               g_e820_ranges[i].type);
+    exit(1);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_mdr(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(sinit_mdr_t));
+}
+
+static unsigned edge_index(const uint64_t *edges, unsigned n, uint64_t addr)
+{
+    const uint64_t *e = bsearch(&addr, edges, n, sizeof(*edges), cmp_u64);
+
+    return e - edges;
+}
+
+/*
+ * reference: cut the address space at every e820 and GOOD MDR edge, count
+ * how many GOOD MDRs cover each piece and retype uncovered RAM pieces;
+ * then merge like pieces into what the range map must hold
+ */
+static unsigned expected_map(const table_t *t, range_t *out)
+{
+    static uint64_t edges[MAX_EDGES];
+    static int delta[MAX_EDGES];
+    static uint32_t type[MAX_EDGES];
+    unsigned n = 0, m = 0, nr_out = 0;
+    int covered = 0;
+
+    for ( unsigned i = 0; i < t->n; i++ ) {
+        edges[n++] = t->e820[i].base;
+        edges[n++] = t->e820[i].end;
+    }
+    for ( unsigned i = 0; i < t->nr_mdrs; i++ ) {
+        if ( t->mdrs[i].mem_type != MDR_MEMTYPE_GOOD )
+            continue;
+        edges[n++] = t->mdrs[i].base;
+        edges[n++] = t->mdrs[i].base + t->mdrs[i].length;
+    }
+    qsort(edges, n, sizeof(edges[0]), cmp_u64);
+    for ( unsigned i = 0; i < n; i++ )
+        if ( m == 0 || edges[i] != edges[m - 1] )
+            edges[m++] = edges[i];
+
+    memset(delta, 0, m * sizeof(delta[0]));
+    for ( unsigned i = 0; i < m; i++ )
+        type[i] = E820_GAP;
+    for ( unsigned i = 0; i < t->nr_mdrs; i++ ) {
+        if ( t->mdrs[i].mem_type != MDR_MEMTYPE_GOOD )
+            continue;
+        delta[edge_index(edges, m, t->mdrs[i].base)]++;
+        delta[edge_index(edges, m, t->mdrs[i].base + t->mdrs[i].length)]--;
+    }
+    /* e820 entries are disjoint here; later ones win like the loader */
+    for ( unsigned i = 0; i < t->n; i++ )
+        for ( unsigned j = edge_index(edges, m, t->e820[i].base);
+              edges[j] < t->e820[i].end; j++ )
+            type[j] = t->e820[i].type;
+
+    for ( unsigned i = 0; i + 1 < m; i++ ) {
+        uint32_t ty = type[i];
+
+        covered += delta[i];
+        if ( ty == E820_GAP )
+            continue;
+        if ( ty == E820_RAM && covered == 0 )
+            ty = E820_RESERVED;
+        if ( nr_out > 0 && out[nr_out - 1].end == edges[i] &&
+             out[nr_out - 1].type == ty )
+            out[nr_out - 1].end = edges[i + 1];
+        else
+            out[nr_out++] = (range_t){ .base = edges[i], .end = edges[i + 1],
+                                       .type = ty };
+    }
+
+    return nr_out;
+}
+
+static void run(const table_t *t)
+{
+    static range_t want[MAX_EDGES];
+    static sinit_mdr_t mdrs[MAX_MDRS], sorted[MAX_MDRS];
+    unsigned nr_want = expected_map(t, want);
+
+    g_e820_map.nr = 0;
+    for ( unsigned i = 0; i < t->n; i++ )
+        if ( !protect_region(&g_e820_map, t->e820[i].base,
+                             t->e820[i].end - t->e820[i].base,
+                             t->e820[i].type) )
+            fail("e820 map load failed");
+
+    memcpy(mdrs, t->mdrs, t->nr_mdrs * sizeof(mdrs[0]));
+    if ( !verify_e820_map(mdrs, t->nr_mdrs) ) {
+        if ( nr_want <= MAX_E820_ENTRIES )
+            fail("verify_e820_map() failed");
+        return;
+    }
+    nr_checks++;
+
+    /* sorted by (base, length), and the same MDRs as before */
+    for ( unsigned i = 1; i < t->nr_mdrs; i++ )
+        if ( mdrs[i].base < mdrs[i - 1].base ||
+             (mdrs[i].base == mdrs[i - 1].base &&
+              mdrs[i].length < mdrs[i - 1].length) )
+            fail("MDRs are not sorted");
+    memcpy(sorted, t->mdrs, t->nr_mdrs * sizeof(sorted[0]));
+    qsort(sorted, t->nr_mdrs, sizeof(sorted[0]), cmp_mdr);
+    qsort(mdrs, t->nr_mdrs, sizeof(mdrs[0]), cmp_mdr);
+    if ( memcmp(mdrs, sorted, t->nr_mdrs * sizeof(mdrs[0])) != 0 )
+        fail("sorting changed the MDRs");
+
+    if ( !range_map_is_valid(&g_e820_map) )
+        fail("e820 map is not valid");
+    if ( g_e820_map.nr != nr_want )
+        fail("e820 map differs from the reference in size");
+    for ( unsigned i = 0; i < nr_want; i++ ) {
+        if ( g_e820_ranges[i].base != want[i].base ||
+             g_e820_ranges[i].end != want[i].end ||
+             g_e820_ranges[i].type != want[i].type ) {
+            static char msg[128];
+
+            snprintf(msg, sizeof(msg), "e820 map differs from the reference "
+                     "at 0x%llx-0x%llx (%u)",
+                     (unsigned long long)want[i].base,
+                     (unsigned long long)want[i].end, want[i].type);
+            fail(msg);
+        }
+    }
+}
+
+static uint32_t e820_type(const char *s)
+{
+    if ( strncmp(s, "usable", 6) == 0 )    return E820_RAM;
+    if ( strncmp(s, "ACPI data", 9) == 0 ) return E820_ACPI;
+    if ( strncmp(s, "ACPI NVS", 8) == 0 )  return E820_NVS;
+    if ( strncmp(s, "unusable", 8) == 0 )  return E820_UNUSABLE;
+    return E820_RESERVED;
+}
+
+static uint8_t mdr_type(const char *s)
+{
+    static const char *mem_types[] = {"GOOD", "SMRAM OVERLAY",
+                                      "SMRAM NON-OVERLAY",
+                                      "PCIE EXTENDED CONFIG", "PROTECTED"};
+
+    for ( unsigned i = 0; i < sizeof(mem_types) / sizeof(mem_types[0]); i++ )
+        if ( strcmp(s, mem_types[i]) == 0 )
+            return i;
+    return atoi(s);
+}
+
+/* same as the loader would end up with: overlaps go to the later entry */
+static void add_e820(table_t *t, uint64_t base, uint64_t end, uint32_t type)
+{
+    unsigned n = t->n, j = 0;
+
+    for ( unsigned i = 0; i < n && t->n < MAX_E820 - 1; i++ ) {
+        range_t *r = &t->e820[i];
+
+        if ( r->end <= base || r->base >= end )
+            continue;
+        if ( r->base < base )
+            t->e820[t->n++] = (range_t){ .base = r->base, .end = base,
+                                         .type = r->type };
+        if ( r->end > end )
+            t->e820[t->n++] = (range_t){ .base = end, .end = r->end,
+                                         .type = r->type };
+        r->end = r->base;
+    }
+    for ( unsigned i = 0; i < t->n; i++ )
+        if ( t->e820[i].base < t->e820[i].end )
+            t->e820[j++] = t->e820[i];
+    t->n = j;
+    if ( base < end && t->n < MAX_E820 )
+        t->e820[t->n++] = (range_t){ .base = base, .end = end, .type = type };
+}
+
+/*
+ * Tables hold the e820 map as Linux logs it ("BIOS-e820: [mem
+ * <first>-<last>] <type>") and the MDRs as tboot does at its DETA log level
+ * ("<base> - <end> (<type>)" lines after "sinit_mdrs:")
+ */
+static bool parse_table(const char *path, table_t *t)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+    bool in_mdrs = false;
+
+    if ( f == NULL )
+        return false;
+    t->n = t->nr_mdrs = 0;
+    while ( fgets(line, sizeof(line), f) != NULL ) {
+        unsigned long long first, last;
+        char name[32];
+        char *s;
+
+        if ( (s = strstr(line, "[mem ")) != NULL &&
+             sscanf(s, "[mem %llx-%llx]", &first, &last) == 2 ) {
+            add_e820(t, first, last + 1, e820_type(strchr(s, ']') + 2));
+            continue;
+        }
+        if ( strstr(line, "sinit_mdrs:") != NULL ) {
+            in_mdrs = true;
+            continue;
+        }
+        if ( !in_mdrs )
+            continue;
+        s = strncmp(line, "TBOOT:", 6) == 0 ? line + 6 : line;
+        if ( sscanf(s, " %llx - %llx (%31[^)])", &first, &last, name) != 3 ) {
+            in_mdrs = false;
+            continue;
+        }
+        if ( t->nr_mdrs < MAX_MDRS ) {
+            sinit_mdr_t *mdr = &t->mdrs[t->nr_mdrs++];
+
+            memset(mdr, 0, sizeof(*mdr));
+            mdr->base = first;
+            mdr->length = last - first;
+            mdr->mem_type = mdr_type(name);
+        }
+    }
+    fclose(f);
+    return t->n > 0 && t->nr_mdrs > 0;
+}
+
+/*
+ * an e820 map with RAM, holes and reserved islands, and MDRs that mostly
+ * follow the RAM but also nest, repeat, overlap, are empty, reach into
+ * reserved memory and holes, or carry other types
+ */
+static void random_table(table_t *t)
+{
+    static const uint32_t types[] = {
+        E820_RAM, E820_RAM, E820_RAM, E820_RESERVED, E820_ACPI, E820_NVS,
+        E820_UNUSABLE
+    };
+    unsigned n = 1 + rand() % 100, nr_mdrs = 1 + rand() % (rand() % 8 ? 64
+                                                                 : MAX_MDRS);
+    uint64_t a = 0;
+
+    t->n = t->nr_mdrs = 0;
+    for ( unsigned i = 0; i < n; i++ ) {
+        uint64_t size = (rand() % 4 ? rand() % 256 + 1 : rand() % 262144 + 1) *
+                        PAGE;
+
+        if ( rand() % 8 == 0 )
+            a += (rand() % 64) * PAGE;              /* hole */
+        add_e820(t, a, a + size, types[rand() % 7]);
+        a += size;
+    }
+
+    for ( unsigned i = 0; i < nr_mdrs; i++ ) {
+        sinit_mdr_t *mdr = &t->mdrs[t->nr_mdrs++];
+        const range_t *r = &t->e820[rand() % t->n];
+        uint64_t size = r->end - r->base;
+
+        memset(mdr, 0, sizeof(*mdr));
+        switch ( rand() % 8 ) {
+        case 0:     /* anywhere, possibly across several entries */
+            mdr->base = (uint64_t)rand() * PAGE % (a + PAGE);
+            mdr->length = (uint64_t)(rand() % 1024) * PAGE;
+            break;
+        case 1:     /* a repeat of or nested in an earlier one */
+            if ( i > 0 ) {
+                *mdr = t->mdrs[rand() % (t->nr_mdrs - 1)];
+                if ( rand() % 2 && mdr->length > 2 * PAGE ) {
+                    mdr->base += PAGE;
+                    mdr->length -= 2 * PAGE;
+                }
+                break;
+            }
+            /* fall through */
+        default:    /* part or all of one entry */
+            mdr->base = r->base + (rand() % 2 ? 0 : rand() % (size / PAGE)) *
+                        PAGE;
+            mdr->length = rand() % 2 ? r->end - mdr->base
+                                     : (rand() % ((r->end - mdr->base) / PAGE)
+                                        + 1) * PAGE;
+            break;
+        }
+        if ( rand() % 16 == 0 )
+            mdr->length = 0;
+        mdr->mem_type = rand() % 6 ? MDR_MEMTYPE_GOOD : rand() % 5;
+    }
+}
+
+static table_t table;
+
+int main(int argc, char *argv[])
+{
+    unsigned seed = argc > 1 ? atoi(argv[1]) : 1;
+    const char *dir_name = argc > 2 ? argv[2] : CORPUS_DIR;
+    unsigned nr_files = 0;
+    DIR *dir;
+    struct dirent *de;
+    char path[512];
+
+    verbose = getenv("TEST_VERBOSE") != NULL;
+    srand(seed);
+
+    dir = opendir(dir_name);
+    if ( dir == NULL ) {
+        perror("test-mdrs: " CORPUS_DIR);
+        return 1;
+    }
+    while ( (de = readdir(dir)) != NULL ) {
+        if ( de->d_name[0] == '.' )
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir_name, de->d_name);
+        if ( !parse_table(path, &table) )
+            continue;
+        cur_name = de->d_name;
+        run(&table);
+        nr_files++;
+    }
+    closedir(dir);
+
+    cur_name = "random table";
+    for ( int i = 0; i < RANDOM_TABLES; i++ ) {
+        random_table(&table);
+        run(&table);
+    }
+
+    printf("test-mdrs: %u synthetic and %u random tables, %lu checks: PASS\n",
+           nr_files, RANDOM_TABLES, nr_checks);
+    return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * test-memcpy: host correctness fuzzer and bandwidth benchmark for
+ *              tb_memcpy()/tb_memset()
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <time.h>
+#include <cpuid.h>
+
+/* tb_memcpy()/tb_memset() are what is tested here */
+#define HOST_TEST_OWN_TB_MEM
+#include "host-test.h"
+
+/* host cpuid instead of tboot's 32-bit one */
+#define __PROCESSOR_H__
+static inline void do_cpuid(unsigned int ax, uint32_t *p)
+{
+    __cpuid(ax, p[0], p[1], p[2], p[3]);
+}
+
+static inline void do_cpuid1(unsigned int ax, unsigned int cx, uint32_t *p)
+{
+    __cpuid_count(ax, cx, p[0], p[1], p[2], p[3]);
+}
+
+static inline uint32_t cpuid_eax(unsigned int op)
+{
+    uint32_t regs[4];
+
+    do_cpuid(op, regs);
+    return regs[0];
+}
+
+#include "../tboot/include/string.h"
+#include "../tboot/common/memcpy.c"
+
+#define BUF_SIZE    (4 * TB_MEM_NT_THRESHOLD)
+#define ITERATIONS  4000
+
+/* every dispatch path, forced regardless of what this CPU has */
+static const uint32_t feature_sets[] = {
+    0, TB_MEM_ERMS, TB_MEM_FSRM, TB_MEM_SSE2, TB_MEM_SSE2 | TB_MEM_ERMS,
+};
+#define NR_FEATURE_SETS  (sizeof(feature_sets) / sizeof(feature_sets[0]))
+
+static void force_features(uint32_t features)
+{
+    mem_features = features;
+    mem_features_probed = true;
+}
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+    for ( size_t i = 0; i < len; i++ )
+        buf[i] = (uint8_t)rand();
+}
+
+/* mostly short lengths, some around and above the non-temporal threshold */
+static size_t random_len(size_t max)
+{
+    size_t len;
+
+    switch ( rand() % 4 ) {
+    case 0:
+        len = rand() % 64;
+        break;
+    case 1:
+        len = rand() % 4096;
+        break;
+    case 2:
+        len = TB_MEM_NT_THRESHOLD - 64 + rand() % 128;
+        break;
+    default:
+        len = rand() % max;
+        break;
+    }
+    return len > max ? max : len;
+}
+
+/*
+ * buf and ref are kept identical between operations, so only the bytes an
+ * operation may have touched (plus guard bytes either side) need comparing;
+ * both are refilled, and compared whole, every REFILL_EVERY operations
+ */
+#define REFILL_EVERY    256
+#define GUARD           64
+
+static bool same(const uint8_t *buf, const uint8_t *ref, size_t lo, size_t hi)
+{
+    lo = lo > GUARD ? lo - GUARD : 0;
+    hi = hi + GUARD < BUF_SIZE ? hi + GUARD : BUF_SIZE;
+    return memcmp(buf + lo, ref + lo, hi - lo) == 0;
+}
+
+static void refill(uint8_t *buf, uint8_t *ref, int i)
+{
+    if ( i % REFILL_EVERY == 0 ) {
+        fill_random(buf, BUF_SIZE);
+        memcpy(ref, buf, BUF_SIZE);
+    }
+}
+
+static bool fuzz_memcpy(uint8_t *buf, uint8_t *ref, uint32_t features)
+{
+    force_features(features);
+    for ( int i = 0; i < ITERATIONS; i++ ) {
+        size_t len = random_len(BUF_SIZE / 2);
+        size_t src = rand() % (BUF_SIZE - len + 1);
+        size_t dst;
+
+        /* a third of the copies overlap their source (either direction) */
+        if ( rand() % 3 == 0 ) {
+            size_t lo = src > len ? src - len : 0;
+            size_t hi = src + len < BUF_SIZE - len ? src + len : BUF_SIZE - len;
+            dst = lo + rand() % (hi - lo + 1);
+        }
+        else
+            dst = rand() % (BUF_SIZE - len + 1);
+
+        refill(buf, ref, i);
+        memmove(ref + dst, ref + src, len);
+        if ( tb_memcpy(buf + dst, buf + src, len) != buf + dst ||
+             !same(buf, ref, dst, dst + len) ) {
+            printf("tb_memcpy mismatch: features=0x%x dst=0x%zx src=0x%zx "
+                   "len=0x%zx\n", features, dst, src, len);
+            return false;
+        }
+    }
+    return memcmp(buf, ref, BUF_SIZE) == 0;
+}
+
+static bool fuzz_memset(uint8_t *buf, uint8_t *ref, uint32_t features)
+{
+    force_features(features);
+    for ( int i = 0; i < ITERATIONS; i++ ) {
+        size_t len = random_len(BUF_SIZE);
+        size_t off = rand() % (BUF_SIZE - len + 1);
+        int c = rand();
+
+        refill(buf, ref, i);
+        memset(ref + off, c, len);
+        if ( tb_memset(buf + off, c, len) != buf + off ||
+             !same(buf, ref, off, off + len) ) {
+            printf("tb_memset mismatch: features=0x%x off=0x%zx len=0x%zx "
+                   "c=0x%x\n", features, off, len, c);
+            return false;
+        }
+    }
+    return memcmp(buf, ref, BUF_SIZE) == 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchmark(uint8_t *buf, uint8_t *ref)
+{
+    static const size_t sizes[] = { 256, 4096, 64 * 1024, BUF_SIZE };
+
+    printf("%-10s %10s %14s %14s\n", "features", "size", "memcpy MB/s",
+           "memset MB/s");
+    for ( unsigned int f = 0; f < NR_FEATURE_SETS; f++ ) {
+        force_features(feature_sets[f]);
+        for ( unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++ ) {
+            size_t len = sizes[s];
+            unsigned int reps = (256 * 1024 * 1024) / len;
+            double t0 = now();
+            for ( unsigned int r = 0; r < reps; r++ )
+                tb_memcpy(buf, ref, len);
+            double t1 = now();
+            for ( unsigned int r = 0; r < reps; r++ )
+                tb_memset(buf, r, len);
+            double t2 = now();
+            printf("0x%-8x %10zu %14.0f %14.0f\n", feature_sets[f], len,
+                   (double)len * reps / (t1 - t0) / 1e6,
+                   (double)len * reps / (t2 - t1) / 1e6);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *buf = malloc(BUF_SIZE), *ref = malloc(BUF_SIZE);
+    bool ok = true;
+
+    if ( buf == NULL || ref == NULL )
+        return 1;
+
+    if ( argc > 1 && strcmp(argv[1], "-b") == 0 ) {
+        fill_random(ref, BUF_SIZE);
+        benchmark(buf, ref);
+        return 0;
+    }
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    for ( unsigned int f = 0; f < NR_FEATURE_SETS; f++ ) {
+        ok = ok && fuzz_memcpy(buf, ref, feature_sets[f]);
+        ok = ok && fuzz_memset(buf, ref, feature_sets[f]);
+    }
+
+    free(buf);
+    free(ref);
+    printf("test-memcpy: %s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
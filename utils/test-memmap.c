@@ -0,0 +1,730 @@
+/*
+ * test-memmap: host replay test of the e820 and EFI memory map copies
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include "host-test.h"
+#include "../tboot/include/multiboot.h"
+#include "../tboot/include/rangemap.h"
+#include "../tboot/include/e820.h"
+#include "../tboot/include/efi_memmap.h"
+#include "../tboot/common/rangemap.c"
+#include "../tboot/common/e820.c"
+#include "../tboot/common/efi_memmap.c"
+
+#define CORPUS_DIR      "memmaps"
+#define RANDOM_MAPS     2000
+#define RUNS_PER_MAP    40
+#define OPS_PER_RUN     60
+#define PAGE            0x1000ULL
+
+/* firmware's copy of the EFI map, below 4GB like the real one */
+#define FW_MMAP_ADDR    0x100000UL
+#define FW_MMAP_SIZE    0x10000UL
+
+#define MAX_DESCR       256
+#define MAX_PIECES      4096
+
+/*
+ * Reference model: an unsorted list of disjoint pieces that is only ever
+ * split, never merged, so it shares no code or ideas with rangemap.c
+ */
+typedef struct {
+    uint64_t base, end;
+    uint32_t type;
+    uint64_t attr;
+    uint32_t src;       /* EFI: firmware descriptor the piece came from */
+} piece_t;
+
+typedef struct {
+    piece_t  p[MAX_PIECES];
+    unsigned n;
+} model_t;
+
+static model_t e820_model, efi_model;
+
+/* firmware map as loaded; descriptors carry their index as a marker */
+typedef struct {
+    unsigned n;
+    uint32_t descr_size;
+    uint8_t  raw[MAX_DESCR][64];
+    uint64_t bytes[MAX_DESCR];  /* e820 entries are not page granular */
+    bool     is_efi;
+} fw_map_t;
+
+static const char *cur_name;
+static unsigned long nr_checks;
+
+static void fail(const char *what)
+{
+    printf("test-memmap: %s: %s\n", cur_name, what);
+    printf("e820 map:\n");
+    for ( unsigned i = 0; i < g_e820_map.nr; i++ )
+        printf("  %016llx - %016llx (%u)\n",
+               (unsigned long long)g_e820_ranges[i].base,
+               (unsigned long long)g_e820_ranges[i].end,
+               g_e820_ranges[i].type);
+    printf("EFI map:\n");
+    for ( unsigned i = 0; i < efi_range_map.nr; i++ )
+        printf("  %016llx - %016llx (%u, 0x%llx, tag %u)\n",
+               (unsigned long long)efi_ranges[i].base,
+               (unsigned long long)efi_ranges[i].end,
+               efi_ranges[i].type, (unsigned long long)efi_ranges[i].attr,
+               efi_ranges[i].tag);
+    exit(1);
+}
+
+/* drop [base, end) from the model, keeping what sticks out */
+static void model_cut(model_t *m, uint64_t base, uint64_t end)
+{
+    unsigned n = m->n, j = 0;
+
+    for ( unsigned i = 0; i < n; i++ ) {
+        piece_t *p = &m->p[i];
+
+        if ( p->end <= base || p->base >= end )
+            continue;
+        if ( p->base < base ) {
+            m->p[m->n] = *p;
+            m->p[m->n++].end = base;
+        }
+        if ( p->end > end ) {
+            m->p[m->n] = *p;
+            m->p[m->n++].base = end;
+        }
+        p->end = p->base;
+    }
+    for ( unsigned i = 0; i < m->n; i++ )
+        if ( m->p[i].base < m->p[i].end )
+            m->p[j++] = m->p[i];
+    m->n = j;
+}
+
+static void model_set(model_t *m, uint64_t base, uint64_t end, uint32_t type,
+                      uint64_t attr, uint32_t src)
+{
+    if ( base >= end )
+        return;
+    model_cut(m, base, end);
+    m->p[m->n++] = (piece_t){ base, end, type, attr, src };
+}
+
+static void model_retype(model_t *m, uint64_t base, uint64_t end,
+                         bool (*match)(uint32_t), uint32_t new_type)
+{
+    unsigned n = m->n;
+
+    if ( base >= end )
+        return;
+    for ( unsigned i = 0; i < n; i++ ) {
+        piece_t *p = &m->p[i];
+
+        if ( p->end <= base || p->base >= end || !match(p->type) )
+            continue;
+        if ( p->base < base ) {
+            m->p[m->n] = *p;
+            m->p[m->n++].end = base;
+            p->base = base;
+        }
+        if ( p->end > end ) {
+            m->p[m->n] = *p;
+            m->p[m->n++].base = end;
+            p->end = end;
+        }
+        p->type = new_type;
+    }
+}
+
+static const piece_t *model_at(const model_t *m, uint64_t addr)
+{
+    for ( unsigned i = 0; i < m->n; i++ )
+        if ( m->p[i].base <= addr && addr < m->p[i].end )
+            return &m->p[i];
+    return NULL;
+}
+
+/* the map holds exactly what the model does, and is a valid range map */
+static void compare(const range_map_t *map, const model_t *m, bool with_attr,
+                    const char *name)
+{
+    static char msg[128];
+    uint64_t map_bytes = 0, model_bytes = 0;
+
+    nr_checks++;
+    if ( !range_map_is_valid(map) ) {
+        snprintf(msg, sizeof(msg), "%s map is not valid", name);
+        fail(msg);
+    }
+    for ( unsigned i = 0; i < map->nr; i++ )
+        map_bytes += map->ranges[i].end - map->ranges[i].base;
+    for ( unsigned i = 0; i < m->n; i++ ) {
+        const piece_t *p = &m->p[i];
+        unsigned j = range_map_find(map, p->base);
+        const range_t *r = &map->ranges[j];
+
+        model_bytes += p->end - p->base;
+        if ( j == map->nr || r->base > p->base || r->end < p->end ||
+             r->type != p->type || (with_attr && r->attr != p->attr) ) {
+            snprintf(msg, sizeof(msg), "%s map differs from model at "
+                     "0x%llx-0x%llx (%u)", name,
+                     (unsigned long long)p->base, (unsigned long long)p->end,
+                     p->type);
+            fail(msg);
+        }
+    }
+    /* every piece is covered and both are disjoint, so sizes must match */
+    if ( map_bytes != model_bytes ) {
+        snprintf(msg, sizeof(msg), "%s map covers more than the model", name);
+        fail(msg);
+    }
+}
+
+static bool model_is_ram(uint32_t type) { return type == E820_RAM; }
+static bool model_is_reservable(uint32_t type)
+{
+    return type >= EFI_LOADER_CODE && type <= EFI_CONVENTIONAL_MEMORY;
+}
+static bool model_is_free(uint32_t type)
+{
+    return type == EFI_LOADER_CODE || type == EFI_LOADER_DATA ||
+           type == EFI_CONVENTIONAL_MEMORY;
+}
+
+static uint32_t efi_to_e820(uint32_t type)
+{
+    switch ( type ) {
+    case EFI_LOADER_CODE: case EFI_LOADER_DATA:
+    case EFI_BOOT_SERVICES_CODE: case EFI_BOOT_SERVICES_DATA:
+    case EFI_CONVENTIONAL_MEMORY:
+        return E820_RAM;
+    case EFI_ACPI_RECLAIM_MEMORY: return E820_ACPI;
+    case EFI_ACPI_MEMORY_NVS:     return E820_NVS;
+    case EFI_UNUSABLE_MEMORY:     return E820_UNUSABLE;
+    default:                      return E820_RESERVED;
+    }
+}
+
+static efi_mem_descr_t *fw_descr(fw_map_t *fw, unsigned i)
+{
+    return (efi_mem_descr_t *)fw->raw[i];
+}
+
+static void fw_add(fw_map_t *fw, uint64_t base, uint64_t end, uint32_t type,
+                   uint64_t attr, uint64_t virt)
+{
+    efi_mem_descr_t *d;
+
+    if ( fw->n == MAX_DESCR )
+        return;
+    d = fw_descr(fw, fw->n);
+    memset(fw->raw[fw->n], 0, sizeof(fw->raw[0]));
+    d->type = type;
+    d->padding = 0xa5a50000 | fw->n;
+    d->physical_start = base;
+    d->virtual_start = virt;
+    d->num_pages = (end - base + PAGE - 1) / PAGE;
+    d->attribute = attr;
+    fw->bytes[fw->n] = end - base;
+    /* bytes past efi_mem_descr_t must come back as they went in */
+    for ( unsigned b = sizeof(*d); b < sizeof(fw->raw[0]); b += 4 )
+        *(uint32_t *)&fw->raw[fw->n][b] = 0x5a5a0000 | fw->n;
+    fw->n++;
+}
+
+/* load the firmware map into both copies as copy_e820_map() and
+   efi_memmap_copy() do */
+static void load(fw_map_t *fw)
+{
+    e820_model.n = efi_model.n = 0;
+    g_e820_map.nr = 0;
+    efi_range_map.nr = 0;
+    efi_mmap_available = false;
+
+    for ( unsigned i = 0; i < fw->n; i++ ) {
+        efi_mem_descr_t *d = fw_descr(fw, i);
+        uint64_t end = d->physical_start + fw->bytes[i];
+        uint32_t type = fw->is_efi ? efi_to_e820(d->type) : d->type;
+
+        if ( !protect_region(&g_e820_map, d->physical_start,
+                             end - d->physical_start, type) )
+            fail("e820 map load failed");
+        model_set(&e820_model, d->physical_start, end, type, 0, 0);
+        if ( fw->is_efi )
+            model_set(&efi_model, d->physical_start, end, d->type,
+                      d->attribute, i);
+    }
+    compare(&g_e820_map, &e820_model, false, "e820");
+
+    if ( !fw->is_efi )
+        return;
+    for ( unsigned i = 0; i < fw->n; i++ )
+        memcpy((uint8_t *)FW_MMAP_ADDR + i * fw->descr_size, fw->raw[i],
+               fw->descr_size);
+    if ( !efi_memmap_load(FW_MMAP_ADDR, fw->descr_size,
+                          fw->n * fw->descr_size) )
+        fail("EFI map load failed");
+    compare(&efi_range_map, &efi_model, true, "EFI");
+}
+
+/* check the descriptors written back by efi_memmap_sync() */
+static void check_efi_copy(fw_map_t *fw)
+{
+    uint32_t descr_size, descr_vers, mmap_size;
+    uint32_t addr = efi_memmap_get_addr(&descr_size, &descr_vers, &mmap_size);
+    uint32_t nr = mmap_size / descr_size, last_src = 0;
+    uint64_t last_base = 0;
+
+    if ( addr == 0 || descr_size != fw->descr_size ||
+         mmap_size % descr_size != 0 )
+        fail("bad EFI map copy header");
+    if ( nr != efi_range_map.nr )
+        fail("EFI map copy and range map differ in size");
+
+    for ( uint32_t i = 0; i < nr; i++ ) {
+        uint8_t *raw = (uint8_t *)(uintptr_t)addr + i * descr_size;
+        efi_mem_descr_t *d = (efi_mem_descr_t *)raw;
+        uint64_t end = d->physical_start + (d->num_pages << EFI_PAGE_SHIFT);
+        uint32_t src = d->padding & 0xffff;
+        const piece_t *p = model_at(&efi_model, d->physical_start);
+        efi_mem_descr_t *orig;
+
+        if ( (d->padding & 0xffff0000) != 0xa5a50000 || src >= fw->n )
+            fail("EFI descriptor lost its padding");
+        orig = fw_descr(fw, src);
+        for ( unsigned b = sizeof(*d); b < descr_size; b += 4 )
+            if ( *(uint32_t *)&raw[b] != (0x5a5a0000 | src) )
+                fail("EFI descriptor lost bytes past efi_mem_descr_t");
+        if ( p == NULL || p->src != src || p->type != d->type ||
+             p->attr != d->attribute )
+            fail("EFI descriptor does not match the model");
+        for ( uint64_t a = d->physical_start; a < end; a = p->end ) {
+            p = model_at(&efi_model, a);
+            if ( p == NULL || p->src != src || p->type != d->type ||
+                 p->attr != d->attribute )
+                fail("EFI descriptor spans different model pieces");
+        }
+        if ( d->virtual_start != (orig->virtual_start == 0 ? 0 :
+                 orig->virtual_start + d->physical_start -
+                 orig->physical_start) )
+            fail("EFI descriptor virtual start not carried over");
+        if ( d->type == orig->type &&
+             d->physical_start == orig->physical_start &&
+             d->num_pages == orig->num_pages &&
+             d->attribute == orig->attribute &&
+             memcmp(raw, fw->raw[src], descr_size) != 0 )
+            fail("untouched EFI descriptor was rewritten");
+        if ( i > 0 && (src < last_src ||
+                       (src == last_src && d->physical_start < last_base)) )
+            fail("EFI descriptors out of firmware order");
+        last_src = src;
+        last_base = d->physical_start;
+    }
+
+    /* the range map is retagged to the descriptor each range went to */
+    for ( uint32_t i = 0; i < efi_range_map.nr; i++ ) {
+        const range_t *r = &efi_ranges[i];
+        efi_mem_descr_t *d;
+
+        if ( r->tag >= nr )
+            fail("EFI range tagged past the end of the copy");
+        d = (efi_mem_descr_t *)((uintptr_t)addr + r->tag * descr_size);
+        if ( d->physical_start != r->base || d->type != r->type ||
+             d->physical_start + (d->num_pages << EFI_PAGE_SHIFT) != r->end )
+            fail("EFI range tag does not match its descriptor");
+    }
+}
+
+static void check_e820_copy(void)
+{
+    memory_map_t *copy = get_e820_copy();
+
+    if ( get_nr_map() != g_e820_map.nr )
+        fail("e820 copy and range map differ in size");
+    for ( unsigned i = 0; i < g_e820_map.nr; i++ ) {
+        const range_t *r = &g_e820_ranges[i];
+
+        if ( e820_base_64(&copy[i]) != r->base ||
+             e820_length_64(&copy[i]) != r->end - r->base ||
+             copy[i].type != r->type || copy[i].size != 20 )
+            fail("e820 copy does not match the range map");
+    }
+}
+
+static void check_highest(fw_map_t *fw, uint64_t size, uint64_t limit)
+{
+    uint64_t base = 0, len = 0, want_base = 0, want_len = 0;
+    bool found = e820_get_highest_sized_ram(size, limit, &base, &len);
+
+    /* model: highest maximal RAM run that ends at or below limit */
+    for ( unsigned i = 0; i < e820_model.n; i++ ) {
+        const piece_t *p = &e820_model.p[i];
+        uint64_t s = p->base, e = p->end;
+        const piece_t *q;
+
+        if ( p->type != E820_RAM )
+            continue;
+        while ( s > 0 && (q = model_at(&e820_model, s - 1)) != NULL &&
+                q->type == E820_RAM )
+            s = q->base;
+        while ( (q = model_at(&e820_model, e)) != NULL && q->type == E820_RAM )
+            e = q->end;
+        if ( e <= limit && e - s >= size && s >= want_base ) {
+            want_base = s;
+            want_len = e - s;
+        }
+    }
+    if ( found != (want_len != 0) ||
+         (found && (base != want_base || len != want_len)) )
+        fail("e820_get_highest_sized_ram() disagrees with the model");
+
+    if ( !fw->is_efi )
+        return;
+    if ( efi_memmap_get_highest_sized_ram(size, limit, &base, &len) ) {
+        if ( len < size || base + len > limit )
+            fail("efi_memmap_get_highest_sized_ram() result out of bounds");
+        for ( uint64_t a = base; a < base + len; a += PAGE ) {
+            const piece_t *p = model_at(&efi_model, a);
+            if ( p == NULL || !model_is_free(p->type) )
+                fail("efi_memmap_get_highest_sized_ram() returned used "
+                     "memory");
+            a = p->end - PAGE;
+        }
+    }
+}
+
+static uint64_t rand64(void)
+{
+    return (uint64_t)rand() << 40 ^ (uint64_t)rand() << 20 ^ rand();
+}
+
+/* an address near a map boundary, or anywhere below top */
+static uint64_t random_addr(fw_map_t *fw, uint64_t top)
+{
+    uint64_t a;
+
+    if ( rand() % 4 == 0 ) {
+        a = rand64() % top;
+    }
+    else {
+        efi_mem_descr_t *d = fw_descr(fw, rand() % fw->n);
+        a = d->physical_start;
+        if ( rand() % 2 )
+            a += fw->bytes[d->padding & 0xffff];
+        a += (rand() % 9 - 4) * PAGE;
+        if ( a >= top )     /* wrapped below 0, or past the end */
+            a = rand64() % top;
+    }
+    if ( rand() % 8 == 0 )
+        a += rand() % PAGE;     /* e820 takes unaligned ranges */
+    else
+        a &= ~(PAGE - 1);
+    return a;
+}
+
+static void efi_round(range_t *r)
+{
+    if ( r->end == r->base )
+        return;
+    r->base &= ~(PAGE - 1);
+    if ( r->end & (PAGE - 1) )
+        r->end = (r->end & ~(PAGE - 1)) + PAGE;
+}
+
+/* one boot's worth of edits, checked against the model after each */
+static void run(fw_map_t *fw, uint64_t top)
+{
+    load(fw);
+
+    for ( int op = 0; op < OPS_PER_RUN; op++ ) {
+        range_t batch[4];
+        unsigned count = 1 + rand() % 4;
+        uint64_t base = random_addr(fw, top);
+        uint64_t len = rand() % 4 ? (rand() % 64 + 1) * PAGE : rand64() % top;
+
+        if ( base + len > top )
+            len = top - base;
+
+        switch ( rand() % 6 ) {
+        case 0:     /* tboot/TXT regions, as in begin_launch() */
+            for ( unsigned i = 0; i < count; i++ ) {
+                uint64_t b = random_addr(fw, top);
+                batch[i] = (range_t){ b, b + (rand() % 32 + 1) * PAGE,
+                                      rand() % 2 ? E820_UNUSABLE :
+                                      E820_RESERVED, 0, 0 };
+                model_set(&e820_model, batch[i].base, batch[i].end,
+                          batch[i].type, 0, 0);
+            }
+            if ( !e820_protect_regions(batch, count) )
+                fail("e820_protect_regions() failed");
+            if ( fw->is_efi )
+                for ( unsigned i = 0; i < count; i++ )
+                    model_retype(&efi_model, batch[i].base, batch[i].end,
+                                 model_is_reservable, EFI_RESERVED_TYPE);
+            break;
+        case 1:     /* a single protect, e.g. the log or the policy */
+            if ( !e820_protect_region(base, len, E820_RESERVED) )
+                fail("e820_protect_region() failed");
+            model_set(&e820_model, base, base + len, E820_RESERVED, 0, 0);
+            break;
+        case 2:     /* RAM discarded by get_ram_ranges() */
+            if ( !e820_reserve_ram(base, len) ||
+                 !efi_memmap_reserve(base, len) )
+                fail("reserve failed");
+            model_retype(&e820_model, base, base + len, model_is_ram,
+                         E820_RESERVED);
+            if ( fw->is_efi ) {
+                range_t r = { base, base + len, 0, 0, 0 };
+                efi_round(&r);
+                model_retype(&efi_model, r.base, r.end, model_is_reservable,
+                             EFI_RESERVED_TYPE);
+            }
+            break;
+        case 3:     /* PMR/DMA carve-outs */
+            for ( unsigned i = 0; i < count; i++ ) {
+                uint64_t b = random_addr(fw, top);
+                batch[i] = (range_t){ b, b + (rand() % 64) * PAGE, 0, 0, 0 };
+                model_retype(&e820_model, batch[i].base, batch[i].end,
+                             model_is_ram, E820_RESERVED);
+            }
+            {
+                range_t copy[4];
+                memcpy(copy, batch, sizeof(copy));
+                if ( !e820_reserve_ram_batch(batch, count) ||
+                     !efi_memmap_reserve_batch(copy, count) )
+                    fail("batch reserve failed");
+                if ( fw->is_efi )
+                    for ( unsigned i = 0; i < count; i++ )
+                        model_retype(&efi_model, copy[i].base, copy[i].end,
+                                     model_is_reservable, EFI_RESERVED_TYPE);
+            }
+            break;
+        case 4:     /* hand the maps to the kernel, then keep editing */
+            check_e820_copy();
+            if ( fw->is_efi )
+                check_efi_copy(fw);
+            break;
+        default:
+            check_highest(fw, (rand() % 256 + 1) * PAGE * (rand() % 2 ? 1 : 64),
+                          rand() % 2 ? 0x100000000ULL : top);
+            break;
+        }
+
+        compare(&g_e820_map, &e820_model, false, "e820");
+        if ( fw->is_efi )
+            compare(&efi_range_map, &efi_model, true, "EFI");
+    }
+
+    check_e820_copy();
+    if ( fw->is_efi )
+        check_efi_copy(fw);
+}
+
+static uint32_t e820_type(const char *s)
+{
+    if ( strncmp(s, "usable", 6) == 0 )    return E820_RAM;
+    if ( strncmp(s, "reserved", 8) == 0 )  return E820_RESERVED;
+    if ( strncmp(s, "ACPI data", 9) == 0 ) return E820_ACPI;
+    if ( strncmp(s, "ACPI NVS", 8) == 0 )  return E820_NVS;
+    if ( strncmp(s, "unusable", 8) == 0 )  return E820_UNUSABLE;
+    return E820_RESERVED;
+}
+
+/*
+ * Maps are kept as Linux logs them: "BIOS-e820: [mem <first>-<last>] <type>"
+ * lines, or "efi: memNN: type=, attr=, [virt=,] range=[<base>-<end>)" ones
+ * (efi=debug)
+ */
+static bool parse_map(const char *path, fw_map_t *fw, uint64_t *top)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+
+    if ( f == NULL )
+        return false;
+    fw->n = 0;
+    fw->is_efi = false;
+    fw->descr_size = sizeof(efi_mem_descr_t);
+    *top = 0;
+    while ( fgets(line, sizeof(line), f) != NULL ) {
+        unsigned long long first, last, attr = 0, virt = 0;
+        unsigned type;
+        char *s;
+
+        if ( (s = strstr(line, "[mem ")) != NULL &&
+             sscanf(s, "[mem %llx-%llx]", &first, &last) == 2 ) {
+            s = strchr(s, ']') + 2;
+            fw_add(fw, first, last + 1, e820_type(s), 0, 0);
+        }
+        else if ( (s = strstr(line, "type=")) != NULL &&
+                  sscanf(s, "type=%u, attr=%llx", &type, &attr) == 2 &&
+                  (s = strstr(line, "range=[")) != NULL &&
+                  sscanf(s, "range=[%llx-%llx)", &first, &last) == 2 ) {
+            if ( (s = strstr(line, "virt=")) != NULL )
+                sscanf(s, "virt=%llx", &virt);
+            fw->is_efi = true;
+            fw_add(fw, first, last, type, attr, virt);
+        }
+        else
+            continue;
+        if ( last > *top )
+            *top = last;
+    }
+    fclose(f);
+    return fw->n > 0;
+}
+
+/* firmware-like layout: mostly ascending, some holes and overlaps */
+static void random_map(fw_map_t *fw, uint64_t *top)
+{
+    static const uint32_t types[] = {
+        EFI_CONVENTIONAL_MEMORY, EFI_CONVENTIONAL_MEMORY,
+        EFI_CONVENTIONAL_MEMORY, EFI_LOADER_CODE, EFI_LOADER_DATA,
+        EFI_BOOT_SERVICES_CODE, EFI_BOOT_SERVICES_DATA,
+        EFI_RUNTIME_SERVICES_CODE, EFI_RUNTIME_SERVICES_DATA,
+        EFI_RESERVED_TYPE, EFI_ACPI_RECLAIM_MEMORY, EFI_ACPI_MEMORY_NVS,
+        EFI_UNUSABLE_MEMORY, EFI_MEMORY_MAPPED_IO,
+    };
+    static const uint32_t sizes[] = { 40, 48, 56, 64 };
+    unsigned n = 2 + rand() % 120;
+    uint64_t a = 0;
+
+    fw->n = 0;
+    fw->is_efi = true;
+    fw->descr_size = sizes[rand() % 4];
+    for ( unsigned i = 0; i < n; i++ ) {
+        uint32_t type = types[rand() % (sizeof(types) / sizeof(types[0]))];
+        bool runtime = type == EFI_RUNTIME_SERVICES_CODE ||
+                       type == EFI_RUNTIME_SERVICES_DATA ||
+                       type == EFI_MEMORY_MAPPED_IO;
+        uint64_t size = (rand() % 4 ? rand() % 64 + 1 : rand() % 65536 + 1) *
+                        PAGE;
+        uint64_t base = a;
+
+        if ( rand() % 10 == 0 )
+            base += (rand() % 16) * PAGE;           /* hole */
+        else if ( rand() % 20 == 0 && base > 8 * PAGE )
+            base -= (rand() % 8) * PAGE;            /* overlap */
+        fw_add(fw, base, base + size, type,
+               (rand() % 4 ? EFI_MEMORY_WB : EFI_MEMORY_UC) |
+               (runtime ? EFI_MEMORY_RUNTIME : 0),
+               runtime && rand() % 2 ? 0xfffffffe00000000ULL + base : 0);
+        a = base + size;
+    }
+    /* now and then an out of order one */
+    if ( n > 3 && rand() % 4 == 0 ) {
+        unsigned i = rand() % n, j = rand() % n;
+        uint8_t tmp[64];
+        uint64_t bytes = fw->bytes[i];
+
+        memcpy(tmp, fw->raw[i], 64);
+        memcpy(fw->raw[i], fw->raw[j], 64);
+        memcpy(fw->raw[j], tmp, 64);
+        fw->bytes[i] = fw->bytes[j];
+        fw->bytes[j] = bytes;
+        /* keep the markers in step with the positions */
+        for ( unsigned k = 0; k < 2; k++ ) {
+            unsigned x = k ? j : i;
+            fw_descr(fw, x)->padding = 0xa5a50000 | x;
+            for ( unsigned b = sizeof(efi_mem_descr_t); b < 64; b += 4 )
+                *(uint32_t *)&fw->raw[x][b] = 0x5a5a0000 | x;
+        }
+    }
+    *top = a + 64 * PAGE;
+}
+
+static void map_fixed(unsigned long addr, unsigned long size)
+{
+    if ( mmap((void *)addr, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) !=
+         (void *)addr ) {
+        perror("test-memmap: mmap");
+        exit(1);
+    }
+}
+
+static fw_map_t fw;
+
+int main(int argc, char *argv[])
+{
+    unsigned seed = argc > 1 ? atoi(argv[1]) : 1;
+    unsigned nr_files = 0;
+    uint64_t top;
+    DIR *dir;
+    struct dirent *de;
+    char path[512];
+
+    verbose = getenv("TEST_VERBOSE") != NULL;
+    srand(seed);
+
+    /* the copies live at fixed addresses, as in tboot */
+    map_fixed(TBOOT_E820_COPY_ADDR,
+              TBOOT_EFI_MEMMAP_COPY_ADDR + TBOOT_EFI_MEMMAP_COPY_SIZE -
+              TBOOT_E820_COPY_ADDR);
+    map_fixed(FW_MMAP_ADDR, FW_MMAP_SIZE);
+
+    dir = opendir(argc > 2 ? argv[2] : CORPUS_DIR);
+    if ( dir == NULL ) {
+        perror("test-memmap: " CORPUS_DIR);
+        return 1;
+    }
+    while ( (de = readdir(dir)) != NULL ) {
+        if ( de->d_name[0] == '.' )
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", argc > 2 ? argv[2] : CORPUS_DIR,
+                 de->d_name);
+        if ( !parse_map(path, &fw, &top) )
+            continue;
+        cur_name = de->d_name;
+        for ( unsigned i = 0; i < RUNS_PER_MAP; i++ ) {
+            /* with and without stride bytes past efi_mem_descr_t */
+            if ( fw.is_efi )
+                fw.descr_size = sizeof(efi_mem_descr_t) + (i % 4) * 8;
+            run(&fw, top + 64 * PAGE);
+        }
+        nr_files++;
+    }
+    closedir(dir);
+
+    cur_name = "random map";
+    for ( int i = 0; i < RANDOM_MAPS; i++ ) {
+        random_map(&fw, &top);
+        run(&fw, top);
+    }
+
+    printf("test-memmap: %u sample and %u random maps, %lu checks: PASS\n",
+           nr_files, RANDOM_MAPS, nr_checks);
+    return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * test-mlept: host walker test of the MLE page table builder
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * build_mle_pagetable() is run for every MLE size up to twice
+ * TBOOT_MLE_MAX_SIZE, with the MLE placed as tboot's MLE header says it
+ * is, and the table is walked the way SINIT does (PAE-style: pg dir ptr
+ * table, pg dirs, ptables of 4KB pages, from linear address 0).  Every
+ * MLE page must map to its place after TBOOT_START and nothing else may
+ * be mapped; the table pages must all lie in g_mle_pt, which must end
+ * where the MLE starts.  MLEs too big for g_mle_pt must be refused.
+ *
+ *   test-mlept
+ */
+
+#include "host-test.h"
+#include "../include/uuid.h"
+#include "../include/mle.h"
+#include "../tboot/include/page.h"
+
+/* the linker script page aligns .mlept */
+#undef __mlept
+#define __mlept    __attribute__ ((aligned (PAGE_SIZE)))
+#include "../tboot/txt/txt.c"
+
+#define ENTRIES         512
+#define ENTRY_FLAGS     0x01    /* P, as MAKE_PDTE() sets */
+#define NOT_MAPPED      (~0ULL)
+
+static uint32_t cur_size;
+
+static void fail(const char *what)
+{
+    printf("test-mlept: MLE size 0x%x: %s\n", cur_size, what);
+    exit(1);
+}
+
+/* the table page an entry points to, which must be one of g_mle_pt's */
+static const uint64_t *table_at(uint64_t entry)
+{
+    uintptr_t addr = entry & ~(uint64_t)(PAGE_SIZE - 1);
+
+    if ( (entry & (PAGE_SIZE - 1)) != ENTRY_FLAGS )
+        fail("entry with unexpected flags");
+    if ( addr < (uintptr_t)g_mle_pt ||
+         addr >= (uintptr_t)g_mle_pt + sizeof(g_mle_pt) )
+        fail("entry points outside g_mle_pt");
+    return (const uint64_t *)addr;
+}
+
+/* linear -> physical, as SINIT sees the MLE */
+static uint64_t walk(const uint64_t *pdpt, uint64_t linear)
+{
+    const uint64_t *pd, *pt;
+    uint64_t e;
+
+    e = pdpt[(linear >> 30) & 3];
+    if ( e == 0 )
+        return NOT_MAPPED;
+    pd = table_at(e);
+    e = pd[(linear >> 21) & (ENTRIES - 1)];
+    if ( e == 0 )
+        return NOT_MAPPED;
+    pt = table_at(e);
+    e = pt[(linear >> 12) & (ENTRIES - 1)];
+    if ( e == 0 )
+        return NOT_MAPPED;
+    if ( (e & (PAGE_SIZE - 1)) != ENTRY_FLAGS )
+        fail("PTE with unexpected flags");
+    return (e & ~(uint64_t)(PAGE_SIZE - 1)) | (linear & (PAGE_SIZE - 1));
+}
+
+/*
+ * every present entry of every table reachable from pdpt, and every
+ * table page reached once only
+ */
+static unsigned count_present(const uint64_t *pdpt, unsigned *nr_tables)
+{
+    const uint64_t *seen[TBOOT_MLE_PT_PAGES];
+    unsigned nr_seen = 0, nr_ptes = 0;
+
+    for ( unsigned i = 4; i < ENTRIES; i++ )
+        if ( pdpt[i] != 0 )
+            fail("pg dir ptr table entry past the 4th");
+    for ( unsigned i = 0; i < 4; i++ ) {
+        const uint64_t *pd;
+
+        if ( pdpt[i] == 0 )
+            continue;
+        pd = table_at(pdpt[i]);
+        for ( unsigned k = 0; k < nr_seen; k++ )
+            if ( seen[k] == pd )
+                fail("table page used twice");
+        if ( nr_seen == TBOOT_MLE_PT_PAGES - 1 )
+            fail("too many table pages");
+        seen[nr_seen++] = pd;
+
+        for ( unsigned j = 0; j < ENTRIES; j++ ) {
+            const uint64_t *pt;
+
+            if ( pd[j] == 0 )
+                continue;
+            pt = table_at(pd[j]);
+            if ( pt == pdpt )
+                fail("ptable is the pg dir ptr table");
+            for ( unsigned k = 0; k < nr_seen; k++ )
+                if ( seen[k] == pt )
+                    fail("table page used twice");
+            if ( nr_seen == TBOOT_MLE_PT_PAGES - 1 )
+                fail("too many table pages");
+            seen[nr_seen++] = pt;
+
+            for ( unsigned l = 0; l < ENTRIES; l++ )
+                nr_ptes += pt[l] != 0;
+        }
+    }
+    *nr_tables = 1 + nr_seen;
+    return nr_ptes;
+}
+
+/* the MLE header as tboot fills it in, for an MLE of the given size */
+static void make_mle_hdr(mle_hdr_t *hdr, uint32_t size)
+{
+    static const mle_hdr_t tmpl = {
+        .uuid = MLE_HDR_UUID, .length = sizeof(mle_hdr_t),
+        .version = MLE_HDR_VER,
+        /* _mle_start == TBOOT_START, see tboot.lds.x */
+        .mle_start_off = TBOOT_START - TBOOT_BASE_ADDR,
+    };
+
+    *hdr = tmpl;
+    hdr->mle_end_off = hdr->mle_start_off + size;
+    hdr->entry_point = size / 2 & PAGE_MASK;
+}
+
+/* pages the table takes: pg dir ptr table, pg dirs and ptables */
+static unsigned pt_pages_needed(uint32_t size)
+{
+    uint64_t pages = size == 0 ? 1 : (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t ptabs = (pages + ENTRIES - 1) / ENTRIES;
+
+    return 1 + (ptabs + ENTRIES - 1) / ENTRIES + ptabs;
+}
+
+static unsigned long nr_built, nr_refused;
+
+static void check(uint32_t size)
+{
+    mle_hdr_t hdr;
+    uint32_t mle_start, pages = size == 0 ? 1 : (size + PAGE_SIZE - 1) /
+                                               PAGE_SIZE;
+    const uint64_t *pdpt;
+    unsigned nr_tables;
+
+    cur_size = size;
+    make_mle_hdr(&hdr, size);
+    mle_start = hdr.mle_start_off + TBOOT_BASE_ADDR;
+
+    /* whatever was there before must not show up in the table */
+    memset(g_mle_pt, 0xa5, sizeof(g_mle_pt));
+    pdpt = build_mle_pagetable(mle_start, hdr.mle_end_off - hdr.mle_start_off);
+    if ( pt_pages_needed(size) > TBOOT_MLE_PT_PAGES ) {
+        if ( pdpt != NULL )
+            fail("MLE too big for g_mle_pt was accepted");
+        nr_refused++;
+        return;
+    }
+    if ( pdpt == NULL )
+        fail("MLE was refused");
+    if ( pdpt != (const uint64_t *)g_mle_pt )
+        fail("table does not start at g_mle_pt");
+
+    for ( uint32_t i = 0; i < pages; i++ )
+        if ( walk(pdpt, (uint64_t)i * PAGE_SIZE) !=
+             mle_start + (uint64_t)i * PAGE_SIZE )
+            fail("MLE page maps to the wrong place");
+    if ( walk(pdpt, hdr.entry_point) != TBOOT_START + hdr.entry_point )
+        fail("entry point does not map into the MLE");
+    if ( count_present(pdpt, &nr_tables) != pages )
+        fail("memory beyond the MLE is mapped");
+    if ( nr_tables != pt_pages_needed(size) )
+        fail("table uses more pages than needed");
+    nr_built++;
+}
+
+int main(void)
+{
+    verbose = getenv("TEST_VERBOSE") != NULL;
+
+    /* the table must fill the pages between the header page and the MLE */
+    if ( sizeof(g_mle_pt) != TBOOT_START - TBOOT_BASE_ADDR - PAGE_SIZE )
+        fail("g_mle_pt does not end at TBOOT_START");
+
+    /* every page count, some not page sized */
+    for ( uint32_t size = 0; size <= 2 * TBOOT_MLE_MAX_SIZE;
+          size += PAGE_SIZE ) {
+        check(size);
+        if ( size > 0 )
+            check(size - 1 - (size / PAGE_SIZE) % 0x800);
+    }
+
+    /* the builder's own checks */
+    cur_size = PAGE_SIZE;
+    if ( build_mle_pagetable(TBOOT_START + 0x10, PAGE_SIZE) != NULL )
+        fail("unaligned MLE was accepted");
+
+    printf("test-mlept: %lu tables walked, %lu MLEs refused: PASS\n",
+           nr_built, nr_refused);
+    return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * test-modreloc: host test of the ELF kernel module relocation planner
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "host-test.h"
+#include "../tboot/include/page.h"
+#include "../tboot/include/modreloc.h"
+#include "../tboot/common/modreloc.c"
+
+#define ITERATIONS   200000
+#define MB           0x100000U
+#define GB           0x40000000ULL
+
+/*
+ * A layout is a kernel image (module 0) and the other modules, all page
+ * aligned and disjoint, as a multiboot1 or multiboot2 loader leaves them;
+ * the planner only sees their ranges, so both boil down to the same input.
+ */
+typedef struct {
+    unsigned int count;
+    uint32_t     start[MAX_RELOC_MODULES];
+    uint32_t     end[MAX_RELOC_MODULES];
+    uint32_t     ld_floor;
+    uint32_t     elf_end;
+    uint64_t     stage_base;
+    uint64_t     stage_size;
+} layout_t;
+
+static bool overlap(uint64_t s1, uint64_t e1, uint64_t s2, uint64_t e2)
+{
+    return s1 < e2 && s2 < e1;
+}
+
+static uint32_t random_size(void)
+{
+    /* mostly small modules, now and then a large initrd */
+    if ( rand() % 8 == 0 )
+        return PAGE_UP(MB + rand() % (200 * MB));
+    return PAGE_UP(1 + rand() % (4 * MB));
+}
+
+/* place module i somewhere in [lo, hi) without overlapping 0..i-1 */
+static bool place(layout_t *l, unsigned int i, uint32_t size, uint32_t lo,
+                  uint32_t hi)
+{
+    for ( int tries = 0; tries < 100; tries++ ) {
+        uint32_t s = PAGE_DOWN(lo + (uint32_t)(((uint64_t)rand() << 16 ^ rand())
+                                               % (hi - lo - size)));
+        bool clash = false;
+
+        for ( unsigned int j = 0; j < i && !clash; j++ )
+            clash = overlap(s, s + size, l->start[j], l->end[j]);
+        if ( !clash ) {
+            l->start[i] = s;
+            l->end[i] = s + size;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * kernel and modules below 3GB, either packed one after the other (as GRUB
+ * loads them) or scattered; the staging area is RAM at or above 3GB
+ */
+static bool random_layout(layout_t *l)
+{
+    memset(l, 0, sizeof(*l));
+    l->count = 1 + rand() % 12;
+    l->elf_end = PAGE_UP(MB + rand() % (64 * MB));
+    l->ld_floor = PAGE_UP(l->elf_end + (rand() % 2 ? 0 : rand() % (8 * MB)));
+
+    if ( rand() % 2 ) {
+        uint32_t next = PAGE_UP(MB + rand() % (256 * MB));
+        for ( unsigned int i = 0; i < l->count; i++ ) {
+            l->start[i] = next;
+            l->end[i] = next + random_size();
+            next = l->end[i] + (rand() % 4 ? 0 : PAGE_UP(rand() % MB));
+        }
+        if ( next > 3 * GB )
+            return false;
+    }
+    else {
+        for ( unsigned int i = 0; i < l->count; i++ )
+            if ( !place(l, i, random_size(), MB, 3 * GB) )
+                return false;
+    }
+
+    l->stage_base = 3 * GB + PAGE_UP(rand() % (256 * MB));
+    l->stage_size = 4 * GB - l->stage_base;
+    return true;
+}
+
+static uint32_t layout_bytes(const layout_t *l)
+{
+    uint32_t total = 0;
+
+    for ( unsigned int i = 1; i < l->count; i++ )
+        total += l->end[i] - l->start[i];
+    return total;
+}
+
+/*
+ * final layout as move_modules_above_elf_kernel() produces it: modules in
+ * address order, packed from ld_floor up; the kernel image (module 0) has
+ * been removed from the list by then and gets no slot
+ */
+static bool reference_targets(const layout_t *l, uint32_t *target)
+{
+    bool done[MAX_RELOC_MODULES] = { false };
+    uint64_t floor = l->ld_floor;
+
+    for ( unsigned int n = 1; n < l->count; n++ ) {
+        unsigned int lowest = 0;
+        for ( unsigned int i = 1; i < l->count; i++ )
+            if ( !done[i] && (lowest == 0 || l->start[i] < l->start[lowest]) )
+                lowest = i;
+        done[lowest] = true;
+        target[lowest] = floor;
+        floor = PAGE_UP(floor + l->end[lowest] - l->start[lowest]);
+    }
+    return floor <= 4 * GB;
+}
+
+/*
+ * replay the plan on the layout: no copy may overwrite a module that is
+ * still needed, and everything must end up where the reference puts it
+ */
+static bool replay(const layout_t *l, const reloc_mod_t *planned,
+                   const reloc_step_t *steps, unsigned int nr_steps,
+                   const uint32_t *target, uint64_t *copied)
+{
+    uint64_t start[MAX_RELOC_MODULES], end[MAX_RELOC_MODULES];
+
+    for ( unsigned int i = 0; i < l->count; i++ ) {
+        start[i] = l->start[i];
+        end[i] = l->end[i];
+    }
+
+    for ( unsigned int n = 0; n < nr_steps; n++ ) {
+        unsigned int i = steps[n].mod_i;
+        uint64_t dest = steps[n].dest, size = end[i] - start[i];
+
+        if ( i >= l->count || dest & (PAGE_SIZE - 1) || dest + size > 4 * GB ) {
+            printf("step %u: bad move of module %u to 0x%llx\n", n, i,
+                   (unsigned long long)dest);
+            return false;
+        }
+        for ( unsigned int j = 0; j < l->count; j++ ) {
+            if ( j != i && overlap(dest, dest + size, start[j], end[j]) ) {
+                printf("step %u: moving module %u to 0x%llx clobbers module "
+                       "%u\n", n, i, (unsigned long long)dest, j);
+                return false;
+            }
+        }
+        /* anything that isn't a final placement is a stage */
+        if ( (i == 0 || dest != target[i]) &&
+             (dest < l->stage_base || dest + size > l->stage_base + l->stage_size ||
+              dest < l->elf_end) ) {
+            printf("step %u: module %u staged outside the staging area\n", n, i);
+            return false;
+        }
+        start[i] = dest;
+        end[i] = dest + size;
+        *copied += size;
+    }
+
+    if ( overlap(0, l->elf_end, start[0], end[0]) ) {
+        printf("kernel image left in the way of its expansion\n");
+        return false;
+    }
+    for ( unsigned int i = 0; i < l->count; i++ ) {
+        if ( i > 0 && start[i] != target[i] ) {
+            printf("module %u ends at 0x%llx, expected 0x%x\n", i,
+                   (unsigned long long)start[i], target[i]);
+            return false;
+        }
+        if ( planned[i].start != start[i] || planned[i].end != end[i] ) {
+            printf("planner state of module %u does not match its moves\n", i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void print_layout(const layout_t *l)
+{
+    printf("ld_floor=0x%x elf_end=0x%x stage=0x%llx+0x%llx\n", l->ld_floor,
+           l->elf_end, (unsigned long long)l->stage_base,
+           (unsigned long long)l->stage_size);
+    for ( unsigned int i = 0; i < l->count; i++ )
+        printf("  module %u: 0x%08x-0x%08x\n", i, l->start[i], l->end[i]);
+}
+
+int main(int argc, char *argv[])
+{
+    static reloc_mod_t mods[MAX_RELOC_MODULES];
+    static reloc_step_t steps[2 * MAX_RELOC_MODULES];
+    uint64_t copied = 0, baseline = 0;
+    unsigned int layouts = 0, nr_steps;
+    uint32_t target[MAX_RELOC_MODULES];
+    layout_t l;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    for ( int n = 0; n < ITERATIONS; n++ ) {
+        if ( !random_layout(&l) || !reference_targets(&l, target) )
+            continue;
+        /*
+         * only keep layouts whose final placements stay below the staging
+         * area and whose modules all fit in it at once
+         */
+        bool fits_below_stage = true;
+        for ( unsigned int i = 1; i < l.count; i++ )
+            if ( target[i] + (l.end[i] - l.start[i]) > l.stage_base )
+                fits_below_stage = false;
+        if ( !fits_below_stage || layout_bytes(&l) +
+             (l.end[0] - l.start[0]) > l.stage_size )
+            continue;
+
+        memset(mods, 0, sizeof(mods));
+        for ( unsigned int i = 0; i < l.count; i++ ) {
+            mods[i].start = l.start[i];
+            mods[i].end = l.end[i];
+        }
+
+        /* with enough free staging RAM a plan must always exist */
+        if ( !plan_module_moves(mods, l.count, l.ld_floor, l.elf_end,
+                                l.stage_base, l.stage_size, steps,
+                                &nr_steps) ) {
+            printf("no plan found for:\n");
+            print_layout(&l);
+            return 1;
+        }
+        if ( !replay(&l, mods, steps, nr_steps, target, &copied) ) {
+            print_layout(&l);
+            return 1;
+        }
+        /* the old path copied each module to high memory and back down */
+        baseline += 2 * (uint64_t)layout_bytes(&l);
+        layouts++;
+    }
+
+    printf("test-modreloc: %u layouts, %llu MB copied (two-pass: %llu MB): "
+           "PASS\n", layouts, (unsigned long long)(copied >> 20),
+           (unsigned long long)(baseline >> 20));
+    return 0;
+}
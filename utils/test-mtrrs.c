@@ -0,0 +1,501 @@
+/*
+ * test-mtrrs: host differential test of the tboot MTRR type model and
+ * the var MTRR planner
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Random var MTRR states are checked against the page-by-page scan that
+ * validate_mmio_regions() used before the interval model replaced it:
+ * build_mtrr_model() must reject exactly the masks the old contiguity
+ * check rejected, and get_region_type() must give the scan's answer for
+ * every region.  plan_mem_type() results are checked by evaluating the
+ * same scan at every MTRR block edge, which covers each piece of memory
+ * whose type the plan determines.
+ *
+ *   test-mtrrs [seed] [-v]
+ */
+
+/* processor.h's version is 32-bit asm */
+static inline int fls(int mask)
+{
+    return mask == 0 ? 0 : 32 - __builtin_clz((unsigned int)mask);
+}
+
+#include "host-test.h"
+#include "../include/uuid.h"
+#include "../include/mle.h"
+#include "../tboot/include/printk.h"
+#include "../tboot/include/msr.h"
+#include "../tboot/include/page.h"
+#include "../tboot/include/misc.h"
+#include "../tboot/include/txt/acmod.h"
+#include "../tboot/include/txt/mtrrs.h"
+#include "../tboot/include/rangemap.h"
+#include "../tboot/common/rangemap.c"
+#include "../tboot/txt/mtrrs.c"
+
+#define STATES          20000
+#define REGIONS         16
+#define PLANS           50000
+#define PLAN_MUTATIONS  4
+
+static const int types[] = {
+    MTRR_TYPE_UNCACHABLE, 1 /* WC */, MTRR_TYPE_WRTHROUGH, 5 /* WP */,
+    MTRR_TYPE_WRBACK
+};
+
+static uint64_t rnd64(void)
+{
+    return ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ rand();
+}
+
+/* in [0, n), n > 0 */
+static uint64_t rnd_below(uint64_t n)
+{
+    return rnd64() % n;
+}
+
+#define fail(...)                                     \
+    do {                                              \
+        printf("test-mtrrs: FAIL: " __VA_ARGS__);     \
+        print_state(state, maxphyaddr_mask);          \
+        exit(1);                                      \
+    } while ( 0 )
+
+static void print_state(const mtrr_state_t *s, uint64_t maxphyaddr_mask)
+{
+    printf("  maxphyaddr_mask %llx, def type %u, e %u\n",
+           (unsigned long long)maxphyaddr_mask,
+           (unsigned int)s->mtrr_def_type.type,
+           (unsigned int)s->mtrr_def_type.e);
+    for ( unsigned int i = 0; i < s->num_var_mtrrs; i++ )
+        printf("  [%u] base %13.13llx mask %13.13llx type %u v %u\n", i,
+               (unsigned long long)s->mtrr_physbases[i].base,
+               (unsigned long long)s->mtrr_physmasks[i].mask,
+               (unsigned int)s->mtrr_physbases[i].type,
+               (unsigned int)s->mtrr_physmasks[i].v);
+}
+
+/*
+ * reference: the scan the model replaced, taking MAXPHYADDR as a
+ * parameter instead of from cpuid
+ */
+static int ref_page_type(const mtrr_state_t *saved_state,
+                         uint64_t maxphyaddr_mask, uint64_t base)
+{
+    int type = -1;
+    bool wt = false;
+
+    base >>= PAGE_SHIFT;
+    for ( unsigned int i = 0; i < saved_state->num_var_mtrrs; i++ ) {
+        const mtrr_physbase_t *base_i = &saved_state->mtrr_physbases[i];
+        const mtrr_physmask_t *mask_i = &saved_state->mtrr_physmasks[i];
+
+        if ( mask_i->v == 0 )
+            continue;
+        if ( (base & mask_i->mask & maxphyaddr_mask) !=
+             (base_i->base & mask_i->mask & maxphyaddr_mask) )
+            continue;
+
+        type = base_i->type;
+        if ( type == MTRR_TYPE_UNCACHABLE )
+            return MTRR_TYPE_UNCACHABLE;
+        if ( type == MTRR_TYPE_WRTHROUGH )
+            wt = true;
+    }
+    if ( wt )
+        return MTRR_TYPE_WRTHROUGH;
+    if ( type != -1 )
+        return type;
+
+    return saved_state->mtrr_def_type.type;
+}
+
+static int ref_region_type(const mtrr_state_t *saved_state,
+                           uint64_t maxphyaddr_mask,
+                           uint32_t base, uint32_t pages)
+{
+    int type;
+    uint32_t end;
+
+    if ( pages == 0 )
+        return MTRR_TYPE_MIXED;
+
+    /* wrap the 4G address space */
+    if ( ((uint32_t)(~0) - base) < (pages << PAGE_SHIFT) )
+        return MTRR_TYPE_MIXED;
+
+    if ( saved_state->mtrr_def_type.e == 0 )
+        return MTRR_TYPE_UNCACHABLE;
+
+    /* align to 4k page boundary */
+    base &= PAGE_MASK;
+    end = base + (pages << PAGE_SHIFT);
+
+    type = ref_page_type(saved_state, maxphyaddr_mask, base);
+    base += PAGE_SIZE;
+    for ( ; base < end; base += PAGE_SIZE )
+        if ( type != ref_page_type(saved_state, maxphyaddr_mask, base) )
+            return MTRR_TYPE_MIXED;
+
+    return type;
+}
+
+/* the contiguity check validate_mtrrs() did bit by bit */
+static bool ref_masks_contiguous(const mtrr_state_t *saved_state,
+                                 uint64_t maxphyaddr_mask)
+{
+    uint64_t max_pages = maxphyaddr_mask + 1;
+
+    for ( unsigned int ndx = 0; ndx < saved_state->num_var_mtrrs; ndx++ ) {
+        uint64_t tb;
+
+        if ( saved_state->mtrr_physmasks[ndx].v == 0 )
+            continue;
+
+        for ( tb = 1; tb != max_pages; tb = tb << 1 ) {
+            if ( (tb & saved_state->mtrr_physmasks[ndx].mask & maxphyaddr_mask)
+                 != 0 )
+                break;
+        }
+        for ( ; tb != max_pages; tb = tb << 1 ) {
+            if ( (tb & saved_state->mtrr_physmasks[ndx].mask & maxphyaddr_mask)
+                 == 0 )
+                break;
+        }
+        if ( tb != max_pages )
+            return false;
+    }
+
+    return true;
+}
+
+/* a var MTRR of 2^k pages, mostly below 4GB, mostly well formed */
+static void random_var_mtrr(mtrr_state_t *state, unsigned int i,
+                            unsigned int maxphyaddr_bits)
+{
+    unsigned int page_bits = maxphyaddr_bits - PAGE_SHIFT;
+    unsigned int k = rnd_below(21);
+    uint64_t base = rnd_below(rand() % 8 ? 1ULL << 20 : 1ULL << page_bits);
+    uint64_t mask = ~((1ULL << k) - 1);
+
+    switch ( rand() % 16 ) {
+    case 0:     /* a hole in the mask */
+        mask &= ~(1ULL << (k + rnd_below(page_bits - k)));
+        break;
+    case 1:     /* garbage above MAXPHYADDR, ignored by the processor */
+        mask |= rnd64() << page_bits;
+        base |= rnd64() << page_bits;
+        break;
+    case 2:     /* base not aligned to the size, low bits are ignored */
+        base |= rnd_below(1ULL << k);
+        break;
+    case 3:     /* covers everything */
+        mask = 0;
+        break;
+    default:
+        break;
+    }
+    if ( rand() % 4 )
+        base &= mask;
+
+    state->mtrr_physbases[i].raw = 0;
+    state->mtrr_physbases[i].base = base;
+    state->mtrr_physbases[i].type = types[rand() % ARRAY_SIZE(types)];
+    state->mtrr_physmasks[i].raw = 0;
+    state->mtrr_physmasks[i].mask = mask;
+    state->mtrr_physmasks[i].v = rand() % 8 != 0;
+}
+
+/* a page of interest: an MTRR edge or a fixed MMIO address, +- a bit */
+static uint32_t random_region_base(const mtrr_state_t *state)
+{
+    static const uint32_t mmio[] = {
+        MMIO_APIC_BASE, 0xfec00000, 0xfed30000 /* TXT public */,
+        0xfed20000 /* TXT private */, 0xe0000000
+    };
+    uint64_t page;
+
+    switch ( rand() % 4 ) {
+    case 0:
+        return rand() * 2654435761U;
+    case 1:
+        page = mmio[rand() % ARRAY_SIZE(mmio)] >> PAGE_SHIFT;
+        break;
+    default:
+        if ( state->num_var_mtrrs == 0 )
+            return rand();
+        {
+            unsigned int i = rand() % state->num_var_mtrrs;
+            uint64_t mask = state->mtrr_physmasks[i].mask;
+
+            page = state->mtrr_physbases[i].base & mask;
+            if ( rand() % 2 )
+                page += (~mask & 0xfffff) + 1;
+        }
+    }
+    page += (int)rnd_below(9) - 4;
+
+    return (uint32_t)(page << PAGE_SHIFT) | (rand() % 8 ? 0 : rand() % 4096);
+}
+
+static uint32_t random_region_pages(void)
+{
+    switch ( rand() % 10 ) {
+    case 0:
+        return rnd_below(8193);
+    case 1: case 2: case 3: case 4:
+        return rnd_below(257);
+    default:
+        return rnd_below(17);
+    }
+}
+
+/*
+ * the pages at which the effective type of a state with contiguous masks
+ * can change (every block edge plus start, end and 0) and the pages just
+ * before them, so that each piece has its first and last page checked
+ */
+static unsigned int state_edges(const mtrr_state_t *state,
+                                uint64_t maxphyaddr_mask, uint32_t start,
+                                uint32_t end, uint64_t *edges)
+{
+    unsigned int n = 0;
+
+    edges[n++] = 0;
+    edges[n++] = start;
+    edges[n++] = end;
+    for ( unsigned int i = 0; i < state->num_var_mtrrs; i++ ) {
+        uint64_t mask = state->mtrr_physmasks[i].mask & maxphyaddr_mask;
+        uint64_t base = state->mtrr_physbases[i].base & mask;
+
+        edges[n++] = base;
+        edges[n++] = base + ((~mask & maxphyaddr_mask) + 1);
+    }
+    for ( unsigned int i = 0, nr_edges = n; i < nr_edges; i++ )
+        edges[n++] = edges[i] - 1;
+
+    return n;
+}
+
+static unsigned long nr_regions, nr_rejected;
+
+static void check_model(unsigned int maxphyaddr_bits)
+{
+    uint64_t maxphyaddr_mask = (1ULL << (maxphyaddr_bits - PAGE_SHIFT)) - 1;
+    mtrr_state_t state_buf, *state = &state_buf;
+    mtrr_model_t model;
+    bool built, contiguous;
+    uint64_t edges[2 * (3 + 2 * MAX_VARIABLE_MTRRS)];
+    unsigned int n;
+
+    memset(state, 0, sizeof(*state));
+    state->num_var_mtrrs = rnd_below(MAX_VARIABLE_MTRRS + 1);
+    state->mtrr_def_type.type = types[rand() % ARRAY_SIZE(types)];
+    state->mtrr_def_type.e = rand() % 16 != 0;
+    for ( unsigned int i = 0; i < state->num_var_mtrrs; i++ )
+        random_var_mtrr(state, i, maxphyaddr_bits);
+
+    built = build_mtrr_model(state, maxphyaddr_mask, &model);
+    contiguous = state->mtrr_def_type.e == 0 ||
+                 ref_masks_contiguous(state, maxphyaddr_mask);
+    if ( built != contiguous )
+        fail("model %s a state the old check %s\n",
+             built ? "accepted" : "rejected",
+             contiguous ? "accepted" : "rejected");
+    if ( !built ) {
+        nr_rejected++;
+        return;
+    }
+    if ( range_map_check(&model.map, 0, (maxphyaddr_mask + 1) << PAGE_SHIFT)
+         == RANGE_MAP_GAP )
+        fail("model has a gap\n");
+
+    /* the whole address space, one page per piece of the scan's answer */
+    n = state_edges(state, maxphyaddr_mask, 0, 0, edges);
+    for ( unsigned int i = 0; i < n; i++ ) {
+        uint64_t addr = edges[i] << PAGE_SHIFT;
+        uint32_t got, want;
+
+        if ( edges[i] > maxphyaddr_mask )
+            continue;
+        got = range_map_check(&model.map, addr, addr + PAGE_SIZE);
+        want = state->mtrr_def_type.e == 0 ? MTRR_TYPE_UNCACHABLE :
+               (uint32_t)ref_page_type(state, maxphyaddr_mask, addr);
+        if ( got != want )
+            fail("page %llx: model says %u, scan says %u\n",
+                 (unsigned long long)edges[i], got, want);
+    }
+
+    for ( unsigned int r = 0; r < REGIONS; r++ ) {
+        uint32_t base = random_region_base(state);
+        uint32_t pages = random_region_pages();
+        int got = get_region_type(&model, base, pages);
+        int want = ref_region_type(state, maxphyaddr_mask, base, pages);
+
+        if ( got != want )
+            fail("region %08x + %u pages: model says %d, scan says %d\n",
+                 base, pages, got, want);
+        nr_regions++;
+    }
+}
+
+/* exact answer for verify_mem_type_plan(), from the old scan */
+static bool ref_plan_ok(const mtrr_state_t *plan, uint32_t start,
+                        uint32_t end, uint32_t mem_type)
+{
+    uint64_t edges[2 * (3 + 2 * MAX_VARIABLE_MTRRS)];
+    unsigned int n = state_edges(plan, SINIT_MTRR_MASK, start, end, edges);
+
+    if ( plan->mtrr_def_type.e == 0 )
+        return mem_type == MTRR_TYPE_UNCACHABLE;
+    for ( unsigned int i = 0; i < n; i++ ) {
+        uint64_t page = edges[i];
+        uint32_t want;
+
+        if ( page > SINIT_MTRR_MASK )
+            continue;
+        want = (page >= start && page < end) ? mem_type
+                                             : MTRR_TYPE_UNCACHABLE;
+        if ( (uint32_t)ref_page_type(plan, SINIT_MTRR_MASK,
+                                     page << PAGE_SHIFT) != want )
+            return false;
+    }
+
+    return true;
+}
+
+static unsigned long nr_plans, nr_rescued, nr_unplannable;
+
+static void check_plan(void)
+{
+    uint64_t maxphyaddr_mask = SINIT_MTRR_MASK;
+    mtrr_state_t state_buf, *state = &state_buf;
+    unsigned int max_mtrrs = 1 + rnd_below(MAX_VARIABLE_MTRRS);
+    unsigned int align = rnd_below(16);
+    uint32_t start, end, mem_type, exact;
+
+    switch ( rand() % 8 ) {
+    case 0:
+        start = rnd_below(SINIT_MTRR_MASK + 1);
+        break;
+    case 1:     /* up to the top of what SINIT can map */
+        start = SINIT_MTRR_MASK - rnd_below(1U << rnd_below(24));
+        break;
+    default:
+        start = rnd_below(1U << 20);
+        break;
+    }
+    start &= ~((1U << align) - 1);
+    end = start + 1 + rnd_below(rand() % 2 ? 64 : 1U << rnd_below(21));
+    if ( end > SINIT_MTRR_MASK + 1 || end <= start )
+        end = SINIT_MTRR_MASK + 1;
+    mem_type = types[rand() % ARRAY_SIZE(types)];
+
+    memset(state, 0, sizeof(*state));
+    exact = plan_aligned_blocks(NULL, start, end, mem_type);
+    if ( !plan_mem_type(start, end, mem_type, max_mtrrs, state) ) {
+        if ( exact <= max_mtrrs )
+            fail("pages %x-%x need %u MTRRs of %u but planning failed\n",
+                 start, end, exact, max_mtrrs);
+        nr_unplannable++;
+        return;
+    }
+    if ( state->num_var_mtrrs > max_mtrrs || state->num_var_mtrrs > exact )
+        fail("pages %x-%x planned with %u MTRRs (limit %u, exact %u)\n",
+             start, end, state->num_var_mtrrs, max_mtrrs, exact);
+    if ( state->mtrr_def_type.e != 1 ||
+         state->mtrr_def_type.type != MTRR_TYPE_UNCACHABLE )
+        fail("plan default type is not UC\n");
+    if ( !ref_plan_ok(state, start, end, mem_type) )
+        fail("plan for pages %x-%x type %u is wrong\n", start, end, mem_type);
+    if ( !verify_mem_type_plan(state, start, end, mem_type) )
+        fail("verify_mem_type_plan() rejects a good plan for %x-%x\n",
+             start, end);
+    if ( exact > max_mtrrs )
+        nr_rescued++;
+    nr_plans++;
+
+    /* broken plans must be caught by verify_mem_type_plan() */
+    for ( unsigned int m = 0; m < PLAN_MUTATIONS; m++ ) {
+        mtrr_state_t bad = *state;
+        unsigned int i = rnd_below(bad.num_var_mtrrs);
+
+        switch ( rand() % 4 ) {
+        case 0:
+            bad.mtrr_physbases[i].type = types[rand() % ARRAY_SIZE(types)];
+            break;
+        case 1:
+            bad.mtrr_physmasks[i].v = 0;
+            break;
+        case 2:
+            bad.mtrr_physbases[i].base ^= 1ULL << rnd_below(24);
+            break;
+        default:
+            bad.mtrr_physmasks[i].mask =
+                (bad.mtrr_physmasks[i].mask << 1) & SINIT_MTRR_MASK;
+            break;
+        }
+        if ( verify_mem_type_plan(&bad, start, end, mem_type) !=
+             ref_plan_ok(&bad, start, end, mem_type) ) {
+            state = &bad;
+            fail("verify_mem_type_plan() disagrees with the scan on a "
+                 "mutated plan for %x-%x type %u\n", start, end, mem_type);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int maxphyaddr_bits[] = { 36, 39, 46, 52 };
+    unsigned int seed = 1;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp(argv[i], "-v") == 0 )
+            verbose = true;
+        else
+            seed = atoi(argv[i]);
+    }
+    srand(seed);
+
+    for ( unsigned int i = 0; i < STATES; i++ )
+        check_model(maxphyaddr_bits[i % ARRAY_SIZE(maxphyaddr_bits)]);
+    for ( unsigned int i = 0; i < PLANS; i++ )
+        check_plan();
+
+    printf("test-mtrrs: %u states (%lu rejected), %lu regions, "
+           "%lu plans (%lu rescued, %lu unplannable): PASS\n", STATES,
+           nr_rejected, nr_regions, nr_plans, nr_rescued, nr_unplannable);
+    return 0;
+}
@@ -0,0 +1,388 @@
+/*
+ * test-pmrs: host fuzz test of the VT-d PMR planner
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Runs plan_vtd_pmrs() and the delta reservation after it on the e820
+ * maps in memmaps/ and mdrs/ and on random maps, with and without
+ * min_ram, and checks the result against the maps themselves:
+ *
+ *  - planning fails exactly when RAM straddles 4GB or there is no low RAM
+ *  - only low RAM is discarded, and (without min_ram) no reserved region
+ *    above the first low RAM lies below the end of low RAM
+ *  - the RAM extents are those of the map, and the PMRs are them rounded
+ *    to 2MB, never by 2MB or more
+ *  - after the delta reservation every RAM byte is inside a PMR, and only
+ *    RAM outside the PMRs was reserved
+ *
+ *   test-pmrs [seed]
+ */
+
+#include <dirent.h>
+
+#define HOST_TEST_TXT_HEAP
+#define HOST_TEST_EFI_STUBS
+#include "host-test.h"
+#include "../tboot/include/multiboot.h"
+#include "../tboot/include/e820.h"
+#include "../tboot/include/txt/verify.h"
+#include "../tboot/common/rangemap.c"
+#include "../tboot/common/e820.c"
+#include "../tboot/txt/verify.c"
+
+#define RANDOM_MAPS     20000
+#define MAX_E820        128
+#define PAGE            0x1000ULL
+#define PMR_ALIGN       0x200000ULL
+#define _4GB            0x100000000ULL
+
+typedef struct {
+    unsigned n;
+    range_t  e820[MAX_E820];
+} map_t;
+
+static const char *cur_name;
+static uint32_t cur_min_ram;
+static unsigned long nr_planned, nr_refused, nr_discarding, nr_trimmed;
+
+static void dump_map(const char *title, const range_t *ranges, unsigned n)
+{
+    printf("%s:\n", title);
+    for ( unsigned i = 0; i < n; i++ )
+        printf("  %016llx - %016llx (%u)\n",
+               (unsigned long long)ranges[i].base,
+               (unsigned long long)ranges[i].end, ranges[i].type);
+}
+
+static map_t orig;
+
+static void fail(const char *what)
+{
+    printf("test-pmrs: %s (min_ram 0x%x): %s\n", cur_name, cur_min_ram, what);
+    dump_map("map", orig.e820, orig.n);
+    dump_map("e820 map now", g_e820_ranges, g_e820_map.nr);
+    exit(1);
+}
+
+/* RAM bytes of map in [base, end) */
+static uint64_t ram_in(const range_t *ranges, unsigned n, uint64_t base,
+                       uint64_t end)
+{
+    uint64_t size = 0;
+
+    for ( unsigned i = 0; i < n; i++ ) {
+        uint64_t b = ranges[i].base > base ? ranges[i].base : base;
+        uint64_t e = ranges[i].end < end ? ranges[i].end : end;
+
+        if ( ranges[i].type == E820_RAM && b < e )
+            size += e - b;
+    }
+    return size;
+}
+
+static bool inside(uint64_t base, uint64_t end, uint64_t pmr_base,
+                   uint64_t pmr_size)
+{
+    return pmr_size > 0 && base >= pmr_base && end <= pmr_base + pmr_size;
+}
+
+static void check_rounding(uint64_t min, uint64_t max, uint64_t base,
+                           uint64_t size)
+{
+    if ( base % PMR_ALIGN != 0 || size % PMR_ALIGN != 0 )
+        fail("PMR not 2MB granular");
+    if ( base > min || min - base >= PMR_ALIGN )
+        fail("PMR base not the lowest RAM rounded down to 2MB");
+    if ( base + size > max || max - (base + size) >= PMR_ALIGN )
+        fail("PMR end not the end of RAM rounded down to 2MB");
+}
+
+static void run(const map_t *m, uint32_t min_ram)
+{
+    static range_t loaded[MAX_E820 * 2], planned[MAX_E820 * 2];
+    unsigned nr_loaded, nr_planned_ranges;
+    uint64_t lo_min = ~0ULL, lo_max = 0, hi_min = ~0ULL, hi_max = 0;
+    uint64_t pmr_ram;
+    bool straddles = false, has_lo = false, ok;
+    vtd_pmr_plan_t plan;
+
+    cur_min_ram = g_min_ram = min_ram;
+    g_e820_map.nr = 0;
+    for ( unsigned i = 0; i < m->n; i++ )
+        if ( !protect_region(&g_e820_map, m->e820[i].base,
+                             m->e820[i].end - m->e820[i].base,
+                             m->e820[i].type) )
+            fail("e820 map load failed");
+    nr_loaded = g_e820_map.nr;
+    memcpy(loaded, g_e820_ranges, nr_loaded * sizeof(loaded[0]));
+    for ( unsigned i = 0; i < nr_loaded; i++ ) {
+        const range_t *r = &loaded[i];
+
+        if ( r->type != E820_RAM )
+            continue;
+        straddles |= r->base < _4GB && r->end > _4GB;
+        has_lo |= r->base < _4GB;
+    }
+
+    ok = plan_vtd_pmrs(&plan);
+    if ( ok != (!straddles && has_lo) )
+        fail(ok ? "planning succeeded on a bad map"
+                : "planning failed on a good map");
+    if ( !ok ) {
+        nr_refused++;
+        return;
+    }
+    nr_planned++;
+
+    /* what was discarded: low RAM only, and all RAM above a reserved
+       region that is above the first low RAM (unless min_ram) */
+    if ( !range_map_is_valid(&g_e820_map) )
+        fail("e820 map is not valid");
+    for ( unsigned i = 0; i < g_e820_map.nr; i++ ) {
+        const range_t *r = &g_e820_ranges[i];
+
+        if ( r->type == E820_RAM && ram_in(loaded, nr_loaded, r->base,
+                                           r->end) != r->end - r->base )
+            fail("RAM appeared");
+    }
+    if ( ram_in(loaded, nr_loaded, _4GB, ~0ULL) !=
+         ram_in(g_e820_ranges, g_e820_map.nr, _4GB, ~0ULL) )
+        fail("high RAM was discarded");
+    if ( ram_in(loaded, nr_loaded, 0, _4GB) !=
+         ram_in(g_e820_ranges, g_e820_map.nr, 0, _4GB) )
+        nr_discarding++;
+
+    for ( unsigned i = 0; i < g_e820_map.nr; i++ ) {
+        const range_t *r = &g_e820_ranges[i];
+
+        if ( r->type != E820_RAM )
+            continue;
+        if ( r->base < _4GB ) {
+            lo_min = r->base < lo_min ? r->base : lo_min;
+            lo_max = r->end > lo_max ? r->end : lo_max;
+        }
+        else {
+            hi_min = r->base < hi_min ? r->base : hi_min;
+            hi_max = r->end > hi_max ? r->end : hi_max;
+        }
+    }
+    if ( min_ram == 0 ) {
+        for ( unsigned i = 0; i < g_e820_map.nr; i++ ) {
+            const range_t *r = &g_e820_ranges[i];
+
+            if ( r->type != E820_RAM && r->end > 0x100000 &&
+                 r->base >= lo_min && r->base < lo_max )
+                fail("reserved region below the end of low RAM");
+        }
+    }
+
+    /* extents and PMRs */
+    if ( plan.min_lo_ram != lo_min || plan.max_lo_ram != lo_max )
+        fail("low RAM extent differs from the map");
+    check_rounding(lo_min, lo_max, plan.lo_base, plan.lo_size);
+    if ( hi_max == 0 ) {
+        if ( plan.min_hi_ram != 0 || plan.max_hi_ram != 0 ||
+             plan.hi_base != 0 || plan.hi_size != 0 )
+            fail("high PMR without high RAM");
+    }
+    else {
+        if ( plan.min_hi_ram != hi_min || plan.max_hi_ram != hi_max )
+            fail("high RAM extent differs from the map");
+        check_rounding(hi_min, hi_max, plan.hi_base, plan.hi_size);
+    }
+
+    /* the delta reservation leaves RAM only inside the PMRs */
+    nr_planned_ranges = g_e820_map.nr;
+    memcpy(planned, g_e820_ranges, nr_planned_ranges * sizeof(planned[0]));
+    pmr_ram = ram_in(planned, nr_planned_ranges, plan.lo_base,
+                     plan.lo_base + plan.lo_size) +
+              ram_in(planned, nr_planned_ranges, plan.hi_base,
+                     plan.hi_base + plan.hi_size);
+    if ( !reserve_vtd_delta_mem(&plan) )
+        fail("delta reservation failed");
+    for ( unsigned i = 0; i < g_e820_map.nr; i++ ) {
+        const range_t *r = &g_e820_ranges[i];
+
+        if ( r->type == E820_RAM &&
+             !inside(r->base, r->end, plan.lo_base, plan.lo_size) &&
+             !inside(r->base, r->end, plan.hi_base, plan.hi_size) )
+            fail("RAM left outside the PMRs");
+    }
+    if ( ram_in(g_e820_ranges, g_e820_map.nr, 0, ~0ULL) != pmr_ram )
+        fail("RAM inside the PMRs was reserved");
+    if ( pmr_ram != ram_in(planned, nr_planned_ranges, 0, ~0ULL) )
+        nr_trimmed++;
+}
+
+static uint32_t e820_type(const char *s)
+{
+    if ( strncmp(s, "usable", 6) == 0 )    return E820_RAM;
+    if ( strncmp(s, "ACPI data", 9) == 0 ) return E820_ACPI;
+    if ( strncmp(s, "ACPI NVS", 8) == 0 )  return E820_NVS;
+    if ( strncmp(s, "unusable", 8) == 0 )  return E820_UNUSABLE;
+    return E820_RESERVED;
+}
+
+/* "BIOS-e820: [mem <first>-<last>] <type>" lines, as Linux logs them */
+static bool parse_map(const char *path, map_t *m)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+
+    if ( f == NULL )
+        return false;
+    m->n = 0;
+    while ( fgets(line, sizeof(line), f) != NULL && m->n < MAX_E820 ) {
+        unsigned long long first, last;
+        char *s;
+
+        if ( (s = strstr(line, "[mem ")) == NULL ||
+             sscanf(s, "[mem %llx-%llx]", &first, &last) != 2 )
+            continue;
+        m->e820[m->n++] = (range_t){ .base = first, .end = last + 1,
+                                     .type = e820_type(strchr(s, ']') + 2) };
+    }
+    fclose(f);
+    return m->n > 0;
+}
+
+/*
+ * firmware-like: legacy low memory, RAM split by reserved, ACPI and NVS
+ * islands up to a PCI hole, more RAM above 4GB; now and then RAM across
+ * 4GB or up to it, no low RAM, holes or boundaries off the 2MB grid
+ */
+static void random_map(map_t *m)
+{
+    static const uint32_t types[] = {
+        E820_RESERVED, E820_RESERVED, E820_ACPI, E820_NVS, E820_UNUSABLE
+    };
+    uint64_t a = 0, top_lo = (2 + rand() % 30) * 0x8000000ULL;
+    unsigned n = rand() % 24;
+
+    m->n = 0;
+    if ( rand() % 16 != 0 ) {
+        m->e820[m->n++] = (range_t){ .base = 0, .end = 0x9f000,
+                                     .type = E820_RAM };
+        m->e820[m->n++] = (range_t){ .base = 0xf0000, .end = 0x100000,
+                                     .type = E820_RESERVED };
+        a = 0x100000;
+    }
+    for ( unsigned i = 0; i < n && a < top_lo; i++ ) {
+        uint64_t size = rand() % 4 ? (rand() % 256 + 1) * PAGE
+                                   : (rand() % 64 + 1) * PMR_ALIGN;
+        bool ram = rand() % 3 != 0;
+
+        if ( rand() % 8 == 0 )
+            a += (rand() % 64) * PAGE;              /* hole */
+        if ( ram )
+            size *= 16;
+        m->e820[m->n++] = (range_t){ .base = a, .end = a + size,
+                                     .type = ram ? E820_RAM
+                                                 : types[rand() % 5] };
+        a += size;
+    }
+    if ( rand() % 32 == 0 )                         /* across 4GB */
+        m->e820[m->n++] = (range_t){ .base = _4GB - 0x100000,
+                                     .end = _4GB + 0x100000,
+                                     .type = E820_RAM };
+    if ( a < 0xfec00000 && rand() % 16 == 0 )      /* RAM up to 4GB */
+        m->e820[m->n++] = (range_t){ .base = a, .end = _4GB,
+                                     .type = E820_RAM };
+    else if ( a < 0xfec00000 )
+        m->e820[m->n++] = (range_t){ .base = 0xfec00000, .end = _4GB,
+                                     .type = E820_RESERVED };
+
+    a = _4GB + (rand() % 4 == 0 ? (rand() % 8192) * PAGE : 0);
+    n = rand() % 4 ? rand() % 6 : 0;
+    for ( unsigned i = 0; i < n; i++ ) {
+        uint64_t size = (uint64_t)(rand() % 4096 + 1) * PMR_ALIGN +
+                        (rand() % 4 == 0 ? (rand() % 512) * PAGE : 0);
+        bool ram = i == 0 || rand() % 4 != 0;
+
+        m->e820[m->n++] = (range_t){ .base = a, .end = a + size,
+                                     .type = ram ? E820_RAM : E820_RESERVED };
+        a += size;
+    }
+}
+
+static void run_min_rams(const map_t *m)
+{
+    run(m, 0);
+    run(m, 0x2000000);
+    run(m, (rand() % 512 + 1) * 0x100000);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *dirs[] = { "memmaps", "mdrs" };
+    unsigned seed = argc > 1 ? atoi(argv[1]) : 1;
+    unsigned nr_files = 0;
+    char path[512];
+
+    verbose = getenv("TEST_VERBOSE") != NULL;
+    srand(seed);
+
+    for ( unsigned d = 0; d < sizeof(dirs) / sizeof(dirs[0]); d++ ) {
+        DIR *dir = opendir(dirs[d]);
+        struct dirent *de;
+
+        if ( dir == NULL ) {
+            printf("test-pmrs: no %s directory\n", dirs[d]);
+            return 1;
+        }
+        while ( (de = readdir(dir)) != NULL ) {
+            if ( de->d_name[0] == '.' )
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", dirs[d], de->d_name);
+            if ( !parse_map(path, &orig) )
+                continue;
+            cur_name = de->d_name;
+            run_min_rams(&orig);
+            nr_files++;
+        }
+        closedir(dir);
+    }
+
+    cur_name = "random map";
+    for ( int i = 0; i < RANDOM_MAPS; i++ ) {
+        random_map(&orig);
+        run_min_rams(&orig);
+    }
+
+    printf("test-pmrs: %u sample and %u random maps, %lu planned "
+           "(%lu discarding low RAM, %lu trimmed), %lu refused: PASS\n",
+           nr_files, RANDOM_MAPS, nr_planned, nr_discarding, nr_trimmed,
+           nr_refused);
+    return 0;
+}
@@ -0,0 +1,435 @@
+/*
+ * test-rangemap: host fuzz test and benchmark of the tboot range map
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Each input is a byte string decoded into a sequence of range_map_*
+ * calls.  After every call the map must be valid and equal, range for
+ * range, to what a flat array of per-unit types says it should be.
+ *
+ *   test-rangemap [seed]       random inputs (what 'make check' runs)
+ *   test-rangemap -f file...   replay saved inputs
+ *   test-rangemap -b           benchmark on tboot-sized maps
+ *
+ * LLVMFuzzerTestOneInput() is the libFuzzer entry point; for coverage
+ * guided fuzzing build with
+ *   clang -DLIBFUZZER -fsanitize=fuzzer,address -idirafter ../include \
+ *         -idirafter ../tboot/include test-rangemap.c
+ */
+
+#include <time.h>
+
+#include "host-test.h"
+#include "../tboot/include/rangemap.h"
+#include "../tboot/common/rangemap.c"
+
+/* the model works on a grid of UNITS cells, each scale bytes long */
+#define UNITS       64
+#define MAX_RANGES  UNITS
+#define NO_TYPE     0xffffffffU
+
+typedef struct {
+    uint32_t type;      /* NO_TYPE for a gap */
+    uint64_t attr;
+    uint32_t tag;
+} cell_t;
+
+static cell_t   cells[UNITS];
+static range_t  ranges[MAX_RANGES];
+static range_map_t map;
+static uint64_t scale;
+static bool     merge_filter;
+static unsigned long nr_ops;
+
+static const uint8_t *input, *input_start;
+static size_t   input_left, input_size;
+
+/* save the failing input for 'test-rangemap -f' */
+static void dump_input(void)
+{
+    FILE *f = fopen("test-rangemap.crash", "wb");
+
+    if ( f != NULL ) {
+        fwrite(input_start, 1, input_size, f);
+        fclose(f);
+        printf("input saved to test-rangemap.crash\n");
+    }
+}
+
+static unsigned expected(range_t *out);
+
+static void print_ranges(const char *name, const range_t *r, unsigned n)
+{
+    printf("%s:\n", name);
+    for ( unsigned i = 0; i < n; i++ )
+        printf("  %016llx - %016llx (%u, 0x%llx, tag %u)\n",
+               (unsigned long long)r[i].base, (unsigned long long)r[i].end,
+               r[i].type, (unsigned long long)r[i].attr, r[i].tag);
+}
+
+static void fail(const char *what)
+{
+    range_t want[UNITS];
+
+    printf("test-rangemap: %s (scale 0x%llx, max %u)\n", what,
+           (unsigned long long)scale, map.max);
+    print_ranges("map", ranges, map.nr);
+    print_ranges("model", want, expected(want));
+    dump_input();
+#ifdef LIBFUZZER
+    abort();
+#else
+    exit(1);
+#endif
+}
+
+static uint8_t next(void)
+{
+    if ( input_left == 0 )
+        return 0;
+    input_left--;
+    return *input++;
+}
+
+/* type 3 never merges when the map has a filter */
+static bool merge_ok(uint32_t type) { return type != 3; }
+static bool match_low(uint32_t type) { return type < 2; }
+static bool match_odd(uint32_t type) { return type & 1; }
+
+static bool same(const cell_t *a, const cell_t *b)
+{
+    return a->type == b->type && a->attr == b->attr && a->tag == b->tag;
+}
+
+/* the canonical map for cells[]: maximal runs, split where can't merge */
+static unsigned expected(range_t *out)
+{
+    unsigned n = 0;
+
+    for ( unsigned u = 0; u < UNITS; u++ ) {
+        const cell_t *c = &cells[u];
+
+        if ( c->type == NO_TYPE )
+            continue;
+        if ( n > 0 && out[n-1].end == u * scale && same(c, &cells[u-1]) &&
+             (!merge_filter || merge_ok(c->type)) ) {
+            out[n-1].end += scale;
+            continue;
+        }
+        out[n++] = (range_t){ u * scale, (u + 1) * scale, c->type, c->attr,
+                              c->tag };
+    }
+    return n;
+}
+
+static void check(void)
+{
+    range_t want[UNITS];
+    unsigned n = expected(want);
+
+    if ( !range_map_is_valid(&map) )
+        fail("map is not valid");
+
+    /*
+     * a type the filter refuses to merge keeps the boundaries its ranges
+     * were set with, so only compare unit by unit then; otherwise there is
+     * exactly one right map
+     */
+    if ( merge_filter ) {
+        for ( unsigned u = 0; u < UNITS; u++ ) {
+            unsigned i = range_map_find(&map, u * scale);
+            const range_t *r = &ranges[i];
+            const cell_t *c = &cells[u];
+
+            if ( i < map.nr && r->base < (u + 1) * scale ) {
+                if ( r->base % scale != 0 || r->end % scale != 0 ||
+                     r->type != c->type || r->attr != c->attr ||
+                     r->tag != c->tag )
+                    fail("map differs from the model");
+            }
+            else if ( c->type != NO_TYPE )
+                fail("map is missing a range");
+        }
+        return;
+    }
+
+    if ( n != map.nr )
+        fail("map has the wrong number of ranges");
+    for ( unsigned i = 0; i < n; i++ )
+        if ( want[i].base != ranges[i].base || want[i].end != ranges[i].end ||
+             want[i].type != ranges[i].type ||
+             want[i].attr != ranges[i].attr || want[i].tag != ranges[i].tag )
+            fail("map differs from the model");
+}
+
+static void model_set(unsigned a, unsigned b, uint32_t type, uint64_t attr,
+                      uint32_t tag)
+{
+    for ( unsigned u = a; u < b; u++ )
+        cells[u] = (cell_t){ type, attr, tag };
+}
+
+static void model_retype(unsigned a, unsigned b, range_type_match_t match,
+                         uint32_t type)
+{
+    for ( unsigned u = a; u < b; u++ )
+        if ( cells[u].type != NO_TYPE && match(cells[u].type) )
+            cells[u].type = type;
+}
+
+static uint32_t model_check(unsigned a, unsigned b)
+{
+    uint32_t ret = cells[a].type == NO_TYPE ? RANGE_MAP_GAP : cells[a].type;
+
+    for ( unsigned u = a + 1; u < b; u++ ) {
+        uint32_t t = cells[u].type == NO_TYPE ? RANGE_MAP_GAP : cells[u].type;
+        if ( ret == RANGE_MAP_GAP || t == RANGE_MAP_GAP )
+            ret = RANGE_MAP_GAP;
+        else if ( t != ret )
+            ret = RANGE_MAP_MIXED;
+    }
+    return ret;
+}
+
+/* two units a <= b, b may be UNITS */
+static void next_span(unsigned *a, unsigned *b)
+{
+    unsigned x = next() % (UNITS + 1), y = next() % (UNITS + 1);
+
+    *a = x < y ? x : y;
+    *b = x < y ? y : x;
+}
+
+static void run_one(const uint8_t *data, size_t size)
+{
+    input = input_start = data;
+    input_left = input_size = size;
+
+    /* header: grid scale, map capacity, merge filter */
+    uint8_t s = next();
+    scale = (s & 0x80) ? 1ULL << (s % 53) : 0x1000ULL * (1 + s % 16);
+    map = (range_map_t){ ranges, 0, 4 + next() % (MAX_RANGES - 3), NULL };
+    merge_filter = next() & 1;
+    if ( merge_filter )
+        map.can_merge = merge_ok;
+    for ( unsigned u = 0; u < UNITS; u++ )
+        cells[u] = (cell_t){ NO_TYPE, 0, 0 };
+
+    while ( input_left > 0 ) {
+        uint8_t op = next();
+        unsigned a, b;
+        uint32_t type = next() % 4;
+        bool ok;
+
+        next_span(&a, &b);
+        nr_ops++;
+
+        switch ( op % 6 ) {
+        case 0:
+        case 1: {
+            range_t r = { a * scale, b * scale, type, op & 0x40 ? 0xf : 0,
+                          op & 0x80 ? 1 : 0 };
+            cell_t saved[UNITS];
+
+            memcpy(saved, cells, sizeof(cells));
+            model_set(a, b, r.type, r.attr, r.tag);
+            ok = (op % 6 == 0 && r.tag == 0) ?
+                 range_map_set(&map, r.base, r.end, r.type, r.attr) :
+                 range_map_set_range(&map, &r);
+            if ( !ok ) {
+                /* no room: the map must be left as it was */
+                range_t want[UNITS];
+                if ( expected(want) <= map.max )
+                    fail("set failed with room to spare");
+                memcpy(cells, saved, sizeof(cells));
+            }
+            break;
+        }
+        case 2:
+        case 3: {
+            range_type_match_t match = op & 0x10 ? match_low : match_odd;
+            range_t batch[4];
+            unsigned count = 1 + next() % 4;
+
+            if ( op % 6 == 2 ) {
+                model_retype(a, b, match, type);
+                ok = range_map_retype(&map, a * scale, b * scale, match, type);
+            }
+            else {
+                for ( unsigned i = 0; i < count; i++ ) {
+                    unsigned x, y;
+                    next_span(&x, &y);
+                    batch[i] = (range_t){ x * scale, y * scale, 0, 0, 0 };
+                    model_retype(x, y, match, type);
+                }
+                ok = range_map_retype_batch(&map, batch, count, match, type);
+            }
+            if ( !ok ) {
+                /* a partial retype is not undone; tboot gives up here */
+                if ( !range_map_is_valid(&map) )
+                    fail("retype ran out of room and broke the map");
+                return;
+            }
+            break;
+        }
+        case 4:
+            if ( a < UNITS ) {
+                /* an empty range is checked as its first byte */
+                uint64_t addr = a * scale + scale / 2;
+                unsigned i = range_map_find(&map, addr), want = 0;
+
+                if ( range_map_check(&map, a * scale, b * scale) !=
+                     model_check(a, b > a ? b : a + 1) )
+                    fail("range_map_check() disagrees with the model");
+                for ( unsigned j = 0; j < map.nr; j++ )
+                    want += ranges[j].end <= addr;
+                if ( i != want )
+                    fail("range_map_find() returned the wrong index");
+            }
+            continue;
+        default: {
+            range_t want[UNITS];
+            unsigned n = expected(want);
+            uint64_t base = 0, len = 0, size = (uint64_t)(b - a) * scale;
+            bool found = range_map_get_highest(&map, size, b * scale,
+                                               match_low, &base, &len);
+            int best = -1;
+
+            for ( unsigned i = 0; i < n; i++ )
+                if ( want[i].end <= b * scale && match_low(want[i].type) &&
+                     want[i].end - want[i].base >= size )
+                    best = i;
+            if ( found != (best >= 0) ||
+                 (found && (base != want[best].base ||
+                            len != want[best].end - want[best].base)) )
+                fail("range_map_get_highest() disagrees with the model");
+            continue;
+        }
+        }
+        check();
+    }
+}
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    run_one(data, size);
+    return 0;
+}
+#else
+
+#define ITERATIONS  100000
+#define BENCH_OPS   2000000
+
+static volatile unsigned long bench_sink;
+
+/* tboot-sized maps: 256 e820 entries, EFI_MEMMAP_MAX_ENTRIES descriptors */
+static void bench(unsigned nr)
+{
+    static range_t big[1024];
+    range_map_t m = { big, 0, 1024, NULL };
+    struct timespec t0, t1;
+    unsigned long sum = 0;
+
+    for ( unsigned i = 0; i < nr; i++ )
+        range_map_set(&m, i * 0x100000ULL, (i + 1) * 0x100000ULL, i & 1, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for ( unsigned i = 0; i < BENCH_OPS; i++ ) {
+        uint64_t a = (uint64_t)(i * 2654435761U % nr) * 0x100000ULL;
+        switch ( i % 4 ) {
+        case 0:     /* split and restore, as a reservation would */
+            range_map_set(&m, a + 0x1000, a + 0x2000, 7, 0);
+            range_map_set(&m, a + 0x1000, a + 0x2000, (a >> 20) & 1, 0);
+            break;
+        case 1:
+            sum += range_map_check(&m, a, a + 0x180000);
+            break;
+        case 2:
+            sum += range_map_find(&m, a + 0x800);
+            break;
+        default:
+            range_map_retype(&m, a, a + 0x1000, match_odd, 1);
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if ( !range_map_is_valid(&m) )
+        fail("benchmark map is not valid");
+    bench_sink = sum;
+    printf("test-rangemap: %u ranges: %.1f ns/op\n", nr,
+           ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+           BENCH_OPS);
+}
+
+int main(int argc, char *argv[])
+{
+    static uint8_t buf[4096];
+
+    if ( argc > 1 && strcmp(argv[1], "-b") == 0 ) {
+        bench(256);
+        bench(682);
+        return 0;
+    }
+
+    if ( argc > 1 && strcmp(argv[1], "-f") == 0 ) {
+        for ( int i = 2; i < argc; i++ ) {
+            FILE *f = fopen(argv[i], "rb");
+            size_t n;
+
+            if ( f == NULL ) {
+                perror(argv[i]);
+                return 1;
+            }
+            n = fread(buf, 1, sizeof(buf), f);
+            fclose(f);
+            run_one(buf, n);
+        }
+        printf("test-rangemap: %d inputs, %lu ops: PASS\n", argc - 2, nr_ops);
+        return 0;
+    }
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    for ( int i = 0; i < ITERATIONS; i++ ) {
+        size_t n = 3 + rand() % 200;
+
+        for ( size_t j = 0; j < n; j++ )
+            buf[j] = rand();
+        run_one(buf, n);
+    }
+    printf("test-rangemap: %d inputs, %lu ops: PASS\n", ITERATIONS, nr_ops);
+    return 0;
+}
+#endif
@@ -0,0 +1,428 @@
+/*
+ * test-vtd: host test of the DRHD disable paths against a register model
+ *
+ * Copyright (c) 2021, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Random DMAR tables (DRHDs mixed with other records, up to a few hundred
+ * units, now and then a malformed record) are handed to
+ * vtd_disable_dma_remap_all(), whose register accesses go to a model of
+ * each unit's GCMD/GSTS (and IQH/IQT) registers.  A command completes a
+ * random number of GSTS reads after it was written, or never.  Checked:
+ *
+ *  - every unit before the first malformed record has translation off,
+ *    unless it never completes, and nothing after it was touched
+ *  - GCMD is written with GSTS less the one-shot bits and the bit being
+ *    cleared, never while the unit is still busy
+ *  - every unit that had translation on is reported once, as disabled or
+ *    timed out, and the result is false exactly when one timed out
+ *  - a batch waits for its slowest unit, not the sum of them
+ *
+ * vtd_disable_dma_remap/qie/ire() are run on single units the same way.
+ *
+ *   test-vtd [seed]
+ */
+
+#include <sys/types.h>
+
+/* the DRHD lines of the log are checked */
+static void test_printk(const char *fmt, ...);
+#define printk     test_printk
+
+#include "host-test.h"
+#include "../include/tboot.h"
+#include "../tboot/include/acpi.h"
+#include "../tboot/include/vtd.h"
+
+/* a unit that never completes would otherwise take a while to give up on */
+#undef VTD_OPERATION_TIMEOUT
+#define VTD_OPERATION_TIMEOUT  256
+
+static uint32_t read_reg32(uint32_t base, uint32_t reg);
+static void write_reg32(uint32_t base, uint32_t reg, uint32_t val);
+static uint64_t read_reg64(uint32_t base, uint32_t reg);
+static void write_reg64(uint32_t base, uint32_t reg, uint64_t val);
+static uint64_t rdtsc(void);
+static void cpu_relax(void);
+struct acpi_dmar *get_vtd_dmar_table(void);
+
+#include "../tboot/common/vtd.c"
+
+#define TABLES          20000
+#define SINGLES         20000
+#define MAX_UNITS       300
+#define MAX_DELAY       8
+#define UNIT_BASE       0xfed90000U
+#define UNIT_STRIDE     0x1000U
+#define ONE_SHOT        0x69000000U     /* GSTS bits never written to GCMD */
+
+typedef struct {
+    uint32_t gsts;
+    uint32_t busy;              /* bits a GCMD write is still clearing */
+    unsigned delay;             /* GSTS reads until it completes */
+    bool     stuck;             /* never completes */
+    uint64_t iqh, iqt;
+    unsigned nr_reports;
+    bool     timed_out;         /* ...as reported */
+    bool     touched;
+} unit_t;
+
+static unit_t units[MAX_UNITS];
+static unsigned nr_units;
+static uint8_t table[sizeof(struct acpi_dmar) + MAX_UNITS * 4 * 48];
+static const char *cur_what;
+static unsigned long nr_relax, nr_tables, nr_batched, nr_malformed,
+                    nr_timeouts;
+
+static void fail(const char *what)
+{
+    printf("test-vtd: %s\n", what);
+    exit(1);
+}
+
+static unit_t *unit_at(uint32_t base)
+{
+    if ( base < UNIT_BASE || (base - UNIT_BASE) % UNIT_STRIDE != 0 ||
+         (base - UNIT_BASE) / UNIT_STRIDE >= nr_units )
+        fail("access to something that is not a DRHD");
+    units[(base - UNIT_BASE) / UNIT_STRIDE].touched = true;
+    return &units[(base - UNIT_BASE) / UNIT_STRIDE];
+}
+
+static uint32_t read_reg32(uint32_t base, uint32_t reg)
+{
+    unit_t *u = unit_at(base);
+
+    if ( reg != VTD_GSTS_OFFSET )
+        fail("32-bit read of a register other than GSTS");
+    if ( u->busy != 0 && !u->stuck ) {
+        if ( u->delay == 0 ) {
+            u->gsts &= ~u->busy;
+            u->busy = 0;
+        }
+        else
+            u->delay--;
+    }
+    return u->gsts;
+}
+
+static void write_reg32(uint32_t base, uint32_t reg, uint32_t val)
+{
+    unit_t *u = unit_at(base);
+    uint32_t cleared = u->gsts & ~val & ~ONE_SHOT;
+
+    if ( reg != VTD_GCMD_OFFSET )
+        fail("32-bit write of a register other than GCMD");
+    if ( u->busy != 0 )
+        fail("GCMD written while the unit is busy");
+    if ( val != (u->gsts & ~ONE_SHOT & ~cleared) )
+        fail("GCMD written with bits GSTS does not have, or one-shot bits");
+    if ( cleared != (uint32_t)TE_STAT && cleared != QIE_STAT &&
+         cleared != IRE_STAT )
+        fail("GCMD write does not clear exactly one enable");
+    if ( cleared == QIE_STAT && u->iqh != u->iqt )
+        fail("QIE cleared with invalidations pending");
+    u->busy = cleared;
+    u->delay = rand() % (MAX_DELAY + 1);
+}
+
+static uint64_t read_reg64(uint32_t base, uint32_t reg)
+{
+    unit_t *u = unit_at(base);
+
+    if ( reg == VTD_IQT_OFFSET )
+        return u->iqt;
+    if ( reg != VTD_IQH_OFFSET )
+        fail("64-bit read of a register other than IQH/IQT");
+    /* the hardware works through the queue */
+    if ( u->iqh != u->iqt && rand() % 4 == 0 )
+        u->iqh += 16;
+    return u->iqh;
+}
+
+static void write_reg64(uint32_t base, uint32_t reg, uint64_t val)
+{
+    unit_t *u = unit_at(base);
+
+    if ( reg != VTD_IQT_OFFSET || val != 0 )
+        fail("64-bit write other than IQT = 0");
+    if ( u->gsts & QIE_STAT )
+        fail("IQT written with QIE still on");
+    u->iqt = val;
+}
+
+static uint64_t rdtsc(void)
+{
+    static uint64_t now;
+
+    return now += 0x40;      /* a few GSTS polls per Ktick */
+}
+
+static void cpu_relax(void)
+{
+    nr_relax++;
+}
+
+struct acpi_dmar *get_vtd_dmar_table(void)
+{
+    return (struct acpi_dmar *)table;
+}
+
+/* the DRHD lines are what the test checks; the rest is for TEST_VERBOSE */
+static void test_printk(const char *fmt, ...)
+{
+    char line[256];
+    unsigned long long base;
+    const char *s;
+    unit_t *u;
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if ( verbose )
+        fputs(line, stdout);
+
+    if ( (s = strstr(line, "DRHD @ 0x")) == NULL )
+        return;
+    if ( sscanf(s, "DRHD @ 0x%llx:", &base) != 1 )
+        fail("unparsable DRHD line");
+    u = unit_at(base);
+    if ( strstr(line, cur_what) == NULL )
+        fail("DRHD line for another operation");
+    u->nr_reports++;
+    if ( strstr(line, "timed out") != NULL )
+        u->timed_out = true;
+    else if ( strstr(line, "disabled in") == NULL )
+        fail("DRHD line is neither a completion nor a timeout");
+}
+
+static void new_unit(unit_t *u, bool may_stick)
+{
+    memset(u, 0, sizeof(*u));
+    u->gsts = rand() & ~(TE_STAT | QIE_STAT | IRE_STAT);
+    u->gsts |= rand() % 4 != 0 ? TE_STAT : 0;
+    u->gsts |= rand() % 2 != 0 ? QIE_STAT : 0;
+    u->gsts |= rand() % 2 != 0 ? IRE_STAT : 0;
+    u->stuck = may_stick && rand() % 32 == 0;
+    if ( u->gsts & QIE_STAT )
+        u->iqt = u->iqh + 16 * (rand() % 8);
+}
+
+static unsigned random_nr_units(void)
+{
+    static const unsigned edges[] = {
+        0, 1, 2, 63, 64, 65, 127, 128, 129, 192, 193, MAX_UNITS
+    };
+
+    if ( rand() % 2 == 0 )
+        return edges[rand() % (sizeof(edges) / sizeof(edges[0]))];
+    return rand() % (MAX_UNITS + 1);
+}
+
+/*
+ * DRHDs in order, each with 0-3 device scope entries, other records
+ * between them; returns how many units come before the first malformed
+ * record (all of them if there is none)
+ */
+static unsigned build_table(bool malformed)
+{
+    struct acpi_dmar *dmar = (struct acpi_dmar *)table;
+    uint8_t *p = (uint8_t *)dmar->table_offsets, *bad = NULL;
+    unsigned bad_at = rand() % (nr_units + 1), reachable = nr_units;
+
+    memset(table, 0, sizeof(table));
+    memcpy(dmar->hdr.signature, DMAR_SIG, sizeof(dmar->hdr.signature));
+    for ( unsigned i = 0; i <= nr_units; i++ ) {
+        struct dmar_remapping *r;
+
+        if ( malformed && i == bad_at ) {
+            bad = p;
+            p += 16;
+            reachable = i;
+        }
+        for ( unsigned n = 0; n < 3 && rand() % 3 == 0; n++ ) {
+            /* RMRR, ATSR, RHSA... */
+            r = (struct dmar_remapping *)p;
+            r->type = 1 + rand() % 4;
+            r->length = 16 + 8 * (rand() % 4);
+            r->register_base_address = 0xdead0000;
+            p += r->length;
+        }
+        if ( i == nr_units )
+            break;
+        r = (struct dmar_remapping *)p;
+        r->type = DMAR_REMAPPING_DRHD;
+        r->length = 16 + 8 * (rand() % 4);
+        r->register_base_address = UNIT_BASE + i * UNIT_STRIDE;
+        p += r->length;
+    }
+    dmar->hdr.length = p - table;
+    if ( bad != NULL ) {
+        /* 0 length, or one that runs past the end of the table */
+        ((struct dmar_remapping *)bad)->type = DMAR_REMAPPING_DRHD;
+        ((struct dmar_remapping *)bad)->length =
+            rand() % 2 == 0 ? 0 : p - bad + 8 * (1 + rand() % 4);
+    }
+    return reachable;
+}
+
+static void run_table(void)
+{
+    bool may_stick = rand() % 8 == 0, malformed = rand() % 8 == 0;
+    unsigned reachable, batches;
+    unsigned long max_relax = 0;
+    bool expect = true, ok;
+    uint32_t before[MAX_UNITS];
+
+    nr_units = random_nr_units();
+    for ( unsigned i = 0; i < nr_units; i++ ) {
+        new_unit(&units[i], may_stick);
+        before[i] = units[i].gsts;
+    }
+    reachable = build_table(malformed);
+    for ( unsigned i = 0; i < nr_units; i++ )
+        units[i].touched = false;
+
+    cur_what = "DMA remapping";
+    nr_relax = 0;
+    ok = vtd_disable_dma_remap_all();
+
+    for ( unsigned i = 0; i < nr_units; i++ ) {
+        unit_t *u = &units[i];
+        bool pending = before[i] & TE_STAT;
+
+        if ( i >= reachable ) {
+            if ( u->touched )
+                fail("unit past a malformed record was touched");
+            continue;
+        }
+        if ( !pending ) {
+            if ( u->nr_reports != 0 || u->gsts != before[i] )
+                fail("unit without translation was changed or reported");
+            continue;
+        }
+        if ( u->nr_reports != 1 )
+            fail("unit with translation on not reported exactly once");
+        if ( u->stuck ) {
+            expect = false;
+            nr_timeouts++;
+            if ( !u->timed_out )
+                fail("unit that never completed not reported as timed out");
+        }
+        else {
+            if ( u->timed_out )
+                fail("unit that completed reported as timed out");
+            if ( u->gsts != (before[i] & ~TE_STAT) )
+                fail("translation still on, or another bit changed");
+        }
+    }
+    if ( ok != expect )
+        fail(ok ? "success with a unit timed out"
+                : "failure without a unit timed out");
+
+    /* one wait per batch, each as long as its slowest unit */
+    batches = (reachable + MAX_DRHD_UNITS - 1) / MAX_DRHD_UNITS;
+    if ( expect ) {
+        for ( unsigned b = 0; b < batches; b++ )
+            max_relax += MAX_DELAY;
+        if ( nr_relax > max_relax )
+            fail("waited for the units one after another");
+    }
+
+    nr_tables++;
+    nr_batched += reachable > MAX_DRHD_UNITS;
+    nr_malformed += malformed;
+}
+
+static void run_single(void)
+{
+    static const struct {
+        const char *what;
+        uint32_t stat;
+        bool (*fn)(struct dmar_remapping *);
+    } ops[] = {
+        { "DMA remapping", TE_STAT, vtd_disable_dma_remap },
+        { "queued invalidation", QIE_STAT, vtd_disable_qie },
+        { "interrupt remapping", IRE_STAT, vtd_disable_ire },
+    };
+    unsigned op = rand() % 3;
+    struct dmar_remapping rs = {
+        .type = rand() % 8 == 0 ? DMAR_REMAPPING_RMRR : DMAR_REMAPPING_DRHD,
+        .length = sizeof(rs), .register_base_address = UNIT_BASE,
+    };
+    unit_t *u = &units[0];
+    uint32_t before;
+    bool ok, pending;
+
+    nr_units = 1;
+    new_unit(u, true);
+    before = u->gsts;
+    pending = before & ops[op].stat;
+    cur_what = ops[op].what;
+    ok = ops[op].fn(&rs);
+
+    if ( rs.type != DMAR_REMAPPING_DRHD ) {
+        if ( ok || u->touched )
+            fail("non-DRHD record was handled as a unit");
+        return;
+    }
+    if ( ok != !(pending && u->stuck) )
+        fail("single unit: wrong result");
+    if ( u->nr_reports != (pending ? 1 : 0) )
+        fail("single unit: not reported exactly once");
+    if ( ok && u->gsts != (before & ~ops[op].stat) )
+        fail("single unit: enable still on, or another bit changed");
+    if ( ok && ops[op].stat == QIE_STAT && pending && u->iqt != 0 )
+        fail("single unit: IQT not reset");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned seed = argc > 1 ? atoi(argv[1]) : 1;
+
+    verbose = getenv("TEST_VERBOSE") != NULL;
+    srand(seed);
+
+    if ( sizeof(table) > 0xffff )
+        fail("DMAR table too big for a 16-bit record length");
+    for ( int i = 0; i < TABLES; i++ )
+        run_table();
+    for ( int i = 0; i < SINGLES; i++ )
+        run_single();
+
+    printf("test-vtd: %lu tables (%lu over %u units, %lu malformed), "
+           "%lu timeouts, %u single units: PASS\n", nr_tables, nr_batched,
+           MAX_DRHD_UNITS, nr_malformed, nr_timeouts, SINGLES);
+    return 0;
+}